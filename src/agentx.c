@@ -0,0 +1,1197 @@
+/*
+ * netsnmp-pcap :: agentx.c
+ * ------------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syslog.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "netsnmp-pcap.h"
+
+
+#define AGENTX_VERSION          1
+#define AGENTX_HEADER_LENGTH    20
+#define AGENTX_MAX_PAYLOAD      (1 << 20)   /* larger PDUs are refused */
+#define AGENTX_MAX_RESPONSE     (1 << 16)   /* GETBULK stops there */
+#define AGENTX_MAX_OUTPUT       (1 << 22)   /* reading stops there */
+#define AGENTX_READ_SIZE        (1 << 16)   /* per wakeup */
+#define AGENTX_DEFAULT_SOCKET   "/var/agentx/master"
+#define AGENTX_DEFAULT_PORT     "705"
+#define AGENTX_PING_INTERVAL    30          /* seconds */
+#define AGENTX_MAX_BACKOFF      60          /* seconds */
+#define AGENTX_PRIORITY         127
+
+/* PDU types */
+#define AGENTX_OPEN             1
+#define AGENTX_CLOSE            2
+#define AGENTX_REGISTER         3
+#define AGENTX_GET              5
+#define AGENTX_GETNEXT          6
+#define AGENTX_GETBULK          7
+#define AGENTX_TESTSET          8
+#define AGENTX_COMMITSET        9
+#define AGENTX_UNDOSET          10
+#define AGENTX_CLEANUPSET       11
+#define AGENTX_PING             13
+#define AGENTX_RESPONSE         18
+
+/* header flags */
+#define FLAG_NON_DEFAULT_CONTEXT    0x08
+#define FLAG_NETWORK_BYTE_ORDER     0x10
+
+/* errors of the responses */
+#define AGENTX_NOERROR          0
+#define AGENTX_NOTWRITABLE      17
+#define AGENTX_PARSEERROR       266
+#define AGENTX_PROCESSINGERROR  268
+
+/* reason of a close */
+#define REASON_SHUTDOWN         5
+
+/* states of the session */
+#define STATE_CLOSED            0
+#define STATE_CONNECTING        1
+#define STATE_OPENING           2
+#define STATE_REGISTERING       3
+#define STATE_READY             4
+
+
+/* buffer of the connection; the bytes before start were already
+   parsed, or sent */
+struct agentx_buffer {
+    u_char      *data;
+    size_t      start;
+    size_t      length;
+    size_t      size;
+};
+
+/* header of a PDU */
+struct agentx_header {
+    uint8_t     version;
+    uint8_t     type;
+    uint8_t     flags;
+    uint32_t    session_id;
+    uint32_t    transaction_id;
+    uint32_t    packet_id;
+    uint32_t    length;
+};
+
+/* payload of a received PDU, being decoded */
+struct agentx_pdu {
+    const u_char    *data;
+    size_t          length;
+    size_t          offset;
+    int             network;        /* in big endian */
+};
+
+/* search range of a repeated variable of a GETBULK */
+struct agentx_range {
+    struct agentx_oid   start;
+    struct agentx_oid   end;
+    int                 include;
+};
+
+/* the session with the master agent */
+struct agentx_session {
+    struct event_base   *ev_base;
+    struct event        *reader;
+    struct event        *writer;
+    struct event        *retry;
+    struct event        *pinger;
+    struct agentx_buffer    input;
+    struct agentx_buffer    output;
+    const struct agentx_region  *regions;   /* to register */
+    int                 region_count;
+    int                 registered;     /* regions registered so far */
+    const char          *address;
+    int                 fd;
+    int                 state;
+    int                 reading;        /* the reader is active */
+    int                 waiting;        /* for an answer since a ping */
+    int                 broken;         /* a PDU couldn't be written */
+    int                 backoff;        /* before reconnecting, seconds */
+    uint32_t            session_id;
+    uint32_t            packet_id;      /* of the last PDU we sent */
+    uint32_t            pending_id;     /* Open or Register to answer */
+    uint32_t            ping_id;        /* Ping to answer, or 0 */
+    size_t              pdu_start;      /* of the PDU being written */
+};
+
+
+/*
+ * prototypes
+ */
+static void agentx_close(int retry);
+static void agentx_connect(evutil_socket_t fd, short what, void *arg);
+static void agentx_connected(void);
+static void agentx_dispatch(const struct agentx_header *header,
+    struct agentx_pdu *pdu);
+static int  agentx_flush(void);
+static void agentx_io(evutil_socket_t fd, short what, void *arg);
+static void agentx_ping(evutil_socket_t fd, short what, void *arg);
+static void agentx_process(void);
+static void agentx_register(void);
+static void agentx_request(const struct agentx_header *header,
+    struct agentx_pdu *pdu);
+static void agentx_respond(const struct agentx_header *header,
+    uint16_t error, uint16_t index);
+
+
+static struct agentx_session agentx = { .fd = -1 };
+
+
+
+/*
+ * agentx_reserve()
+ * --------------
+ * make room for the given number of bytes at the end of a buffer
+ */
+static int
+agentx_reserve(struct agentx_buffer *buffer, size_t count) {
+    u_char  *data;
+    size_t  size;
+
+    if (buffer->length + count <= buffer->size)
+        return(0);
+
+    for (size = (buffer->size ? buffer->size : 4096);
+        size < buffer->length + count; size *= 2)
+        ;
+
+    if ((data = realloc(buffer->data, size)) == NULL) {
+        syslog(_LOGERR_"couldn't allocate an AgentX buffer: %s",
+            strerror(errno));
+        return(-1);
+    }
+
+    buffer->data = data;
+    buffer->size = size;
+
+    return(0);
+}
+
+
+/*
+ * agentx_put()
+ * ----------
+ * append bytes to the PDU being written; a failure is reported by
+ * agentx_end()
+ */
+static void
+agentx_put(const void *bytes, size_t count) {
+    if (count == 0 || agentx.broken)
+        return;
+
+    if (agentx_reserve(&agentx.output, count) < 0) {
+        agentx.broken = 1;
+        return;
+    }
+
+    memcpy(agentx.output.data + agentx.output.length, bytes, count);
+    agentx.output.length += count;
+}
+
+
+/*
+ * agentx_put_u16(), agentx_put_u32(), agentx_put_u64()
+ * --------------------------------------------------
+ * append integers to the PDU being written, in network byte order
+ */
+static void
+agentx_put_u16(uint16_t value) {
+    u_char  bytes[2] = { value >> 8, value };
+
+    agentx_put(bytes, 2);
+}
+
+static void
+agentx_put_u32(uint32_t value) {
+    u_char  bytes[4] = { value >> 24, value >> 16, value >> 8, value };
+
+    agentx_put(bytes, 4);
+}
+
+static void
+agentx_put_u64(uint64_t value) {
+    agentx_put_u32(value >> 32);
+    agentx_put_u32(value);
+}
+
+
+/*
+ * agentx_put_string()
+ * -----------------
+ * append an octet string to the PDU being written, padded to 4 bytes
+ */
+static void
+agentx_put_string(const char *string, uint32_t length) {
+    static const u_char padding[3] = { 0, 0, 0 };
+
+    agentx_put_u32(length);
+    agentx_put(string, length);
+    agentx_put(padding, (4 - length % 4) % 4);
+}
+
+
+/*
+ * agentx_put_oid()
+ * --------------
+ * append an OID to the PDU being written; 1.3.6.1.x is sent as a prefix
+ */
+static void
+agentx_put_oid(const struct agentx_oid *oid, int include) {
+    u_char      header[4] = { 0, 0, include, 0 };
+    uint32_t    i = 0;
+
+    if (oid->len >= 5 && oid->subids[0] == 1 && oid->subids[1] == 3
+        && oid->subids[2] == 6 && oid->subids[3] == 1
+        && oid->subids[4] > 0 && oid->subids[4] < 256) {
+        header[1] = oid->subids[4];
+        i = 5;
+    }
+
+    header[0] = oid->len - i;
+    agentx_put(header, 4);
+
+    for (; i<oid->len; i++)
+        agentx_put_u32(oid->subids[i]);
+}
+
+
+/*
+ * agentx_put_varbind()
+ * ------------------
+ * append a variable to the PDU being written
+ */
+static void
+agentx_put_varbind(const struct agentx_oid *name,
+    const struct agentx_value *value) {
+    agentx_put_u16(value->type);
+    agentx_put_u16(0);
+    agentx_put_oid(name, 0);
+
+    switch (value->type) {
+    case AGENTX_INTEGER:
+        agentx_put_u32(value->number);
+        break;
+
+    case AGENTX_COUNTER64:
+        agentx_put_u64(value->number);
+        break;
+
+    case AGENTX_OCTET_STRING:
+        agentx_put_string(value->string, value->length);
+        break;
+    }
+}
+
+
+/*
+ * agentx_begin()
+ * ------------
+ * start writing a PDU in the output buffer
+ */
+static void
+agentx_begin(uint8_t type, uint32_t transaction_id, uint32_t packet_id) {
+    u_char  header[4] = { AGENTX_VERSION, type, FLAG_NETWORK_BYTE_ORDER, 0 };
+
+    agentx.pdu_start = agentx.output.length;
+    agentx_put(header, 4);
+    agentx_put_u32(agentx.session_id);
+    agentx_put_u32(transaction_id);
+    agentx_put_u32(packet_id);
+    agentx_put_u32(0);          /* set by agentx_end() */
+}
+
+
+/*
+ * agentx_end()
+ * ----------
+ * finish the PDU being written, setting its payload length; it's sent by
+ * the next agentx_flush()
+ */
+static int
+agentx_end(void) {
+    u_char  *bytes;
+    size_t  length;
+
+    if (agentx.broken) {
+        agentx_close(1);
+        return(-1);
+    }
+
+    length = agentx.output.length - agentx.pdu_start - AGENTX_HEADER_LENGTH;
+    bytes = agentx.output.data + agentx.pdu_start + AGENTX_HEADER_LENGTH - 4;
+    bytes[0] = length >> 24;
+    bytes[1] = length >> 16;
+    bytes[2] = length >> 8;
+    bytes[3] = length;
+
+    return(0);
+}
+
+
+/*
+ * agentx_get_u16(), agentx_get_u32()
+ * --------------------------------
+ * decode integers from a received PDU, in its byte order
+ */
+static int
+agentx_get_u16(struct agentx_pdu *pdu, uint16_t *value) {
+    const u_char *bytes = pdu->data + pdu->offset;
+
+    if (pdu->offset + 2 > pdu->length)
+        return(-1);
+
+    *value = pdu->network ? (bytes[0] << 8 | bytes[1])
+        : (bytes[1] << 8 | bytes[0]);
+    pdu->offset += 2;
+
+    return(0);
+}
+
+static int
+agentx_get_u32(struct agentx_pdu *pdu, uint32_t *value) {
+    const u_char *bytes = pdu->data + pdu->offset;
+
+    if (pdu->offset + 4 > pdu->length)
+        return(-1);
+
+    *value = pdu->network
+        ? ((uint32_t)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8
+            | bytes[3])
+        : ((uint32_t)bytes[3] << 24 | bytes[2] << 16 | bytes[1] << 8
+            | bytes[0]);
+    pdu->offset += 4;
+
+    return(0);
+}
+
+
+/*
+ * agentx_get_oid()
+ * --------------
+ * decode an OID from a received PDU, and its include flag if asked for
+ */
+static int
+agentx_get_oid(struct agentx_pdu *pdu, struct agentx_oid *oid,
+    int *include) {
+    const u_char *header = pdu->data + pdu->offset;
+    uint32_t    count, i;
+
+    if (pdu->offset + 4 > pdu->length)
+        return(-1);
+
+    count = header[0];
+    oid->len = 0;
+
+    if (header[1] != 0) {
+        oid->subids[0] = 1;
+        oid->subids[1] = 3;
+        oid->subids[2] = 6;
+        oid->subids[3] = 1;
+        oid->subids[4] = header[1];
+        oid->len = 5;
+    }
+
+    if (oid->len + count > AGENTX_MAX_SUBIDS)
+        return(-1);
+
+    if (include != NULL)
+        *include = header[2];
+
+    pdu->offset += 4;
+
+    for (i=0; i<count; i++) {
+        if (agentx_get_u32(pdu, &oid->subids[oid->len++]) < 0)
+            return(-1);
+    }
+
+    return(0);
+}
+
+
+/*
+ * agentx_oid_compare()
+ * ------------------
+ * compare two OIDs in lexicographic order
+ */
+static int
+agentx_oid_compare(const struct agentx_oid *a, const struct agentx_oid *b) {
+    uint32_t    i;
+
+    for (i=0; i<a->len && i<b->len; i++) {
+        if (a->subids[i] != b->subids[i])
+            return((a->subids[i] < b->subids[i]) ? -1 : 1);
+    }
+
+    return((a->len > b->len) - (a->len < b->len));
+}
+
+
+/*
+ * agentx_start()
+ * ------------
+ * start the AgentX session with the master agent at the given address,
+ * to serve the given regions of the tree, which must outlive it: a Unix
+ * socket path, optionally prefixed by "unix:", or "tcp:host:port". it's
+ * opened in the background, and opened again whenever it's lost
+ */
+int
+agentx_start(struct event_base *ev_base, const char *address,
+    const struct agentx_region *regions, int count) {
+    struct timeval  ping_delay = { AGENTX_PING_INTERVAL, 0 };
+
+    agentx.ev_base = ev_base;
+    agentx.address = (address != NULL ? address : AGENTX_DEFAULT_SOCKET);
+    agentx.regions = regions;
+    agentx.region_count = count;
+    agentx.backoff = 1;
+
+    agentx.retry = evtimer_new(ev_base, agentx_connect, NULL);
+    agentx.pinger = event_new(ev_base, -1, EV_PERSIST, agentx_ping, NULL);
+    if (agentx.retry == NULL || agentx.pinger == NULL
+        || event_add(agentx.pinger, &ping_delay) < 0) {
+        syslog(_LOGERR_"couldn't create the AgentX timers");
+        return(-1);
+    }
+
+    agentx_connect(-1, 0, NULL);
+
+    return(0);
+}
+
+
+/*
+ * agentx_stop()
+ * -----------
+ * close the session, telling the master agent if it's open
+ */
+void
+agentx_stop(void) {
+    u_char  reason[4] = { REASON_SHUTDOWN, 0, 0, 0 };
+
+    if (agentx.state >= STATE_REGISTERING) {
+        agentx_begin(AGENTX_CLOSE, 0, ++agentx.packet_id);
+        agentx_put(reason, 4);
+        if (agentx_end() == 0)
+            agentx_flush();
+    }
+
+    agentx_close(0);
+
+    if (agentx.retry != NULL)
+        event_free(agentx.retry);
+    if (agentx.pinger != NULL)
+        event_free(agentx.pinger);
+    agentx.retry = agentx.pinger = NULL;
+}
+
+
+/*
+ * agentx_socket()
+ * -------------
+ * create a non-blocking socket, and start connecting it to the given
+ * address; *pending tells if the connection is still in progress
+ */
+static int
+agentx_socket(const char *address, int *pending) {
+    struct sockaddr_un  sun;
+    struct addrinfo     hints, *list, *ai;
+    const char  *path;
+    char    host[256], *port;
+    int     fd = -1, res;
+
+    *pending = 0;
+
+    if (strncmp(address, "tcp:", 4) == 0) {
+        snprintf(host, sizeof(host), "%s", address + 4);
+        if ((port = strrchr(host, ':')) != NULL)
+            *port++ = '\0';
+        else
+            port = AGENTX_DEFAULT_PORT;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if ((res = getaddrinfo(host, port, &hints, &list)) != 0) {
+            syslog(_LOGWARN_"couldn't resolve the AgentX master agent "
+                "address %s: %s", address, gai_strerror(res));
+            return(-1);
+        }
+
+        for (ai = list; ai != NULL; ai = ai->ai_next) {
+            if ((fd = socket(ai->ai_family, SOCK_STREAM, 0)) < 0)
+                continue;
+
+            if (evutil_make_socket_nonblocking(fd) == 0
+                && (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0
+                || errno == EINPROGRESS)) {
+                *pending = (errno == EINPROGRESS);
+                break;
+            }
+
+            close(fd);
+            fd = -1;
+        }
+
+        freeaddrinfo(list);
+    }
+    else {
+        path = (strncmp(address, "unix:", 5) == 0) ? address + 5 : address;
+        if (strlen(path) >= sizeof(sun.sun_path)) {
+            syslog(_LOGERR_"AgentX socket path too long: %s", path);
+            return(-1);
+        }
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, path);
+
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            return(-1);
+
+        errno = 0;
+        if (evutil_make_socket_nonblocking(fd) < 0
+            || (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0
+            && errno != EINPROGRESS)) {
+            res = errno;
+            close(fd);
+            errno = res;
+            return(-1);
+        }
+
+        *pending = (errno == EINPROGRESS);
+    }
+
+    return(fd);
+}
+
+
+/*
+ * agentx_connect()
+ * --------------
+ * callback function invoked by libevent when it's time to connect to the
+ * master agent again, and at startup
+ */
+static void
+agentx_connect(evutil_socket_t unused, short what, void *arg) {
+    int pending;
+
+    if (options.debug >= 2)
+        fprintf(stderr, "agentx_connect: connecting to %s\n",
+            agentx.address);
+
+    if ((agentx.fd = agentx_socket(agentx.address, &pending)) < 0) {
+        syslog(_LOGWARN_"couldn't connect to the AgentX master agent at "
+            "%s: %s, retrying in %d s", agentx.address, strerror(errno),
+            agentx.backoff);
+        agentx_close(1);
+        return;
+    }
+
+    agentx.reader = event_new(agentx.ev_base, agentx.fd, EV_READ|EV_PERSIST,
+        agentx_io, NULL);
+    agentx.writer = event_new(agentx.ev_base, agentx.fd, EV_WRITE|EV_PERSIST,
+        agentx_io, NULL);
+    if (agentx.reader == NULL || agentx.writer == NULL) {
+        syslog(_LOGERR_"couldn't create the watchers of the AgentX socket");
+        agentx_close(1);
+        return;
+    }
+
+    /* wait for the connection to be established */
+    if (pending) {
+        agentx.state = STATE_CONNECTING;
+        event_add(agentx.writer, NULL);
+        return;
+    }
+
+    agentx_connected();
+}
+
+
+/*
+ * agentx_connected()
+ * ----------------
+ * start reading from the master agent, and open the session
+ */
+static void
+agentx_connected(void) {
+    static const char descr[] = PROGRAM " " VERSION;
+    struct agentx_oid   id = { .len = 0 };
+    u_char  timeout[4] = { 0, 0, 0, 0 };    /* the master agent's default */
+
+    event_add(agentx.reader, NULL);
+    agentx.reading = 1;
+
+    agentx.state = STATE_OPENING;
+    agentx.pending_id = ++agentx.packet_id;
+
+    agentx_begin(AGENTX_OPEN, 0, agentx.pending_id);
+    agentx_put(timeout, 4);
+    agentx_put_oid(&id, 0);
+    agentx_put_string(descr, strlen(descr));
+    if (agentx_end() == 0)
+        agentx_flush();
+}
+
+
+/*
+ * agentx_close()
+ * ------------
+ * close the connection to the master agent, and try again later if asked
+ * to, waiting twice as long after each failure
+ */
+static void
+agentx_close(int retry) {
+    struct timeval  delay = { agentx.backoff, 0 };
+
+    if (agentx.reader != NULL)
+        event_free(agentx.reader);
+    if (agentx.writer != NULL)
+        event_free(agentx.writer);
+    if (agentx.fd >= 0)
+        close(agentx.fd);
+
+    agentx.reader = agentx.writer = NULL;
+    agentx.fd = -1;
+    agentx.state = STATE_CLOSED;
+    agentx.reading = agentx.waiting = agentx.broken = 0;
+    agentx.session_id = agentx.pending_id = agentx.ping_id = 0;
+    agentx.input.start = agentx.input.length = 0;
+    agentx.output.start = agentx.output.length = 0;
+
+    if (!retry || agentx.retry == NULL)
+        return;
+
+    evtimer_add(agentx.retry, &delay);
+
+    agentx.backoff *= 2;
+    if (agentx.backoff > AGENTX_MAX_BACKOFF)
+        agentx.backoff = AGENTX_MAX_BACKOFF;
+}
+
+
+/*
+ * agentx_flush()
+ * ------------
+ * send as much of the output buffer as the socket takes, and watch it
+ * for the rest; the requests aren't read anymore while too many
+ * responses wait to be sent
+ */
+static int
+agentx_flush(void) {
+    struct agentx_buffer *output = &agentx.output;
+    ssize_t count;
+    size_t  pending;
+
+    while (output->start < output->length) {
+        count = send(agentx.fd, output->data + output->start,
+            output->length - output->start, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (count < 0) {
+            syslog(_LOGWARN_"lost the AgentX master agent at %s: %s",
+                agentx.address, strerror(errno));
+            agentx_close(1);
+            return(-1);
+        }
+
+        output->start += count;
+    }
+
+    pending = output->length - output->start;
+
+    if (pending == 0) {
+        output->start = output->length = 0;
+        event_del(agentx.writer);
+    }
+    else {
+        memmove(output->data, output->data + output->start, pending);
+        output->start = 0;
+        output->length = pending;
+        event_add(agentx.writer, NULL);
+    }
+
+    if (pending > AGENTX_MAX_OUTPUT && agentx.reading) {
+        event_del(agentx.reader);
+        agentx.reading = 0;
+    }
+    else if (pending <= AGENTX_MAX_OUTPUT && !agentx.reading) {
+        event_add(agentx.reader, NULL);
+        agentx.reading = 1;
+    }
+
+    return(0);
+}
+
+
+/*
+ * agentx_io()
+ * ---------
+ * callback function invoked by libevent when the AgentX socket is
+ * connected, can be written to, or has data to read
+ */
+static void
+agentx_io(evutil_socket_t fd, short what, void *arg) {
+    socklen_t   len = sizeof(int);
+    ssize_t     count;
+    size_t      total = 0;
+    uint64_t    start, elapsed;
+    int         error = 0;
+
+    if (what & EV_WRITE) {
+        if (agentx.state != STATE_CONNECTING) {
+            agentx_flush();
+            return;
+        }
+
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0
+            || error != 0) {
+            syslog(_LOGWARN_"couldn't connect to the AgentX master agent at "
+                "%s: %s, retrying in %d s", agentx.address,
+                strerror(error ? error : errno), agentx.backoff);
+            agentx_close(1);
+            return;
+        }
+
+        event_del(agentx.writer);
+        agentx_connected();
+        return;
+    }
+
+    start = nsp_clock();
+
+    /* read what's there, a bounded amount at a time */
+    while (total < AGENTX_READ_SIZE) {
+        if (agentx_reserve(&agentx.input, 4096) < 0) {
+            agentx_close(1);
+            return;
+        }
+
+        count = recv(fd, agentx.input.data + agentx.input.length,
+            agentx.input.size - agentx.input.length, 0);
+        if (count > 0) {
+            agentx.input.length += count;
+            total += count;
+            continue;
+        }
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        syslog(_LOGWARN_"lost the AgentX master agent at %s: %s",
+            agentx.address, (count < 0 ? strerror(errno) : "closed"));
+        agentx_close(1);
+        return;
+    }
+
+    agentx_process();
+
+    elapsed = nsp_clock() - start;
+    self_stats.agent_time += elapsed;
+    if (elapsed > self_stats.agent_time_max)
+        self_stats.agent_time_max = elapsed;
+}
+
+
+/*
+ * agentx_process()
+ * --------------
+ * handle the complete PDUs of the input buffer, as they come, and send
+ * the responses together
+ */
+static void
+agentx_process(void) {
+    struct agentx_buffer *input = &agentx.input;
+    struct agentx_header header;
+    struct agentx_pdu   pdu;
+    const u_char    *bytes;
+
+    while (agentx.state != STATE_CLOSED
+        && input->length - input->start >= AGENTX_HEADER_LENGTH) {
+        bytes = input->data + input->start;
+
+        pdu.data = bytes;
+        pdu.length = AGENTX_HEADER_LENGTH;
+        pdu.offset = 4;
+        pdu.network = bytes[2] & FLAG_NETWORK_BYTE_ORDER;
+
+        header.version = bytes[0];
+        header.type = bytes[1];
+        header.flags = bytes[2];
+        agentx_get_u32(&pdu, &header.session_id);
+        agentx_get_u32(&pdu, &header.transaction_id);
+        agentx_get_u32(&pdu, &header.packet_id);
+        agentx_get_u32(&pdu, &header.length);
+
+        if (header.version != AGENTX_VERSION
+            || header.length > AGENTX_MAX_PAYLOAD || header.length % 4) {
+            syslog(_LOGERR_"invalid PDU from the AgentX master agent at %s",
+                agentx.address);
+            agentx_close(1);
+            return;
+        }
+
+        /* wait for the rest of it */
+        if (input->length - input->start
+            < AGENTX_HEADER_LENGTH + header.length)
+            break;
+
+        pdu.data = bytes + AGENTX_HEADER_LENGTH;
+        pdu.length = header.length;
+        pdu.offset = 0;
+        input->start += AGENTX_HEADER_LENGTH + header.length;
+
+        agentx_dispatch(&header, &pdu);
+    }
+
+    if (agentx.state == STATE_CLOSED)
+        return;
+
+    /* keep the incomplete PDU at the start of the buffer */
+    memmove(input->data, input->data + input->start,
+        input->length - input->start);
+    input->length -= input->start;
+    input->start = 0;
+
+    agentx_flush();
+}
+
+
+/*
+ * agentx_dispatch()
+ * ---------------
+ * handle a PDU from the master agent
+ */
+static void
+agentx_dispatch(const struct agentx_header *header, struct agentx_pdu *pdu) {
+    uint32_t    uptime;
+    uint16_t    error;
+
+    if (options.debug >= 3)
+        fprintf(stderr, "agentx_dispatch: PDU type %u, packet %u, "
+            "%u bytes\n", header->type, header->packet_id, header->length);
+
+    switch (header->type) {
+    case AGENTX_GET:
+    case AGENTX_GETNEXT:
+    case AGENTX_GETBULK:
+        agentx_request(header, pdu);
+        break;
+
+    case AGENTX_TESTSET:
+        agentx_respond(header, AGENTX_NOTWRITABLE, 1);
+        break;
+
+    case AGENTX_COMMITSET:
+    case AGENTX_UNDOSET:
+        agentx_respond(header, AGENTX_NOERROR, 0);
+        break;
+
+    case AGENTX_CLEANUPSET:
+        break;
+
+    case AGENTX_CLOSE:
+        syslog(_LOGWARN_"the AgentX master agent at %s closed the session, "
+            "opening it again in %d s", agentx.address, agentx.backoff);
+        agentx_close(1);
+        break;
+
+    case AGENTX_RESPONSE:
+        if (agentx_get_u32(pdu, &uptime) < 0
+            || agentx_get_u16(pdu, &error) < 0) {
+            syslog(_LOGERR_"invalid PDU from the AgentX master agent at %s",
+                agentx.address);
+            agentx_close(1);
+            break;
+        }
+
+        if (header->packet_id == agentx.ping_id) {
+            agentx.ping_id = 0;
+            agentx.waiting = 0;
+            break;
+        }
+
+        if (header->packet_id != agentx.pending_id)
+            break;
+
+        agentx.waiting = 0;
+
+        if (error != AGENTX_NOERROR) {
+            syslog(_LOGERR_"the AgentX master agent at %s refused to %s "
+                "(error %u), trying again in %d s", agentx.address,
+                (agentx.state == STATE_OPENING ? "open the session"
+                : "register the tree"), error, agentx.backoff);
+            agentx_close(1);
+            break;
+        }
+
+        /* register the regions of the tree one by one, once the session
+           is open */
+        if (agentx.state == STATE_OPENING) {
+            agentx.session_id = header->session_id;
+            agentx.state = STATE_REGISTERING;
+            agentx.registered = 0;
+            agentx_register();
+            break;
+        }
+
+        if (++agentx.registered < agentx.region_count) {
+            agentx_register();
+            break;
+        }
+
+        agentx.state = STATE_READY;
+        agentx.pending_id = 0;
+        agentx.backoff = 1;
+        syslog(LOG_INFO, PROGRAM ": serving %s through the AgentX master "
+            "agent at %s", options.base_oid, agentx.address);
+        break;
+
+    default:
+        if (options.debug >= 3)
+            fprintf(stderr, "agentx_dispatch: ignoring PDU type %u\n",
+                header->type);
+        break;
+    }
+}
+
+
+/*
+ * agentx_register()
+ * ---------------
+ * register the next region of the tree with the master agent
+ */
+static void
+agentx_register(void) {
+    const struct agentx_region *region = &agentx.regions[agentx.registered];
+    u_char  flags[4] = { 0, AGENTX_PRIORITY, region->range_subid, 0 };
+
+    agentx.pending_id = ++agentx.packet_id;
+
+    agentx_begin(AGENTX_REGISTER, 0, agentx.pending_id);
+    agentx_put(flags, 4);
+    agentx_put_oid(&region->subtree, 0);
+    if (region->range_subid > 0)
+        agentx_put_u32(region->upper_bound);
+    agentx_end();
+}
+
+
+/*
+ * agentx_respond()
+ * --------------
+ * write a response without variables
+ */
+static void
+agentx_respond(const struct agentx_header *header, uint16_t error,
+    uint16_t index) {
+    agentx_begin(AGENTX_RESPONSE, header->transaction_id, header->packet_id);
+    agentx_put_u32(0);          /* sysUpTime, ignored by the master */
+    agentx_put_u16(error);
+    agentx_put_u16(index);
+    agentx_end();
+}
+
+
+/*
+ * agentx_next()
+ * -----------
+ * find the variable following the start of a search range, and before
+ * its end if any
+ */
+static int
+agentx_next(const struct agentx_oid *start, int include,
+    const struct agentx_oid *end, struct agentx_oid *name,
+    struct agentx_value *value) {
+    if (nsp_tree_next(start, include, name, value) < 0
+        || (end->len > 0 && agentx_oid_compare(name, end) >= 0)) {
+        *name = *start;
+        value->type = AGENTX_END_OF_MIB_VIEW;
+        return(-1);
+    }
+
+    return(0);
+}
+
+
+/*
+ * agentx_request()
+ * --------------
+ * answer a GET, GETNEXT or GETBULK request; the variables come from the
+ * snapshot of snmp.c, which doesn't change while a request is answered
+ */
+static void
+agentx_request(const struct agentx_header *header, struct agentx_pdu *pdu) {
+    struct agentx_range *ranges = NULL;
+    struct agentx_oid   start, end, name;
+    struct agentx_value value;
+    uint32_t    context;
+    uint16_t    non_repeaters = 0, repetitions = 0;
+    int     include, count = 0, ended, i, r;
+    size_t  first;
+
+    self_stats.agent_calls++;
+
+    /* begin the response first, so that a parse error rolls back to the
+       start of this one */
+    agentx_begin(AGENTX_RESPONSE, header->transaction_id, header->packet_id);
+    agentx_put_u32(0);          /* sysUpTime, ignored by the master */
+    agentx_put_u16(AGENTX_NOERROR);
+    agentx_put_u16(0);
+
+    /* only the default context is registered */
+    if (header->flags & FLAG_NON_DEFAULT_CONTEXT) {
+        if (agentx_get_u32(pdu, &context) < 0
+            || (pdu->offset += (context + 3) & ~3) > pdu->length)
+            goto parse_error;
+    }
+
+    if (header->type == AGENTX_GETBULK
+        && (agentx_get_u16(pdu, &non_repeaters) < 0
+        || agentx_get_u16(pdu, &repetitions) < 0))
+        goto parse_error;
+
+    /* the variables of a GET or a GETNEXT, and the non repeaters of
+       a GETBULK */
+    first = pdu->offset;
+    for (i=0; pdu->offset < pdu->length; i++) {
+        if (agentx_get_oid(pdu, &start, &include) < 0
+            || agentx_get_oid(pdu, &end, NULL) < 0)
+            goto parse_error;
+
+        if (header->type == AGENTX_GET) {
+            nsp_tree_get(&start, &value);
+            agentx_put_varbind(&start, &value);
+        }
+        else if (header->type == AGENTX_GETNEXT || i < non_repeaters) {
+            agentx_next(&start, include, &end, &name, &value);
+            agentx_put_varbind(&name, &value);
+        }
+        else
+            count++;
+    }
+
+    /* the repetitions of the other variables of a GETBULK, until they
+       all reached the end of their ranges, or the response is large */
+    if (count > 0 && repetitions > 0) {
+        if ((ranges = malloc(count * sizeof(struct agentx_range))) == NULL) {
+            agentx.output.length = agentx.pdu_start;
+            agentx_respond(header, AGENTX_PROCESSINGERROR, 0);
+            return;
+        }
+
+        pdu->offset = first;
+        for (i=0; pdu->offset < pdu->length; i++) {
+            agentx_get_oid(pdu, &start, &include);
+            agentx_get_oid(pdu, &end, NULL);
+            if (i >= non_repeaters) {
+                ranges[i - non_repeaters].start = start;
+                ranges[i - non_repeaters].end = end;
+                ranges[i - non_repeaters].include = include;
+            }
+        }
+
+        for (r=0; r<repetitions && agentx.output.length - agentx.pdu_start
+            < AGENTX_MAX_RESPONSE; r++) {
+            for (i=0, ended=0; i<count; i++) {
+                if (agentx_next(&ranges[i].start, ranges[i].include,
+                    &ranges[i].end, &name, &value) < 0)
+                    ended++;
+
+                agentx_put_varbind(&name, &value);
+                ranges[i].start = name;
+                ranges[i].include = 0;
+            }
+
+            if (ended == count)
+                break;
+        }
+
+        free(ranges);
+    }
+
+    agentx_end();
+    return;
+
+  parse_error:
+    if (options.debug >= 3)
+        fprintf(stderr, "agentx_request: couldn't parse packet %u\n",
+            header->packet_id);
+
+    agentx.output.length = agentx.pdu_start;
+    agentx_respond(header, AGENTX_PARSEERROR, 0);
+}
+
+
+/*
+ * agentx_ping()
+ * -----------
+ * callback function invoked by libevent to check that the master agent
+ * still answers: what was sent to it at the previous call, or before,
+ * must have been answered by now
+ */
+static void
+agentx_ping(evutil_socket_t fd, short what, void *arg) {
+    if (agentx.state == STATE_CLOSED)
+        return;
+
+    if (agentx.waiting) {
+        syslog(_LOGWARN_"the AgentX master agent at %s stopped answering, "
+            "reconnecting in %d s", agentx.address, agentx.backoff);
+        agentx_close(1);
+        return;
+    }
+
+    if (agentx.state == STATE_READY) {
+        agentx.ping_id = ++agentx.packet_id;
+        agentx_begin(AGENTX_PING, 0, agentx.ping_id);
+        if (agentx_end() < 0 || agentx_flush() < 0)
+            return;
+    }
+
+    agentx.waiting = 1;
+}
@@ -0,0 +1,484 @@
+/*
+ * netsnmp-pcap :: bench.c
+ * -----------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "netsnmp-pcap.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+
+#define FRAME_COUNT         1024
+#define FRAME_SNAP_LENGTH   128
+#define EVALUATIONS         (64 * 1000 * 1000)
+#define MAX_PACKETS         (2 * 1000 * 1000)
+
+
+/* the daemon options, normally defined in main.c */
+struct options options;
+
+/* synthetic frames */
+struct frame {
+    struct pcap_pkthdr  header;
+    u_char              bytes[FRAME_SNAP_LENGTH];
+};
+
+/* filter complexities; %d is a protocol or a port depending on the
+   monitor */
+static const struct {
+    const char  *name;
+    const char  *format;
+} filters[] = {
+    { "none",       NULL },
+    { "proto",      "ip proto %d" },
+    { "port",       "port %d" },
+    { "complex",    "(tcp or udp) and (port %d or portrange 3000-3100)"
+                    " and not src net 10.0.0.0/16" },
+};
+
+static const int monitor_counts[] = { 1, 8, 64, 512 };
+
+/* run the filters one by one instead of through the classifier */
+static int unmerged = 0;
+
+/* run the filters with the libpcap interpreter instead of the JIT */
+static int interpreted = 0;
+
+/* hardware counters */
+#define PERF_CYCLES         0
+#define PERF_INSTRUCTIONS   1
+#define PERF_CACHE_MISSES   2
+#define PERF_COUNT          3
+
+static int perf_fd[PERF_COUNT] = { -1, -1, -1 };
+
+
+/*
+ * perf_open()
+ * ---------
+ * open the hardware counters as a group, led by the cycles counter;
+ * they're not available without the right perf_event_paranoid setting,
+ * or in most virtual machines
+ */
+static void
+perf_open(void) {
+#ifdef __linux__
+    static const uint64_t config[PERF_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+    };
+    struct perf_event_attr attr;
+    int i;
+
+    for (i=0; i<PERF_COUNT; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config[i];
+        attr.disabled = (i == 0);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        perf_fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1,
+            (i == 0 ? -1 : perf_fd[0]), 0);
+        if (perf_fd[i] < 0)
+            break;
+    }
+#endif
+}
+
+
+/*
+ * perf_enable()
+ * -----------
+ */
+static void
+perf_enable(int enable) {
+#ifdef __linux__
+    if (perf_fd[0] >= 0)
+        ioctl(perf_fd[0], (enable ? PERF_EVENT_IOC_ENABLE
+            : PERF_EVENT_IOC_DISABLE), PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+
+/*
+ * perf_read()
+ * ---------
+ * read the counters of the group, which may be only partially open
+ */
+static int
+perf_read(uint64_t *values) {
+    uint64_t buffer[1 + PERF_COUNT];
+    int i;
+
+    if (perf_fd[0] < 0)
+        return(0);
+
+    memset(buffer, 0, sizeof(buffer));
+    if (read(perf_fd[0], buffer, sizeof(buffer)) < (ssize_t)sizeof(uint64_t))
+        return(0);
+
+    for (i=0; i<PERF_COUNT; i++)
+        values[i] = (i < (int)buffer[0] ? buffer[1 + i] : 0);
+
+    return((int)buffer[0]);
+}
+
+
+/*
+ * bench_frames()
+ * ------------
+ * build a mix of Ethernet/IPv4, Ethernet/IPv6 and 802.1Q/IPv4 frames,
+ * with TCP and UDP ports and addresses varying across the frames
+ */
+static struct frame *
+bench_frames(void) {
+    struct frame *frames, *f;
+    u_char  *p;
+    int     i, kind, l4, proto, len;
+
+    frames = calloc(FRAME_COUNT, sizeof(struct frame));
+    if (frames == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i=0; i<FRAME_COUNT; i++) {
+        f = &frames[i];
+        p = f->bytes;
+        kind = i % 4;
+        proto = (i % 3 == 0 ? 17 : 6);
+        len = 64 + (i * 37) % 1450;
+
+        /* Ethernet */
+        memcpy(p, "\x00\x11\x22\x33\x44\x55\x00\x66\x77\x88\x99\xaa", 12);
+        p += 12;
+
+        if (kind == 3) {
+            memcpy(p, "\x81\x00", 2);
+            p[2] = 0;
+            p[3] = 100 + i % 10;
+            p += 4;
+        }
+
+        if (kind == 2) {
+            /* IPv6 */
+            memcpy(p, "\x86\xdd", 2);
+            p += 2;
+            p[0] = 0x60;
+            p[4] = (len - 54) >> 8;
+            p[5] = (len - 54) & 0xff;
+            p[6] = proto;
+            p[7] = 64;
+            p[8] = 0x20;
+            p[9] = 0x01;
+            p[23] = i & 0xff;
+            p[24] = 0x20;
+            p[25] = 0x01;
+            p[39] = (i >> 8) & 0xff;
+            p += 40;
+        }
+        else {
+            /* IPv4 */
+            memcpy(p, "\x08\x00", 2);
+            p += 2;
+            p[0] = 0x45;
+            p[2] = (len - 14) >> 8;
+            p[3] = (len - 14) & 0xff;
+            p[8] = 64;
+            p[9] = proto;
+            p[12] = (i % 5 == 0 ? 10 : 192);
+            p[13] = (i % 5 == 0 ? 0 : 168);
+            p[14] = (i >> 8) & 0xff;
+            p[15] = i & 0xff;
+            p[16] = 172;
+            p[17] = 16;
+            p[18] = (i >> 4) & 0xff;
+            p[19] = 1;
+            p += 20;
+        }
+
+        /* TCP or UDP ports */
+        l4 = 1000 + (i * 7) % 600;
+        p[0] = (40000 + i) >> 8;
+        p[1] = (40000 + i) & 0xff;
+        p[2] = l4 >> 8;
+        p[3] = l4 & 0xff;
+        p += (proto == 6 ? 20 : 8);
+
+        f->header.len = len;
+        f->header.caplen = (p - f->bytes);
+    }
+
+    return(frames);
+}
+
+
+/*
+ * bench_capture()
+ * -------------
+ * create a shared capture with count monitors, whose filters are built
+ * from the given format
+ */
+static struct capture *
+bench_capture(int count, const char *format) {
+    struct capture  *cap;
+    struct monitor  *mon;
+    pcap_t  *pcap;
+    char    filter[256];
+    int     i;
+
+    pcap = pcap_open_dead(DLT_EN10MB, FRAME_SNAP_LENGTH);
+    cap = calloc(1, sizeof(struct capture));
+    if (pcap == NULL || cap == NULL
+        || (cap->monitors = calloc(count, sizeof(struct monitor *))) == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    cap->pcap = pcap;
+    cap->shared = 1;
+    cap->classify = !unmerged;
+
+    for (i=0; i<count; i++) {
+        /* aligned as in the daemon */
+        if (posix_memalign((void **)&mon, CACHE_LINE_SIZE,
+            sizeof(struct monitor)) != 0) {
+            perror("posix_memalign");
+            exit(EXIT_FAILURE);
+        }
+
+        memset(mon, 0, sizeof(struct monitor));
+
+        if (posix_memalign((void **)&mon->counters, CACHE_LINE_SIZE,
+            sizeof(struct monitor_counters)) != 0) {
+            perror("posix_memalign");
+            exit(EXIT_FAILURE);
+        }
+
+        memset(mon->counters, 0, sizeof(struct monitor_counters));
+        mon->index = i + 1;
+        mon->device = "bench";
+
+        /* every packet updates the rate ring, as in the daemon */
+        if (rate_init(mon, 1) < 0)
+            exit(EXIT_FAILURE);
+
+        if (format != NULL) {
+            snprintf(filter, sizeof(filter), format,
+                (strstr(format, "proto") ? (i % 2 ? 6 : 17) : 1000 + i));
+            mon->filter = strdup(filter);
+
+            if (pcap_compile(pcap, &mon->filter_bpf, mon->filter, 1,
+                PCAP_NETMASK_UNKNOWN) < 0) {
+                fprintf(stderr, "couldn't compile <%s>: %s\n", mon->filter,
+                    pcap_geterr(pcap));
+                exit(EXIT_FAILURE);
+            }
+
+            mon->filter_valid = 1;
+
+            if (!interpreted)
+                mon->filter_jit = jit_compile(&mon->filter_bpf);
+        }
+
+        cap->monitors[cap->monitor_count++] = mon;
+    }
+
+    if (cap->classify)
+        capture_classify(cap);
+
+    return(cap);
+}
+
+
+/*
+ * bench_free()
+ * ----------
+ */
+static void
+bench_free(struct capture *cap) {
+    struct monitor *mon;
+    int i;
+
+    for (i=0; i<cap->monitor_count; i++) {
+        mon = cap->monitors[i];
+        if (mon->filter_valid)
+            pcap_freecode(&mon->filter_bpf);
+        jit_free(mon->filter_jit);
+        rate_free(mon);
+        free(mon->filter);
+        free(mon->counters);
+        free(mon);
+    }
+
+    classifier_free(cap->classifier);
+    pcap_close(cap->pcap);
+    free(cap->monitors);
+    free(cap);
+}
+
+
+/*
+ * bench_run()
+ * ---------
+ * run packets frames through the monitors of a capture, and print the
+ * cost per packet
+ */
+static void
+bench_run(struct capture *cap, const char *name, struct frame *frames,
+    long packets) {
+    struct timespec start, end;
+    uint64_t    before[PERF_COUNT], after[PERF_COUNT];
+    uint64_t    matches = 0;
+    double      ns;
+    long        i;
+    int         counters, j;
+
+    /* warm the caches up */
+    for (i=0; i<FRAME_COUNT; i++)
+        capture_packet((u_char *)cap, &frames[i].header, frames[i].bytes);
+
+    counters = perf_read(before);
+    perf_enable(1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i=0; i<packets; i++) {
+        struct frame *f = &frames[i & (FRAME_COUNT - 1)];
+        capture_packet((u_char *)cap, &f->header, f->bytes);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    perf_enable(0);
+    counters = perf_read(after);
+
+    for (j=0; j<cap->monitor_count; j++)
+        matches += cap->monitors[j]->counters[0].packets;
+
+    ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec))
+        / packets;
+
+    printf("%8d  %-8s %9ld %10.1f %8.2f", cap->monitor_count, name, packets,
+        ns, 1e3 / ns);
+
+    for (j=0; j<PERF_COUNT; j++) {
+        if (j < counters)
+            printf(" %12.1f", (double)(after[j] - before[j]) / packets);
+        else
+            printf(" %12s", "-");
+    }
+
+    printf(" %8.2f\n", (double)matches / (packets + FRAME_COUNT));
+}
+
+
+/*
+ * main()
+ * ----
+ */
+int
+main(int argc, char **argv) {
+    struct capture  *cap;
+    struct frame    *frames;
+    long    packets = 0, n;
+    int     opt;
+    size_t  f, m;
+
+    while ((opt = getopt(argc, argv, "hin:u")) != -1) {
+        switch (opt) {
+            case 'i':
+                interpreted = 1;
+                break;
+
+            case 'n':
+                packets = atol(optarg);
+                break;
+
+            case 'u':
+                unmerged = 1;
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-i] [-n packets] [-u]\n", argv[0]);
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    /* a single worker, whose counters are the first ones */
+    worker_count = 1;
+
+    if (!interpreted && jit_selftest() < 0)
+        interpreted = 1;
+
+    frames = bench_frames();
+    perf_open();
+
+    printf("%8s  %-8s %9s %10s %8s %12s %12s %12s %8s\n", "monitors",
+        "filter", "packets", "ns/pkt", "Mpps", "cycles/pkt", "instr/pkt",
+        "misses/pkt", "hits/pkt");
+
+    for (m=0; m<sizeof(monitor_counts)/sizeof(int); m++) {
+        for (f=0; f<sizeof(filters)/sizeof(filters[0]); f++) {
+            /* keep the runs roughly the same length */
+            n = packets;
+            if (n <= 0) {
+                n = EVALUATIONS / monitor_counts[m];
+                if (n > MAX_PACKETS)
+                    n = MAX_PACKETS;
+            }
+
+            cap = bench_capture(monitor_counts[m], filters[f].format);
+            bench_run(cap, filters[f].name, frames, n);
+            bench_free(cap);
+        }
+    }
+
+    free(frames);
+    return(EXIT_SUCCESS);
+}
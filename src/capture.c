@@ -0,0 +1,812 @@
+/*
+ * netsnmp-pcap :: capture.c
+ * -------------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslog.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "netsnmp-pcap.h"
+
+#ifdef __linux__
+#include <linux/if_packet.h>
+#include <sys/socket.h>
+#endif
+
+
+#define SNAP_LENGTH             48
+#define SHARED_SNAP_LENGTH      128     /* filters run in userspace on the
+                                           captured bytes only, so keep
+                                           enough for VLAN + IPv6 + ports */
+
+/* dispatch scheduler bounds */
+#define MIN_BUDGET              16
+#define MAX_BUDGET              65536
+#define INITIAL_BUDGET          256
+#define MIN_DELAY               100     /* microseconds */
+#define MAX_DELAY               5000
+
+/* period of the polls of the kernel counters, in seconds */
+#define STATS_INTERVAL          1
+
+/* below this many monitors, running their filters one by one is faster
+   than walking a classifier */
+#define MIN_CLASSIFIED          4
+
+
+
+/* list of capture handles */
+struct capture_list captures = TAILQ_HEAD_INITIALIZER(captures);
+
+/* next PACKET_FANOUT group identifier */
+static int fanout_next_id = -1;
+
+
+/*
+ * capture_classify()
+ * ----------------
+ * merge the filters of the monitors of a shared capture handle, after
+ * monitors were added or removed; the workers must not be running it
+ */
+void
+capture_classify(struct capture *cap) {
+    classifier_free(cap->classifier);
+    cap->classifier = NULL;
+    cap->classify = 0;
+
+    if (cap->monitor_count < MIN_CLASSIFIED)
+        return;
+
+    cap->classifier = classifier_build(cap->monitors, cap->monitor_count);
+    if (cap->classifier == NULL)
+        syslog(_LOGWARN_"couldn't merge the filters of the monitors on %s, "
+            "running them one by one", cap->device);
+}
+
+
+/*
+ * capture_classify_all()
+ * --------------------
+ * merge the filters of the shared capture handles whose monitors changed,
+ * once the monitors are attached: at startup, before the workers run, or
+ * on a reload, while they're paused; capture_packet() only runs them
+ */
+void
+capture_classify_all(void) {
+    struct capture *cap;
+
+    TAILQ_FOREACH(cap, &captures, link) {
+        if (cap->classify)
+            capture_classify(cap);
+    }
+}
+
+
+/*
+ * capture_packet()
+ * --------------
+ * callback function for handling received packets, invoked by
+ * pcap_dispatch(); dispatch the packet to every monitor of the capture
+ * whose filter matches it
+ */
+void
+capture_packet(u_char *arg, const struct pcap_pkthdr *header,
+    const u_char *bytes) {
+    struct capture *cap = (struct capture*)arg;
+    struct monitor *mon;
+    const uint64_t *matches;
+    uint64_t bits;
+    int i;
+
+    /* the classifier finds all the matching monitors at once */
+    if (cap->classifier != NULL) {
+        matches = classifier_run(cap->classifier, bytes, header->len,
+            header->caplen);
+
+        for (i=0; i<cap->monitor_count; i+=64) {
+            for (bits = matches[i / 64]; bits != 0; bits &= bits - 1)
+                monitor_packet(cap->monitors[i + __builtin_ctzll(bits)],
+                    cap->worker, header, bytes);
+        }
+
+        return;
+    }
+
+    for (i=0; i<cap->monitor_count; i++) {
+        mon = cap->monitors[i];
+
+        /* the kernel already filtered the packets of a dedicated handle */
+        if (cap->shared && mon->filter_valid
+            && (mon->filter_jit != NULL
+                ? mon->filter_jit->function(bytes, header->len,
+                    header->caplen)
+                : bpf_filter(mon->filter_bpf.bf_insns, bytes,
+                    header->len, header->caplen)) == 0)
+            continue;
+
+        monitor_packet(mon, cap->worker, header, bytes);
+    }
+}
+
+
+/*
+ * capture_schedule()
+ * ----------------
+ * adapt the packet budget and the deferral delay of a capture handle to
+ * the size of the last batch: a full batch means there's a backlog, so
+ * the budget grows, within what fits in the time slice, and the handle
+ * is polled again right away; a small batch means the handle is mostly
+ * idle, so the budget shrinks and the next poll is deferred for a while,
+ * to read larger batches with fewer wakeups
+ */
+static void
+capture_schedule(struct capture *cap, int n, uint64_t elapsed) {
+    uint64_t    slice = (uint64_t)options.dispatch_slice * 1000;
+    uint64_t    limit;
+    uint32_t    budget = cap->budget, delay = cap->delay;
+    struct timeval  tv;
+
+    /* average cost of a packet */
+    if (n > 0) {
+        if (cap->packet_cost == 0)
+            cap->packet_cost = elapsed / n;
+        else
+            cap->packet_cost = (7 * cap->packet_cost + elapsed / n) / 8;
+    }
+
+    /* the budget can't take longer than the time slice */
+    limit = slice / (cap->packet_cost > 0 ? cap->packet_cost : 1);
+    if (limit > MAX_BUDGET)
+        limit = MAX_BUDGET;
+    if (limit < MIN_BUDGET)
+        limit = MIN_BUDGET;
+
+    if ((uint32_t)n >= budget) {
+        COUNTER_ADD(cap->dispatch_full, 1);
+        budget = (budget * 2 < limit ? budget * 2 : limit);
+        delay = 0;
+    }
+    else if ((uint32_t)n < budget / 4) {
+        budget = (budget / 2 > MIN_BUDGET ? budget / 2 : MIN_BUDGET);
+        delay = (delay == 0 ? MIN_DELAY
+            : (delay * 2 < MAX_DELAY ? delay * 2 : MAX_DELAY));
+    }
+
+    if (budget > limit)
+        budget = limit;
+
+    COUNTER_SET(cap->budget, budget);
+    COUNTER_SET(cap->delay, delay);
+
+    /* stop polling the handle for the delay */
+    if (delay > 0) {
+        tv.tv_sec = 0;
+        tv.tv_usec = delay;
+
+        if (event_del(cap->watcher) == 0 && event_add(cap->resume, &tv) == 0)
+            COUNTER_ADD(cap->dispatch_deferred, 1);
+        else
+            event_add(cap->watcher, NULL);
+    }
+}
+
+
+/*
+ * capture_io()
+ * ----------
+ * callback function invoked by libevent when there are incoming data in
+ * the watched socket, or when a deferred capture handle is resumed;
+ * dispatch at most the budget of the handle, so that a busy handle can't
+ * hog the event loop
+ */
+static void
+capture_io(evutil_socket_t fd, short what, void *arg) {
+    struct capture *cap = (struct capture*)arg;
+    struct timespec start, end;
+    uint64_t elapsed;
+    int count = (options.dispatch_slice > 0 ? (int)cap->budget : -1);
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (cap->ring != NULL)
+        n = ring_dispatch(cap->ring, count, capture_packet, (u_char *)cap);
+    else
+        n = pcap_dispatch(cap->pcap, count, capture_packet, (u_char *)cap);
+
+    if (n < 0) {
+        syslog(_LOGERR_"pcap_dispatch: %s", pcap_geterr(cap->pcap));
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000
+        + end.tv_nsec - start.tv_nsec;
+
+    COUNTER_ADD(cap->dispatch_calls, 1);
+    COUNTER_ADD(cap->dispatch_packets, n);
+    COUNTER_ADD(cap->dispatch_time, elapsed);
+
+    if (count > 0)
+        capture_schedule(cap, n, elapsed);
+}
+
+
+/*
+ * capture_resume()
+ * --------------
+ * callback function invoked by libevent at the end of the deferral delay
+ * of a capture handle
+ */
+static void
+capture_resume(evutil_socket_t fd, short what, void *arg) {
+    struct capture *cap = (struct capture*)arg;
+
+    if (event_add(cap->watcher, NULL) < 0) {
+        syslog(_LOGERR_"couldn't activate a watcher for a pcap handle");
+        return;
+    }
+
+    capture_io(fd, EV_TIMEOUT, arg);
+}
+
+
+/*
+ * capture_stats()
+ * -------------
+ * callback function invoked by libevent in the worker of a capture handle
+ * to poll its kernel counters, which libpcap doesn't let another thread
+ * read; those of libpcap are 32-bit and wrap around, so their differences
+ * are accumulated
+ */
+static void
+capture_stats(evutil_socket_t fd, short what, void *arg) {
+    struct capture *cap = (struct capture*)arg;
+    struct pcap_stat stats;
+    uint64_t    recv, drop, ifdrop;
+
+    if (cap->ring != NULL) {
+        if (ring_stats(cap->ring, &recv, &drop, &ifdrop) == 0) {
+            COUNTER_SET(cap->kernel_recv, recv);
+            COUNTER_SET(cap->kernel_drop, drop);
+            COUNTER_SET(cap->kernel_ifdrop, ifdrop);
+        }
+        return;
+    }
+
+    if (pcap_stats(cap->pcap, &stats) < 0) {
+        syslog(_LOGERR_"couldn't read the statistics of a handle on %s: %s",
+            cap->device, pcap_geterr(cap->pcap));
+        return;
+    }
+
+    COUNTER_SET(cap->kernel_recv, cap->kernel_recv
+        + (u_int)(stats.ps_recv - cap->last_stats.ps_recv));
+    COUNTER_SET(cap->kernel_drop, cap->kernel_drop
+        + (u_int)(stats.ps_drop - cap->last_stats.ps_drop));
+    COUNTER_SET(cap->kernel_ifdrop, cap->kernel_ifdrop
+        + (u_int)(stats.ps_ifdrop - cap->last_stats.ps_ifdrop));
+    cap->last_stats = stats;
+}
+
+
+/*
+ * capture_free()
+ * ------------
+ * deallocate a capture handle
+ */
+static void
+capture_free(struct capture *cap) {
+    if (cap == NULL)
+        return;
+
+    if (cap->watcher != NULL) {
+        event_del(cap->watcher);
+        event_free(cap->watcher);
+    }
+
+    if (cap->resume != NULL) {
+        event_del(cap->resume);
+        event_free(cap->resume);
+    }
+
+    if (cap->stats_timer != NULL) {
+        event_del(cap->stats_timer);
+        event_free(cap->stats_timer);
+    }
+
+    if (cap->pcap != NULL)
+        pcap_close(cap->pcap);
+
+    if (cap->ring != NULL)
+        ring_close(cap->ring);
+
+    classifier_free(cap->classifier);
+
+    if (cap->monitors != NULL)
+        free(cap->monitors);
+
+    if (cap->device != NULL)
+        free(cap->device);
+
+    TAILQ_REMOVE(&captures, cap, link);
+    free(cap);
+}
+
+
+/*
+ * capture_new()
+ * -----------
+ * open a pcap handle, or a TPACKET_V3 ring when the geometry has blocks,
+ * on the given device, and associate it with a libevent watcher
+ */
+static struct capture *
+capture_new(const char *device, int shared,
+    const struct ring_geometry *geometry, int worker) {
+    struct capture  *cap;
+    struct timeval  tv;
+    char    errbuf[PCAP_ERRBUF_SIZE];
+    int     snaplen = (shared ? SHARED_SNAP_LENGTH : SNAP_LENGTH);
+    int     fd;
+
+    if (options.debug)
+        fprintf(stderr, "capture_new: opening %s handle on %s for "
+            "worker %d\n", (shared ? "shared" : "dedicated"), device, worker);
+
+    /* allocate memory for the capture */
+    cap = calloc(1, sizeof(struct capture));
+    if (cap == NULL) {
+        syslog(_LOGERR_"couldn't allocate capture: %s", strerror(errno));
+        return(NULL);
+    }
+
+    TAILQ_INSERT_TAIL(&captures, cap, link);
+    cap->shared = shared;
+    cap->worker = worker;
+    cap->fanout_id = -1;
+    cap->budget = INITIAL_BUDGET;
+
+    if ((cap->device = strdup(device)) == NULL) {
+        syslog(_LOGERR_"couldn't allocate capture: %s", strerror(errno));
+        capture_free(cap);
+        return(NULL);
+    }
+
+    if (geometry->blocks > 0) {
+        /* create the capture ring, and a dead pcap handle to compile
+           the filters against */
+        cap->ring = ring_open(cap->device, snaplen, geometry);
+        if (cap->ring == NULL) {
+            capture_free(cap);
+            return(NULL);
+        }
+
+        cap->pcap = pcap_open_dead(DLT_EN10MB, snaplen);
+        if (cap->pcap == NULL) {
+            syslog(_LOGERR_"couldn't create a pcap handle to compile "
+                "filters for %s", cap->device);
+            capture_free(cap);
+            return(NULL);
+        }
+
+        fd = ring_fd(cap->ring);
+    }
+    else {
+        /* create the pcap handle */
+        cap->pcap = pcap_open_live(cap->device, snaplen, 1, 100, errbuf);
+        if (cap->pcap == NULL) {
+            syslog(_LOGERR_"couldn't open monitor on %s: %s", cap->device,
+                errbuf);
+            capture_free(cap);
+            return(NULL);
+        }
+
+        /* set the pcap handle in non-block mode */
+        if (pcap_setnonblock(cap->pcap, 1, errbuf) < 0) {
+            syslog(_LOGERR_"couldn't set monitor in non-block mode: %s",
+                errbuf);
+            capture_free(cap);
+            return(NULL);
+        }
+
+        /* get a selectable file descriptor */
+        fd = pcap_get_selectable_fd(cap->pcap);
+        if (fd < 0) {
+            syslog(_LOGERR_"couldn't get a selectable file descriptor: %s",
+                pcap_geterr(cap->pcap));
+            capture_free(cap);
+            return(NULL);
+        }
+    }
+
+    /* create and activate the libevent watcher associated with
+       the pcap handle */
+    cap->watcher = event_new(workers[worker].ev_base, fd, EV_READ|EV_PERSIST,
+        capture_io, (void *)cap);
+    if (cap->watcher == NULL) {
+        syslog(_LOGERR_"couldn't create a watcher for a pcap handle");
+        capture_free(cap);
+        return(NULL);
+    }
+
+    if (event_add(cap->watcher, NULL) < 0) {
+        syslog(_LOGERR_"couldn't activate a watcher for a pcap handle");
+        capture_free(cap);
+        return(NULL);
+    }
+
+    /* and the timer to resume it after a deferral */
+    cap->resume = evtimer_new(workers[worker].ev_base, capture_resume,
+        (void *)cap);
+    if (cap->resume == NULL) {
+        syslog(_LOGERR_"couldn't create a timer for a pcap handle");
+        capture_free(cap);
+        return(NULL);
+    }
+
+    /* and the one to poll its kernel counters */
+    tv.tv_sec = STATS_INTERVAL;
+    tv.tv_usec = 0;
+
+    cap->stats_timer = event_new(workers[worker].ev_base, -1, EV_PERSIST,
+        capture_stats, (void *)cap);
+    if (cap->stats_timer == NULL || event_add(cap->stats_timer, &tv) < 0) {
+        syslog(_LOGERR_"couldn't create a timer for a pcap handle");
+        capture_free(cap);
+        return(NULL);
+    }
+
+    return(cap);
+}
+
+
+/*
+ * capture_offline()
+ * ---------------
+ * open the capture file given to --replay, as a handle shared by all the
+ * monitors; it has no watcher, the replay loop reads it
+ */
+static struct capture *
+capture_offline(const char *path) {
+    struct capture  *cap;
+    char    errbuf[PCAP_ERRBUF_SIZE];
+
+    if (options.debug)
+        fprintf(stderr, "capture_offline: opening %s\n", path);
+
+    cap = calloc(1, sizeof(struct capture));
+    if (cap == NULL) {
+        syslog(_LOGERR_"couldn't allocate capture: %s", strerror(errno));
+        return(NULL);
+    }
+
+    TAILQ_INSERT_TAIL(&captures, cap, link);
+    cap->shared = 1;
+    cap->fanout_id = -1;
+
+    if ((cap->device = strdup(path)) == NULL) {
+        syslog(_LOGERR_"couldn't allocate capture: %s", strerror(errno));
+        capture_free(cap);
+        return(NULL);
+    }
+
+    cap->pcap = pcap_open_offline(path, errbuf);
+    if (cap->pcap == NULL) {
+        syslog(_LOGERR_"couldn't open capture file %s: %s", path, errbuf);
+        capture_free(cap);
+        return(NULL);
+    }
+
+    return(cap);
+}
+
+
+/*
+ * capture_fanout()
+ * --------------
+ * make the capture handle join the given PACKET_FANOUT group, so that
+ * the kernel spreads the packets of the device among the workers
+ */
+static int
+capture_fanout(struct capture *cap, int id) {
+#ifdef __linux__
+    int fd, value;
+
+    fd = (cap->ring != NULL ? ring_fd(cap->ring) : pcap_fileno(cap->pcap));
+    value = (id & 0xffff) | ((options.fanout == FANOUT_CPU
+        ? PACKET_FANOUT_CPU : PACKET_FANOUT_HASH|PACKET_FANOUT_FLAG_DEFRAG)
+        << 16);
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &value,
+        sizeof(value)) < 0) {
+        syslog(_LOGERR_"couldn't join fanout group %d on %s: %s", id,
+            cap->device, strerror(errno));
+        return(-1);
+    }
+
+    cap->fanout_id = id;
+    return(0);
+#else
+    syslog(_LOGERR_"couldn't join fanout group on %s: PACKET_FANOUT is "
+        "only available on Linux", cap->device);
+    return(-1);
+#endif
+}
+
+
+/*
+ * capture_add()
+ * -----------
+ * add a monitor to the list of a capture handle
+ */
+static int
+capture_add(struct capture *cap, struct monitor *mon) {
+    struct monitor **list;
+
+    list = realloc(cap->monitors,
+        (cap->monitor_count + 1) * sizeof(struct monitor *));
+    if (list == NULL) {
+        syslog(_LOGERR_"couldn't allocate capture: %s", strerror(errno));
+        return(-1);
+    }
+
+    cap->monitors = list;
+    cap->monitors[cap->monitor_count++] = mon;
+    cap->classify = cap->shared;
+    mon->captures[cap->worker] = cap;
+
+    return(0);
+}
+
+
+/*
+ * capture_attach()
+ * --------------
+ * attach a monitor to a capture handle in each worker: its own one in
+ * the default mode, or the one shared by all the monitors of the same
+ * device when --shared is in effect; compile the monitor filter against
+ * that handle. with several workers, the handles of a device join the
+ * same fanout group
+ */
+int
+capture_attach(struct monitor *mon) {
+    struct capture  *cap;
+    int     w;
+
+    assert(mon->device);
+
+    mon->captures = calloc(worker_count, sizeof(struct capture *));
+    if (mon->captures == NULL) {
+        syslog(_LOGERR_"couldn't allocate monitor: %s", strerror(errno));
+        return(-1);
+    }
+
+    for (w=0; w<worker_count; w++) {
+        cap = NULL;
+
+        /* look for an existing handle on the same device; when replaying,
+           all the monitors read the same file */
+        if (options.replay != NULL)
+            cap = TAILQ_FIRST(&captures);
+        else if (options.shared) {
+            TAILQ_FOREACH(cap, &captures, link) {
+                if (cap->shared && cap->worker == w
+                    && strcmp(cap->device, mon->device) == 0)
+                    break;
+            }
+        }
+
+        if (cap == NULL && options.replay != NULL) {
+            if ((cap = capture_offline(options.replay)) == NULL)
+                goto fail;
+        }
+        else if (cap == NULL) {
+            cap = capture_new(mon->device, options.shared, &mon->ring, w);
+            if (cap == NULL)
+                goto fail;
+
+            /* the handles of the other workers join the group of the first
+               one, which already holds this monitor */
+            if (worker_count > 1) {
+                if (fanout_next_id < 0)
+                    fanout_next_id = getpid() & 0xffff;
+
+                if (capture_fanout(cap, (w == 0 ? fanout_next_id++
+                    : mon->captures[0]->fanout_id)) < 0) {
+                    capture_free(cap);
+                    goto fail;
+                }
+            }
+        }
+        else if (mon->ring.blocks > 0 && cap->ring == NULL
+            && options.replay == NULL) {
+            syslog(_LOGWARN_"monitor %u: the shared handle on %s is already "
+                "opened without a ring, ignoring its ring geometry",
+                mon->index, cap->device);
+        }
+
+        /* if there's a filter, compile it once */
+        if (!mon->filter_valid && (mon->filter != NULL)
+            && (strlen(mon->filter) > 0)) {
+            if (pcap_compile(cap->pcap, &mon->filter_bpf, mon->filter,
+                1, 0) < 0) {
+                syslog(_LOGERR_"couldn't compile monitor filter: %s",
+                    pcap_geterr(cap->pcap));
+                goto fail_capture;
+            }
+
+            mon->filter_valid = 1;
+        }
+
+        /* translate it to native code when it runs in userspace */
+        if (mon->filter_valid && cap->shared && options.jit
+            && mon->filter_jit == NULL)
+            mon->filter_jit = jit_compile(&mon->filter_bpf);
+
+        /* associate it to the pcap handle, unless it's a shared one, where
+           the filter is run in userspace by capture_packet() */
+        if (mon->filter_valid && !cap->shared) {
+            if (cap->ring != NULL) {
+                if (ring_setfilter(cap->ring, &mon->filter_bpf) < 0)
+                    goto fail_capture;
+            }
+            else if (pcap_setfilter(cap->pcap, &mon->filter_bpf) < 0) {
+                syslog(_LOGERR_"couldn't setup monitor filter: %s",
+                    pcap_geterr(cap->pcap));
+                goto fail_capture;
+            }
+        }
+
+        /* add the monitor to the list of the capture */
+        if (capture_add(cap, mon) < 0)
+            goto fail_capture;
+    }
+
+    return(0);
+
+  fail_capture:
+    if (cap->monitor_count == 0)
+        capture_free(cap);
+
+  fail:
+    return(-1);
+}
+
+
+/*
+ * capture_detach()
+ * --------------
+ * remove a monitor from its capture handles, and close the handles
+ * no monitor uses anymore
+ */
+void
+capture_detach(struct monitor *mon) {
+    struct capture *cap;
+    int i, w;
+
+    if (mon->captures == NULL)
+        return;
+
+    for (w=0; w<worker_count; w++) {
+        if ((cap = mon->captures[w]) == NULL)
+            continue;
+
+        for (i=0; i<cap->monitor_count; i++) {
+            if (cap->monitors[i] == mon) {
+                memmove(&cap->monitors[i], &cap->monitors[i+1],
+                    (cap->monitor_count - i - 1) * sizeof(struct monitor *));
+                cap->monitor_count--;
+                cap->classify = cap->shared;
+                break;
+            }
+        }
+
+        if (cap->monitor_count == 0)
+            capture_free(cap);
+    }
+
+    free(mon->captures);
+    mon->captures = NULL;
+}
+
+
+/*
+ * capture_dispatch_stats()
+ * ----------------------
+ * gather the dispatch scheduler metrics of the capture handles of
+ * a monitor
+ */
+void
+capture_dispatch_stats(struct monitor *mon, struct dispatch_stats *stats) {
+    struct capture *cap;
+    uint32_t delay;
+    int w;
+
+    memset(stats, 0, sizeof(struct dispatch_stats));
+
+    if (mon->captures == NULL)
+        return;
+
+    for (w=0; w<worker_count; w++) {
+        if ((cap = mon->captures[w]) == NULL)
+            continue;
+
+        delay = COUNTER_GET(cap->delay);
+        if (delay > stats->delay)
+            stats->delay = delay;
+
+        stats->budget   += COUNTER_GET(cap->budget);
+        stats->calls    += COUNTER_GET(cap->dispatch_calls);
+        stats->full     += COUNTER_GET(cap->dispatch_full);
+        stats->deferred += COUNTER_GET(cap->dispatch_deferred);
+        stats->packets  += COUNTER_GET(cap->dispatch_packets);
+        stats->time     += COUNTER_GET(cap->dispatch_time);
+    }
+}
+
+
+/*
+ * capture_kernel_stats()
+ * --------------------
+ * gather the kernel counters of the capture handles of a monitor, as
+ * last polled by their workers; with --shared, they count the packets of
+ * all the monitors of its device
+ */
+void
+capture_kernel_stats(struct monitor *mon, struct kernel_stats *stats) {
+    struct capture *cap;
+    int w;
+
+    memset(stats, 0, sizeof(struct kernel_stats));
+
+    if (mon->captures == NULL)
+        return;
+
+    for (w=0; w<worker_count; w++) {
+        if ((cap = mon->captures[w]) == NULL)
+            continue;
+
+        stats->recv += COUNTER_GET(cap->kernel_recv);
+        stats->drop += COUNTER_GET(cap->kernel_drop);
+        if (COUNTER_GET(cap->kernel_ifdrop) > stats->ifdrop)
+            stats->ifdrop = COUNTER_GET(cap->kernel_ifdrop);
+    }
+}
@@ -0,0 +1,1371 @@
+/*
+ * netsnmp-pcap :: classifier.c
+ * ----------------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#include <errno.h>
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslog.h>
+#include <sys/types.h>
+
+#include "netsnmp-pcap.h"
+
+
+/* bounds of a classifier, beyond which the filters are run one by one */
+#define MAX_TESTS           (1 << 16)
+#define MAX_NODES           (1 << 16)
+#define MAX_RANGES          (1 << 20)
+
+/* kinds of symbolic values */
+#define EXPR_CONST          0
+#define EXPR_LEN            1       /* wire length of the packet */
+#define EXPR_LOAD           2       /* bytes at k, or at k + a */
+#define EXPR_MSH            3       /* 4 * (byte at k & 0xf) */
+#define EXPR_ALU            4       /* a op b */
+#define EXPR_NEG            5       /* -a */
+
+/* kinds of filter tests */
+#define TEST_ACCEPT         0
+#define TEST_REJECT         1
+#define TEST_LOAD           2       /* reject if expr can't be evaluated */
+#define TEST_JUMP           3       /* expr op k, to jt or jf */
+
+/* the two leaves, which are the first tests of every classifier */
+#define ACCEPT              0
+#define REJECT              1
+
+/* kinds of test keys, when choosing the next node of the classifier */
+#define KEY_SWITCH          0       /* loads and comparisons of an expr */
+#define KEY_COND            1       /* any other test */
+
+
+/* symbolic value of a classic BPF register, as a function of the packet */
+struct cl_expr {
+    uint8_t     kind;
+    uint8_t     size;       /* of a load, in bytes */
+    uint8_t     op;         /* BPF_OP() of an arithmetic */
+    uint8_t     faulty;     /* its evaluation can fail */
+    uint32_t    k;
+    int32_t     a, b;       /* operands, or -1 */
+};
+
+/* step of a filter, once its program is executed symbolically */
+struct cl_test {
+    uint8_t     kind;
+    uint8_t     op;         /* BPF_JEQ, BPF_JGT, BPF_JGE or BPF_JSET */
+    uint8_t     src;        /* BPF_X when k is an expression */
+    uint8_t     unused;
+    int32_t     expr;
+    uint32_t    k;
+    int32_t     jt, jf;     /* next tests; a load only uses jt */
+};
+
+/* position of a monitor in its filter */
+struct cl_pair {
+    int32_t     monitor;
+    int32_t     test;
+};
+
+/* state of the symbolic execution of a filter */
+struct cl_state {
+    int32_t     pc;
+    int32_t     a, x;
+    int32_t     mem[BPF_MEMWORDS];
+};
+
+/* transition of the classifier, which flags monitors as matching */
+struct cl_edge {
+    int32_t     next;       /* node, or -1 when the packet is classified */
+    uint32_t    first;      /* monitors to flag, in marks */
+    uint32_t    count;
+};
+
+/* monitors to flag, in a word of the bitmap */
+struct cl_mark {
+    uint32_t    word;
+    uint64_t    bits;
+};
+
+/* values of a switch from low on, up to the low of the next range */
+struct cl_range {
+    uint32_t    low;
+    int32_t     edge;
+};
+
+/* node of the classifier: a switch over the value of an expression, or
+   a condition when op is set */
+struct cl_node {
+    int32_t     expr;
+    uint8_t     op;
+    uint8_t     src;
+    uint32_t    k;
+    uint32_t    first;      /* switch ranges */
+    uint32_t    count;
+    int32_t     on_true;    /* condition edges */
+    int32_t     on_false;
+    int32_t     on_fault;   /* edge when the expression can't be
+                               evaluated on the packet */
+};
+
+/* merged filters of the monitors of a capture handle */
+struct classifier {
+    struct cl_expr  *exprs;
+    struct cl_node  *nodes;
+    struct cl_range *ranges;
+    struct cl_edge  *edges;
+    struct cl_mark  *marks;
+    int             expr_count;
+    int             node_count;
+    int             range_count;
+    int             edge_count;
+    int             mark_count;
+    int             root;       /* edge */
+
+    /* values of the expressions for the current packet */
+    uint32_t        *values;
+    uint32_t        *stamps;
+    uint8_t         *faults;
+    uint32_t        stamp;
+
+    /* monitors matching the current packet */
+    uint64_t        *matches;
+    int             words;
+};
+
+/* hash table of keys of any length, each associated to an index */
+struct cl_slot {
+    uint32_t    hash;
+    uint32_t    length;
+    size_t      offset;
+    int32_t     value;
+};
+
+struct cl_table {
+    struct cl_slot  *slots;
+    uint32_t        mask;
+    uint32_t        count;
+    unsigned char   *pool;
+    size_t          used;
+    size_t          size;
+};
+
+/* classifier being built */
+struct cl_builder {
+    struct classifier   *cl;
+    struct cl_table     expr_table;
+    struct cl_table     test_table;
+    struct cl_table     walk_table;
+    struct cl_table     state_table;
+
+    struct cl_test      *tests;
+    int                 test_count;
+
+    /* program being executed symbolically */
+    const struct bpf_insn   *insns;
+    u_int               insn_count;
+
+    /* monitors still undecided in each node of the classifier */
+    struct cl_pair      *pairs;
+    size_t              pair_count;
+    size_t              *state_first;
+    int                 *state_count;
+
+    /* allocated sizes */
+    int                 expr_size;
+    int                 node_size;
+    int                 range_size;
+    int                 edge_size;
+    int                 mark_size;
+    int                 test_size;
+    size_t              pair_size;
+
+    int                 failed;
+};
+
+
+/*
+ * classifier_grow()
+ * ---------------
+ * make room for one more element in an array
+ */
+static int
+classifier_grow(void *array, int *size, int count, size_t element) {
+    void    *p;
+    int     n;
+
+    if (count < *size)
+        return(0);
+
+    n = (*size ? *size * 2 : 64);
+    if ((p = realloc(*(void **)array, n * element)) == NULL)
+        return(-1);
+
+    *(void **)array = p;
+    *size = n;
+    return(0);
+}
+
+
+/*
+ * table_hash()
+ * ----------
+ * FNV-1a
+ */
+static uint32_t
+table_hash(const void *key, size_t length) {
+    const unsigned char *p = key;
+    uint32_t    hash = 2166136261u;
+
+    while (length--) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+
+    return(hash);
+}
+
+
+/*
+ * table_lookup()
+ * ------------
+ * look for a key in the table, and add it with the given value if it's
+ * not there yet, unless that value is -1; return the value associated
+ * to the key, -1 if it's missing, or -2 if memory is exhausted
+ */
+static int32_t
+table_lookup(struct cl_table *table, const void *key, size_t length,
+    int32_t value) {
+    struct cl_slot  *slots, *slot;
+    unsigned char   *pool;
+    uint32_t    hash = table_hash(key, length), mask, i;
+    size_t      size;
+
+    if (table->slots != NULL) {
+        for (i = hash & table->mask; ; i = (i + 1) & table->mask) {
+            slot = &table->slots[i];
+            if (slot->value < 0)
+                break;
+            if (slot->hash == hash && slot->length == length
+                && memcmp(table->pool + slot->offset, key, length) == 0)
+                return(slot->value);
+        }
+    }
+
+    if (value < 0)
+        return(-1);
+
+    /* keep the table at most half full */
+    if (table->slots == NULL || (table->count + 1) * 2 > table->mask + 1) {
+        mask = (table->slots ? table->mask * 2 + 1 : 255);
+        if ((slots = malloc((mask + 1) * sizeof(struct cl_slot))) == NULL)
+            return(-2);
+
+        for (i=0; i<=mask; i++)
+            slots[i].value = -1;
+
+        for (i=0; table->slots != NULL && i<=table->mask; i++) {
+            if (table->slots[i].value < 0)
+                continue;
+            for (slot = &slots[table->slots[i].hash & mask]; slot->value >= 0;
+                slot = &slots[(slot - slots + 1) & mask]);
+            *slot = table->slots[i];
+        }
+
+        free(table->slots);
+        table->slots = slots;
+        table->mask = mask;
+    }
+
+    if (table->used + length > table->size) {
+        size = (table->size ? table->size * 2 : 4096);
+        while (size < table->used + length)
+            size *= 2;
+        if ((pool = realloc(table->pool, size)) == NULL)
+            return(-2);
+        table->pool = pool;
+        table->size = size;
+    }
+
+    for (i = hash & table->mask; table->slots[i].value >= 0;
+        i = (i + 1) & table->mask);
+
+    slot = &table->slots[i];
+    slot->hash = hash;
+    slot->length = length;
+    slot->offset = table->used;
+    slot->value = value;
+    memcpy(table->pool + table->used, key, length);
+    table->used += length;
+    table->count++;
+
+    return(value);
+}
+
+
+/*
+ * table_clear()
+ * -----------
+ */
+static void
+table_clear(struct cl_table *table) {
+    free(table->slots);
+    free(table->pool);
+    memset(table, 0, sizeof(struct cl_table));
+}
+
+
+/*
+ * classifier_alu()
+ * --------------
+ * compute a op b like classic BPF does; a division by zero is a fault,
+ * which makes the filter reject the packet
+ */
+static uint32_t
+classifier_alu(int op, uint32_t a, uint32_t b, int *fault) {
+    switch (op) {
+        case BPF_ADD:   return(a + b);
+        case BPF_SUB:   return(a - b);
+        case BPF_MUL:   return(a * b);
+        case BPF_OR:    return(a | b);
+        case BPF_AND:   return(a & b);
+        case BPF_XOR:   return(a ^ b);
+        case BPF_LSH:   return(b < 32 ? a << b : 0);
+        case BPF_RSH:   return(b < 32 ? a >> b : 0);
+        case BPF_DIV:
+        case BPF_MOD:
+            if (b == 0) {
+                *fault = 1;
+                return(0);
+            }
+            return(op == BPF_DIV ? a / b : a % b);
+    }
+
+    *fault = 1;
+    return(0);
+}
+
+
+/*
+ * classifier_compare()
+ * ------------------
+ */
+static int
+classifier_compare(int op, uint32_t a, uint32_t b) {
+    switch (op) {
+        case BPF_JEQ:   return(a == b);
+        case BPF_JGT:   return(a > b);
+        case BPF_JGE:   return(a >= b);
+        default:        return((a & b) != 0);
+    }
+}
+
+
+/*
+ * classifier_expr()
+ * ---------------
+ * return the index of an expression, which is added to the classifier
+ * if it's new; arithmetic on constants is folded
+ */
+static int32_t
+classifier_expr(struct cl_builder *b, int kind, int size, int op, uint32_t k,
+    int32_t x, int32_t y) {
+    struct classifier   *cl = b->cl;
+    struct cl_expr  expr;
+    int32_t     id;
+    int         fault = 0;
+
+    if (b->failed)
+        return(-1);
+
+    if (kind == EXPR_ALU && cl->exprs[x].kind == EXPR_CONST
+        && cl->exprs[y].kind == EXPR_CONST) {
+        k = classifier_alu(op, cl->exprs[x].k, cl->exprs[y].k, &fault);
+        if (!fault) {
+            kind = EXPR_CONST;
+            op = 0;
+            x = y = -1;
+        }
+    }
+    else if (kind == EXPR_NEG && cl->exprs[x].kind == EXPR_CONST) {
+        kind = EXPR_CONST;
+        k = -cl->exprs[x].k;
+        x = -1;
+    }
+
+    memset(&expr, 0, sizeof(expr));
+    expr.kind = kind;
+    expr.size = size;
+    expr.op = op;
+    expr.k = k;
+    expr.a = x;
+    expr.b = y;
+    expr.faulty = (kind == EXPR_LOAD || kind == EXPR_MSH
+        || (kind == EXPR_ALU && (op == BPF_DIV || op == BPF_MOD))
+        || (x >= 0 && cl->exprs[x].faulty) || (y >= 0 && cl->exprs[y].faulty));
+
+    id = table_lookup(&b->expr_table, &expr, sizeof(expr), cl->expr_count);
+    if (id == cl->expr_count) {
+        if (classifier_grow(&cl->exprs, &b->expr_size, cl->expr_count,
+            sizeof(struct cl_expr)) < 0) {
+            b->failed = 1;
+            return(-1);
+        }
+        cl->exprs[cl->expr_count++] = expr;
+    }
+    else if (id < 0)
+        b->failed = 1;
+
+    return(id);
+}
+
+
+/*
+ * classifier_test()
+ * ---------------
+ * return the index of a filter test, which is added if it's new, so that
+ * identical filters end up with the same tests
+ */
+static int32_t
+classifier_test(struct cl_builder *b, int kind, int op, int src, int32_t expr,
+    uint32_t k, int32_t jt, int32_t jf) {
+    struct cl_test  test;
+    int32_t     id;
+
+    if (b->failed || jt < 0 || jf < 0)
+        return(-1);
+
+    memset(&test, 0, sizeof(test));
+    test.kind = kind;
+    test.op = op;
+    test.src = src;
+    test.expr = expr;
+    test.k = k;
+    test.jt = jt;
+    test.jf = jf;
+
+    id = table_lookup(&b->test_table, &test, sizeof(test), b->test_count);
+    if (id == b->test_count) {
+        if (b->test_count >= MAX_TESTS || classifier_grow(&b->tests,
+            &b->test_size, b->test_count, sizeof(struct cl_test)) < 0) {
+            b->failed = 1;
+            return(-1);
+        }
+        b->tests[b->test_count++] = test;
+    }
+    else if (id < 0)
+        b->failed = 1;
+
+    return(id);
+}
+
+
+/*
+ * classifier_walk()
+ * ---------------
+ * execute a classic BPF program symbolically from the given state, and
+ * return the test the state leads to; registers and scratch memory hold
+ * expressions, and each conditional jump becomes a test, unless both
+ * sides are constants
+ */
+static int32_t
+classifier_walk(struct cl_builder *b, const struct cl_state *entry) {
+    const struct bpf_insn   *insn;
+    struct cl_state     state = *entry, branch;
+    int32_t     id, value, rhs, jt, jf;
+    uint32_t    k;
+
+    if ((id = table_lookup(&b->walk_table, entry, sizeof(*entry), -1)) >= 0)
+        return(id);
+
+    for (id = -1; id < 0 && !b->failed; ) {
+        if (state.pc < 0 || (u_int)state.pc >= b->insn_count) {
+            b->failed = 1;
+            break;
+        }
+
+        insn = &b->insns[state.pc++];
+        k = insn->k;
+        value = -1;
+
+        switch (BPF_CLASS(insn->code)) {
+            case BPF_LD:
+            case BPF_LDX:
+                switch (BPF_MODE(insn->code)) {
+                    case BPF_IMM:
+                        value = classifier_expr(b, EXPR_CONST, 0, 0, k, -1, -1);
+                        break;
+                    case BPF_LEN:
+                        value = classifier_expr(b, EXPR_LEN, 0, 0, 0, -1, -1);
+                        break;
+                    case BPF_MEM:
+                        if (k >= BPF_MEMWORDS) {
+                            b->failed = 1;
+                            break;
+                        }
+                        value = state.mem[k];
+                        break;
+                    case BPF_ABS:
+                    case BPF_IND:
+                        if (BPF_CLASS(insn->code) != BPF_LD) {
+                            b->failed = 1;
+                            break;
+                        }
+                        value = classifier_expr(b, EXPR_LOAD,
+                            (BPF_SIZE(insn->code) == BPF_W ? 4
+                            : (BPF_SIZE(insn->code) == BPF_H ? 2 : 1)), 0, k,
+                            (BPF_MODE(insn->code) == BPF_IND ? state.x : -1),
+                            -1);
+                        break;
+                    case BPF_MSH:
+                        value = classifier_expr(b, EXPR_MSH, 1, 0, k, -1, -1);
+                        break;
+                    default:
+                        b->failed = 1;
+                        break;
+                }
+
+                if (value < 0)
+                    break;
+
+                if (BPF_CLASS(insn->code) == BPF_LD)
+                    state.a = value;
+                else
+                    state.x = value;
+
+                /* a packet load rejects the packet when it's out of
+                   bounds, even if its value is never used */
+                if (b->cl->exprs[value].kind == EXPR_LOAD
+                    || b->cl->exprs[value].kind == EXPR_MSH)
+                    id = classifier_test(b, TEST_LOAD, 0, 0, value, 0,
+                        classifier_walk(b, &state), REJECT);
+                break;
+
+            case BPF_ST:
+            case BPF_STX:
+                if (k >= BPF_MEMWORDS) {
+                    b->failed = 1;
+                    break;
+                }
+                state.mem[k] = (BPF_CLASS(insn->code) == BPF_ST
+                    ? state.a : state.x);
+                break;
+
+            case BPF_ALU:
+                if (BPF_OP(insn->code) == BPF_NEG) {
+                    state.a = classifier_expr(b, EXPR_NEG, 0, 0, 0, state.a,
+                        -1);
+                    break;
+                }
+
+                rhs = (BPF_SRC(insn->code) == BPF_X ? state.x
+                    : classifier_expr(b, EXPR_CONST, 0, 0, k, -1, -1));
+                if (rhs < 0)
+                    break;
+
+                /* a division by a null constant is an invalid program,
+                   by a null X a rejection */
+                if ((BPF_OP(insn->code) == BPF_DIV
+                    || BPF_OP(insn->code) == BPF_MOD)
+                    && b->cl->exprs[rhs].kind == EXPR_CONST
+                    && b->cl->exprs[rhs].k == 0) {
+                    if (BPF_SRC(insn->code) == BPF_X)
+                        id = REJECT;
+                    else
+                        b->failed = 1;
+                    break;
+                }
+
+                state.a = classifier_expr(b, EXPR_ALU, 0, BPF_OP(insn->code),
+                    0, state.a, rhs);
+                if (state.a >= 0 && b->cl->exprs[state.a].kind == EXPR_ALU
+                    && (BPF_OP(insn->code) == BPF_DIV
+                    || BPF_OP(insn->code) == BPF_MOD)
+                    && b->cl->exprs[rhs].kind != EXPR_CONST)
+                    id = classifier_test(b, TEST_LOAD, 0, 0, state.a, 0,
+                        classifier_walk(b, &state), REJECT);
+                break;
+
+            case BPF_JMP:
+                if (BPF_OP(insn->code) == BPF_JA) {
+                    state.pc += k;
+                    break;
+                }
+
+                if (BPF_OP(insn->code) != BPF_JEQ
+                    && BPF_OP(insn->code) != BPF_JGT
+                    && BPF_OP(insn->code) != BPF_JGE
+                    && BPF_OP(insn->code) != BPF_JSET) {
+                    b->failed = 1;
+                    break;
+                }
+
+                rhs = -1;
+                if (BPF_SRC(insn->code) == BPF_X) {
+                    if (b->cl->exprs[state.x].kind == EXPR_CONST)
+                        k = b->cl->exprs[state.x].k;
+                    else
+                        rhs = state.x;
+                }
+
+                /* both sides are known, take the branch right away */
+                if (rhs < 0 && b->cl->exprs[state.a].kind == EXPR_CONST) {
+                    state.pc += (classifier_compare(BPF_OP(insn->code),
+                        b->cl->exprs[state.a].k, k) ? insn->jt : insn->jf);
+                    break;
+                }
+
+                branch = state;
+                branch.pc = state.pc + insn->jt;
+                jt = classifier_walk(b, &branch);
+                branch.pc = state.pc + insn->jf;
+                jf = classifier_walk(b, &branch);
+
+                if (jt >= 0 && jt == jf)
+                    id = jt;
+                else
+                    id = classifier_test(b, TEST_JUMP, BPF_OP(insn->code),
+                        (rhs < 0 ? BPF_K : BPF_X), state.a,
+                        (rhs < 0 ? k : (uint32_t)rhs), jt, jf);
+                break;
+
+            case BPF_RET:
+                if (BPF_RVAL(insn->code) == BPF_K)
+                    id = (k ? ACCEPT : REJECT);
+                else if (BPF_RVAL(insn->code) != BPF_A)
+                    b->failed = 1;
+                else if (b->cl->exprs[state.a].kind == EXPR_CONST)
+                    id = (b->cl->exprs[state.a].k ? ACCEPT : REJECT);
+                else
+                    id = classifier_test(b, TEST_JUMP, BPF_JEQ, BPF_K,
+                        state.a, 0, REJECT, ACCEPT);
+                break;
+
+            case BPF_MISC:
+                if (BPF_MISCOP(insn->code) == BPF_TAX)
+                    state.x = state.a;
+                else if (BPF_MISCOP(insn->code) == BPF_TXA)
+                    state.a = state.x;
+                else
+                    b->failed = 1;
+                break;
+        }
+
+        if (state.a < 0 || state.x < 0)
+            b->failed = 1;
+    }
+
+    if (b->failed)
+        return(-1);
+
+    if (table_lookup(&b->walk_table, entry, sizeof(*entry), id) < 0)
+        b->failed = 1;
+
+    return(id);
+}
+
+
+/*
+ * classifier_edge()
+ * ---------------
+ * add an edge to the given node, flagging the given monitors, which are
+ * in ascending order
+ */
+static int32_t
+classifier_edge(struct cl_builder *b, int32_t next, const uint32_t *marks,
+    int count) {
+    struct classifier   *cl = b->cl;
+    struct cl_edge  *edge;
+    int     i;
+
+    if (b->failed || classifier_grow(&cl->edges, &b->edge_size,
+        cl->edge_count, sizeof(struct cl_edge)) < 0) {
+        b->failed = 1;
+        return(-1);
+    }
+
+    edge = &cl->edges[cl->edge_count];
+    edge->next = next;
+    edge->first = cl->mark_count;
+    edge->count = 0;
+
+    for (i=0; i<count; i++) {
+        if (edge->count == 0
+            || cl->marks[cl->mark_count - 1].word != marks[i] / 64) {
+            if (classifier_grow(&cl->marks, &b->mark_size, cl->mark_count,
+                sizeof(struct cl_mark)) < 0) {
+                b->failed = 1;
+                return(-1);
+            }
+            cl->marks[cl->mark_count].word = marks[i] / 64;
+            cl->marks[cl->mark_count].bits = 0;
+            cl->mark_count++;
+            edge->count++;
+        }
+        cl->marks[cl->mark_count - 1].bits |= (uint64_t)1 << (marks[i] % 64);
+    }
+
+    return(cl->edge_count++);
+}
+
+
+/*
+ * classifier_same()
+ * ---------------
+ * tell whether an edge leads to the given node, flagging the given
+ * monitors
+ */
+static int
+classifier_same(struct classifier *cl, const struct cl_edge *edge,
+    int32_t next, const uint32_t *marks, int count) {
+    uint64_t    bits;
+    uint32_t    i;
+    int         j = 0;
+
+    if (edge->next != next)
+        return(0);
+
+    for (i=0; i<edge->count; i++) {
+        for (bits=0; j<count
+            && marks[j] / 64 == cl->marks[edge->first + i].word; j++)
+            bits |= (uint64_t)1 << (marks[j] % 64);
+        if (bits != cl->marks[edge->first + i].bits)
+            return(0);
+    }
+
+    return(j == count);
+}
+
+
+/*
+ * classifier_state()
+ * ----------------
+ * return the node of the classifier where the given monitors are still
+ * undecided, at the given tests of their filters, which is added if it's
+ * new; when no monitor is left, the packet is classified
+ */
+static int32_t
+classifier_state(struct cl_builder *b, const struct cl_pair *pairs,
+    int count) {
+    struct classifier   *cl = b->cl;
+    struct cl_pair  *pool;
+    int32_t     id;
+    size_t      size;
+
+    if (b->failed || count == 0)
+        return(-1);
+
+    id = table_lookup(&b->state_table, pairs, count * sizeof(struct cl_pair),
+        cl->node_count);
+    if (id < 0) {
+        b->failed = 1;
+        return(-1);
+    }
+
+    if (id < cl->node_count)
+        return(id);
+
+    if (cl->node_count >= MAX_NODES
+        || classifier_grow(&cl->nodes, &b->node_size, cl->node_count,
+            sizeof(struct cl_node)) < 0
+        || (b->state_first = realloc(b->state_first,
+            b->node_size * sizeof(size_t))) == NULL
+        || (b->state_count = realloc(b->state_count,
+            b->node_size * sizeof(int))) == NULL) {
+        b->failed = 1;
+        return(-1);
+    }
+
+    if (b->pair_count + count > b->pair_size) {
+        size = (b->pair_size ? b->pair_size * 2 : 1024);
+        while (size < b->pair_count + count)
+            size *= 2;
+        if ((pool = realloc(b->pairs, size * sizeof(struct cl_pair))) == NULL) {
+            b->failed = 1;
+            return(-1);
+        }
+        b->pairs = pool;
+        b->pair_size = size;
+    }
+
+    memcpy(&b->pairs[b->pair_count], pairs, count * sizeof(struct cl_pair));
+    b->state_first[id] = b->pair_count;
+    b->state_count[id] = count;
+    b->pair_count += count;
+
+    memset(&cl->nodes[id], 0, sizeof(struct cl_node));
+    cl->node_count++;
+
+    return(id);
+}
+
+
+/*
+ * classifier_advance()
+ * ------------------
+ * move a monitor to the next test of its filter; when it accepts the
+ * packet, flag the monitor, and let it go on with the other branch,
+ * which can't change its outcome anymore, but leads to the same node as
+ * the other monitors that didn't match, so that matching one of hundreds
+ * of ports doesn't need hundreds of nodes afterwards
+ */
+static void
+classifier_advance(int32_t monitor, int32_t next, int32_t other,
+    struct cl_pair *pairs, int *count, uint32_t *marks, int *mark_count) {
+    if (next == ACCEPT) {
+        marks[(*mark_count)++] = monitor;
+        next = (other >= 0 && other != ACCEPT ? other : REJECT);
+    }
+
+    if (next != REJECT) {
+        pairs[*count].monitor = monitor;
+        pairs[*count].test = next;
+        (*count)++;
+    }
+}
+
+
+/*
+ * classifier_key()
+ * --------------
+ * compare two tests by what they evaluate: loads and comparisons with
+ * a constant of the same expression all belong to a switch over it
+ */
+static int
+classifier_key(struct cl_builder *b, int32_t x, int32_t y) {
+    const struct cl_test *t = &b->tests[x], *u = &b->tests[y];
+    int     kt, ku;
+
+    kt = (t->kind == TEST_LOAD || (t->src == BPF_K && t->op != BPF_JSET)
+        ? KEY_SWITCH : KEY_COND);
+    ku = (u->kind == TEST_LOAD || (u->src == BPF_K && u->op != BPF_JSET)
+        ? KEY_SWITCH : KEY_COND);
+
+    if (kt != ku)
+        return(kt < ku ? -1 : 1);
+    if (t->expr != u->expr)
+        return(t->expr < u->expr ? -1 : 1);
+    if (kt == KEY_SWITCH)
+        return(0);
+    if (t->op != u->op)
+        return(t->op < u->op ? -1 : 1);
+    if (t->src != u->src)
+        return(t->src < u->src ? -1 : 1);
+    if (t->k != u->k)
+        return(t->k < u->k ? -1 : 1);
+    return(0);
+}
+
+
+/* for qsort(), which has no context argument */
+static struct cl_builder *sort_builder;
+
+static int
+classifier_sort_tests(const void *x, const void *y) {
+    return(classifier_key(sort_builder, *(const int32_t *)x,
+        *(const int32_t *)y));
+}
+
+static int
+classifier_sort_values(const void *x, const void *y) {
+    uint32_t a = *(const uint32_t *)x, b = *(const uint32_t *)y;
+    return(a < b ? -1 : (a > b));
+}
+
+
+/*
+ * classifier_split()
+ * ----------------
+ * build a node of the classifier: among the tests its monitors are at,
+ * pick the one most of them share, and evaluate it once for all of them;
+ * the tests on the value of an expression become a switch, whose ranges
+ * are bounded by all the constants they compare it to
+ */
+static void
+classifier_split(struct cl_builder *b, int32_t id) {
+    struct classifier   *cl = b->cl;
+    struct cl_pair  *pairs, *next;
+    struct cl_test  *t;
+    struct cl_node  node;
+    struct cl_edge  *last;
+    int32_t     *tests, key, test, other, edge, child;
+    uint32_t    *marks, *values, v;
+    int     count = b->state_count[id], best, run, i, j;
+    int     n, m, value_count, taken, range_first;
+
+    pairs = malloc(count * sizeof(struct cl_pair));
+    next = malloc(count * sizeof(struct cl_pair));
+    tests = malloc(count * sizeof(int32_t));
+    marks = malloc(count * sizeof(uint32_t));
+    values = malloc((2 * count + 1) * sizeof(uint32_t));
+    if (pairs == NULL || next == NULL || tests == NULL || marks == NULL
+        || values == NULL) {
+        b->failed = 1;
+        goto done;
+    }
+
+    memcpy(pairs, &b->pairs[b->state_first[id]],
+        count * sizeof(struct cl_pair));
+
+    /* find the most common test */
+    for (i=0; i<count; i++)
+        tests[i] = pairs[i].test;
+
+    sort_builder = b;
+    qsort(tests, count, sizeof(int32_t), classifier_sort_tests);
+
+    key = tests[0];
+    for (i=0, best=0; i<count; i+=run) {
+        for (run=1; i+run<count
+            && classifier_key(b, tests[i], tests[i+run]) == 0; run++);
+        if (run > best) {
+            best = run;
+            key = tests[i];
+        }
+    }
+
+    memset(&node, 0, sizeof(node));
+    node.expr = b->tests[key].expr;
+    node.on_fault = -1;
+
+    if (b->tests[key].kind == TEST_LOAD || (b->tests[key].src == BPF_K
+        && b->tests[key].op != BPF_JSET)) {
+        /* the bounds of the ranges of the switch */
+        values[0] = 0;
+        value_count = 1;
+
+        for (i=0; i<count; i++) {
+            if (classifier_key(b, pairs[i].test, key) != 0)
+                continue;
+
+            t = &b->tests[pairs[i].test];
+            if (t->kind == TEST_LOAD)
+                t = &b->tests[t->jt];
+            if (t->kind != TEST_JUMP || t->expr != node.expr
+                || classifier_key(b, t - b->tests, key) != 0)
+                continue;
+
+            if (t->op != BPF_JGT)
+                values[value_count++] = t->k;
+            if (t->op != BPF_JGE && t->k != UINT32_MAX)
+                values[value_count++] = t->k + 1;
+        }
+
+        qsort(values, value_count, sizeof(uint32_t), classifier_sort_values);
+
+        node.first = cl->range_count;
+        range_first = cl->range_count;
+
+        for (j=0; j<value_count && !b->failed; j++) {
+            if (j > 0 && values[j] == values[j-1])
+                continue;
+
+            v = values[j];
+            n = m = 0;
+
+            for (i=0; i<count; i++) {
+                test = pairs[i].test;
+                other = -1;
+
+                if (classifier_key(b, test, key) == 0) {
+                    t = &b->tests[test];
+                    if (t->kind == TEST_LOAD) {
+                        test = t->jt;
+                        t = &b->tests[test];
+                    }
+
+                    if (t->kind == TEST_JUMP && t->expr == node.expr
+                        && classifier_key(b, test, key) == 0) {
+                        taken = classifier_compare(t->op, v, t->k);
+                        test = (taken ? t->jt : t->jf);
+                        other = (taken ? t->jf : t->jt);
+                    }
+                }
+
+                classifier_advance(pairs[i].monitor, test, other, next, &n,
+                    marks, &m);
+            }
+
+            child = classifier_state(b, next, n);
+
+            /* merge it with the previous range when they lead to the same
+               place, flagging the same monitors */
+            if (cl->range_count > range_first) {
+                last = &cl->edges[cl->ranges[cl->range_count - 1].edge];
+                if (classifier_same(cl, last, child, marks, m))
+                    continue;
+            }
+
+            edge = classifier_edge(b, child, marks, m);
+            if (edge < 0 || cl->range_count >= MAX_RANGES
+                || classifier_grow(&cl->ranges, &b->range_size,
+                    cl->range_count, sizeof(struct cl_range)) < 0) {
+                b->failed = 1;
+                break;
+            }
+
+            cl->ranges[cl->range_count].low = v;
+            cl->ranges[cl->range_count].edge = edge;
+            cl->range_count++;
+        }
+
+        node.count = cl->range_count - range_first;
+    }
+    else {
+        /* a condition, true or false for all the monitors at it */
+        node.op = b->tests[key].op;
+        node.src = b->tests[key].src;
+        node.k = b->tests[key].k;
+
+        for (taken=1; taken>=0 && !b->failed; taken--) {
+            n = m = 0;
+
+            for (i=0; i<count; i++) {
+                t = &b->tests[pairs[i].test];
+                if (classifier_key(b, pairs[i].test, key) == 0)
+                    classifier_advance(pairs[i].monitor,
+                        (taken ? t->jt : t->jf), (taken ? t->jf : t->jt),
+                        next, &n, marks, &m);
+                else
+                    classifier_advance(pairs[i].monitor, pairs[i].test, -1,
+                        next, &n, marks, &m);
+            }
+
+            edge = classifier_edge(b, classifier_state(b, next, n), marks, m);
+            if (taken)
+                node.on_true = edge;
+            else
+                node.on_false = edge;
+        }
+    }
+
+    /* the monitors at the test reject the packets it can't evaluate */
+    if (cl->exprs[node.expr].faulty
+        || (node.src == BPF_X && cl->exprs[node.k].faulty)) {
+        for (i=0, n=0; i<count; i++) {
+            if (classifier_key(b, pairs[i].test, key) != 0)
+                next[n++] = pairs[i];
+        }
+
+        node.on_fault = classifier_edge(b, classifier_state(b, next, n),
+            NULL, 0);
+    }
+
+    /* the nodes may have moved */
+    cl->nodes[id] = node;
+
+  done:
+    free(pairs);
+    free(next);
+    free(tests);
+    free(marks);
+    free(values);
+}
+
+
+/*
+ * classifier_free()
+ * ---------------
+ */
+void
+classifier_free(struct classifier *cl) {
+    if (cl == NULL)
+        return;
+
+    free(cl->exprs);
+    free(cl->nodes);
+    free(cl->ranges);
+    free(cl->edges);
+    free(cl->marks);
+    free(cl->values);
+    free(cl->stamps);
+    free(cl->faults);
+    free(cl->matches);
+    free(cl);
+}
+
+
+/*
+ * classifier_build()
+ * ----------------
+ * merge the filters of the monitors of a shared capture handle into
+ * a single classifier, which finds all the monitors matching a packet
+ * in one pass, evaluating each common check of the filters once; return
+ * NULL when the filters can't be merged, or are too complex to, in which
+ * case they have to be run one by one
+ */
+struct classifier *
+classifier_build(struct monitor **mons, int count) {
+    struct cl_builder   b;
+    struct cl_state     state;
+    struct cl_pair      *pairs = NULL;
+    struct classifier   *cl;
+    uint32_t    *marks = NULL;
+    int32_t     zero, test;
+    int     i, j, n = 0, m = 0;
+
+    memset(&b, 0, sizeof(b));
+    if ((cl = b.cl = calloc(1, sizeof(struct classifier))) == NULL
+        || (count > 0 && ((pairs = malloc(count * sizeof(struct cl_pair)))
+            == NULL || (marks = malloc(count * sizeof(uint32_t))) == NULL)))
+        goto fail;
+
+    /* the leaves */
+    classifier_test(&b, TEST_ACCEPT, 0, 0, -1, 0, 0, 0);
+    classifier_test(&b, TEST_REJECT, 0, 0, -1, 0, 0, 0);
+    zero = classifier_expr(&b, EXPR_CONST, 0, 0, 0, -1, -1);
+
+    /* execute each filter symbolically */
+    for (i=0; i<count && !b.failed; i++) {
+        test = ACCEPT;
+
+        if (mons[i]->filter_valid) {
+            b.insns = mons[i]->filter_bpf.bf_insns;
+            b.insn_count = mons[i]->filter_bpf.bf_len;
+
+            state.pc = 0;
+            state.a = state.x = zero;
+            for (j=0; j<BPF_MEMWORDS; j++)
+                state.mem[j] = zero;
+
+            test = classifier_walk(&b, &state);
+            table_clear(&b.walk_table);
+        }
+
+        classifier_advance(i, test, -1, pairs, &n, marks, &m);
+    }
+
+    /* then merge them, from the root */
+    cl->root = classifier_edge(&b, classifier_state(&b, pairs, n), marks, m);
+
+    for (i=0; i<cl->node_count && !b.failed; i++)
+        classifier_split(&b, i);
+
+    if (b.failed)
+        goto fail;
+
+    cl->words = (count + 63) / 64;
+    cl->values = calloc(cl->expr_count, sizeof(uint32_t));
+    cl->stamps = calloc(cl->expr_count, sizeof(uint32_t));
+    cl->faults = calloc(cl->expr_count, sizeof(uint8_t));
+    cl->matches = calloc(cl->words + 1, sizeof(uint64_t));
+    if (cl->values == NULL || cl->stamps == NULL || cl->faults == NULL
+        || cl->matches == NULL)
+        goto fail;
+
+    if (options.debug)
+        fprintf(stderr, "classifier_build: merged %d filters into %d nodes "
+            "(%d tests, %d expressions, %d ranges)\n", count, cl->node_count,
+            b.test_count, cl->expr_count, cl->range_count);
+
+    goto done;
+
+  fail:
+    classifier_free(cl);
+    cl = NULL;
+
+  done:
+    table_clear(&b.expr_table);
+    table_clear(&b.test_table);
+    table_clear(&b.walk_table);
+    table_clear(&b.state_table);
+    free(b.tests);
+    free(b.pairs);
+    free(b.state_first);
+    free(b.state_count);
+    free(pairs);
+    free(marks);
+
+    return(cl);
+}
+
+
+/*
+ * classifier_eval()
+ * ---------------
+ * evaluate an expression on the current packet, once
+ */
+static int
+classifier_eval(struct classifier *cl, int32_t id, const u_char *bytes,
+    u_int wirelen, u_int buflen, uint32_t *value) {
+    const struct cl_expr *expr = &cl->exprs[id];
+    uint32_t    a = 0, b = 0, k;
+    int         fault = 0;
+
+    if (cl->stamps[id] == cl->stamp) {
+        *value = cl->values[id];
+        return(cl->faults[id] ? -1 : 0);
+    }
+
+    switch (expr->kind) {
+        case EXPR_CONST:
+            a = expr->k;
+            break;
+
+        case EXPR_LEN:
+            a = wirelen;
+            break;
+
+        case EXPR_LOAD:
+            k = expr->k;
+            if (expr->a >= 0) {
+                if (classifier_eval(cl, expr->a, bytes, wirelen, buflen,
+                    &b) < 0 || k > buflen || b > buflen - k) {
+                    fault = 1;
+                    break;
+                }
+                k += b;
+            }
+
+            if (k > buflen || expr->size > buflen - k) {
+                fault = 1;
+                break;
+            }
+
+            switch (expr->size) {
+                case 4:
+                    a = ((uint32_t)bytes[k] << 24)
+                        | ((uint32_t)bytes[k+1] << 16)
+                        | ((uint32_t)bytes[k+2] << 8) | bytes[k+3];
+                    break;
+                case 2:
+                    a = ((uint32_t)bytes[k] << 8) | bytes[k+1];
+                    break;
+                default:
+                    a = bytes[k];
+                    break;
+            }
+            break;
+
+        case EXPR_MSH:
+            if (expr->k >= buflen) {
+                fault = 1;
+                break;
+            }
+            a = (bytes[expr->k] & 0xf) << 2;
+            break;
+
+        case EXPR_ALU:
+            if (classifier_eval(cl, expr->a, bytes, wirelen, buflen, &a) < 0
+                || classifier_eval(cl, expr->b, bytes, wirelen, buflen,
+                    &b) < 0) {
+                fault = 1;
+                break;
+            }
+            a = classifier_alu(expr->op, a, b, &fault);
+            break;
+
+        case EXPR_NEG:
+            if (classifier_eval(cl, expr->a, bytes, wirelen, buflen, &a) < 0)
+                fault = 1;
+            a = -a;
+            break;
+    }
+
+    cl->stamps[id] = cl->stamp;
+    cl->values[id] = a;
+    cl->faults[id] = fault;
+    *value = a;
+
+    return(fault ? -1 : 0);
+}
+
+
+/*
+ * classifier_run()
+ * --------------
+ * classify a packet, and return the bitmap of the monitors it matches,
+ * in the order they were given to classifier_build()
+ */
+const uint64_t *
+classifier_run(struct classifier *cl, const u_char *bytes, u_int wirelen,
+    u_int buflen) {
+    const struct cl_edge    *edge = &cl->edges[cl->root];
+    const struct cl_node    *node;
+    const struct cl_range   *ranges;
+    uint32_t    a, b, i;
+    int         low, high, mid;
+
+    for (low=0; low<cl->words; low++)
+        cl->matches[low] = 0;
+
+    /* forget the values of the previous packet */
+    if (++cl->stamp == 0) {
+        memset(cl->stamps, 0, cl->expr_count * sizeof(uint32_t));
+        cl->stamp = 1;
+    }
+
+    for (;;) {
+        for (i=0; i<edge->count; i++)
+            cl->matches[cl->marks[edge->first + i].word]
+                |= cl->marks[edge->first + i].bits;
+
+        if (edge->next < 0)
+            break;
+
+        node = &cl->nodes[edge->next];
+
+        if (classifier_eval(cl, node->expr, bytes, wirelen, buflen, &a) < 0) {
+            edge = &cl->edges[node->on_fault];
+            continue;
+        }
+
+        if (node->op == 0) {
+            /* the last range starting at or below the value */
+            ranges = &cl->ranges[node->first];
+            for (low=0, high=node->count-1; low < high; ) {
+                mid = (low + high + 1) / 2;
+                if (ranges[mid].low <= a)
+                    low = mid;
+                else
+                    high = mid - 1;
+            }
+            edge = &cl->edges[ranges[low].edge];
+            continue;
+        }
+
+        b = node->k;
+        if (node->src == BPF_X && classifier_eval(cl, node->k, bytes,
+            wirelen, buflen, &b) < 0) {
+            edge = &cl->edges[node->on_fault];
+            continue;
+        }
+
+        edge = &cl->edges[classifier_compare(node->op, a, b)
+            ? node->on_true : node->on_false];
+    }
+
+    return(cl->matches);
+}
@@ -0,0 +1,807 @@
+/*
+ * netsnmp-pcap :: ebpf.c
+ * ----------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslog.h>
+#include <sys/types.h>
+
+#include "netsnmp-pcap.h"
+
+#ifdef __linux__
+
+#include <arpa/inet.h>
+#include <net/if_arp.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* the kernel eBPF instruction is also called struct bpf_insn */
+#define bpf_insn ebpf_insn
+#include <linux/bpf.h>
+#undef bpf_insn
+
+
+#define ETHERNET_HEADER_LENGTH  14
+#define FILTER_SNAP_LENGTH      65535
+#define LOG_SIZE                (1 << 20)
+
+/* registers of the translated programs */
+#define R_RET       BPF_REG_0
+#define R_ARG1      BPF_REG_1
+#define R_ARG2      BPF_REG_2
+#define R_ARG3      BPF_REG_3
+#define R_ARG4      BPF_REG_4
+#define R_CTX       BPF_REG_6       /* struct __sk_buff */
+#define R_A         BPF_REG_7       /* classic BPF accumulator */
+#define R_X         BPF_REG_8       /* classic BPF index register */
+#define R_LEN       BPF_REG_9       /* packet length */
+#define R_FP        BPF_REG_10
+
+/* stack layout of the translated programs */
+#define STACK_LOAD      (-8)                    /* packet load buffer */
+#define STACK_MEM(k)    (-16 - 8 * (int)(k))    /* classic BPF M[k] */
+#define STACK_KEY       STACK_MEM(BPF_MEMWORDS) /* map key */
+
+/* jump targets which aren't classic BPF instructions */
+#define TARGET_NOMATCH  (-1)
+#define TARGET_MATCH    (-2)
+
+
+/* in-kernel counters of a monitor, as stored in the map */
+struct ebpf_counters {
+    uint64_t    packets;
+    uint64_t    octets;
+};
+
+/* eBPF program counting the monitors of a device */
+struct ebpf {
+    char        *device;
+    int         map_fd;
+    int         prog_fd;
+    int         sock_fd;
+};
+
+/* eBPF program being generated */
+struct ebpf_prog {
+    struct ebpf_insn    *insns;
+    int                 count;
+    int                 size;
+    int                 failed;
+};
+
+/* jump to patch once the classic BPF program is translated */
+struct ebpf_fixup {
+    int     insn;
+    int     target;
+};
+
+
+/* number of possible CPUs, which sizes the per-CPU map values */
+static int ebpf_cpus = 0;
+
+
+/*
+ * ebpf_syscall()
+ * ------------
+ */
+static int
+ebpf_syscall(int cmd, union bpf_attr *attr) {
+    return(syscall(__NR_bpf, cmd, attr, sizeof(*attr)));
+}
+
+
+/*
+ * ebpf_possible_cpus()
+ * ------------------
+ * parse /sys/devices/system/cpu/possible, a list of ranges like "0-3,6"
+ */
+static int
+ebpf_possible_cpus(void) {
+    FILE    *fh;
+    char    line[256], *p;
+    long    last;
+    int     count = 0;
+
+    if ((fh = fopen("/sys/devices/system/cpu/possible", "r")) == NULL)
+        return(-1);
+
+    if (fgets(line, sizeof(line), fh) == NULL) {
+        fclose(fh);
+        return(-1);
+    }
+
+    fclose(fh);
+
+    for (p = line; ; p++) {
+        last = strtol(p, &p, 10);
+        if (*p == '-')
+            last = strtol(p + 1, &p, 10);
+        count = last + 1;
+        if (*p != ',')
+            break;
+    }
+
+    return(count);
+}
+
+
+/*
+ * ebpf_emit()
+ * ---------
+ * append an instruction to the program; once an allocation failed, the
+ * program is left as it is and the caller checks prog->failed
+ */
+static int
+ebpf_emit(struct ebpf_prog *prog, uint8_t code, uint8_t dst, uint8_t src,
+    int16_t off, int32_t imm) {
+    struct ebpf_insn *insn;
+    int     size;
+
+    if (prog->failed)
+        return(0);
+
+    if (prog->count == prog->size) {
+        size = (prog->size ? prog->size * 2 : 256);
+        insn = realloc(prog->insns, size * sizeof(struct ebpf_insn));
+        if (insn == NULL) {
+            prog->failed = 1;
+            return(0);
+        }
+        prog->insns = insn;
+        prog->size = size;
+    }
+
+    insn = &prog->insns[prog->count];
+    insn->code = code;
+    insn->dst_reg = dst;
+    insn->src_reg = src;
+    insn->off = off;
+    insn->imm = imm;
+
+    return(prog->count++);
+}
+
+
+/*
+ * ebpf_emit_load()
+ * --------------
+ * load size bytes of the packet at the offset held by R_ARG2 into dst,
+ * in host byte order; a failed load is a non-match, like in classic BPF
+ */
+static void
+ebpf_emit_load(struct ebpf_prog *prog, struct ebpf_fixup *fixups,
+    int *fixup_count, int size, int dst) {
+    ebpf_emit(prog, BPF_ALU64|BPF_MOV|BPF_X, R_ARG1, R_CTX, 0, 0);
+    ebpf_emit(prog, BPF_ALU64|BPF_MOV|BPF_X, R_ARG3, R_FP, 0, 0);
+    ebpf_emit(prog, BPF_ALU64|BPF_ADD|BPF_K, R_ARG3, 0, 0, STACK_LOAD);
+    ebpf_emit(prog, BPF_ALU64|BPF_MOV|BPF_K, R_ARG4, 0, 0, size);
+    ebpf_emit(prog, BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_skb_load_bytes);
+
+    fixups[*fixup_count].insn =
+        ebpf_emit(prog, BPF_JMP|BPF_JNE|BPF_K, R_RET, 0, 0, 0);
+    fixups[(*fixup_count)++].target = TARGET_NOMATCH;
+
+    switch (size) {
+        case 4:
+            ebpf_emit(prog, BPF_LDX|BPF_MEM|BPF_W, dst, R_FP, STACK_LOAD, 0);
+            ebpf_emit(prog, BPF_ALU|BPF_END|BPF_TO_BE, dst, 0, 0, 32);
+            break;
+        case 2:
+            ebpf_emit(prog, BPF_LDX|BPF_MEM|BPF_H, dst, R_FP, STACK_LOAD, 0);
+            ebpf_emit(prog, BPF_ALU|BPF_END|BPF_TO_BE, dst, 0, 0, 16);
+            break;
+        default:
+            ebpf_emit(prog, BPF_LDX|BPF_MEM|BPF_B, dst, R_FP, STACK_LOAD, 0);
+            break;
+    }
+}
+
+
+/*
+ * ebpf_translate()
+ * --------------
+ * translate the classic BPF filter of a monitor into eBPF, appended to the
+ * program, followed by the update of its counters at the given slot of
+ * the map when the filter accepts the packet; return -1 on unsupported
+ * instructions
+ */
+static int
+ebpf_translate(struct ebpf_prog *prog, struct monitor *mon, uint32_t slot,
+    int map_fd) {
+    struct bpf_insn     *insns, accept = { BPF_RET|BPF_K, 0, 0, 1 };
+    struct ebpf_fixup   *fixups;
+    int     *offsets;
+    int     count, fixup_count = 0, match, nomatch, i, target;
+    int     size;
+
+    if (mon->filter_valid) {
+        insns = mon->filter_bpf.bf_insns;
+        count = mon->filter_bpf.bf_len;
+    }
+    else {
+        insns = &accept;
+        count = 1;
+    }
+
+    /* each instruction generates at most two jumps */
+    offsets = calloc(count, sizeof(int));
+    fixups = calloc(2 * count + 1, sizeof(struct ebpf_fixup));
+    if (offsets == NULL || fixups == NULL) {
+        free(offsets);
+        free(fixups);
+        return(-1);
+    }
+
+    /* A and X start at zero */
+    ebpf_emit(prog, BPF_ALU|BPF_MOV|BPF_K, R_A, 0, 0, 0);
+    ebpf_emit(prog, BPF_ALU|BPF_MOV|BPF_K, R_X, 0, 0, 0);
+
+    for (i=0; i<count; i++) {
+        struct bpf_insn *insn = &insns[i];
+        uint16_t code = insn->code;
+
+        offsets[i] = prog->count;
+
+        switch (BPF_CLASS(code)) {
+            case BPF_LD:
+            case BPF_LDX:
+                size = (BPF_SIZE(code) == BPF_W ? 4
+                    : BPF_SIZE(code) == BPF_H ? 2 : 1);
+
+                switch (BPF_MODE(code)) {
+                    case BPF_ABS:
+                        /* ancillary data loads aren't supported */
+                        if (insn->k >= 0x80000000 || BPF_CLASS(code) != BPF_LD)
+                            goto unsupported;
+                        ebpf_emit(prog, BPF_ALU|BPF_MOV|BPF_K, R_ARG2, 0, 0,
+                            insn->k);
+                        ebpf_emit_load(prog, fixups, &fixup_count, size, R_A);
+                        break;
+
+                    case BPF_IND:
+                        if (BPF_CLASS(code) != BPF_LD)
+                            goto unsupported;
+                        ebpf_emit(prog, BPF_ALU|BPF_MOV|BPF_X, R_ARG2, R_X, 0,
+                            0);
+                        ebpf_emit(prog, BPF_ALU|BPF_ADD|BPF_K, R_ARG2, 0, 0,
+                            insn->k);
+                        ebpf_emit_load(prog, fixups, &fixup_count, size, R_A);
+                        break;
+
+                    case BPF_MSH:
+                        /* X <- 4 * (P[k:1] & 0xf) */
+                        ebpf_emit(prog, BPF_ALU|BPF_MOV|BPF_K, R_ARG2, 0, 0,
+                            insn->k);
+                        ebpf_emit_load(prog, fixups, &fixup_count, 1, R_X);
+                        ebpf_emit(prog, BPF_ALU|BPF_AND|BPF_K, R_X, 0, 0, 0xf);
+                        ebpf_emit(prog, BPF_ALU|BPF_LSH|BPF_K, R_X, 0, 0, 2);
+                        break;
+
+                    case BPF_IMM:
+                        ebpf_emit(prog, BPF_ALU|BPF_MOV|BPF_K,
+                            (BPF_CLASS(code) == BPF_LD ? R_A : R_X), 0, 0,
+                            insn->k);
+                        break;
+
+                    case BPF_LEN:
+                        ebpf_emit(prog, BPF_ALU|BPF_MOV|BPF_X,
+                            (BPF_CLASS(code) == BPF_LD ? R_A : R_X), R_LEN, 0,
+                            0);
+                        break;
+
+                    case BPF_MEM:
+                        if (insn->k >= BPF_MEMWORDS)
+                            goto unsupported;
+                        ebpf_emit(prog, BPF_LDX|BPF_MEM|BPF_W,
+                            (BPF_CLASS(code) == BPF_LD ? R_A : R_X), R_FP,
+                            STACK_MEM(insn->k), 0);
+                        break;
+
+                    default:
+                        goto unsupported;
+                }
+                break;
+
+            case BPF_ST:
+            case BPF_STX:
+                if (insn->k >= BPF_MEMWORDS)
+                    goto unsupported;
+                ebpf_emit(prog, BPF_STX|BPF_MEM|BPF_W, R_FP,
+                    (BPF_CLASS(code) == BPF_ST ? R_A : R_X),
+                    STACK_MEM(insn->k), 0);
+                break;
+
+            case BPF_ALU:
+                /* classic BPF rejects the packet on a division by zero */
+                if ((BPF_OP(code) == BPF_DIV || BPF_OP(code) == BPF_MOD)
+                    && BPF_SRC(code) == BPF_X) {
+                    fixups[fixup_count].insn = ebpf_emit(prog,
+                        BPF_JMP|BPF_JEQ|BPF_K, R_X, 0, 0, 0);
+                    fixups[fixup_count++].target = TARGET_NOMATCH;
+                }
+
+                /* the operations have the same encoding in eBPF */
+                if (BPF_OP(code) == BPF_NEG)
+                    ebpf_emit(prog, BPF_ALU|BPF_NEG, R_A, 0, 0, 0);
+                else if (BPF_SRC(code) == BPF_X)
+                    ebpf_emit(prog, BPF_ALU|BPF_OP(code)|BPF_X, R_A, R_X, 0,
+                        0);
+                else
+                    ebpf_emit(prog, BPF_ALU|BPF_OP(code)|BPF_K, R_A, 0, 0,
+                        insn->k);
+                break;
+
+            case BPF_JMP:
+                if (BPF_OP(code) == BPF_JA) {
+                    fixups[fixup_count].insn = ebpf_emit(prog, BPF_JMP|BPF_JA,
+                        0, 0, 0, 0);
+                    fixups[fixup_count++].target = i + 1 + insn->k;
+                    break;
+                }
+
+                /* 64-bit comparisons sign-extend the immediate, so compare
+                   against a register holding the zero-extended constant */
+                if (BPF_SRC(code) == BPF_K)
+                    ebpf_emit(prog, BPF_ALU|BPF_MOV|BPF_K, R_ARG2, 0, 0,
+                        insn->k);
+
+                fixups[fixup_count].insn = ebpf_emit(prog,
+                    BPF_JMP|BPF_OP(code)|BPF_X, R_A,
+                    (BPF_SRC(code) == BPF_K ? R_ARG2 : R_X), 0, 0);
+                fixups[fixup_count++].target = i + 1 + insn->jt;
+
+                fixups[fixup_count].insn = ebpf_emit(prog, BPF_JMP|BPF_JA,
+                    0, 0, 0, 0);
+                fixups[fixup_count++].target = i + 1 + insn->jf;
+                break;
+
+            case BPF_RET:
+                if (BPF_RVAL(code) == BPF_A) {
+                    fixups[fixup_count].insn = ebpf_emit(prog,
+                        BPF_JMP|BPF_JEQ|BPF_K, R_A, 0, 0, 0);
+                    fixups[fixup_count++].target = TARGET_NOMATCH;
+                }
+                else if (BPF_RVAL(code) != BPF_K)
+                    goto unsupported;
+
+                fixups[fixup_count].insn = ebpf_emit(prog, BPF_JMP|BPF_JA,
+                    0, 0, 0, 0);
+                fixups[fixup_count++].target = (BPF_RVAL(code) == BPF_K
+                    && insn->k == 0 ? TARGET_NOMATCH : TARGET_MATCH);
+                break;
+
+            case BPF_MISC:
+                if (BPF_MISCOP(code) == BPF_TAX)
+                    ebpf_emit(prog, BPF_ALU|BPF_MOV|BPF_X, R_X, R_A, 0, 0);
+                else
+                    ebpf_emit(prog, BPF_ALU|BPF_MOV|BPF_X, R_A, R_X, 0, 0);
+                break;
+
+            default:
+                goto unsupported;
+        }
+    }
+
+    /* on a match, add the packet to the counters of the monitor */
+    match = ebpf_emit(prog, BPF_ST|BPF_MEM|BPF_W, R_FP, 0, STACK_KEY, slot);
+    ebpf_emit(prog, BPF_LD|BPF_DW|BPF_IMM, R_ARG1, BPF_PSEUDO_MAP_FD, 0,
+        map_fd);
+    ebpf_emit(prog, 0, 0, 0, 0, 0);
+    ebpf_emit(prog, BPF_ALU64|BPF_MOV|BPF_X, R_ARG2, R_FP, 0, 0);
+    ebpf_emit(prog, BPF_ALU64|BPF_ADD|BPF_K, R_ARG2, 0, 0, STACK_KEY);
+    ebpf_emit(prog, BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+    fixups[fixup_count].insn =
+        ebpf_emit(prog, BPF_JMP|BPF_JEQ|BPF_K, R_RET, 0, 0, 0);
+    fixups[fixup_count++].target = TARGET_NOMATCH;
+
+    ebpf_emit(prog, BPF_LDX|BPF_MEM|BPF_DW, R_ARG1, R_RET,
+        offsetof(struct ebpf_counters, packets), 0);
+    ebpf_emit(prog, BPF_ALU64|BPF_ADD|BPF_K, R_ARG1, 0, 0, 1);
+    ebpf_emit(prog, BPF_STX|BPF_MEM|BPF_DW, R_RET, R_ARG1,
+        offsetof(struct ebpf_counters, packets), 0);
+    ebpf_emit(prog, BPF_LDX|BPF_MEM|BPF_DW, R_ARG1, R_RET,
+        offsetof(struct ebpf_counters, octets), 0);
+    ebpf_emit(prog, BPF_ALU64|BPF_ADD|BPF_X, R_ARG1, R_LEN, 0, 0);
+    ebpf_emit(prog, BPF_ALU64|BPF_ADD|BPF_K, R_ARG1, 0, 0,
+        -ETHERNET_HEADER_LENGTH);
+    ebpf_emit(prog, BPF_STX|BPF_MEM|BPF_DW, R_RET, R_ARG1,
+        offsetof(struct ebpf_counters, octets), 0);
+
+    nomatch = prog->count;
+
+    if (prog->failed)
+        goto unsupported;
+
+    /* patch the jumps */
+    for (i=0; i<fixup_count; i++) {
+        target = fixups[i].target;
+
+        if (target == TARGET_MATCH)
+            target = match;
+        else if (target == TARGET_NOMATCH)
+            target = nomatch;
+        else if (target < count)
+            target = offsets[target];
+        else
+            goto unsupported;
+
+        if (target - fixups[i].insn - 1 > INT16_MAX)
+            goto unsupported;
+
+        prog->insns[fixups[i].insn].off = target - fixups[i].insn - 1;
+    }
+
+    free(offsets);
+    free(fixups);
+    return(0);
+
+  unsupported:
+    free(offsets);
+    free(fixups);
+    return(-1);
+}
+
+
+/*
+ * ebpf_free()
+ * ---------
+ */
+static void
+ebpf_free(struct ebpf *ebpf) {
+    if (ebpf == NULL)
+        return;
+
+    if (ebpf->sock_fd >= 0)
+        close(ebpf->sock_fd);
+
+    if (ebpf->prog_fd >= 0)
+        close(ebpf->prog_fd);
+
+    if (ebpf->map_fd >= 0)
+        close(ebpf->map_fd);
+
+    free(ebpf->device);
+    free(ebpf);
+}
+
+
+/*
+ * ebpf_open()
+ * ---------
+ * create the counters map and the program of a device, and attach the
+ * program to a packet socket bound to the device
+ */
+static struct ebpf *
+ebpf_open(const char *device, struct monitor **mons, int count) {
+    struct ebpf         *ebpf;
+    struct ebpf_prog    prog = { NULL, 0, 0, 0 };
+    struct packet_mreq  mreq;
+    struct sockaddr_ll  sll;
+    struct ifreq        ifr;
+    union bpf_attr      attr;
+    char        *log;
+    int         ifindex, i;
+
+    if ((ifindex = if_nametoindex(device)) == 0) {
+        syslog(_LOGWARN_"eBPF: no device %s: %s", device, strerror(errno));
+        return(NULL);
+    }
+
+    if (ebpf_cpus <= 0 && (ebpf_cpus = ebpf_possible_cpus()) <= 0) {
+        syslog(_LOGWARN_"eBPF: couldn't get the number of possible CPUs");
+        return(NULL);
+    }
+
+    if ((ebpf = calloc(1, sizeof(struct ebpf))) == NULL) {
+        syslog(_LOGERR_"couldn't allocate eBPF program: %s", strerror(errno));
+        return(NULL);
+    }
+
+    ebpf->map_fd = ebpf->prog_fd = ebpf->sock_fd = -1;
+    ebpf->device = strdup(device);
+
+    /* the packet socket must see Ethernet frames */
+    if ((ebpf->sock_fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+        syslog(_LOGWARN_"eBPF: couldn't create packet socket: %s",
+            strerror(errno));
+        goto fail;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, device, IFNAMSIZ - 1);
+    if (ioctl(ebpf->sock_fd, SIOCGIFHWADDR, &ifr) < 0
+        || ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+        syslog(_LOGWARN_"eBPF: %s isn't an Ethernet device", device);
+        goto fail;
+    }
+
+    /* create the per-CPU counters map, with a slot for each monitor in
+       the order they're given */
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_PERCPU_ARRAY;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(struct ebpf_counters);
+    attr.max_entries = count;
+
+    if ((ebpf->map_fd = ebpf_syscall(BPF_MAP_CREATE, &attr)) < 0) {
+        syslog(_LOGWARN_"eBPF: couldn't create map: %s", strerror(errno));
+        goto fail;
+    }
+
+    /* prologue: keep the context and the packet length around, skip short
+       packets, and clear the scratch memory words */
+    ebpf_emit(&prog, BPF_ALU64|BPF_MOV|BPF_X, R_CTX, R_ARG1, 0, 0);
+    ebpf_emit(&prog, BPF_LDX|BPF_MEM|BPF_W, R_LEN, R_CTX,
+        offsetof(struct __sk_buff, len), 0);
+    ebpf_emit(&prog, BPF_ALU|BPF_MOV|BPF_K, R_ARG2, 0, 0,
+        ETHERNET_HEADER_LENGTH);
+    ebpf_emit(&prog, BPF_JMP|BPF_JGE|BPF_X, R_LEN, R_ARG2, 2, 0);
+    ebpf_emit(&prog, BPF_ALU64|BPF_MOV|BPF_K, R_RET, 0, 0, 0);
+    ebpf_emit(&prog, BPF_JMP|BPF_EXIT, 0, 0, 0, 0);
+    ebpf_emit(&prog, BPF_ALU64|BPF_MOV|BPF_K, R_ARG1, 0, 0, 0);
+    for (i=0; i<BPF_MEMWORDS; i++)
+        ebpf_emit(&prog, BPF_STX|BPF_MEM|BPF_DW, R_FP, R_ARG1,
+            STACK_MEM(i), 0);
+
+    for (i=0; i<count; i++) {
+        if (ebpf_translate(&prog, mons[i], i, ebpf->map_fd) < 0) {
+            syslog(_LOGWARN_"eBPF: couldn't translate the filter of "
+                "monitor %u", mons[i]->index);
+            goto fail;
+        }
+    }
+
+    /* epilogue: never queue anything on the socket */
+    ebpf_emit(&prog, BPF_ALU64|BPF_MOV|BPF_K, R_RET, 0, 0, 0);
+    ebpf_emit(&prog, BPF_JMP|BPF_EXIT, 0, 0, 0, 0);
+
+    if (prog.failed) {
+        syslog(_LOGERR_"couldn't allocate eBPF program: %s", strerror(errno));
+        goto fail;
+    }
+
+    /* load the program */
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+    attr.insns = (uintptr_t)prog.insns;
+    attr.insn_cnt = prog.count;
+    attr.license = (uintptr_t)"BSD";
+
+    if ((ebpf->prog_fd = ebpf_syscall(BPF_PROG_LOAD, &attr)) < 0) {
+        syslog(_LOGWARN_"eBPF: couldn't load the program for %s: %s", device,
+            strerror(errno));
+
+        /* load it again to get the verifier log */
+        if (options.debug && (log = calloc(1, LOG_SIZE)) != NULL) {
+            attr.log_buf = (uintptr_t)log;
+            attr.log_size = LOG_SIZE;
+            attr.log_level = 1;
+            ebpf_syscall(BPF_PROG_LOAD, &attr);
+            fprintf(stderr, "ebpf_open: verifier log:\n%s\n", log);
+            free(log);
+        }
+        goto fail;
+    }
+
+    if (options.debug)
+        fprintf(stderr, "ebpf_open: loaded %d instructions for %d monitors "
+            "on %s\n", prog.count, count, device);
+
+    /* attach it and bind the socket */
+    if (setsockopt(ebpf->sock_fd, SOL_SOCKET, SO_ATTACH_BPF, &ebpf->prog_fd,
+        sizeof(ebpf->prog_fd)) < 0) {
+        syslog(_LOGWARN_"eBPF: couldn't attach the program: %s",
+            strerror(errno));
+        goto fail;
+    }
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+
+    if (bind(ebpf->sock_fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        syslog(_LOGWARN_"eBPF: couldn't bind packet socket to %s: %s",
+            device, strerror(errno));
+        goto fail;
+    }
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+
+    if (setsockopt(ebpf->sock_fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+        sizeof(mreq)) < 0)
+        syslog(_LOGWARN_"couldn't set %s in promiscuous mode: %s", device,
+            strerror(errno));
+
+    free(prog.insns);
+    return(ebpf);
+
+  fail:
+    free(prog.insns);
+    ebpf_free(ebpf);
+    return(NULL);
+}
+
+
+/*
+ * ebpf_attach()
+ * -----------
+ * count the given monitors, all on the same device, with a single eBPF
+ * program; return -1 if eBPF isn't usable for them, in which case the
+ * caller falls back to the libpcap captures
+ */
+int
+ebpf_attach(struct monitor **mons, int count) {
+    struct ebpf *ebpf;
+    pcap_t      *pcap;
+    int         i;
+
+    /* compile the filters for Ethernet frames, with a non-zero snap length
+       so that a match returns non-zero */
+    if ((pcap = pcap_open_dead(DLT_EN10MB, FILTER_SNAP_LENGTH)) == NULL)
+        return(-1);
+
+    for (i=0; i<count; i++) {
+        struct monitor *mon = mons[i];
+
+        if ((mon->filter == NULL) || (strlen(mon->filter) == 0))
+            continue;
+
+        if (pcap_compile(pcap, &mon->filter_bpf, mon->filter, 1, 0) < 0) {
+            syslog(_LOGERR_"couldn't compile monitor filter: %s",
+                pcap_geterr(pcap));
+            goto fail;
+        }
+
+        mon->filter_valid = 1;
+    }
+
+    pcap_close(pcap);
+    pcap = NULL;
+
+    if ((ebpf = ebpf_open(mons[0]->device, mons, count)) == NULL)
+        goto fail;
+
+    for (i=0; i<count; i++) {
+        mons[i]->ebpf = ebpf;
+        mons[i]->ebpf_slot = i;
+    }
+
+    return(0);
+
+  fail:
+    /* the captures compile the filters with their own snap length */
+    for (i=0; i<count; i++) {
+        if (mons[i]->filter_valid) {
+            pcap_freecode(&mons[i]->filter_bpf);
+            mons[i]->filter_valid = 0;
+        }
+    }
+
+    if (pcap != NULL)
+        pcap_close(pcap);
+
+    return(-1);
+}
+
+
+/*
+ * ebpf_read()
+ * ---------
+ * sum the per-CPU counters of a monitor
+ */
+int
+ebpf_read(struct monitor *mon, uint64_t *octets, uint64_t *packets) {
+    struct ebpf_counters    *values;
+    union bpf_attr  attr;
+    uint32_t        key = mon->ebpf_slot;
+    int             i;
+
+    values = calloc(ebpf_cpus, sizeof(struct ebpf_counters));
+    if (values == NULL)
+        return(-1);
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = mon->ebpf->map_fd;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)values;
+
+    if (ebpf_syscall(BPF_MAP_LOOKUP_ELEM, &attr) < 0) {
+        syslog(_LOGERR_"couldn't read the counters of monitor %u: %s",
+            mon->index, strerror(errno));
+        free(values);
+        return(-1);
+    }
+
+    *octets = *packets = 0;
+    for (i=0; i<ebpf_cpus; i++) {
+        *octets  += values[i].octets;
+        *packets += values[i].packets;
+    }
+
+    free(values);
+    return(0);
+}
+
+
+/*
+ * ebpf_detach()
+ * -----------
+ * release the program of a monitor when it's the last one using it
+ */
+void
+ebpf_detach(struct monitor *mon) {
+    struct monitor  *other;
+    struct ebpf     *ebpf = mon->ebpf;
+
+    if (ebpf == NULL)
+        return;
+
+    mon->ebpf = NULL;
+
+    TAILQ_FOREACH(other, &monitors, link) {
+        if (other->ebpf == ebpf)
+            return;
+    }
+
+    ebpf_free(ebpf);
+}
+
+
+#else /* __linux__ */
+
+
+int
+ebpf_attach(struct monitor **mons, int count) {
+    syslog(_LOGWARN_"eBPF is only available on Linux");
+    return(-1);
+}
+
+int  ebpf_read(struct monitor *mon, uint64_t *octets, uint64_t *packets)
+    { return(-1); }
+void ebpf_detach(struct monitor *mon) { }
+
+
+#endif /* __linux__ */
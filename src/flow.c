@@ -0,0 +1,509 @@
+/*
+ * netsnmp-pcap :: flow.c
+ * ----------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslog.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "netsnmp-pcap.h"
+
+
+/* flows are stored in sets of slots chosen by their hash; when all the
+   slots of a set hold live flows, the smallest one is evicted */
+#define BUCKET_SIZE         8
+
+/* link and network layers */
+#define ETHERNET_HEADER_LENGTH  14
+#define ETHERTYPE_IP        0x0800
+#define ETHERTYPE_IPV6      0x86dd
+#define ETHERTYPE_VLAN      0x8100
+#define ETHERTYPE_QINQ      0x88a8
+#define MAX_VLAN_TAGS       2
+#define MAX_IPV6_HEADERS    4
+
+
+/* what it takes to look up a flow in a set, and to pick the one to evict,
+   in a single cache line */
+struct flow_bucket {
+    uint16_t    tags[BUCKET_SIZE];      /* bits of the hashes of the flows */
+    uint32_t    last_seen[BUCKET_SIZE];
+    uint8_t     weights[BUCKET_SIZE];   /* 1 + log2 of the octets, or 0 for
+                                           an empty slot */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* flow table of a monitor in one worker */
+struct flow_table {
+    struct flow_bucket  *buckets;
+    struct flow *flows;         /* BUCKET_SIZE for each bucket */
+    uint32_t    mask;           /* of the bucket numbers */
+    uint32_t    timeout;        /* in seconds */
+    uint32_t    now;            /* timestamp of the last packet */
+    uint64_t    evictions;      /* of live flows */
+};
+
+
+/* seed of the hashes of the flows, set with the first table */
+static uint64_t flow_seed = 0;
+
+
+/*
+ * flow_mix()
+ * --------
+ * add a word to the hash of a flow
+ */
+static inline uint64_t
+flow_mix(uint64_t hash, uint64_t word) {
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    return(hash ^ (hash >> 29));
+}
+
+
+/*
+ * flow_weight()
+ * -----------
+ */
+static inline uint8_t
+flow_weight(uint64_t octets) {
+    return(64 - __builtin_clzll(octets + 1));
+}
+
+
+/*
+ * flow_parse()
+ * ----------
+ * extract the 5-tuple of an Ethernet frame, and hash it; IPv4 addresses
+ * are stored as IPv4-mapped IPv6 addresses. the hash is computed from
+ * the packet rather than from the key, whose narrow stores wouldn't be
+ * forwarded to wide loads. return -1 when the frame doesn't carry IP
+ */
+int
+flow_parse(const struct pcap_pkthdr *header, const u_char *bytes,
+    struct flow_key *key, uint64_t *hash) {
+    const u_char    *p = bytes + ETHERNET_HEADER_LENGTH;
+    const u_char    *end = bytes + header->caplen;
+    uint64_t        words[4];
+    uint32_t        src, dst;
+    uint16_t        type;
+    int             i, length, proto, fragment = 0;
+
+    if (header->caplen < ETHERNET_HEADER_LENGTH)
+        return(-1);
+
+    type = (bytes[12] << 8) | bytes[13];
+
+    for (i=0; i<MAX_VLAN_TAGS
+        && (type == ETHERTYPE_VLAN || type == ETHERTYPE_QINQ); i++) {
+        if (end - p < 4)
+            return(-1);
+        type = (p[2] << 8) | p[3];
+        p += 4;
+    }
+
+    memset(key, 0, sizeof(struct flow_key));
+
+    if (type == ETHERTYPE_IP) {
+        if (end - p < 20 || (p[0] >> 4) != 4)
+            return(-1);
+
+        length = (p[0] & 0xf) * 4;
+        proto = p[9];
+        fragment = ((p[6] & 0x1f) << 8) | p[7];
+
+        memcpy(&src, &p[12], 4);
+        memcpy(&dst, &p[16], 4);
+        *hash = flow_mix(flow_seed, ((uint64_t)src << 32) | dst);
+
+        key->src[10] = key->src[11] = 0xff;
+        key->dst[10] = key->dst[11] = 0xff;
+        memcpy(&key->src[12], &src, 4);
+        memcpy(&key->dst[12], &dst, 4);
+    }
+    else if (type == ETHERTYPE_IPV6) {
+        if (end - p < 40 || (p[0] >> 4) != 6)
+            return(-1);
+
+        proto = p[6];
+        memcpy(words, &p[8], 32);
+        *hash = flow_seed;
+        for (i=0; i<4; i++)
+            *hash = flow_mix(*hash, words[i]);
+
+        memcpy(key->src, &words[0], 16);
+        memcpy(key->dst, &words[2], 16);
+        p += 40;
+        length = 0;
+
+        /* skip the extension headers, up to the transport one */
+        for (i=0; i<MAX_IPV6_HEADERS; i++) {
+            if (proto != IPPROTO_HOPOPTS && proto != IPPROTO_ROUTING
+                && proto != IPPROTO_DSTOPTS && proto != IPPROTO_FRAGMENT)
+                break;
+            if (end - p < 8)
+                break;
+            if (proto == IPPROTO_FRAGMENT) {
+                fragment = ((p[2] << 8) | p[3]) >> 3;
+                length = 8;
+            }
+            else
+                length = (p[1] + 1) * 8;
+            proto = p[0];
+            p += length;
+            length = 0;
+        }
+    }
+    else
+        return(-1);
+
+    key->proto = proto;
+
+    /* only the first fragment has the ports */
+    p += length;
+    if (fragment == 0 && end - p >= 4 && (proto == IPPROTO_TCP
+        || proto == IPPROTO_UDP || proto == IPPROTO_SCTP)) {
+        key->sport = (p[0] << 8) | p[1];
+        key->dport = (p[2] << 8) | p[3];
+    }
+
+    *hash = flow_mix(*hash, ((uint64_t)key->sport << 24)
+        | (key->dport << 8) | proto);
+    *hash ^= *hash >> 32;
+
+    return(0);
+}
+
+
+/*
+ * flow_update()
+ * -----------
+ * account a packet to its flow, given by flow_parse(); a new flow takes
+ * an empty or idle slot of its set, or else evicts its smallest flow, so
+ * a flood of new flows can't push the large ones out
+ */
+void
+flow_update(struct flow_table *table, const struct flow_key *key,
+    uint64_t hash, uint64_t octets, uint32_t now) {
+    struct flow_bucket  *bucket;
+    struct flow *flows, *flow;
+    uint16_t    tag;
+    int         i, victim = 0;
+
+    COUNTER_SET(table->now, now);
+
+    bucket = &table->buckets[hash & table->mask];
+    flows = &table->flows[(hash & table->mask) * BUCKET_SIZE];
+    tag = hash >> 48;
+
+    for (i=0; i<BUCKET_SIZE; i++) {
+        if (bucket->tags[i] != tag || bucket->weights[i] == 0
+            || memcmp(&flows[i].key, key, sizeof(struct flow_key)) != 0)
+            continue;
+
+        flow = &flows[i];
+        COUNTER_ADD(flow->octets, octets);
+        COUNTER_ADD(flow->packets, 1);
+        COUNTER_SET(flow->last_seen, now);
+
+        bucket->last_seen[i] = now;
+        bucket->weights[i] = flow_weight(flow->octets);
+        return;
+    }
+
+    /* pick an empty slot, an idle flow, or else the smallest flow */
+    for (i=0; i<BUCKET_SIZE; i++) {
+        if (bucket->weights[i] == 0
+            || now - bucket->last_seen[i] > table->timeout)
+            break;
+
+        if (bucket->weights[i] < bucket->weights[victim]
+            || (bucket->weights[i] == bucket->weights[victim]
+            && bucket->last_seen[i] < bucket->last_seen[victim]))
+            victim = i;
+    }
+
+    if (i < BUCKET_SIZE)
+        victim = i;
+    else
+        COUNTER_ADD(table->evictions, 1);
+
+    bucket->tags[victim] = tag;
+    bucket->last_seen[victim] = now;
+    bucket->weights[victim] = flow_weight(octets);
+
+    /* replace the flow, under its sequence number for the readers */
+    flow = &flows[victim];
+    COUNTER_SET(flow->seq, flow->seq + 1);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    flow->key = *key;
+    COUNTER_SET(flow->octets, octets);
+    COUNTER_SET(flow->packets, 1);
+    COUNTER_SET(flow->last_seen, now);
+
+    __atomic_store_n(&flow->seq, flow->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * flow_read()
+ * ---------
+ * copy a flow stored in a table; return -1 if it's empty, or being
+ * replaced by its worker
+ */
+static int
+flow_read(const struct flow *flow, struct flow *copy) {
+    uint32_t seq;
+
+    seq = __atomic_load_n(&flow->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+        return(-1);
+
+    copy->key = flow->key;
+    copy->octets = COUNTER_GET(flow->octets);
+    copy->packets = COUNTER_GET(flow->packets);
+    copy->last_seen = COUNTER_GET(flow->last_seen);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (COUNTER_GET(flow->seq) != seq || copy->packets == 0)
+        return(-1);
+
+    return(0);
+}
+
+
+/*
+ * flow_rank()
+ * ---------
+ * insert a flow in an array sorted by decreasing octets, of count flows
+ * out of size; return the new count
+ */
+static uint32_t
+flow_rank(struct flow *top, uint32_t count, uint32_t size,
+    const struct flow *flow) {
+    uint32_t i;
+
+    if (count == size && flow->octets <= top[count - 1].octets)
+        return(count);
+
+    if (count < size)
+        count++;
+
+    for (i=count - 1; i>0 && top[i - 1].octets < flow->octets; i--)
+        top[i] = top[i - 1];
+
+    top[i] = *flow;
+
+    return(count);
+}
+
+
+/*
+ * flow_collect()
+ * ------------
+ * gather the largest live flows of the workers into the top flows of
+ * the monitor; a flow split among several workers is summed
+ */
+void
+flow_collect(struct monitor *mon) {
+    struct flow_table   *table;
+    struct flow         flow, *top, *merged;
+    uint32_t    count, total = 0, i, j;
+    uint64_t    evictions = 0;
+    int         w;
+
+    if (mon->flows == NULL)
+        return;
+
+    merged = mon->flow_scratch;
+
+    for (w=0; w<worker_count; w++) {
+        table = mon->flows[w];
+        top = &merged[total];
+        count = 0;
+
+        for (i=0; i<(table->mask + 1) * BUCKET_SIZE; i++) {
+            if (flow_read(&table->flows[i], &flow) < 0)
+                continue;
+            if (COUNTER_GET(table->now) - flow.last_seen > table->timeout)
+                continue;
+            count = flow_rank(top, count, mon->flow_top, &flow);
+        }
+
+        total += count;
+        evictions += COUNTER_GET(table->evictions);
+    }
+
+    /* merge the flows of the workers, and keep the largest ones */
+    mon->top_flow_count = 0;
+
+    for (i=0; i<total; i++) {
+        for (j=0; j<i; j++) {
+            if (merged[j].packets != 0
+                && memcmp(&merged[j].key, &merged[i].key,
+                sizeof(struct flow_key)) == 0)
+                break;
+        }
+
+        if (j < i) {
+            merged[j].octets += merged[i].octets;
+            merged[j].packets += merged[i].packets;
+            merged[i].packets = 0;
+        }
+    }
+
+    for (i=0; i<total; i++) {
+        if (merged[i].packets != 0)
+            mon->top_flow_count = flow_rank(mon->top_flows,
+                mon->top_flow_count, mon->flow_top, &merged[i]);
+    }
+
+    mon->flow_evictions = evictions;
+}
+
+
+/*
+ * flow_address()
+ * ------------
+ * format an address of a flow key, as IPv4 when it's IPv4-mapped
+ */
+const char *
+flow_address(const uint8_t *address, char *buffer, size_t size) {
+    static const uint8_t mapped[12] = { [10] = 0xff, [11] = 0xff };
+
+    if (memcmp(address, mapped, sizeof(mapped)) == 0)
+        return(inet_ntop(AF_INET, address + 12, buffer, size));
+
+    return(inet_ntop(AF_INET6, address, buffer, size));
+}
+
+
+/*
+ * flow_free()
+ * ---------
+ */
+void
+flow_free(struct monitor *mon) {
+    int w;
+
+    if (mon->flows != NULL) {
+        for (w=0; w<worker_count; w++) {
+            if (mon->flows[w] != NULL) {
+                free(mon->flows[w]->buckets);
+                free(mon->flows[w]->flows);
+            }
+            free(mon->flows[w]);
+        }
+        free(mon->flows);
+        mon->flows = NULL;
+    }
+
+    free(mon->top_flows);
+    free(mon->flow_scratch);
+    mon->top_flows = mon->flow_scratch = NULL;
+}
+
+
+/*
+ * flow_init()
+ * ---------
+ * allocate the flow tables of a monitor, sharing the given number of
+ * flows among the workers; the memory they take is fixed from there
+ */
+int
+flow_init(struct monitor *mon, uint32_t size, uint32_t timeout,
+    uint32_t top) {
+    struct flow_table   *table;
+    uint32_t    buckets;
+    int         w;
+
+    if (flow_seed == 0)
+        flow_seed = ((uint64_t)random() << 32) ^ random() ^ time(NULL);
+
+    /* the largest power of two within the share of each worker */
+    for (buckets=1; buckets * 2 * BUCKET_SIZE <= size / worker_count;
+        buckets *= 2);
+
+    mon->flow_top = top;
+    mon->flows = calloc(worker_count, sizeof(struct flow_table *));
+    mon->top_flows = calloc(top, sizeof(struct flow));
+    mon->flow_scratch = calloc((size_t)top * worker_count,
+        sizeof(struct flow));
+    if (mon->flows == NULL || mon->top_flows == NULL
+        || mon->flow_scratch == NULL)
+        goto fail;
+
+    for (w=0; w<worker_count; w++) {
+        if ((table = calloc(1, sizeof(struct flow_table))) == NULL)
+            goto fail;
+        mon->flows[w] = table;
+
+        if (posix_memalign((void **)&table->buckets, CACHE_LINE_SIZE,
+            buckets * sizeof(struct flow_bucket)) != 0) {
+            table->buckets = NULL;
+            goto fail;
+        }
+
+        if (posix_memalign((void **)&table->flows, CACHE_LINE_SIZE,
+            buckets * BUCKET_SIZE * sizeof(struct flow)) != 0) {
+            table->flows = NULL;
+            goto fail;
+        }
+
+        memset(table->buckets, 0, buckets * sizeof(struct flow_bucket));
+        memset(table->flows, 0, buckets * BUCKET_SIZE * sizeof(struct flow));
+        table->mask = buckets - 1;
+        table->timeout = timeout;
+    }
+
+    if (options.debug)
+        fprintf(stderr, "flow_init: %u flows of %zu bytes in %d worker(s) "
+            "for monitor %u\n", buckets * BUCKET_SIZE, sizeof(struct flow)
+            + sizeof(struct flow_bucket) / BUCKET_SIZE, worker_count,
+            mon->index);
+
+    return(0);
+
+  fail:
+    syslog(_LOGERR_"couldn't allocate the flow table of monitor %u: %s",
+        mon->index, strerror(errno));
+    flow_free(mon);
+    return(-1);
+}
@@ -0,0 +1,528 @@
+/*
+ * netsnmp-pcap :: history-query.c
+ * -------------------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+/*
+ * netsnmp-pcap-history: print the octets and packets logged by the
+ * daemon with --history over a range of time, per export or in total,
+ * mapping the segments instead of reading them
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nsp-history.h"
+
+
+/* a mapped file of a segment */
+struct mapping {
+    const uint8_t   *data;
+    size_t          size;
+};
+
+/* a record being decoded */
+struct record {
+    const uint8_t   *cursor;
+    const uint8_t   *end;
+    uint64_t        time;
+    uint64_t        flags;
+    uint64_t        count;
+};
+
+/* sum of a monitor over the range */
+struct total {
+    uint32_t    index;
+    uint64_t    octets;
+    uint64_t    packets;
+};
+
+static struct {
+    uint64_t    start;              /* microseconds since the epoch */
+    uint64_t    end;
+    int64_t     index;              /* of the monitor, or -1 */
+    int         totals;
+} query = { 0, UINT64_MAX, -1, 0 };
+
+static uint32_t     *indexes = NULL;    /* index column in effect */
+static uint64_t     index_count = 0;
+static uint64_t     index_base = UINT64_MAX;
+static uint64_t     *octets = NULL;
+static uint64_t     column_size = 0;
+static struct total *totals = NULL;
+static uint32_t     total_count = 0;
+static uint32_t     total_size = 0;
+
+
+
+/*
+ * usage()
+ * -----
+ */
+static void
+usage(const char *program, int status) {
+    fprintf(stderr,
+        "Usage: %s [-i index] [-s start] [-e end] [-t] directory\n"
+        "  -i index   only print this monitor\n"
+        "  -s start   from this time, in seconds since the epoch or as\n"
+        "             \"YYYY-MM-DD HH:MM:SS\" in local time\n"
+        "  -e end     up to this time, likewise\n"
+        "  -t         print the totals of each monitor over the range,\n"
+        "             instead of each export\n", program);
+    exit(status);
+}
+
+
+/*
+ * parse_time()
+ * ----------
+ * parse a time given on the command line, into microseconds since the
+ * epoch
+ */
+static uint64_t
+parse_time(const char *string) {
+    struct tm   tm;
+    const char  *end;
+    char        *number_end;
+    long long   seconds;
+
+    seconds = strtoll(string, &number_end, 10);
+    if (*number_end == '\0' && number_end != string)
+        return((uint64_t)seconds * 1000000);
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_isdst = -1;
+    if (((end = strptime(string, "%Y-%m-%d %H:%M:%S", &tm)) == NULL
+        && (end = strptime(string, "%Y-%m-%dT%H:%M:%S", &tm)) == NULL
+        && (end = strptime(string, "%Y-%m-%d", &tm)) == NULL)
+        || *end != '\0') {
+        fprintf(stderr, "couldn't parse '%s' as a time\n", string);
+        exit(EXIT_FAILURE);
+    }
+
+    return((uint64_t)mktime(&tm) * 1000000);
+}
+
+
+/*
+ * map_file()
+ * --------
+ * map a whole file; an empty one is mapped as NULL
+ */
+static int
+map_file(const char *path, struct mapping *map) {
+    struct stat st;
+    int     fd;
+
+    map->data = NULL;
+    map->size = 0;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "couldn't open '%s': %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return(-1);
+    }
+
+    if (st.st_size > 0) {
+        map->data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map->data == MAP_FAILED) {
+            fprintf(stderr, "couldn't map '%s': %s\n", path,
+                strerror(errno));
+            close(fd);
+            map->data = NULL;
+            return(-1);
+        }
+        map->size = st.st_size;
+    }
+
+    close(fd);
+
+    return(0);
+}
+
+
+/*
+ * unmap_file()
+ * ----------
+ */
+static void
+unmap_file(struct mapping *map) {
+    if (map->data != NULL)
+        munmap((void *)map->data, map->size);
+}
+
+
+/*
+ * varint()
+ * ------
+ * decode a LEB128 varint; return -1 past the end of the record
+ */
+static int
+varint(struct record *rec, uint64_t *value) {
+    int     shift = 0;
+
+    *value = 0;
+
+    while (rec->cursor < rec->end && shift < 64) {
+        *value |= (uint64_t)(*rec->cursor & 0x7f) << shift;
+        if ((*rec->cursor++ & 0x80) == 0)
+            return(0);
+        shift += 7;
+    }
+
+    return(-1);
+}
+
+
+/*
+ * record_open()
+ * -----------
+ * start decoding the record at the given offset of a data file, up to
+ * its columns
+ */
+static int
+record_open(const struct mapping *data, uint64_t offset,
+    struct record *rec) {
+    const uint8_t   *bytes = data->data + offset;
+    uint32_t    length;
+
+    /* a record cut by a crash of the daemon */
+    if (offset + 4 > data->size)
+        return(-1);
+
+    length = bytes[0] | bytes[1] << 8 | bytes[2] << 16
+        | (uint32_t)bytes[3] << 24;
+    if (offset + 4 + length > data->size)
+        return(-1);
+
+    rec->cursor = bytes + 4;
+    rec->end = bytes + 4 + length;
+
+    if (varint(rec, &rec->time) < 0 || varint(rec, &rec->flags) < 0
+        || varint(rec, &rec->count) < 0)
+        return(-1);
+
+    return(0);
+}
+
+
+/*
+ * record_indexes()
+ * --------------
+ * decode the index column of a record
+ */
+static int
+record_indexes(struct record *rec) {
+    uint64_t    gap, i, index = 0;
+
+    if (rec->count > column_size) {
+        indexes = realloc(indexes, rec->count * sizeof(uint32_t));
+        octets = realloc(octets, rec->count * sizeof(uint64_t));
+        if (indexes == NULL || octets == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        column_size = rec->count;
+    }
+
+    for (i=0; i<rec->count; i++) {
+        if (varint(rec, &gap) < 0)
+            return(-1);
+        index += gap;
+        indexes[i] = index;
+    }
+
+    index_count = rec->count;
+
+    return(0);
+}
+
+
+/*
+ * add_total()
+ * ---------
+ * add the deltas of a monitor to its total, kept sorted by index
+ */
+static void
+add_total(uint32_t index, uint64_t delta_octets, uint64_t delta_packets) {
+    uint32_t    low = 0, high = total_count, middle;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (totals[middle].index < index)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    if (low == total_count || totals[low].index != index) {
+        if (total_count == total_size) {
+            total_size = total_size ? total_size * 2 : 1024;
+            if ((totals = realloc(totals, total_size
+                * sizeof(struct total))) == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        memmove(&totals[low + 1], &totals[low],
+            (total_count - low) * sizeof(struct total));
+        totals[low].index = index;
+        totals[low].octets = totals[low].packets = 0;
+        total_count++;
+    }
+
+    totals[low].octets += delta_octets;
+    totals[low].packets += delta_packets;
+}
+
+
+/*
+ * print_time()
+ * ----------
+ */
+static void
+print_time(uint64_t time) {
+    time_t      seconds = time / 1000000;
+    char        buffer[32];
+
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S",
+        localtime(&seconds));
+    printf("%s.%03u", buffer, (unsigned int)(time % 1000000 / 1000));
+}
+
+
+/*
+ * query_segment()
+ * -------------
+ * print the records of a segment within the range; return 1 once past
+ * its end
+ */
+static int
+query_segment(const char *directory, uint32_t number) {
+    const struct nsp_history_header *header;
+    const struct nsp_history_entry  *entries;
+    struct mapping  data, index;
+    struct record   rec;
+    uint64_t    count, low, high, middle, i, value, packets;
+    char        path[4096];
+    int         past = 0;
+
+    snprintf(path, sizeof(path), "%s/" NSP_HISTORY_INDEX, directory, number);
+    if (map_file(path, &index) < 0)
+        return(0);
+
+    entries = (const struct nsp_history_entry *)index.data;
+    count = index.size / sizeof(struct nsp_history_entry);
+
+    /* skip the segments out of the range, from their first and last
+       entries */
+    if (count == 0 || entries[count - 1].time < query.start) {
+        unmap_file(&index);
+        return(0);
+    }
+    if (entries[0].time > query.end) {
+        unmap_file(&index);
+        return(1);
+    }
+
+    snprintf(path, sizeof(path), "%s/" NSP_HISTORY_DATA, directory, number);
+    if (map_file(path, &data) < 0) {
+        unmap_file(&index);
+        return(0);
+    }
+
+    header = (const struct nsp_history_header *)data.data;
+    if (data.size < sizeof(*header) || header->magic != NSP_HISTORY_MAGIC
+        || header->version != NSP_HISTORY_VERSION) {
+        fprintf(stderr, "'%s' isn't a history segment of this version\n",
+            path);
+        goto end;
+    }
+
+    /* the first entry within the range */
+    low = 0;
+    high = count;
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (entries[middle].time < query.start)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    index_base = UINT64_MAX;
+
+    for (i=low; i<count; i++) {
+        if (entries[i].time > query.end) {
+            past = 1;
+            break;
+        }
+
+        /* the index column in effect, from the base record */
+        if (entries[i].base != index_base) {
+            if (record_open(&data, entries[i].base, &rec) < 0
+                || (rec.flags & NSP_HISTORY_SAME_INDEXES)
+                || record_indexes(&rec) < 0)
+                break;
+            index_base = entries[i].base;
+        }
+
+        if (record_open(&data, entries[i].offset, &rec) < 0
+            || rec.count != index_count)
+            break;
+
+        if (!(rec.flags & NSP_HISTORY_SAME_INDEXES)
+            && record_indexes(&rec) < 0)
+            break;
+
+        for (value=0; value<rec.count; value++) {
+            if (varint(&rec, &octets[value]) < 0)
+                break;
+        }
+
+        for (value=0; value<rec.count; value++) {
+            if (varint(&rec, &packets) < 0)
+                break;
+
+            if (query.index >= 0 && indexes[value] != query.index)
+                continue;
+
+            if (query.totals) {
+                add_total(indexes[value], octets[value], packets);
+                continue;
+            }
+
+            print_time(entries[i].time);
+            printf(" %10u %16" PRIu64 " %14" PRIu64 "\n", indexes[value],
+                octets[value], packets);
+        }
+    }
+
+  end:
+    unmap_file(&data);
+    unmap_file(&index);
+
+    return(past);
+}
+
+
+/*
+ * segment_filter()
+ * --------------
+ * select the data files of the segments
+ */
+static int
+segment_filter(const struct dirent *entry) {
+    unsigned int    number;
+    char    check[32];
+
+    if (sscanf(entry->d_name, NSP_HISTORY_DATA, &number) != 1)
+        return(0);
+
+    snprintf(check, sizeof(check), NSP_HISTORY_DATA, number);
+
+    return(strcmp(check, entry->d_name) == 0);
+}
+
+
+/*
+ * main()
+ * ----
+ */
+int
+main(int argc, char **argv) {
+    struct dirent   **names;
+    unsigned int    number;
+    int     opt, count, i, past = 0;
+
+    while ((opt = getopt(argc, argv, "e:hi:s:t")) != -1) {
+        switch (opt) {
+            case 'e':
+                query.end = parse_time(optarg);
+                break;
+
+            case 'i':
+                query.index = strtoul(optarg, NULL, 10);
+                break;
+
+            case 's':
+                query.start = parse_time(optarg);
+                break;
+
+            case 't':
+                query.totals = 1;
+                break;
+
+            default:
+                usage(argv[0], opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1)
+        usage(argv[0], EXIT_FAILURE);
+
+    /* the segments, in the order they were written */
+    if ((count = scandir(argv[optind], &names, segment_filter,
+        alphasort)) < 0) {
+        fprintf(stderr, "couldn't read '%s': %s\n", argv[optind],
+            strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i=0; i<count; i++) {
+        sscanf(names[i]->d_name, NSP_HISTORY_DATA, &number);
+        if (!past)
+            past = query_segment(argv[optind], number);
+        free(names[i]);
+    }
+    free(names);
+
+    for (i=0; i<(int)total_count; i++)
+        printf("%10u %16" PRIu64 " %14" PRIu64 "\n", totals[i].index,
+            totals[i].octets, totals[i].packets);
+
+    return(EXIT_SUCCESS);
+}
@@ -0,0 +1,388 @@
+/*
+ * netsnmp-pcap :: history.c
+ * -------------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslog.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "netsnmp-pcap.h"
+#include "nsp-history.h"
+
+
+#define VARINT_MAX_LENGTH   10
+
+
+/* the segment being written */
+static struct {
+    int         data;
+    int         index;
+    uint32_t    number;
+    uint64_t    start;          /* microseconds since the epoch */
+    uint64_t    size;           /* of the data file */
+    uint64_t    base;           /* offset of the last index column */
+    uint8_t     *buffer;        /* record being built */
+    size_t      buffer_size;
+    uint32_t    *indexes;       /* index column of the base record */
+    uint32_t    index_count;
+    uint32_t    index_size;
+} history = { .data = -1, .index = -1 };
+
+
+/*
+ * prototypes
+ */
+static int  history_segment(void);
+
+
+
+/*
+ * history_now()
+ * -----------
+ * return the current time, in microseconds since the epoch
+ */
+static uint64_t
+history_now(void) {
+    struct timeval  now;
+
+    gettimeofday(&now, NULL);
+
+    return((uint64_t)now.tv_sec * 1000000 + now.tv_usec);
+}
+
+
+/*
+ * history_number()
+ * --------------
+ * return the number of a segment from the name of its data file, or -1
+ */
+static long
+history_number(const char *name) {
+    unsigned int    number;
+    char    check[32];
+
+    if (sscanf(name, NSP_HISTORY_DATA, &number) != 1)
+        return(-1);
+
+    snprintf(check, sizeof(check), NSP_HISTORY_DATA, number);
+
+    return(strcmp(check, name) == 0 ? (long)number : -1);
+}
+
+
+/*
+ * history_scan()
+ * ------------
+ * return the highest number of the segments of the directory, and remove
+ * the ones beyond the count to keep, up to the given number
+ */
+static long
+history_scan(uint32_t prune_below) {
+    struct dirent   *entry;
+    DIR     *dir;
+    char    path[PATH_MAX];
+    long    number, highest = -1;
+
+    if ((dir = opendir(options.history)) == NULL)
+        return(-2);
+
+    while ((entry = readdir(dir)) != NULL) {
+        if ((number = history_number(entry->d_name)) < 0)
+            continue;
+
+        if (number > highest)
+            highest = number;
+
+        if (number >= prune_below)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/" NSP_HISTORY_DATA,
+            options.history, (uint32_t)number);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/" NSP_HISTORY_INDEX,
+            options.history, (uint32_t)number);
+        unlink(path);
+    }
+
+    closedir(dir);
+
+    return(highest);
+}
+
+
+/*
+ * history_open()
+ * ------------
+ * start a new segment in the directory given by --history, after the
+ * ones already there
+ */
+void
+history_open(void) {
+    long    highest;
+
+    if (options.debug >= 1)
+        fprintf(stderr, "history_open: %s, %d MB per segment, keep %d\n",
+            options.history, options.history_size,
+            options.history_segments);
+
+    if ((highest = history_scan(0)) < -1) {
+        syslog(_LOGERR_"couldn't read the history directory '%s': %s",
+            options.history, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    history.number = highest + 1;
+
+    if (history_segment() < 0)
+        exit(EXIT_FAILURE);
+}
+
+
+/*
+ * history_segment()
+ * ---------------
+ * create the files of the segment history.number, and remove the oldest
+ * segments beyond --history-segments
+ */
+static int
+history_segment(void) {
+    struct nsp_history_header header;
+    char    path[PATH_MAX];
+
+    memset(&header, 0, sizeof(header));
+    header.magic = NSP_HISTORY_MAGIC;
+    header.version = NSP_HISTORY_VERSION;
+    header.number = history.number;
+    header.start = history_now();
+
+    snprintf(path, sizeof(path), "%s/" NSP_HISTORY_DATA, options.history,
+        history.number);
+    history.data = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND
+        | O_CLOEXEC, 0644);
+
+    if (history.data >= 0) {
+        snprintf(path, sizeof(path), "%s/" NSP_HISTORY_INDEX,
+            options.history, history.number);
+        history.index = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND
+            | O_CLOEXEC, 0644);
+    }
+
+    if (history.data < 0 || history.index < 0
+        || write(history.data, &header, sizeof(header)) != sizeof(header)) {
+        syslog(_LOGERR_"couldn't create the history segment '%s': %s",
+            path, strerror(errno));
+        if (history.data >= 0)
+            close(history.data);
+        if (history.index >= 0)
+            close(history.index);
+        history.data = history.index = -1;
+        return(-1);
+    }
+
+    history.start = header.start;
+    history.size = sizeof(header);
+    history.index_count = 0;
+
+    if (options.history_segments > 0
+        && history.number >= (uint32_t)options.history_segments)
+        history_scan(history.number + 1 - options.history_segments);
+
+    return(0);
+}
+
+
+/*
+ * history_rotate()
+ * --------------
+ * close the segment, and start the next one
+ */
+static void
+history_rotate(void) {
+    close(history.data);
+    close(history.index);
+    history.data = history.index = -1;
+
+    history.number++;
+    history_segment();
+}
+
+
+/*
+ * history_varint()
+ * --------------
+ * encode a number as a LEB128 varint; return the bytes written
+ */
+static size_t
+history_varint(uint8_t *buffer, uint64_t value) {
+    size_t  length = 0;
+
+    while (value >= 0x80) {
+        buffer[length++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    buffer[length++] = value;
+
+    return(length);
+}
+
+
+/*
+ * history_delta()
+ * -------------
+ * return how much a counter grew since the last record, and note its
+ * value; a counter lower than it was started again from zero
+ */
+static uint64_t
+history_delta(uint64_t *last, uint64_t value) {
+    uint64_t    delta = (value >= *last) ? value - *last : value;
+
+    *last = value;
+
+    return(delta);
+}
+
+
+/*
+ * history_record()
+ * --------------
+ * append a record of the deltas of every monitor since the previous
+ * export; invoked at each export, once the monitors are collected
+ */
+void
+history_record(void) {
+    struct nsp_history_entry    entry;
+    struct monitor  *mon;
+    uint32_t    previous = 0, *indexes, m;
+    uint64_t    now;
+    size_t      size, length = 4;
+    uint8_t     *buffer;
+    int         same;
+
+    if (history.data < 0)
+        return;
+
+    /* the three columns of the largest possible record */
+    size = 4 + 3 * VARINT_MAX_LENGTH
+        + (size_t)monitor_count * 3 * VARINT_MAX_LENGTH;
+    if (size > history.buffer_size) {
+        if ((buffer = realloc(history.buffer, size)) == NULL) {
+            syslog(_LOGERR_"couldn't allocate a history record: %s",
+                strerror(errno));
+            return;
+        }
+        history.buffer = buffer;
+        history.buffer_size = size;
+    }
+
+    /* the index column is only written when the monitors changed */
+    same = (history.index_count == (uint32_t)monitor_count);
+    m = 0;
+    TAILQ_FOREACH(mon, &monitors, link) {
+        if (!same || history.indexes[m++] != mon->index) {
+            same = 0;
+            break;
+        }
+    }
+
+    now = history_now();
+    buffer = history.buffer;
+    length += history_varint(buffer + length, now - history.start);
+    length += history_varint(buffer + length,
+        same ? NSP_HISTORY_SAME_INDEXES : 0);
+    length += history_varint(buffer + length, monitor_count);
+
+    if (!same) {
+        if ((uint32_t)monitor_count > history.index_size) {
+            indexes = realloc(history.indexes,
+                monitor_count * sizeof(uint32_t));
+            if (indexes == NULL) {
+                syslog(_LOGERR_"couldn't allocate the history indexes: %s",
+                    strerror(errno));
+                return;
+            }
+            history.indexes = indexes;
+            history.index_size = monitor_count;
+        }
+
+        m = 0;
+        TAILQ_FOREACH(mon, &monitors, link) {
+            length += history_varint(buffer + length, mon->index - previous);
+            previous = history.indexes[m++] = mon->index;
+        }
+
+        history.index_count = monitor_count;
+        history.base = history.size;
+    }
+
+    TAILQ_FOREACH(mon, &monitors, link)
+        length += history_varint(buffer + length,
+            history_delta(&mon->history_octets, mon->seen_octets));
+
+    TAILQ_FOREACH(mon, &monitors, link)
+        length += history_varint(buffer + length,
+            history_delta(&mon->history_packets, mon->seen_packets));
+
+    buffer[0] = (length - 4);
+    buffer[1] = (length - 4) >> 8;
+    buffer[2] = (length - 4) >> 16;
+    buffer[3] = (length - 4) >> 24;
+
+    entry.time = now;
+    entry.offset = history.size;
+    entry.base = history.base;
+
+    if (write(history.data, buffer, length) != (ssize_t)length
+        || write(history.index, &entry, sizeof(entry)) != sizeof(entry)) {
+        syslog(_LOGWARN_"couldn't write the history segment %u: %s",
+            history.number, strerror(errno));
+        history_rotate();
+        return;
+    }
+
+    history.size += length;
+
+    if (options.debug >= 2)
+        fprintf(stderr, "history_record: %zu bytes for %d monitor(s)%s\n",
+            length, monitor_count, same ? ", same indexes" : "");
+
+    if (history.size >= (uint64_t)options.history_size * 1024 * 1024)
+        history_rotate();
+}
@@ -0,0 +1,280 @@
+/*
+ * netsnmp-pcap :: hll.c
+ * ---------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslog.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "netsnmp-pcap.h"
+
+
+#define MIN_PRECISION       4
+#define MAX_PRECISION       16
+
+
+/* HyperLogLog registers of a monitor in one worker: two banks of them,
+   one for each kind of distinct count, selected by the parity of the
+   epoch of the monitor; the worker fills one bank while the exporter
+   reads and clears the other */
+struct hll {
+    uint8_t         *registers;
+    uint32_t        precision;      /* log2 of the registers of a kind */
+    const uint32_t  *epoch;
+};
+
+
+/* seed of the hashes of the addresses */
+static uint64_t hll_seed = 0;
+
+
+/*
+ * hll_hash()
+ * --------
+ */
+static inline uint64_t
+hll_hash(const uint8_t *address) {
+    uint64_t    words[2], hash;
+
+    memcpy(words, address, sizeof(words));
+
+    hash = (hll_seed ^ words[0]) * 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ (hash >> 29) ^ words[1]) * 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ (hash >> 32)) * 0xbf58476d1ce4e5b9ULL;
+
+    return(hash ^ (hash >> 29));
+}
+
+
+/*
+ * hll_add()
+ * -------
+ * the first bits of the hash select a register, which keeps the largest
+ * rank of the first bit set in the others
+ */
+static inline void
+hll_add(uint8_t *registers, uint32_t precision, uint64_t hash) {
+    uint8_t *reg = &registers[hash >> (64 - precision)];
+    uint8_t rank;
+
+    rank = __builtin_clzll((hash << precision)
+        | (1ULL << (precision - 1))) + 1;
+
+    if (rank > COUNTER_GET(*reg))
+        COUNTER_SET(*reg, rank);
+}
+
+
+/*
+ * hll_update()
+ * ----------
+ * account the addresses and the 5-tuple of a packet, invoked by
+ * monitor_packet() with the hash of the 5-tuple from flow_parse()
+ */
+void
+hll_update(struct hll *hll, const struct flow_key *key, uint64_t hash) {
+    uint32_t    size = 1 << hll->precision;
+    uint8_t     *bank;
+
+    bank = hll->registers + (COUNTER_GET(*hll->epoch) & 1)
+        * DISTINCT_KINDS * size;
+
+    hll_add(bank + DISTINCT_SOURCES * size, hll->precision,
+        hll_hash(key->src));
+    hll_add(bank + DISTINCT_DESTINATIONS * size, hll->precision,
+        hll_hash(key->dst));
+
+    /* the hash of the 5-tuple is only mixed enough for the flow tables */
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hll_add(bank + DISTINCT_FLOWS * size, hll->precision,
+        hash ^ (hash >> 32));
+}
+
+
+/*
+ * hll_estimate()
+ * ------------
+ * estimate the number of distinct keys from merged registers, counting
+ * the empty ones when there are few keys
+ */
+static uint64_t
+hll_estimate(const uint8_t *registers, uint32_t size) {
+    double      alpha, sum = 0, estimate;
+    uint32_t    i, zeros = 0;
+
+    switch (size) {
+        case 16: alpha = 0.673; break;
+        case 32: alpha = 0.697; break;
+        case 64: alpha = 0.709; break;
+        default: alpha = 0.7213 / (1 + 1.079 / size); break;
+    }
+
+    for (i=0; i<size; i++) {
+        sum += ldexp(1, -registers[i]);
+        if (registers[i] == 0)
+            zeros++;
+    }
+
+    estimate = alpha * size * size / sum;
+
+    if (estimate <= 2.5 * size && zeros > 0)
+        estimate = size * log((double)size / zeros);
+
+    return((uint64_t)(estimate + 0.5));
+}
+
+
+/*
+ * hll_collect()
+ * -----------
+ * end the current interval: switch the workers to the other bank of
+ * registers, then merge the bank they leave into the distinct counts of
+ * the monitor, and clear it for the next interval; invoked once per
+ * export
+ */
+void
+hll_collect(struct monitor *mon) {
+    uint32_t    epoch, size, i;
+    uint8_t     *bank, value;
+    int         kind, w;
+
+    if (mon->hlls == NULL)
+        return;
+
+    epoch = mon->hll_epoch;
+    __atomic_store_n(&mon->hll_epoch, epoch + 1, __ATOMIC_RELEASE);
+
+    size = 1 << mon->hlls[0]->precision;
+
+    for (kind=0; kind<DISTINCT_KINDS; kind++) {
+        memset(mon->hll_scratch, 0, size);
+
+        for (w=0; w<worker_count; w++) {
+            bank = mon->hlls[w]->registers + ((epoch & 1) * DISTINCT_KINDS
+                + kind) * size;
+
+            for (i=0; i<size; i++) {
+                value = COUNTER_GET(bank[i]);
+                if (value > mon->hll_scratch[i])
+                    mon->hll_scratch[i] = value;
+                COUNTER_SET(bank[i], 0);
+            }
+        }
+
+        mon->distinct[kind] = hll_estimate(mon->hll_scratch, size);
+    }
+}
+
+
+/*
+ * hll_free()
+ * --------
+ */
+void
+hll_free(struct monitor *mon) {
+    int     w;
+
+    if (mon->hlls != NULL) {
+        for (w=0; w<worker_count; w++) {
+            if (mon->hlls[w] != NULL)
+                free(mon->hlls[w]->registers);
+            free(mon->hlls[w]);
+        }
+        free(mon->hlls);
+        mon->hlls = NULL;
+    }
+
+    free(mon->hll_scratch);
+    mon->hll_scratch = NULL;
+}
+
+
+/*
+ * hll_init()
+ * --------
+ * allocate the registers of a monitor in each worker, 2^precision bytes
+ * for each kind of distinct count, in two banks; the standard error of
+ * the counts is 1.04 / sqrt(2^precision)
+ */
+int
+hll_init(struct monitor *mon, uint32_t precision) {
+    uint32_t    size;
+    int         w;
+
+    if (precision < MIN_PRECISION || precision > MAX_PRECISION) {
+        syslog(_LOGERR_"couldn't count the distinct keys of monitor %u: "
+            "the precision (%u) must be between %d and %d", mon->index,
+            precision, MIN_PRECISION, MAX_PRECISION);
+        return(-1);
+    }
+
+    if (hll_seed == 0)
+        hll_seed = ((uint64_t)random() << 32) ^ random() ^ time(NULL);
+
+    size = 1 << precision;
+
+    mon->hlls = calloc(worker_count, sizeof(struct hll *));
+    mon->hll_scratch = malloc(size);
+    if (mon->hlls == NULL || mon->hll_scratch == NULL)
+        goto fail;
+
+    for (w=0; w<worker_count; w++) {
+        if ((mon->hlls[w] = calloc(1, sizeof(struct hll))) == NULL)
+            goto fail;
+
+        mon->hlls[w]->precision = precision;
+        mon->hlls[w]->epoch = &mon->hll_epoch;
+        mon->hlls[w]->registers = calloc(2 * DISTINCT_KINDS, size);
+        if (mon->hlls[w]->registers == NULL)
+            goto fail;
+    }
+
+    if (options.debug)
+        fprintf(stderr, "hll_init: %u registers of each kind in %d "
+            "worker(s) for monitor %u\n", size, worker_count, mon->index);
+
+    return(0);
+
+  fail:
+    syslog(_LOGERR_"couldn't allocate the distinct counts of monitor %u: %s",
+        mon->index, strerror(errno));
+    hll_free(mon);
+    return(-1);
+}
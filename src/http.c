@@ -0,0 +1,553 @@
+/*
+ * netsnmp-pcap :: http.c
+ * ----------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#include <errno.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/syslog.h>
+#include <zlib.h>
+
+#include "netsnmp-pcap.h"
+
+
+#define HTTP_DEFAULT_HOST   "0.0.0.0"
+#define HTTP_CONTENT_TYPE   \
+    "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+
+/* text built by a scrape; kept from one scrape to the next, so that
+   they don't allocate anything once the largest one was served */
+struct http_buffer {
+    char        *data;
+    size_t      length;
+    size_t      size;
+};
+
+/* values of a monitor read once per scrape, and where its labels are */
+struct http_row {
+    struct kernel_stats kernel;
+    size_t              labels;     /* offset in the labels buffer */
+    size_t              length;
+};
+
+
+/*
+ * prototypes
+ */
+static void http_metrics(struct evhttp_request *req, void *arg);
+static void http_not_found(struct evhttp_request *req, void *arg);
+
+
+static struct http_buffer   http_text, http_labels, http_gzip;
+static struct http_row      *http_rows = NULL;
+static int                  http_row_count = 0;
+static z_stream             http_zstream;
+static int                  http_zstream_ready = 0;
+
+
+
+/*
+ * http_start()
+ * ----------
+ * start serving /metrics on the address given by --http, [host:]port
+ */
+void
+http_start(struct event_base *ev_base) {
+    struct evhttp   *http;
+    const char  *bind;
+    char    *host, *port;
+
+    if (options.http == NULL)
+        return;
+
+    if (options.debug >= 1)
+        fprintf(stderr, "http_start: listen on %s\n", options.http);
+
+    if ((host = strdup(options.http)) == NULL) {
+        syslog(_LOGERR_"couldn't allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    /* an IPv6 address is given within brackets */
+    if ((port = strrchr(host, ':')) != NULL
+        && (host[0] != '[' || port[-1] == ']')) {
+        *port++ = '\0';
+        if (host[0] == '[') {
+            host[strlen(host) - 1] = '\0';
+            host++;
+        }
+        bind = host;
+    }
+    else {
+        port = host;
+        bind = HTTP_DEFAULT_HOST;
+    }
+
+    if ((http = evhttp_new(ev_base)) == NULL) {
+        syslog(_LOGERR_"couldn't create the HTTP server");
+        exit(EXIT_FAILURE);
+    }
+
+    evhttp_set_allowed_methods(http, EVHTTP_REQ_GET | EVHTTP_REQ_HEAD);
+    evhttp_set_cb(http, "/metrics", http_metrics, NULL);
+    evhttp_set_gencb(http, http_not_found, NULL);
+
+    if (evhttp_bind_socket(http, bind, atoi(port)) < 0) {
+        syslog(_LOGERR_"couldn't listen for HTTP on %s", options.http);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * http_reserve()
+ * ------------
+ * make room for the given number of bytes at the end of a buffer
+ */
+static int
+http_reserve(struct http_buffer *buffer, size_t count) {
+    char    *data;
+    size_t  size;
+
+    if (buffer->length + count <= buffer->size)
+        return(0);
+
+    for (size = (buffer->size ? buffer->size : 65536);
+        size < buffer->length + count; size *= 2)
+        ;
+
+    if ((data = realloc(buffer->data, size)) == NULL) {
+        syslog(_LOGERR_"couldn't allocate an HTTP buffer: %s",
+            strerror(errno));
+        return(-1);
+    }
+
+    buffer->data = data;
+    buffer->size = size;
+
+    return(0);
+}
+
+
+/*
+ * http_printf()
+ * -----------
+ * append formatted text to a buffer
+ */
+static int
+http_printf(struct http_buffer *buffer, const char *format, ...) {
+    va_list args;
+    int     length;
+
+    va_start(args, format);
+    length = vsnprintf(buffer->data + buffer->length,
+        buffer->size - buffer->length, format, args);
+    va_end(args);
+
+    if ((size_t)length >= buffer->size - buffer->length) {
+        if (http_reserve(buffer, length + 1) < 0)
+            return(-1);
+
+        va_start(args, format);
+        vsnprintf(buffer->data + buffer->length,
+            buffer->size - buffer->length, format, args);
+        va_end(args);
+    }
+
+    buffer->length += length;
+
+    return(0);
+}
+
+
+/*
+ * http_label()
+ * ----------
+ * append a label to a buffer, escaping its value
+ */
+static int
+http_label(struct http_buffer *buffer, const char *name, const char *value) {
+    const char  *c;
+    size_t      length = strlen(name) + 4;
+
+    for (c = value; c != NULL && *c; c++)
+        length += (*c == '\\' || *c == '"' || *c == '\n') ? 2 : 1;
+
+    if (http_reserve(buffer, length + 1) < 0)
+        return(-1);
+
+    buffer->length += sprintf(buffer->data + buffer->length, "%s%s=\"",
+        (buffer->data[buffer->length - 1] == '{') ? "" : ",", name);
+
+    for (c = value; c != NULL && *c; c++) {
+        if (*c == '\\' || *c == '"' || *c == '\n')
+            buffer->data[buffer->length++] = '\\';
+        buffer->data[buffer->length++] = (*c == '\n') ? 'n' : *c;
+    }
+
+    buffer->data[buffer->length++] = '"';
+    buffer->data[buffer->length] = '\0';
+
+    return(0);
+}
+
+
+/*
+ * http_prepare()
+ * ------------
+ * sum the live counters of the monitors, and build their labels
+ */
+static int
+http_prepare(void) {
+    struct http_row *rows;
+    struct monitor  *mon;
+    int     m = 0;
+
+    if (monitor_count > http_row_count) {
+        rows = realloc(http_rows, monitor_count * sizeof(struct http_row));
+        if (rows == NULL) {
+            syslog(_LOGERR_"couldn't allocate the HTTP rows: %s",
+                strerror(errno));
+            return(-1);
+        }
+
+        http_rows = rows;
+        http_row_count = monitor_count;
+    }
+
+    http_labels.length = 0;
+
+    TAILQ_FOREACH(mon, &monitors, link) {
+        monitor_totals(mon);
+        capture_kernel_stats(mon, &http_rows[m].kernel);
+
+        http_rows[m].labels = http_labels.length;
+        if (http_printf(&http_labels, "{index=\"%u\"", mon->index) < 0
+            || http_label(&http_labels, "descr", mon->description) < 0
+            || http_label(&http_labels, "device", mon->device) < 0
+            || http_label(&http_labels, "filter", mon->filter) < 0)
+            return(-1);
+        http_rows[m].length = http_labels.length - http_rows[m].labels;
+        m++;
+    }
+
+    return(0);
+}
+
+
+/*
+ * http_family()
+ * -----------
+ * append the metadata of a metric family
+ */
+static int
+http_family(const char *name, const char *type, const char *unit,
+    const char *help) {
+    if (http_printf(&http_text, "# TYPE %s %s\n", name, type) < 0
+        || (unit != NULL
+        && http_printf(&http_text, "# UNIT %s %s\n", name, unit) < 0))
+        return(-1);
+
+    return(http_printf(&http_text, "# HELP %s %s\n", name, help));
+}
+
+
+/*
+ * http_sample()
+ * -----------
+ * append a sample of a monitor, with an extra label if any
+ */
+static int
+http_sample(const char *name, int row, const char *label, const char *value,
+    uint64_t number) {
+    const struct http_row *r = &http_rows[row];
+
+    if (label != NULL)
+        return(http_printf(&http_text, "%s%.*s,%s=\"%s\"} %lu\n", name,
+            (int)r->length, http_labels.data + r->labels, label, value,
+            number));
+
+    return(http_printf(&http_text, "%s%.*s} %lu\n", name, (int)r->length,
+        http_labels.data + r->labels, number));
+}
+
+
+/*
+ * http_build()
+ * ----------
+ * build the OpenMetrics text of all the monitors, then of the daemon
+ */
+static int
+http_build(void) {
+    static const char *stats[] = { "peak", "p50", "p95", "p99" };
+    static const char *kinds[DISTINCT_KINDS] = {
+        "sources", "destinations", "flows" };
+    struct monitor  *mon;
+    int     m, i, res = 0;
+
+    http_text.length = 0;
+    if (http_prepare() < 0)
+        return(-1);
+
+    res |= http_family("netsnmp_pcap_monitors", "gauge", NULL,
+        "Number of monitors.");
+    res |= http_printf(&http_text, "netsnmp_pcap_monitors %d\n",
+        monitor_count);
+
+    res |= http_family("netsnmp_pcap_octets", "counter", NULL,
+        "Octets captured by the monitor.");
+    m = 0;
+    TAILQ_FOREACH(mon, &monitors, link)
+        res |= http_sample("netsnmp_pcap_octets_total", m++, NULL, NULL,
+            mon->seen_octets);
+
+    res |= http_family("netsnmp_pcap_packets", "counter", NULL,
+        "Packets captured by the monitor.");
+    m = 0;
+    TAILQ_FOREACH(mon, &monitors, link)
+        res |= http_sample("netsnmp_pcap_packets_total", m++, NULL, NULL,
+            mon->seen_packets);
+
+    /* the monitors counted in the kernel have no capture handle, and
+       no rates */
+    res |= http_family("netsnmp_pcap_kernel_received", "counter", NULL,
+        "Packets received by the capture handles of the monitor.");
+    m = 0;
+    TAILQ_FOREACH(mon, &monitors, link) {
+        if (mon->ebpf == NULL)
+            res |= http_sample("netsnmp_pcap_kernel_received_total", m,
+                NULL, NULL, http_rows[m].kernel.recv);
+        m++;
+    }
+
+    res |= http_family("netsnmp_pcap_kernel_dropped", "counter", NULL,
+        "Packets dropped by the kernel before the capture handles.");
+    m = 0;
+    TAILQ_FOREACH(mon, &monitors, link) {
+        if (mon->ebpf == NULL)
+            res |= http_sample("netsnmp_pcap_kernel_dropped_total", m,
+                NULL, NULL, http_rows[m].kernel.drop);
+        m++;
+    }
+
+    res |= http_family("netsnmp_pcap_octet_rate", "gauge", NULL,
+        "Peak and percentiles of the octets per second, over the last "
+        "export interval.");
+    m = 0;
+    TAILQ_FOREACH(mon, &monitors, link) {
+        if (mon->ebpf == NULL) {
+            res |= http_sample("netsnmp_pcap_octet_rate", m, "stat",
+                stats[0], mon->octet_rates.peak);
+            res |= http_sample("netsnmp_pcap_octet_rate", m, "stat",
+                stats[1], mon->octet_rates.p50);
+            res |= http_sample("netsnmp_pcap_octet_rate", m, "stat",
+                stats[2], mon->octet_rates.p95);
+            res |= http_sample("netsnmp_pcap_octet_rate", m, "stat",
+                stats[3], mon->octet_rates.p99);
+        }
+        m++;
+    }
+
+    res |= http_family("netsnmp_pcap_packet_rate", "gauge", NULL,
+        "Peak and percentiles of the packets per second, over the last "
+        "export interval.");
+    m = 0;
+    TAILQ_FOREACH(mon, &monitors, link) {
+        if (mon->ebpf == NULL) {
+            res |= http_sample("netsnmp_pcap_packet_rate", m, "stat",
+                stats[0], mon->packet_rates.peak);
+            res |= http_sample("netsnmp_pcap_packet_rate", m, "stat",
+                stats[1], mon->packet_rates.p50);
+            res |= http_sample("netsnmp_pcap_packet_rate", m, "stat",
+                stats[2], mon->packet_rates.p95);
+            res |= http_sample("netsnmp_pcap_packet_rate", m, "stat",
+                stats[3], mon->packet_rates.p99);
+        }
+        m++;
+    }
+
+    res |= http_family("netsnmp_pcap_distinct", "gauge", NULL,
+        "Estimated distinct sources, destinations and flows, over the "
+        "last export interval.");
+    m = 0;
+    TAILQ_FOREACH(mon, &monitors, link) {
+        if (mon->hlls != NULL) {
+            for (i=0; i<DISTINCT_KINDS; i++)
+                res |= http_sample("netsnmp_pcap_distinct", m, "kind",
+                    kinds[i], mon->distinct[i]);
+        }
+        m++;
+    }
+
+    /* the costs of the daemon itself */
+    res |= http_family("netsnmp_pcap_loop_lag_microseconds", "gauge",
+        "microseconds", "Delay of the last export timer.");
+    res |= http_printf(&http_text, "netsnmp_pcap_loop_lag_microseconds "
+        "%lu\n", self_stats.loop_lag);
+    res |= http_family("netsnmp_pcap_export_microseconds", "gauge",
+        "microseconds", "Duration of the last export.");
+    res |= http_printf(&http_text, "netsnmp_pcap_export_microseconds %lu\n",
+        self_stats.export_time);
+    res |= http_family("netsnmp_pcap_agent_pdus", "counter", NULL,
+        "AgentX PDUs handled.");
+    res |= http_printf(&http_text, "netsnmp_pcap_agent_pdus_total %lu\n",
+        self_stats.agent_calls);
+    res |= http_family("netsnmp_pcap_agent_microseconds", "counter",
+        "microseconds", "Time spent handling AgentX PDUs.");
+    res |= http_printf(&http_text, "netsnmp_pcap_agent_microseconds_total "
+        "%lu\n", self_stats.agent_time);
+
+    res |= http_printf(&http_text, "# EOF\n");
+
+    return(res ? -1 : 0);
+}
+
+
+/*
+ * http_accepts_gzip()
+ * -----------------
+ * tell if the client accepts a gzip encoded response
+ */
+static int
+http_accepts_gzip(struct evhttp_request *req) {
+    const char  *value, *c;
+    size_t      length;
+
+    value = evhttp_find_header(evhttp_request_get_input_headers(req),
+        "Accept-Encoding");
+
+    for (c = value; c != NULL && *c; c += strspn(c, ",")) {
+        c += strspn(c, " \t");
+        length = strcspn(c, ";, \t");
+
+        if (length == 4 && strncasecmp(c, "gzip", 4) == 0) {
+            c += length + strspn(c + length, " \t");
+            /* refused with a zero quality */
+            return(*c != ';' || strtod(c + 1 + strspn(c + 1, " \tq="),
+                NULL) > 0);
+        }
+
+        c += strcspn(c, ",");
+    }
+
+    return(0);
+}
+
+
+/*
+ * http_compress()
+ * -------------
+ * compress the text of the scrape into the gzip buffer, with the stream
+ * kept from one scrape to the next
+ */
+static int
+http_compress(void) {
+    size_t  bound;
+
+    if (!http_zstream_ready) {
+        if (deflateInit2(&http_zstream, Z_BEST_SPEED, Z_DEFLATED, 15 + 16,
+            8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return(-1);
+        http_zstream_ready = 1;
+    }
+    else if (deflateReset(&http_zstream) != Z_OK)
+        return(-1);
+
+    bound = deflateBound(&http_zstream, http_text.length);
+    http_gzip.length = 0;
+    if (http_reserve(&http_gzip, bound) < 0)
+        return(-1);
+
+    http_zstream.next_in = (Bytef *)http_text.data;
+    http_zstream.avail_in = http_text.length;
+    http_zstream.next_out = (Bytef *)http_gzip.data;
+    http_zstream.avail_out = http_gzip.size;
+
+    if (deflate(&http_zstream, Z_FINISH) != Z_STREAM_END)
+        return(-1);
+
+    http_gzip.length = http_gzip.size - http_zstream.avail_out;
+
+    return(0);
+}
+
+
+/*
+ * http_metrics()
+ * ------------
+ * callback function invoked by libevent to serve /metrics
+ */
+static void
+http_metrics(struct evhttp_request *req, void *arg) {
+    struct evkeyvalq    *headers = evhttp_request_get_output_headers(req);
+    const struct http_buffer    *body = &http_text;
+
+    if (options.debug >= 3)
+        fprintf(stderr, "http_metrics: scrape from %s\n",
+            evhttp_request_get_host(req));
+
+    if (http_build() < 0) {
+        evhttp_send_error(req, HTTP_INTERNAL, NULL);
+        return;
+    }
+
+    if (http_accepts_gzip(req) && http_compress() == 0) {
+        body = &http_gzip;
+        evhttp_add_header(headers, "Content-Encoding", "gzip");
+    }
+
+    evhttp_add_header(headers, "Content-Type", HTTP_CONTENT_TYPE);
+    evhttp_add_header(headers, "Vary", "Accept-Encoding");
+    evbuffer_add(evhttp_request_get_output_buffer(req), body->data,
+        body->length);
+    evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+
+/*
+ * http_not_found()
+ * --------------
+ * callback function invoked by libevent for any other path
+ */
+static void
+http_not_found(struct evhttp_request *req, void *arg) {
+    evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+}
@@ -0,0 +1,1409 @@
+/*
+ * netsnmp-pcap :: jit.c
+ * ---------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syslog.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "netsnmp-pcap.h"
+
+
+/* size of the memory the native code of filters is packed in */
+#define ARENA_SIZE      (256 * 1024)
+#define CODE_ALIGNMENT  16
+
+/* jump targets which aren't classic BPF instructions */
+#define TARGET_REJECT   (-1)
+
+/* kinds of jumps to patch */
+#define FIXUP_REL32     0       /* x86-64 rel32 */
+#define FIXUP_COND19    1       /* AArch64 B.cond and CBZ imm19 */
+#define FIXUP_BRANCH26  2       /* AArch64 B imm26 */
+
+
+/* executable memory, mapped twice from a memfd: the code of filters is
+   written through one view and run from the other, so that adding
+   a filter never changes the protection of code other threads may be
+   running, and filters are packed instead of taking a page each */
+struct jit_arena {
+    unsigned char   *write;
+    unsigned char   *exec;
+    size_t          size;
+    size_t          used;
+    int             users;
+};
+
+/* machine code being generated */
+struct jit_code {
+    unsigned char   *bytes;
+    size_t          count;
+    size_t          size;
+    int             failed;
+};
+
+/* jump to patch once the program is translated */
+struct jit_fixup {
+    size_t  at;
+    int     target;
+    int     kind;
+};
+
+/* the arena new filters go to */
+static struct jit_arena *jit_current = NULL;
+
+/* translation state of a program */
+struct jit_state {
+    struct jit_code     code;
+    struct jit_fixup    *fixups;
+    int                 fixup_count;
+    int                 fixup_size;
+    size_t              *offsets;       /* of each classic BPF instruction */
+    size_t              reject;         /* of the rejection epilogue */
+};
+
+
+/*
+ * jit_arena_free()
+ * --------------
+ */
+static void
+jit_arena_free(struct jit_arena *arena) {
+    munmap(arena->write, arena->size);
+    munmap(arena->exec, arena->size);
+    free(arena);
+}
+
+
+/*
+ * jit_arena_new()
+ * -------------
+ * map a new arena of at least the given size; return NULL if the system
+ * doesn't allow it
+ */
+static struct jit_arena *
+jit_arena_new(size_t size) {
+#ifdef __linux__
+    struct jit_arena *arena;
+    int fd;
+
+    if ((arena = calloc(1, sizeof(struct jit_arena))) == NULL)
+        return(NULL);
+
+    arena->size = (size + ARENA_SIZE - 1) / ARENA_SIZE * ARENA_SIZE;
+    arena->write = arena->exec = MAP_FAILED;
+
+    if ((fd = memfd_create(PROGRAM "-jit", MFD_CLOEXEC)) < 0) {
+        free(arena);
+        return(NULL);
+    }
+
+    if (ftruncate(fd, arena->size) == 0) {
+        arena->write = mmap(NULL, arena->size, PROT_READ|PROT_WRITE,
+            MAP_SHARED, fd, 0);
+        arena->exec = mmap(NULL, arena->size, PROT_READ|PROT_EXEC,
+            MAP_SHARED, fd, 0);
+    }
+
+    close(fd);
+
+    if (arena->write == MAP_FAILED || arena->exec == MAP_FAILED) {
+        if (arena->write != MAP_FAILED)
+            munmap(arena->write, arena->size);
+        if (arena->exec != MAP_FAILED)
+            munmap(arena->exec, arena->size);
+        free(arena);
+        return(NULL);
+    }
+
+    return(arena);
+#else
+    return(NULL);
+#endif
+}
+
+
+/*
+ * jit_place()
+ * ---------
+ * copy the native code of a filter to executable memory: in the current
+ * arena, or in its own mapping when arenas aren't available
+ */
+static int
+jit_place(struct jit *jit, const unsigned char *bytes, size_t size) {
+    struct jit_arena *arena = jit_current;
+
+    jit->size = size;
+
+    if (arena == NULL || arena->used + size > arena->size) {
+        /* the previous arena goes away with its last filter */
+        if (arena != NULL && arena->users == 0)
+            jit_arena_free(arena);
+        arena = jit_current = jit_arena_new(size);
+    }
+
+    if (arena != NULL) {
+        memcpy(arena->write + arena->used, bytes, size);
+        jit->code = arena->exec + arena->used;
+        jit->arena = arena;
+        arena->used = (arena->used + size + CODE_ALIGNMENT - 1)
+            / CODE_ALIGNMENT * CODE_ALIGNMENT;
+        arena->users++;
+    }
+    else {
+        jit->code = mmap(NULL, size, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (jit->code == MAP_FAILED) {
+            syslog(_LOGERR_"couldn't allocate memory for a filter: %s",
+                strerror(errno));
+            return(-1);
+        }
+
+        memcpy(jit->code, bytes, size);
+
+        if (mprotect(jit->code, size, PROT_READ|PROT_EXEC) < 0) {
+            syslog(_LOGERR_"couldn't make a filter executable: %s",
+                strerror(errno));
+            munmap(jit->code, size);
+            return(-1);
+        }
+    }
+
+    __builtin___clear_cache((char *)jit->code, (char *)jit->code + size);
+    jit->function = (jit_filter)jit->code;
+
+    return(0);
+}
+
+
+/*
+ * jit_emit()
+ * --------
+ * append bytes to the machine code
+ */
+static void
+jit_emit(struct jit_code *code, const void *bytes, size_t length) {
+    unsigned char *p;
+    size_t size;
+
+    if (code->failed)
+        return;
+
+    if (code->count + length > code->size) {
+        size = (code->size ? code->size * 2 : 4096);
+        while (size < code->count + length)
+            size *= 2;
+        if ((p = realloc(code->bytes, size)) == NULL) {
+            code->failed = 1;
+            return;
+        }
+        code->bytes = p;
+        code->size = size;
+    }
+
+    memcpy(code->bytes + code->count, bytes, length);
+    code->count += length;
+}
+
+
+/*
+ * jit_fixup()
+ * ---------
+ * remember a jump emitted at the given offset, to patch it with the
+ * address of the given target
+ */
+static void
+jit_fixup(struct jit_state *state, size_t at, int target, int kind) {
+    struct jit_fixup *fixups;
+
+    if (state->fixup_count == state->fixup_size) {
+        state->fixup_size = (state->fixup_size ? state->fixup_size * 2 : 64);
+        fixups = realloc(state->fixups,
+            state->fixup_size * sizeof(struct jit_fixup));
+        if (fixups == NULL) {
+            state->code.failed = 1;
+            return;
+        }
+        state->fixups = fixups;
+    }
+
+    state->fixups[state->fixup_count].at = at;
+    state->fixups[state->fixup_count].target = target;
+    state->fixups[state->fixup_count].kind = kind;
+    state->fixup_count++;
+}
+
+
+#if defined(__x86_64__)
+
+/*
+ * The x86-64 translation keeps A in eax and X in ecx, so that shifts by X
+ * can use cl; the packet is in rdi, its length in esi, the captured
+ * length moves to r10d since edx is clobbered by divisions.  The scratch
+ * memory lives in the red zone, below rsp, as the code calls nothing.
+ */
+
+#define MEM_OFFSET(k)   ((int8_t)(-4 * BPF_MEMWORDS + 4 * (int)(k)))
+
+
+/*
+ * jit_x86_imm32()
+ * -------------
+ * append an opcode followed by a 32-bit immediate
+ */
+static void
+jit_x86_imm32(struct jit_code *code, const void *opcode, size_t length,
+    uint32_t imm) {
+    unsigned char bytes[4];
+
+    bytes[0] = imm;
+    bytes[1] = imm >> 8;
+    bytes[2] = imm >> 16;
+    bytes[3] = imm >> 24;
+
+    jit_emit(code, opcode, length);
+    jit_emit(code, bytes, 4);
+}
+
+
+/*
+ * jit_x86_jump()
+ * ------------
+ * append a jump, conditional when cc is not zero, to a classic BPF
+ * instruction or to the rejection
+ */
+static void
+jit_x86_jump(struct jit_state *state, int cc, int target) {
+    unsigned char op[2] = { 0x0f, cc };
+
+    if (cc)
+        jit_x86_imm32(&state->code, op, 2, 0);
+    else
+        jit_x86_imm32(&state->code, "\xe9", 1, 0);
+
+    jit_fixup(state, state->code.count - 4, target, FIXUP_REL32);
+}
+
+
+/*
+ * jit_x86_check()
+ * -------------
+ * reject the packet unless its captured length is at least end bytes
+ */
+static void
+jit_x86_check(struct jit_state *state, uint64_t end) {
+    if (end > UINT32_MAX) {
+        jit_x86_jump(state, 0, TARGET_REJECT);
+        return;
+    }
+
+    /* cmp r10d, end; jb reject */
+    jit_x86_imm32(&state->code, "\x41\x81\xfa", 3, end);
+    jit_x86_jump(state, 0x82, TARGET_REJECT);
+}
+
+
+/*
+ * jit_x86_load()
+ * ------------
+ * load size bytes at [rdi + k], or at [rdi + X + k] when indexed, into
+ * eax, in host byte order
+ */
+static void
+jit_x86_load(struct jit_state *state, int size, uint32_t k, int indexed) {
+    struct jit_code *code = &state->code;
+    unsigned char   disp[4];
+
+    if (indexed) {
+        /* mov r8d, ecx; mov r9d, k; add r8, r9 */
+        jit_emit(code, "\x41\x89\xc8", 3);
+        jit_x86_imm32(code, "\x41\xb9", 2, k);
+        jit_emit(code, "\x4d\x01\xc8", 3);
+
+        /* lea r9, [r8 + size]; cmp r9, r10; ja reject */
+        jit_emit(code, "\x4d\x8d\x48", 3);
+        disp[0] = size;
+        jit_emit(code, disp, 1);
+        jit_emit(code, "\x4d\x39\xd1", 3);
+        jit_x86_jump(state, 0x87, TARGET_REJECT);
+
+        switch (size) {
+            case 4:     /* mov eax, [rdi + r8]; bswap eax */
+                jit_emit(code, "\x42\x8b\x04\x07\x0f\xc8", 6);
+                break;
+            case 2:     /* movzx eax, word [rdi + r8]; rol ax, 8 */
+                jit_emit(code, "\x42\x0f\xb7\x04\x07\x66\xc1\xc0\x08", 9);
+                break;
+            default:    /* movzx eax, byte [rdi + r8] */
+                jit_emit(code, "\x42\x0f\xb6\x04\x07", 5);
+                break;
+        }
+        return;
+    }
+
+    /* offsets beyond 2 GB can't be captured */
+    if (k > INT32_MAX - 4) {
+        jit_x86_jump(state, 0, TARGET_REJECT);
+        return;
+    }
+
+    jit_x86_check(state, (uint64_t)k + size);
+
+    switch (size) {
+        case 4:     /* mov eax, [rdi + k]; bswap eax */
+            jit_x86_imm32(code, "\x8b\x87", 2, k);
+            jit_emit(code, "\x0f\xc8", 2);
+            break;
+        case 2:     /* movzx eax, word [rdi + k]; rol ax, 8 */
+            jit_x86_imm32(code, "\x0f\xb7\x87", 3, k);
+            jit_emit(code, "\x66\xc1\xc0\x08", 4);
+            break;
+        default:    /* movzx eax, byte [rdi + k] */
+            jit_x86_imm32(code, "\x0f\xb6\x87", 3, k);
+            break;
+    }
+}
+
+
+/*
+ * jit_x86_translate()
+ * -----------------
+ * translate a classic BPF instruction; return -1 if it's not supported
+ */
+static int
+jit_x86_translate(struct jit_state *state, const struct bpf_insn *insns,
+    int i, int count) {
+    const struct bpf_insn *insn = &insns[i];
+    struct jit_code *code = &state->code;
+    unsigned char   op[4];
+    uint32_t    k = insn->k;
+    int         jt, jf, cc, ncc;
+
+    switch (insn->code) {
+        /* loads */
+        case BPF_LD|BPF_W|BPF_ABS:
+        case BPF_LD|BPF_H|BPF_ABS:
+        case BPF_LD|BPF_B|BPF_ABS:
+        case BPF_LD|BPF_W|BPF_IND:
+        case BPF_LD|BPF_H|BPF_IND:
+        case BPF_LD|BPF_B|BPF_IND:
+            jit_x86_load(state, (BPF_SIZE(insn->code) == BPF_W ? 4
+                : (BPF_SIZE(insn->code) == BPF_H ? 2 : 1)), k,
+                BPF_MODE(insn->code) == BPF_IND);
+            break;
+
+        case BPF_LDX|BPF_MSH|BPF_B:
+            if (k > INT32_MAX - 4) {
+                jit_x86_jump(state, 0, TARGET_REJECT);
+                break;
+            }
+            /* movzx ecx, byte [rdi + k]; and ecx, 0xf; shl ecx, 2 */
+            jit_x86_check(state, (uint64_t)k + 1);
+            jit_x86_imm32(code, "\x0f\xb6\x8f", 3, k);
+            jit_emit(code, "\x83\xe1\x0f\xc1\xe1\x02", 6);
+            break;
+
+        case BPF_LD|BPF_W|BPF_LEN:
+            jit_emit(code, "\x89\xf0", 2);          /* mov eax, esi */
+            break;
+
+        case BPF_LDX|BPF_W|BPF_LEN:
+            jit_emit(code, "\x89\xf1", 2);          /* mov ecx, esi */
+            break;
+
+        case BPF_LD|BPF_IMM:
+            jit_x86_imm32(code, "\xb8", 1, k);      /* mov eax, k */
+            break;
+
+        case BPF_LDX|BPF_IMM:
+            jit_x86_imm32(code, "\xb9", 1, k);      /* mov ecx, k */
+            break;
+
+        case BPF_LD|BPF_MEM:
+        case BPF_LDX|BPF_MEM:
+        case BPF_ST:
+        case BPF_STX:
+            if (k >= BPF_MEMWORDS)
+                return(-1);
+            /* mov reg, [rsp + offset], or the other way round */
+            op[0] = (BPF_CLASS(insn->code) == BPF_LD
+                || BPF_CLASS(insn->code) == BPF_LDX ? 0x8b : 0x89);
+            op[1] = (BPF_CLASS(insn->code) == BPF_LD
+                || BPF_CLASS(insn->code) == BPF_ST ? 0x44 : 0x4c);
+            op[2] = 0x24;
+            op[3] = MEM_OFFSET(k);
+            jit_emit(code, op, 4);
+            break;
+
+        /* arithmetic */
+        case BPF_ALU|BPF_ADD|BPF_K:
+            jit_x86_imm32(code, "\x05", 1, k);
+            break;
+        case BPF_ALU|BPF_SUB|BPF_K:
+            jit_x86_imm32(code, "\x2d", 1, k);
+            break;
+        case BPF_ALU|BPF_AND|BPF_K:
+            jit_x86_imm32(code, "\x25", 1, k);
+            break;
+        case BPF_ALU|BPF_OR|BPF_K:
+            jit_x86_imm32(code, "\x0d", 1, k);
+            break;
+        case BPF_ALU|BPF_XOR|BPF_K:
+            jit_x86_imm32(code, "\x35", 1, k);
+            break;
+        case BPF_ALU|BPF_MUL|BPF_K:
+            jit_x86_imm32(code, "\x69\xc0", 2, k);  /* imul eax, eax, k */
+            break;
+        case BPF_ALU|BPF_LSH|BPF_K:
+        case BPF_ALU|BPF_RSH|BPF_K:
+            if (k >= 32) {
+                jit_emit(code, "\x31\xc0", 2);      /* xor eax, eax */
+                break;
+            }
+            /* shl/shr eax, k */
+            op[0] = 0xc1;
+            op[1] = (BPF_OP(insn->code) == BPF_LSH ? 0xe0 : 0xe8);
+            op[2] = k;
+            jit_emit(code, op, 3);
+            break;
+        case BPF_ALU|BPF_DIV|BPF_K:
+        case BPF_ALU|BPF_MOD|BPF_K:
+            if (k == 0)
+                return(-1);
+            /* xor edx, edx; mov r8d, k; div r8d */
+            jit_emit(code, "\x31\xd2", 2);
+            jit_x86_imm32(code, "\x41\xb8", 2, k);
+            jit_emit(code, "\x41\xf7\xf0", 3);
+            if (BPF_OP(insn->code) == BPF_MOD)
+                jit_emit(code, "\x89\xd0", 2);      /* mov eax, edx */
+            break;
+        case BPF_ALU|BPF_NEG:
+            jit_emit(code, "\xf7\xd8", 2);          /* neg eax */
+            break;
+
+        case BPF_ALU|BPF_ADD|BPF_X:
+            jit_emit(code, "\x01\xc8", 2);          /* add eax, ecx */
+            break;
+        case BPF_ALU|BPF_SUB|BPF_X:
+            jit_emit(code, "\x29\xc8", 2);
+            break;
+        case BPF_ALU|BPF_AND|BPF_X:
+            jit_emit(code, "\x21\xc8", 2);
+            break;
+        case BPF_ALU|BPF_OR|BPF_X:
+            jit_emit(code, "\x09\xc8", 2);
+            break;
+        case BPF_ALU|BPF_XOR|BPF_X:
+            jit_emit(code, "\x31\xc8", 2);
+            break;
+        case BPF_ALU|BPF_MUL|BPF_X:
+            jit_emit(code, "\x0f\xaf\xc1", 3);      /* imul eax, ecx */
+            break;
+        case BPF_ALU|BPF_LSH|BPF_X:
+        case BPF_ALU|BPF_RSH|BPF_X:
+            /* cmp ecx, 32; jb +4; xor eax, eax; jmp +2; shl/shr eax, cl */
+            jit_emit(code, "\x83\xf9\x20\x72\x04\x31\xc0\xeb\x02", 9);
+            jit_emit(code, (BPF_OP(insn->code) == BPF_LSH
+                ? "\xd3\xe0" : "\xd3\xe8"), 2);
+            break;
+        case BPF_ALU|BPF_DIV|BPF_X:
+        case BPF_ALU|BPF_MOD|BPF_X:
+            /* test ecx, ecx; jz reject; xor edx, edx; div ecx */
+            jit_emit(code, "\x85\xc9", 2);
+            jit_x86_jump(state, 0x84, TARGET_REJECT);
+            jit_emit(code, "\x31\xd2\xf7\xf1", 4);
+            if (BPF_OP(insn->code) == BPF_MOD)
+                jit_emit(code, "\x89\xd0", 2);
+            break;
+
+        case BPF_MISC|BPF_TAX:
+            jit_emit(code, "\x89\xc1", 2);          /* mov ecx, eax */
+            break;
+        case BPF_MISC|BPF_TXA:
+            jit_emit(code, "\x89\xc8", 2);          /* mov eax, ecx */
+            break;
+
+        /* returns */
+        case BPF_RET|BPF_K:
+            jit_x86_imm32(code, "\xb8", 1, k);
+            jit_emit(code, "\xc3", 1);
+            break;
+        case BPF_RET|BPF_A:
+            jit_emit(code, "\xc3", 1);
+            break;
+
+        /* jumps */
+        case BPF_JMP|BPF_JA:
+            if ((uint32_t)(count - i - 1) <= k)
+                return(-1);
+            jit_x86_jump(state, 0, i + 1 + k);
+            break;
+
+        default:
+            if (BPF_CLASS(insn->code) != BPF_JMP)
+                return(-1);
+
+            switch (BPF_OP(insn->code)) {
+                case BPF_JEQ:   cc = 0x84; ncc = 0x85; break;  /* je, jne */
+                case BPF_JGT:   cc = 0x87; ncc = 0x86; break;  /* ja, jbe */
+                case BPF_JGE:   cc = 0x83; ncc = 0x82; break;  /* jae, jb */
+                case BPF_JSET:  cc = 0x85; ncc = 0x84; break;  /* jne, je */
+                default:        return(-1);
+            }
+
+            jt = i + 1 + insn->jt;
+            jf = i + 1 + insn->jf;
+            if (jt >= count || jf >= count)
+                return(-1);
+
+            if (BPF_OP(insn->code) == BPF_JSET)
+                op[0] = (BPF_SRC(insn->code) == BPF_X ? 0x85 : 0xa9);
+            else
+                op[0] = (BPF_SRC(insn->code) == BPF_X ? 0x39 : 0x3d);
+
+            /* test/cmp eax, ecx or k */
+            if (BPF_SRC(insn->code) == BPF_X) {
+                op[1] = 0xc8;
+                jit_emit(code, op, 2);
+            }
+            else
+                jit_x86_imm32(code, op, 1, k);
+
+            if (jt == jf)
+                jit_x86_jump(state, 0, jt);
+            else if (jt == i + 1)
+                jit_x86_jump(state, ncc, jf);
+            else {
+                jit_x86_jump(state, cc, jt);
+                if (jf != i + 1)
+                    jit_x86_jump(state, 0, jf);
+            }
+            break;
+    }
+
+    return(0);
+}
+
+
+/*
+ * jit_arch_prologue()
+ * -----------------
+ */
+static void
+jit_arch_prologue(struct jit_state *state, int zero_memory) {
+    int k;
+
+    /* mov r10d, edx; xor eax, eax; xor ecx, ecx */
+    jit_emit(&state->code, "\x41\x89\xd2\x31\xc0\x31\xc9", 7);
+
+    /* mov [rsp + offset], eax */
+    for (k=0; zero_memory && k<BPF_MEMWORDS; k++) {
+        unsigned char op[4] = { 0x89, 0x44, 0x24, MEM_OFFSET(k) };
+        jit_emit(&state->code, op, 4);
+    }
+}
+
+
+/*
+ * jit_arch_epilogue()
+ * -----------------
+ */
+static void
+jit_arch_epilogue(struct jit_state *state) {
+    /* xor eax, eax; ret */
+    jit_emit(&state->code, "\x31\xc0\xc3", 3);
+}
+
+
+/*
+ * jit_arch_patch()
+ * --------------
+ */
+static void
+jit_arch_patch(struct jit_code *code, const struct jit_fixup *fixup,
+    size_t target) {
+    int32_t rel = (int32_t)(target - (fixup->at + 4));
+
+    memcpy(code->bytes + fixup->at, &rel, 4);
+}
+
+#define jit_arch_translate  jit_x86_translate
+
+#elif defined(__aarch64__)
+
+/*
+ * The AArch64 translation keeps the packet in x9, its length in w10, the
+ * captured length in w11, A in w12 and X in w13; w14 and w15 are
+ * temporaries.  The scratch memory is on the stack.
+ */
+
+#define R_PACKET    9
+#define R_LEN       10
+#define R_BUFLEN    11
+#define R_A         12
+#define R_X         13
+#define R_T1        14
+#define R_T2        15
+#define R_ZERO      31
+
+#define COND_EQ     0x0
+#define COND_NE     0x1
+#define COND_HS     0x2
+#define COND_LO     0x3
+#define COND_HI     0x8
+#define COND_LS     0x9
+
+#define STACK_SIZE  (4 * BPF_MEMWORDS)
+
+
+/*
+ * jit_a64_emit()
+ * ------------
+ */
+static void
+jit_a64_emit(struct jit_code *code, uint32_t insn) {
+    unsigned char bytes[4];
+
+    bytes[0] = insn;
+    bytes[1] = insn >> 8;
+    bytes[2] = insn >> 16;
+    bytes[3] = insn >> 24;
+
+    jit_emit(code, bytes, 4);
+}
+
+
+/*
+ * jit_a64_imm32()
+ * -------------
+ * load a 32-bit immediate in a register, with movz and movk
+ */
+static void
+jit_a64_imm32(struct jit_code *code, int reg, uint32_t imm) {
+    jit_a64_emit(code, 0x52800000 | ((imm & 0xffff) << 5) | reg);
+    if (imm >> 16)
+        jit_a64_emit(code, 0x72a00000 | ((imm >> 16) << 5) | reg);
+}
+
+
+/*
+ * jit_a64_jump()
+ * ------------
+ * append a jump, conditional when cond is not -1, to a classic BPF
+ * instruction or to the rejection
+ */
+static void
+jit_a64_jump(struct jit_state *state, int cond, int target) {
+    jit_fixup(state, state->code.count, target,
+        (cond < 0 ? FIXUP_BRANCH26 : FIXUP_COND19));
+
+    if (cond < 0)
+        jit_a64_emit(&state->code, 0x14000000);             /* b */
+    else
+        jit_a64_emit(&state->code, 0x54000000 | cond);      /* b.cond */
+}
+
+
+/*
+ * jit_a64_load()
+ * ------------
+ * load size bytes at x9 + k, or at x9 + X + k when indexed, into dst, in
+ * host byte order
+ */
+static void
+jit_a64_load(struct jit_state *state, int size, uint32_t k, int indexed,
+    int dst) {
+    struct jit_code *code = &state->code;
+
+    if (indexed) {
+        /* w15 = X; w14 = k; x15 += x14; x14 = x15 + size */
+        jit_a64_emit(code, 0x2a0003e0 | (R_X << 16) | R_T2);
+        jit_a64_imm32(code, R_T1, k);
+        jit_a64_emit(code, 0x8b000000 | (R_T1 << 16) | (R_T2 << 5) | R_T2);
+        jit_a64_emit(code, 0x91000000 | (size << 10) | (R_T2 << 5) | R_T1);
+    }
+    else {
+        /* x14 = k + size; x15 = k */
+        if ((uint64_t)k + size > UINT32_MAX) {
+            jit_a64_jump(state, -1, TARGET_REJECT);
+            return;
+        }
+        jit_a64_imm32(code, R_T1, k + size);
+        jit_a64_imm32(code, R_T2, k);
+    }
+
+    /* cmp x14, x11; b.hi reject */
+    jit_a64_emit(code, 0xeb00001f | (R_BUFLEN << 16) | (R_T1 << 5));
+    jit_a64_jump(state, COND_HI, TARGET_REJECT);
+
+    switch (size) {
+        case 4:     /* ldr dst, [x9, x15]; rev dst, dst */
+            jit_a64_emit(code, 0xb8606800 | (R_T2 << 16) | (R_PACKET << 5)
+                | dst);
+            jit_a64_emit(code, 0x5ac00800 | (dst << 5) | dst);
+            break;
+        case 2:     /* ldrh dst, [x9, x15]; rev16 dst, dst */
+            jit_a64_emit(code, 0x78606800 | (R_T2 << 16) | (R_PACKET << 5)
+                | dst);
+            jit_a64_emit(code, 0x5ac00400 | (dst << 5) | dst);
+            break;
+        default:    /* ldrb dst, [x9, x15] */
+            jit_a64_emit(code, 0x38606800 | (R_T2 << 16) | (R_PACKET << 5)
+                | dst);
+            break;
+    }
+}
+
+
+/*
+ * jit_a64_translate()
+ * -----------------
+ * translate a classic BPF instruction; return -1 if it's not supported
+ */
+static int
+jit_a64_translate(struct jit_state *state, const struct bpf_insn *insns,
+    int i, int count) {
+    const struct bpf_insn *insn = &insns[i];
+    struct jit_code *code = &state->code;
+    uint32_t    k = insn->k, op;
+    int         jt, jf, cond, ncond, rhs;
+
+    switch (insn->code) {
+        /* loads */
+        case BPF_LD|BPF_W|BPF_ABS:
+        case BPF_LD|BPF_H|BPF_ABS:
+        case BPF_LD|BPF_B|BPF_ABS:
+        case BPF_LD|BPF_W|BPF_IND:
+        case BPF_LD|BPF_H|BPF_IND:
+        case BPF_LD|BPF_B|BPF_IND:
+            jit_a64_load(state, (BPF_SIZE(insn->code) == BPF_W ? 4
+                : (BPF_SIZE(insn->code) == BPF_H ? 2 : 1)), k,
+                BPF_MODE(insn->code) == BPF_IND, R_A);
+            break;
+
+        case BPF_LDX|BPF_MSH|BPF_B:
+            /* ldrb w13, [x9, k]; ubfiz w13, w13, #2, #4 */
+            jit_a64_load(state, 1, k, 0, R_X);
+            jit_a64_emit(code, 0x53000000 | (30 << 16) | (3 << 10)
+                | (R_X << 5) | R_X);
+            break;
+
+        case BPF_LD|BPF_W|BPF_LEN:
+            jit_a64_emit(code, 0x2a0003e0 | (R_LEN << 16) | R_A);
+            break;
+
+        case BPF_LDX|BPF_W|BPF_LEN:
+            jit_a64_emit(code, 0x2a0003e0 | (R_LEN << 16) | R_X);
+            break;
+
+        case BPF_LD|BPF_IMM:
+            jit_a64_imm32(code, R_A, k);
+            break;
+
+        case BPF_LDX|BPF_IMM:
+            jit_a64_imm32(code, R_X, k);
+            break;
+
+        case BPF_LD|BPF_MEM:
+        case BPF_LDX|BPF_MEM:
+        case BPF_ST:
+        case BPF_STX:
+            if (k >= BPF_MEMWORDS)
+                return(-1);
+            /* ldr/str reg, [sp, #4 * k] */
+            op = (BPF_CLASS(insn->code) == BPF_LD
+                || BPF_CLASS(insn->code) == BPF_LDX ? 0xb9400000 : 0xb9000000);
+            jit_a64_emit(code, op | (k << 10) | (31 << 5)
+                | (BPF_CLASS(insn->code) == BPF_LD
+                || BPF_CLASS(insn->code) == BPF_ST ? R_A : R_X));
+            break;
+
+        case BPF_ALU|BPF_NEG:
+            /* neg w12, w12 */
+            jit_a64_emit(code, 0x4b0003e0 | (R_A << 16) | R_A);
+            break;
+
+        case BPF_MISC|BPF_TAX:
+            jit_a64_emit(code, 0x2a0003e0 | (R_A << 16) | R_X);
+            break;
+
+        case BPF_MISC|BPF_TXA:
+            jit_a64_emit(code, 0x2a0003e0 | (R_X << 16) | R_A);
+            break;
+
+        /* returns */
+        case BPF_RET|BPF_K:
+            jit_a64_imm32(code, R_A, k);
+            /* fall through */
+        case BPF_RET|BPF_A:
+            /* mov w0, w12; add sp, sp, #size; ret */
+            jit_a64_emit(code, 0x2a0003e0 | (R_A << 16) | 0);
+            jit_a64_emit(code, 0x910003ff | (STACK_SIZE << 10));
+            jit_a64_emit(code, 0xd65f03c0);
+            break;
+
+        case BPF_JMP|BPF_JA:
+            if ((uint32_t)(count - i - 1) <= k)
+                return(-1);
+            jit_a64_jump(state, -1, i + 1 + k);
+            break;
+
+        default:
+            if (BPF_CLASS(insn->code) == BPF_ALU) {
+                /* the operand is X, or k in w14 */
+                rhs = R_X;
+                if (BPF_SRC(insn->code) == BPF_K) {
+                    if (k == 0 && (BPF_OP(insn->code) == BPF_DIV
+                        || BPF_OP(insn->code) == BPF_MOD))
+                        return(-1);
+                    jit_a64_imm32(code, R_T1, k);
+                    rhs = R_T1;
+                }
+
+                switch (BPF_OP(insn->code)) {
+                    case BPF_ADD:   op = 0x0b000000; break;
+                    case BPF_SUB:   op = 0x4b000000; break;
+                    case BPF_AND:   op = 0x0a000000; break;
+                    case BPF_OR:    op = 0x2a000000; break;
+                    case BPF_XOR:   op = 0x4a000000; break;
+                    case BPF_MUL:   op = 0x1b007c00; break;     /* madd */
+                    case BPF_LSH:   op = 0x1ac02000; break;     /* lslv */
+                    case BPF_RSH:   op = 0x1ac02400; break;     /* lsrv */
+                    case BPF_DIV:
+                    case BPF_MOD:   op = 0x1ac00800; break;     /* udiv */
+                    default:        return(-1);
+                }
+
+                /* cbz X, reject */
+                if (rhs == R_X && (BPF_OP(insn->code) == BPF_DIV
+                    || BPF_OP(insn->code) == BPF_MOD)) {
+                    jit_fixup(state, code->count, TARGET_REJECT, FIXUP_COND19);
+                    jit_a64_emit(code, 0x34000000 | R_X);
+                }
+
+                if (BPF_OP(insn->code) == BPF_MOD) {
+                    /* udiv w15, w12, rhs; msub w12, w15, rhs, w12 */
+                    jit_a64_emit(code, op | (rhs << 16) | (R_A << 5) | R_T2);
+                    jit_a64_emit(code, 0x1b008000 | (rhs << 16) | (R_A << 10)
+                        | (R_T2 << 5) | R_A);
+                    break;
+                }
+
+                jit_a64_emit(code, op | (rhs << 16) | (R_A << 5) | R_A);
+
+                /* shifts by 32 or more give 0, which lslv and lsrv don't:
+                   cmp rhs, #32; csel w12, wzr, w12, hs */
+                if (BPF_OP(insn->code) == BPF_LSH
+                    || BPF_OP(insn->code) == BPF_RSH) {
+                    jit_a64_emit(code, 0x7100001f | (32 << 10) | (rhs << 5));
+                    jit_a64_emit(code, 0x1a800000 | (R_A << 16)
+                        | (COND_HS << 12) | (R_ZERO << 5) | R_A);
+                }
+                break;
+            }
+
+            if (BPF_CLASS(insn->code) != BPF_JMP)
+                return(-1);
+
+            switch (BPF_OP(insn->code)) {
+                case BPF_JEQ:   cond = COND_EQ; ncond = COND_NE; break;
+                case BPF_JGT:   cond = COND_HI; ncond = COND_LS; break;
+                case BPF_JGE:   cond = COND_HS; ncond = COND_LO; break;
+                case BPF_JSET:  cond = COND_NE; ncond = COND_EQ; break;
+                default:        return(-1);
+            }
+
+            jt = i + 1 + insn->jt;
+            jf = i + 1 + insn->jf;
+            if (jt >= count || jf >= count)
+                return(-1);
+
+            rhs = R_X;
+            if (BPF_SRC(insn->code) == BPF_K) {
+                jit_a64_imm32(code, R_T1, k);
+                rhs = R_T1;
+            }
+
+            /* tst or cmp w12, rhs */
+            jit_a64_emit(code, (BPF_OP(insn->code) == BPF_JSET
+                ? 0x6a00001f : 0x6b00001f) | (rhs << 16) | (R_A << 5));
+
+            if (jt == jf)
+                jit_a64_jump(state, -1, jt);
+            else if (jt == i + 1)
+                jit_a64_jump(state, ncond, jf);
+            else {
+                jit_a64_jump(state, cond, jt);
+                if (jf != i + 1)
+                    jit_a64_jump(state, -1, jf);
+            }
+            break;
+    }
+
+    return(0);
+}
+
+
+/*
+ * jit_arch_prologue()
+ * -----------------
+ */
+static void
+jit_arch_prologue(struct jit_state *state, int zero_memory) {
+    struct jit_code *code = &state->code;
+    int k;
+
+    /* sub sp, sp, #size; mov x9, x0; mov w10, w1; mov w11, w2 */
+    jit_a64_emit(code, 0xd10003ff | (STACK_SIZE << 10));
+    jit_a64_emit(code, 0xaa0003e0 | (0 << 16) | R_PACKET);
+    jit_a64_emit(code, 0x2a0003e0 | (1 << 16) | R_LEN);
+    jit_a64_emit(code, 0x2a0003e0 | (2 << 16) | R_BUFLEN);
+
+    /* mov w12, #0; mov w13, #0 */
+    jit_a64_emit(code, 0x52800000 | R_A);
+    jit_a64_emit(code, 0x52800000 | R_X);
+
+    /* str wzr, [sp, #4 * k] */
+    for (k=0; zero_memory && k<BPF_MEMWORDS; k++)
+        jit_a64_emit(code, 0xb9000000 | (k << 10) | (31 << 5) | R_ZERO);
+}
+
+
+/*
+ * jit_arch_epilogue()
+ * -----------------
+ */
+static void
+jit_arch_epilogue(struct jit_state *state) {
+    /* mov w0, #0; add sp, sp, #size; ret */
+    jit_a64_emit(&state->code, 0x52800000);
+    jit_a64_emit(&state->code, 0x910003ff | (STACK_SIZE << 10));
+    jit_a64_emit(&state->code, 0xd65f03c0);
+}
+
+
+/*
+ * jit_arch_patch()
+ * --------------
+ */
+static void
+jit_arch_patch(struct jit_code *code, const struct jit_fixup *fixup,
+    size_t target) {
+    int32_t     rel = (int32_t)(target - fixup->at) / 4;
+    uint32_t    insn;
+
+    memcpy(&insn, code->bytes + fixup->at, 4);
+
+    if (fixup->kind == FIXUP_BRANCH26)
+        insn |= rel & 0x3ffffff;
+    else
+        insn |= (rel & 0x7ffff) << 5;
+
+    memcpy(code->bytes + fixup->at, &insn, 4);
+}
+
+#define jit_arch_translate  jit_a64_translate
+
+#endif
+
+
+#if defined(__x86_64__) || defined(__aarch64__)
+
+/*
+ * jit_compile()
+ * -----------
+ * translate a classic BPF program into native code; return NULL if the
+ * architecture or an instruction isn't supported, in which case the
+ * program has to go through bpf_filter()
+ */
+struct jit *
+jit_compile(const struct bpf_program *program) {
+    const struct bpf_insn *insns = program->bf_insns;
+    struct jit_state    state;
+    struct jit  *jit = NULL;
+    size_t      target;
+    int         count = program->bf_len, zero_memory = 0, i;
+
+    if (count == 0)
+        return(NULL);
+
+    memset(&state, 0, sizeof(state));
+    if ((state.offsets = calloc(count, sizeof(size_t))) == NULL)
+        return(NULL);
+
+    /* the scratch memory only needs clearing when it's read */
+    for (i=0; i<count; i++) {
+        if (insns[i].code == (BPF_LD|BPF_MEM)
+            || insns[i].code == (BPF_LDX|BPF_MEM))
+            zero_memory = 1;
+    }
+
+    jit_arch_prologue(&state, zero_memory);
+
+    for (i=0; i<count; i++) {
+        state.offsets[i] = state.code.count;
+        if (jit_arch_translate(&state, insns, i, count) < 0)
+            goto done;
+    }
+
+    /* a program can't fall off its end */
+    if (BPF_CLASS(insns[count - 1].code) != BPF_RET)
+        goto done;
+
+    state.reject = state.code.count;
+    jit_arch_epilogue(&state);
+
+    if (state.code.failed)
+        goto done;
+
+    for (i=0; i<state.fixup_count; i++) {
+        target = (state.fixups[i].target == TARGET_REJECT ? state.reject
+            : state.offsets[state.fixups[i].target]);
+        jit_arch_patch(&state.code, &state.fixups[i], target);
+    }
+
+    /* copy it to executable memory */
+    if ((jit = calloc(1, sizeof(struct jit))) == NULL)
+        goto done;
+
+    if (jit_place(jit, state.code.bytes, state.code.count) < 0) {
+        free(jit);
+        jit = NULL;
+    }
+
+  done:
+    free(state.code.bytes);
+    free(state.fixups);
+    free(state.offsets);
+
+    return(jit);
+}
+
+#else
+
+struct jit *
+jit_compile(const struct bpf_program *program) {
+    return(NULL);
+}
+
+#endif
+
+
+/*
+ * jit_free()
+ * --------
+ */
+void
+jit_free(struct jit *jit) {
+    if (jit == NULL)
+        return;
+
+    if (jit->arena == NULL)
+        munmap(jit->code, jit->size);
+    else if (--jit->arena->users == 0 && jit->arena != jit_current)
+        jit_arena_free(jit->arena);
+
+    free(jit);
+}
+
+
+
+/* programs checked by the self-test, besides compiled filters: together
+   they use every classic BPF instruction */
+#define I(code, jt, jf, k)  { (code), (jt), (jf), (k) }
+
+static const struct bpf_insn selftest_loads[] = {
+    I(BPF_LD|BPF_W|BPF_ABS, 0, 0, 0),
+    I(BPF_ST, 0, 0, 0),
+    I(BPF_LD|BPF_H|BPF_ABS, 0, 0, 12),
+    I(BPF_ST, 0, 0, 1),
+    I(BPF_LD|BPF_B|BPF_ABS, 0, 0, 14),
+    I(BPF_MISC|BPF_TAX, 0, 0, 0),
+    I(BPF_LD|BPF_MEM, 0, 0, 0),
+    I(BPF_ALU|BPF_ADD|BPF_X, 0, 0, 0),
+    I(BPF_LDX|BPF_MEM, 0, 0, 1),
+    I(BPF_ALU|BPF_XOR|BPF_X, 0, 0, 0),
+    I(BPF_STX, 0, 0, 2),
+    I(BPF_LDX|BPF_W|BPF_LEN, 0, 0, 0),
+    I(BPF_ALU|BPF_SUB|BPF_X, 0, 0, 0),
+    I(BPF_LDX|BPF_MEM, 0, 0, 2),
+    I(BPF_ALU|BPF_OR|BPF_X, 0, 0, 0),
+    I(BPF_RET|BPF_A, 0, 0, 0),
+};
+
+static const struct bpf_insn selftest_indexed[] = {
+    I(BPF_LDX|BPF_MSH|BPF_B, 0, 0, 14),
+    I(BPF_LD|BPF_H|BPF_IND, 0, 0, 14),
+    I(BPF_ST, 0, 0, 0),
+    I(BPF_LD|BPF_B|BPF_IND, 0, 0, 16),
+    I(BPF_MISC|BPF_TAX, 0, 0, 0),
+    I(BPF_LD|BPF_W|BPF_IND, 0, 0, 10),
+    I(BPF_LDX|BPF_MEM, 0, 0, 0),
+    I(BPF_ALU|BPF_AND|BPF_X, 0, 0, 0),
+    I(BPF_MISC|BPF_TXA, 0, 0, 0),
+    I(BPF_LD|BPF_W|BPF_LEN, 0, 0, 0),
+    I(BPF_ALU|BPF_ADD|BPF_X, 0, 0, 0),
+    I(BPF_RET|BPF_A, 0, 0, 0),
+};
+
+static const struct bpf_insn selftest_arithmetic[] = {
+    I(BPF_LD|BPF_W|BPF_LEN, 0, 0, 0),
+    I(BPF_ALU|BPF_ADD|BPF_K, 0, 0, 7),
+    I(BPF_ALU|BPF_SUB|BPF_K, 0, 0, 3),
+    I(BPF_ALU|BPF_MUL|BPF_K, 0, 0, 0x10001),
+    I(BPF_ALU|BPF_DIV|BPF_K, 0, 0, 3),
+    I(BPF_ALU|BPF_MOD|BPF_K, 0, 0, 0x7fff),
+    I(BPF_ALU|BPF_AND|BPF_K, 0, 0, 0xfff0),
+    I(BPF_ALU|BPF_OR|BPF_K, 0, 0, 0x80000001),
+    I(BPF_ALU|BPF_XOR|BPF_K, 0, 0, 0x5555aaaa),
+    I(BPF_ALU|BPF_LSH|BPF_K, 0, 0, 3),
+    I(BPF_ALU|BPF_RSH|BPF_K, 0, 0, 2),
+    I(BPF_ALU|BPF_NEG, 0, 0, 0),
+    I(BPF_ALU|BPF_RSH|BPF_K, 0, 0, 9),
+    I(BPF_RET|BPF_A, 0, 0, 0),
+};
+
+static const struct bpf_insn selftest_divisions[] = {
+    I(BPF_LD|BPF_B|BPF_ABS, 0, 0, 15),
+    I(BPF_MISC|BPF_TAX, 0, 0, 0),
+    I(BPF_LD|BPF_IMM, 0, 0, 0x12345678),
+    I(BPF_ALU|BPF_LSH|BPF_X, 0, 0, 0),
+    I(BPF_ST, 0, 0, 3),
+    I(BPF_LD|BPF_IMM, 0, 0, 0x87654321),
+    I(BPF_ALU|BPF_RSH|BPF_X, 0, 0, 0),
+    I(BPF_LDX|BPF_MEM, 0, 0, 3),
+    I(BPF_ALU|BPF_OR|BPF_X, 0, 0, 0),
+    I(BPF_ST, 0, 0, 4),
+    I(BPF_LD|BPF_B|BPF_ABS, 0, 0, 23),
+    I(BPF_MISC|BPF_TAX, 0, 0, 0),
+    I(BPF_LD|BPF_W|BPF_ABS, 0, 0, 26),
+    I(BPF_ALU|BPF_DIV|BPF_X, 0, 0, 0),
+    I(BPF_LDX|BPF_MEM, 0, 0, 4),
+    I(BPF_ALU|BPF_MUL|BPF_X, 0, 0, 0),
+    I(BPF_MISC|BPF_TAX, 0, 0, 0),
+    I(BPF_LD|BPF_B|BPF_ABS, 0, 0, 22),
+    I(BPF_MISC|BPF_TAX, 0, 0, 0),
+    I(BPF_LD|BPF_W|BPF_ABS, 0, 0, 30),
+    I(BPF_ALU|BPF_MOD|BPF_X, 0, 0, 0),
+    I(BPF_RET|BPF_A, 0, 0, 0),
+};
+
+static const struct bpf_insn selftest_jumps[] = {
+    I(BPF_LD|BPF_H|BPF_ABS, 0, 0, 12),
+    I(BPF_JMP|BPF_JEQ|BPF_K, 0, 3, 0x0800),
+    I(BPF_LD|BPF_B|BPF_ABS, 0, 0, 23),
+    I(BPF_JMP|BPF_JSET|BPF_K, 9, 0, 0x10),
+    I(BPF_JMP|BPF_JA, 0, 0, 3),
+    I(BPF_JMP|BPF_JGT|BPF_K, 0, 7, 0x8000),
+    I(BPF_LDX|BPF_W|BPF_LEN, 0, 0, 0),
+    I(BPF_JMP|BPF_JA, 0, 0, 6),
+    I(BPF_LDX|BPF_IMM, 0, 0, 17),
+    I(BPF_JMP|BPF_JEQ|BPF_X, 5, 0, 0),
+    I(BPF_JMP|BPF_JGE|BPF_K, 0, 2, 6),
+    I(BPF_JMP|BPF_JGT|BPF_X, 3, 1, 0),
+    I(BPF_RET|BPF_K, 0, 0, 0),
+    I(BPF_RET|BPF_K, 0, 0, 1),
+    I(BPF_LD|BPF_W|BPF_LEN, 0, 0, 0),
+    I(BPF_JMP|BPF_JGE|BPF_X, 0, 1, 0),
+    I(BPF_JMP|BPF_JSET|BPF_X, 1, 0, 0),
+    I(BPF_RET|BPF_K, 0, 0, 2),
+    I(BPF_RET|BPF_K, 0, 0, 65535),
+};
+
+#undef I
+
+static const struct {
+    const struct bpf_insn   *insns;
+    u_int                   count;
+} selftest_programs[] = {
+    { selftest_loads,       sizeof(selftest_loads) / sizeof(struct bpf_insn) },
+    { selftest_indexed,
+        sizeof(selftest_indexed) / sizeof(struct bpf_insn) },
+    { selftest_arithmetic,
+        sizeof(selftest_arithmetic) / sizeof(struct bpf_insn) },
+    { selftest_divisions,
+        sizeof(selftest_divisions) / sizeof(struct bpf_insn) },
+    { selftest_jumps,       sizeof(selftest_jumps) / sizeof(struct bpf_insn) },
+};
+
+/* filters compiled by libpcap */
+static const char *selftest_filters[] = {
+    "ip",
+    "tcp port 80",
+    "udp and dst port 53",
+    "ip6 and tcp",
+    "vlan and tcp",
+    "len > 100",
+    "tcp[tcpflags] & tcp-syn != 0",
+    "ip[2:2] - ((ip[0] & 0xf) << 2) > 40",
+    "portrange 1000-2000 or icmp",
+    "not src net 10.0.0.0/8",
+};
+
+/* sample packets: TCP SYN to port 80, DNS query, IPv6 TCP, 802.1Q TCP,
+   ARP, and something else */
+static const u_char selftest_packets[][80] = {
+    { 0,1,2,3,4,5, 6,7,8,9,10,11, 0x08,0x00,
+      0x45,0,0,60, 0,1,0x40,0, 64,6,0,0, 10,0,0,1, 192,168,1,1,
+      0x9c,0x40,0,80, 0,0,0,1, 0,0,0,0, 0xa0,0x02,0xff,0xff, 0,0,0,0,
+      2,4,5,0xb4, 4,2,8,10, 0,0,0,1, 0,0,0,0, 1,3,3,7 },
+    { 0,1,2,3,4,5, 6,7,8,9,10,11, 0x08,0x00,
+      0x45,0,0,56, 0,2,0,0, 64,17,0,0, 172,16,0,2, 8,8,8,8,
+      0x04,0x01,0,53, 0,36,0,0, 0x12,0x34,1,0, 0,1,0,0, 0,0,0,0,
+      7,'e','x','a','m','p','l','e', 3,'c','o','m', 0, 0,1,0,1 },
+    { 0,1,2,3,4,5, 6,7,8,9,10,11, 0x86,0xdd,
+      0x60,0,0,0, 0,20,6,64, 0x20,0x01,0x0d,0xb8,0,0,0,0, 0,0,0,0,0,0,0,1,
+      0x20,0x01,0x0d,0xb8,0,0,0,0, 0,0,0,0,0,0,0,2,
+      0x03,0xe8,0x01,0xbb, 0,0,0,1, 0,0,0,0, 0x50,0x10,0x20,0x00, 0,0,0,0 },
+    { 0,1,2,3,4,5, 6,7,8,9,10,11, 0x81,0x00, 0x00,0x64, 0x08,0x00,
+      0x45,0,0,40, 0,3,0x20,0x10, 64,6,0,0, 10,1,2,3, 10,4,5,6,
+      0x05,0xdc,0x07,0xd0, 0,0,0,1, 0,0,0,2, 0x50,0x12,0x10,0x00, 0,0,0,0 },
+    { 0xff,0xff,0xff,0xff,0xff,0xff, 6,7,8,9,10,11, 0x08,0x06,
+      0,1,8,0, 6,4,0,1, 6,7,8,9,10,11, 192,168,1,2,
+      0,0,0,0,0,0, 192,168,1,1 },
+    { 0x5a,0xa5,0xff,0x00,0x7f,0x80, 0x01,0xfe,0x20,0x21,0x3f,0x40,
+      0x08,0x00, 0x4f,0xff,0xff,0xff, 0,0,0xff,0xff, 0xff,0x21,0x80,0x00,
+      0xff,0xff,0xff,0xff, 0,0,0,0, 0xff,0x00,0xff,0x00, 0x80,0x7f,0x01,0xfe,
+      0x33,0x44,0x55,0x66, 0x77,0x88,0x99,0xaa },
+};
+
+static const u_int selftest_lengths[] = { 78, 70, 74, 58, 42, 52 };
+
+
+/*
+ * jit_selftest_program()
+ * --------------------
+ * check that the native code of a program returns the same values as
+ * the interpreter for each sample packet, with every captured length;
+ * return 0 if it can't be translated
+ */
+static int
+jit_selftest_program(const struct bpf_insn *insns, u_int count,
+    const char *name) {
+    struct bpf_program  program;
+    struct jit  *jit;
+    u_int       p, caplen, native, interpreted;
+
+    program.bf_len = count;
+    program.bf_insns = (struct bpf_insn *)insns;
+
+    if ((jit = jit_compile(&program)) == NULL)
+        return(0);
+
+    for (p=0; p<sizeof(selftest_lengths)/sizeof(u_int); p++) {
+        for (caplen=0; caplen<=selftest_lengths[p]; caplen++) {
+            native = jit->function(selftest_packets[p],
+                selftest_lengths[p] + 4, caplen);
+            interpreted = bpf_filter(insns, selftest_packets[p],
+                selftest_lengths[p] + 4, caplen);
+
+            if (native != interpreted) {
+                syslog(_LOGWARN_"filter JIT self-test: <%s> returned %u "
+                    "instead of %u on sample packet %u, captured on %u "
+                    "bytes", name, native, interpreted, p + 1, caplen);
+                jit_free(jit);
+                return(-1);
+            }
+        }
+    }
+
+    jit_free(jit);
+    return(1);
+}
+
+
+/*
+ * jit_selftest()
+ * ------------
+ * compare the native code of sample programs with the interpreter on
+ * sample packets; return -1 if they differ anywhere, or if the JIT isn't
+ * available, in which case filters are left to the interpreter
+ */
+int
+jit_selftest(void) {
+    struct bpf_program  program;
+    pcap_t  *pcap;
+    char    name[32];
+    size_t  i;
+    int     checked = 0, result;
+
+    for (i=0; i<sizeof(selftest_programs)/sizeof(selftest_programs[0]); i++) {
+        snprintf(name, sizeof(name), "program %u", (u_int)i + 1);
+        result = jit_selftest_program(selftest_programs[i].insns,
+            selftest_programs[i].count, name);
+        if (result < 0)
+            return(-1);
+        checked += result;
+    }
+
+    if ((pcap = pcap_open_dead(DLT_EN10MB, 65535)) != NULL) {
+        for (i=0; i<sizeof(selftest_filters)/sizeof(char *); i++) {
+            if (pcap_compile(pcap, &program, selftest_filters[i], 1,
+                PCAP_NETMASK_UNKNOWN) < 0)
+                continue;
+
+            result = jit_selftest_program(program.bf_insns, program.bf_len,
+                selftest_filters[i]);
+            pcap_freecode(&program);
+
+            if (result < 0) {
+                pcap_close(pcap);
+                return(-1);
+            }
+            checked += result;
+        }
+
+        pcap_close(pcap);
+    }
+
+    if (checked == 0) {
+        if (options.debug)
+            fprintf(stderr, "jit_selftest: no filter JIT for this "
+                "architecture\n");
+        return(-1);
+    }
+
+    if (options.debug)
+        fprintf(stderr, "jit_selftest: %d programs agree with the "
+            "interpreter\n", checked);
+
+    return(0);
+}
@@ -50,12 +50,28 @@ struct options options = {
     /* config   = */ NULL,
     /* debug    = */ 0,
     /* detach   = */ 1,
+    /* dispatch_slice = */ 1000,
+    /* drop_threshold = */ 1.0,
     /* dump_file= */ NULL,
+    /* ebpf     = */ 0,
+    /* fanout   = */ FANOUT_HASH,
     /* help     = */ 0,
+    /* history  = */ NULL,
+    /* history_segments = */ 16,
+    /* history_size = */ 64,
+    /* http     = */ NULL,
     /* interval = */ 30,
+    /* jit      = */ 1,
     /* pidfile  = */ NULL,
+    /* push     = */ NULL,
+    /* push_format = */ PUSH_STATSD,
+    /* replay   = */ NULL,
+    /* replay_speed = */ 0,
+    /* shared   = */ 0,
     /* socket   = */ NULL,
+    /* stats_file = */ NULL,
     /* version  = */ 0,
+    /* workers  = */ 0,
 };
 
 
@@ -93,26 +109,114 @@ usage(void) {
         "\n"
         "    -d, --debug [level]\n"
         "        Enable debug mode.\n"
-        "          1: initialization functions, 2: NetSNMP functions,"
-        "          3: AgentX callbacks, 5: report every received packet\n"
+        "          1: initialization functions, 2: AgentX session,"
+        "          3: AgentX PDUs, 5: report every received packet\n"
         "\n"
         "    -D, --detach\n"
         "        Tell the program to detach itself from the terminal and\n"
         "        become a daemon. Use --nodetach to prevent this.\n"
         "\n"
+        "    -t, --drop-threshold percent\n"
+        "        Log a warning when the kernel drops more than the given\n"
+        "        percentage of the packets of a monitor between two exports.\n"
+        "        0 disables the warning. Default: 1\n"
+        "\n"
+        "    -e, --ebpf\n"
+        "        Count the packets in the kernel, with a single eBPF program\n"
+        "        per device evaluating the filters of all its monitors. The\n"
+        "        devices where eBPF can't be used fall back to libpcap.\n"
+        "\n"
         "    -f, --dump-file path\n"
         "        Specify a path to write the stats to, in JSON format.\n"
         "\n"
+        "    -F, --fanout mode\n"
+        "        Specify how the kernel spreads the packets of a device among\n"
+        "        the capture workers: \"hash\" (by flow, the default) or\n"
+        "        \"cpu\" (by receiving CPU, the workers being pinned on the\n"
+        "        CPUs).\n"
+        "\n"
+        "    -l, --history directory\n"
+        "        Append the octets and packets of every monitor since the\n"
+        "        previous export, at each export, to a binary log in the\n"
+        "        given directory, in the layout of nsp-history.h. Query it\n"
+        "        with netsnmp-pcap-history.\n"
+        "\n"
+        "    -L, --history-size megabytes\n"
+        "        Start a new segment of the log after that size. Default: 64\n"
+        "\n"
+        "    -k, --history-segments count\n"
+        "        Remove the oldest segments beyond that count; 0 keeps all\n"
+        "        of them. Default: 16\n"
+        "\n"
+        "    -H, --http [host:]port\n"
+        "        Serve the monitors and the costs of the daemon over HTTP, at\n"
+        "        /metrics, in the OpenMetrics text format. The counters are\n"
+        "        read when scraped, the rates at each export. The host is\n"
+        "        0.0.0.0 when not given; an IPv6 address is put in brackets.\n"
+        "\n"
         "    -i, --interval delay\n"
         "        Specify the interval, in seconds, between exporting the\n"
         "        stats to the AgentX part or writng them on disk. Default: 30\n"
         "\n"
+        "    --jit\n"
+        "        Translate the filters evaluated in userspace, with --shared\n"
+        "        or --replay, into native code on x86-64 and AArch64, after\n"
+        "        checking the translation against the libpcap interpreter on\n"
+        "        sample packets at startup. This is the default; use --nojit\n"
+        "        to always run the interpreter.\n"
+        "\n"
+        "    -m, --stats-file path\n"
+        "        Publish the monitors in a file mapped in memory, such as\n"
+        "        /dev/shm/netsnmp-pcap, in the binary layout of nsp-stats.h.\n"
+        "        The counters are updated every second, the rates and drops\n"
+        "        at each export. Read it with netsnmp-pcap-stats-dump, or\n"
+        "        the functions of libnspstats.\n"
+        "\n"
         "    -p, --pidfile path\n"
         "        Specify the path to a file to write the PID of the daemon.\n"
         "\n"
+        "    -u, --push address\n"
+        "        Push the octets, packets and drops of each monitor since the\n"
+        "        previous export, at each export, to a datagram socket:\n"
+        "        udp:host:port or unix:path. The lines are packed into as\n"
+        "        few datagrams as they fit in, sent together.\n"
+        "\n"
+        "    -P, --push-format format\n"
+        "        Specify the format of the pushed lines: \"statsd\" (the\n"
+        "        default) or \"influx\", the line protocol of InfluxDB.\n"
+        "\n"
+        "    -r, --replay file\n"
+        "        Replay a capture file through the monitors, using the same\n"
+        "        filters and counting code as live captures, then print the\n"
+        "        throughput and the counters of each monitor, and exit.\n"
+        "\n"
+        "    -R, --replay-speed factor\n"
+        "        Replay the packets at the given multiple of the speed they\n"
+        "        were captured at. Default: 0, as fast as possible.\n"
+        "\n"
+        "    -s, --shared\n"
+        "        Open a single capture handle per device, shared by all the\n"
+        "        monitors on that device, and evaluate their filters in\n"
+        "        userspace instead of opening one handle per monitor; the\n"
+        "        filters of a device are merged into a single classifier,\n"
+        "        which checks what they have in common once per packet.\n"
+        "\n"
+        "    -S, --dispatch-slice usec\n"
+        "        Specify the time, in microseconds, a capture handle may use\n"
+        "        per wakeup. The number of packets read per wakeup and the\n"
+        "        delay before polling an idle handle again adapt to the load\n"
+        "        within that limit. 0 reads everything available on each\n"
+        "        wakeup. Default: 1000\n"
+        "\n"
+        "    -w, --workers count\n"
+        "        Specify the number of capture threads. Each one opens its\n"
+        "        own handles, which join a PACKET_FANOUT group per capture.\n"
+        "        Default: 0, capture in the main thread.\n"
+        "\n"
         "    -x, --socket address\n"
-        "        Specify an address to use as AgentX socket. See the manual\n"
-        "        page of snmpd, section \"LISTENING ADDRESSES\".\n"
+        "        Specify the address of the AgentX master agent: a Unix\n"
+        "        socket path, optionally prefixed by \"unix:\", or\n"
+        "        tcp:host:port. Default: /var/agentx/master\n"
         "\n"
         "  Help options:\n"
         "    -h, --help\n"
@@ -134,7 +238,8 @@ main(int argc, char **argv) {
     int optind = 0;
 
     /* options definition */
-    const char short_options[] = "B:c:d::Df:hi:p:Vx:";
+    const char short_options[] =
+        "B:c:d::Def:F:hH:i:k:l:L:m:p:P:r:R:sS:t:u:Vw:x:";
     static struct option long_options[] = {
         { "help",       no_argument,        &options.help, 1 },
         { "usage",      no_argument,        &options.help, 1 },
@@ -146,10 +251,27 @@ main(int argc, char **argv) {
         { "nodaemon",   no_argument,        &options.detach, 0 },
         { "base-oid",   required_argument,  NULL, 'B' },
         { "config",     required_argument,  NULL, 'c' },
+        { "dispatch-slice", required_argument, NULL, 'S' },
+        { "drop-threshold", required_argument, NULL, 't' },
         { "dump-file",  required_argument,  NULL, 'f' },
+        { "ebpf",       no_argument,        NULL, 'e' },
+        { "fanout",     required_argument,  NULL, 'F' },
+        { "history",    required_argument,  NULL, 'l' },
+        { "history-segments", required_argument, NULL, 'k' },
+        { "history-size", required_argument, NULL, 'L' },
+        { "http",       required_argument,  NULL, 'H' },
         { "interval",   required_argument,  NULL, 'i' },
+        { "jit",        no_argument,        &options.jit, 1 },
+        { "nojit",      no_argument,        &options.jit, 0 },
         { "pidfile",    required_argument,  NULL, 'p' },
+        { "push",       required_argument,  NULL, 'u' },
+        { "push-format", required_argument, NULL, 'P' },
+        { "replay",     required_argument,  NULL, 'r' },
+        { "replay-speed", required_argument, NULL, 'R' },
+        { "shared",     no_argument,        NULL, 's' },
         { "socket",     required_argument,  NULL, 'x' },
+        { "stats-file", required_argument,  NULL, 'm' },
+        { "workers",    required_argument,  NULL, 'w' },
         { NULL,         0,                  NULL, 0 }
     };
 
@@ -179,23 +301,105 @@ main(int argc, char **argv) {
                 options.detach = 1;
                 break;
 
+            case 'e': /* --ebpf */
+                options.ebpf = 1;
+                break;
+
             case 'f': /* --dump-file */
                 options.dump_file = strdup(optarg);
                 break;
 
+            case 'F': /* --fanout */
+                if (strcmp(optarg, "hash") == 0)
+                    options.fanout = FANOUT_HASH;
+                else if (strcmp(optarg, "cpu") == 0)
+                    options.fanout = FANOUT_CPU;
+                else {
+                    fprintf(stderr, PROGRAM ": unknown fanout mode '%s'\n",
+                        optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
             case 'h': /* --help */
                 options.help = 1;
                 break;
 
+            case 'l': /* --history */
+                options.history = strdup(optarg);
+                break;
+
+            case 'k': /* --history-segments */
+                options.history_segments = atoi(optarg);
+                break;
+
+            case 'L': /* --history-size */
+                options.history_size = atoi(optarg);
+                if (options.history_size < 1)
+                    options.history_size = 1;
+                break;
+
+            case 'H': /* --http */
+                options.http = strdup(optarg);
+                break;
+
             case 'i': /* --interval */
                 if (optarg != NULL)
                     options.interval = atoi(optarg);
                 break;
 
+            case 'm': /* --stats-file */
+                options.stats_file = strdup(optarg);
+                break;
+
             case 'p': /* --pidfile */
                 options.config = strdup(optarg);
                 break;
 
+            case 'P': /* --push-format */
+                if (strcmp(optarg, "statsd") == 0)
+                    options.push_format = PUSH_STATSD;
+                else if (strcmp(optarg, "influx") == 0)
+                    options.push_format = PUSH_INFLUX;
+                else {
+                    fprintf(stderr, PROGRAM ": unknown push format '%s'\n",
+                        optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'u': /* --push */
+                options.push = strdup(optarg);
+                break;
+
+            case 'r': /* --replay */
+                options.replay = strdup(optarg);
+                break;
+
+            case 'R': /* --replay-speed */
+                if (optarg != NULL)
+                    options.replay_speed = atof(optarg);
+                break;
+
+            case 's': /* --shared */
+                options.shared = 1;
+                break;
+
+            case 'w': /* --workers */
+                if (optarg != NULL)
+                    options.workers = atoi(optarg);
+                break;
+
+            case 'S': /* --dispatch-slice */
+                if (optarg != NULL)
+                    options.dispatch_slice = atoi(optarg);
+                break;
+
+            case 't': /* --drop-threshold */
+                if (optarg != NULL)
+                    options.drop_threshold = atof(optarg);
+                break;
+
             case 'x': /* --socket */
                 options.socket = strdup(optarg);
                 break;
@@ -220,6 +424,13 @@ main(int argc, char **argv) {
     if (options.config == NULL)
         options.config = DEFAULT_CONFIG_PATH;
 
+    /* a replay runs in the foreground, through a single handle */
+    if (options.replay != NULL) {
+        options.detach = 0;
+        options.ebpf = 0;
+        options.workers = 0;
+    }
+
     /* become a daemon */
     if (options.detach) {
 
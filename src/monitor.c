@@ -36,9 +36,9 @@
  * DAMAGE.
  */
 
-#include <assert.h>
 #include <errno.h>
 #include <pcap.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -46,31 +46,93 @@
 #include <sys/types.h>
 
 #include "netsnmp-pcap.h"
-#include "bsnmp-snmpmod-listmgmt.h"
 
 
 #define ETHERNET_HEADER_LENGTH  14
-#define SNAP_LENGTH             48
-#define MAX_DEFINITIONS         64
+#define MAX_INDEX               0x7fffffff     /* SNMP INTEGER */
 
+#define DEFAULT_FLOW_TIMEOUT    60
+#define DEFAULT_FLOW_TOP        10
+#define MAX_FLOW_TOP            1000
+#define DEFAULT_HITTER_TOP      10
+#define MAX_HITTER_TOP          1000
 
+#define ETHERNET_FCS_LENGTH     4
 
-/* list of monitors */
+/* the fields read for every packet must stay on the first cache line */
+_Static_assert(offsetof(struct monitor, filter_bpf) <= CACHE_LINE_SIZE,
+    "the per-packet fields of struct monitor exceed a cache line");
+
+
+/* lowest sizes of the buckets of the histograms, by kind; RMON counts the
+   frame check sequence, which pcap doesn't capture */
+static const uint32_t rmon_bounds[] = {
+    0, 64, 65, 128, 256, 512, 1024, 1519
+};
+
+static const uint32_t pow2_bounds[] = {
+    0, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384
+};
+
+
+
+/* list of monitors, sorted by index */
 struct monitor_list monitors = TAILQ_HEAD_INITIALIZER(monitors);
 
+/* the same, in an array for the lookups by index */
+struct monitor **monitor_table = NULL;
+
 /* number of monitors */
 int monitor_count = 0;
 
+/* monitor definitions read from the config file, found by index with an
+   open addressing hash table while it's parsed */
+struct definition_set {
+    struct monitor_definition **defs;
+    uint32_t    *slots;             /* positions in defs + 1, 0 if free */
+    uint32_t    count;
+    uint32_t    size;               /* of slots, twice that of defs */
+};
+
+
+/*
+ * monitor_size_bucket()
+ * -------------------
+ * find the bucket of a packet size in a histogram
+ */
+static inline int
+monitor_size_bucket(int kind, uint32_t len) {
+    if (kind == SIZES_RMON) {
+        len += ETHERNET_FCS_LENGTH;
+        if (len < 64)
+            return(0);
+        if (len == 64)
+            return(1);
+        if (len > 1518)
+            return(7);
+        return(27 - __builtin_clz(len));
+    }
+
+    if (len < 64)
+        return(0);
+    if (len >= 16384)
+        return(9);
+    return(26 - __builtin_clz(len));
+}
+
 
 /*
  * monitor_packet()
  * --------------
- * callback function for handling received packets, invoked by pcap_dispatch()
+ * account a received packet which matched the monitor filter, invoked by
+ * capture_packet()
  */
-static void
-monitor_packet(u_char *arg, const struct pcap_pkthdr *header,
-    const u_char *bytes) {
-    struct monitor *mon = (struct monitor*)arg;
+void
+monitor_packet(struct monitor *mon, int worker,
+    const struct pcap_pkthdr *header, const u_char *bytes) {
+    struct monitor_counters *counters = &mon->counters[worker];
+    struct flow_key key;
+    uint64_t        hash;
 
     /* skip short packets */
     if (header->len < ETHERNET_HEADER_LENGTH)
@@ -80,41 +142,122 @@ monitor_packet(u_char *arg, const struct pcap_pkthdr *header,
         fprintf(stderr, "monitor_packet: received packet on %s matching "
             "filter <%s>\n", mon->device, mon->filter);
 
-    mon->seen_octets  += header->len - ETHERNET_HEADER_LENGTH;
-    mon->seen_packets += 1;
+    COUNTER_ADD(counters->octets, header->len - ETHERNET_HEADER_LENGTH);
+    COUNTER_ADD(counters->packets, 1);
+
+    if (mon->sizes != SIZES_NONE)
+        COUNTER_ADD(counters->sizes[monitor_size_bucket(mon->sizes,
+            header->len)], 1);
+
+    rate_update(mon->rates[worker], header->ts.tv_sec,
+        header->len - ETHERNET_HEADER_LENGTH);
+
+    /* the flows, the heavy hitters and the distinct counts need the
+       5-tuple */
+    if ((mon->flows == NULL && mon->sketches == NULL && mon->hlls == NULL)
+        || flow_parse(header, bytes, &key, &hash) < 0)
+        return;
+
+    if (mon->flows != NULL)
+        flow_update(mon->flows[worker], &key, hash,
+            header->len - ETHERNET_HEADER_LENGTH, header->ts.tv_sec);
+
+    if (mon->sketches != NULL)
+        sketch_update(mon->sketches[worker], &key,
+            header->len - ETHERNET_HEADER_LENGTH);
+
+    if (mon->hlls != NULL)
+        hll_update(mon->hlls[worker], &key, hash);
 }
 
 
 /*
- * monitor_io()
- * ----------
- * callback function invoked by libevent when there are incoming data in
- * the watched socket
+ * monitor_totals()
+ * --------------
+ * sum the octets and packets counters of every worker into the fields
+ * served over SNMP
  */
-static void
-monitor_io(evutil_socket_t fd, short what, void *arg) {
-    struct monitor *mon = (struct monitor*)arg;
-    int n;
+void
+monitor_totals(struct monitor *mon) {
+    uint64_t    octets = 0, packets = 0;
+    int         i;
+
+    /* the counters of a monitor counted in the kernel are read from the
+       eBPF map */
+    if (mon->ebpf != NULL) {
+        if (ebpf_read(mon, &octets, &packets) == 0) {
+            mon->seen_octets  = octets;
+            mon->seen_packets = packets;
+        }
+        return;
+    }
 
-    n = pcap_dispatch(mon->pcap, -1, monitor_packet, (u_char *)mon);
+    for (i=0; i<worker_count; i++) {
+        octets  += COUNTER_GET(mon->counters[i].octets);
+        packets += COUNTER_GET(mon->counters[i].packets);
+    }
 
-    if (n < 0) {
-        syslog(_LOGERR_"pcap_dispatch: %s", pcap_geterr(mon->pcap));
+    mon->seen_octets  = octets;
+    mon->seen_packets = packets;
+}
+
+
+/*
+ * monitor_collect()
+ * ---------------
+ * sum the counters of every worker into the fields served over SNMP
+ */
+void
+monitor_collect(struct monitor *mon) {
+    uint64_t    sizes;
+    uint32_t    b;
+    int         i;
+
+    monitor_totals(mon);
+
+    if (mon->ebpf != NULL)
         return;
+
+    for (b=0; b<mon->size_bucket_count; b++) {
+        sizes = 0;
+        for (i=0; i<worker_count; i++)
+            sizes += COUNTER_GET(mon->counters[i].sizes[b]);
+        mon->seen_sizes[b] = sizes;
     }
+
+    flow_collect(mon);
+    sketch_collect(mon);
+}
+
+
+/*
+ * monitor_interval()
+ * ----------------
+ * end the interval of the distinct counts and of the rates, and compute
+ * them; invoked once per export
+ */
+void
+monitor_interval(struct monitor *mon) {
+    hll_collect(mon);
+    rate_collect(mon);
 }
 
 
 /*
  * monitor_free()
  * ------------
- * deallocate a monitor
+ * deallocate a monitor; monitor_sort() then rebuilds the table of the
+ * lookups by index
  */
 static void
 monitor_free(struct monitor *mon) {
-    if (mon != NULL)
+    if (mon == NULL)
         return;
 
+    /* release its capture handle or eBPF program */
+    capture_detach(mon);
+    ebpf_detach(mon);
+
     /* deallocate each field */
     if (mon->description != NULL)
         free(mon->description);
@@ -128,13 +271,15 @@ monitor_free(struct monitor *mon) {
     if (mon->filter_valid)
         pcap_freecode(&mon->filter_bpf);
 
-    if (mon->watcher != NULL) {
-        event_del(mon->watcher);
-        event_free(mon->watcher);
-    }
+    jit_free(mon->filter_jit);
+
+    if (mon->counters != NULL)
+        free(mon->counters);
 
-    if (mon->pcap != NULL)
-        pcap_close(mon->pcap);
+    flow_free(mon);
+    sketch_free(mon);
+    hll_free(mon);
+    rate_free(mon);
 
     /* remove the monitor from the list */
     TAILQ_REMOVE(&monitors, mon, link);
@@ -145,106 +290,147 @@ monitor_free(struct monitor *mon) {
 }
 
 
+/*
+ * monitor_device()
+ * --------------
+ * return the device of a monitor definition, or the default one
+ */
+static const char *
+monitor_device(const struct monitor_definition *mondef) {
+    static char *default_device = NULL;
+    char    errbuf[PCAP_ERRBUF_SIZE];
+    char    *device;
+
+    if ((mondef->device != NULL) && (strlen(mondef->device) > 0))
+        return(mondef->device);
+
+    /* look it up only once, so that it stays the same across reloads */
+    if (default_device == NULL) {
+        device = pcap_lookupdev(errbuf);
+        if (device == NULL) {
+            syslog(_LOGWARN_"pcap_lookupdev: %s", errbuf);
+            syslog(_LOGWARN_"trying with interface \"any\"");
+            device = "any";
+        }
+        default_device = strdup(device);
+    }
+
+    return(default_device);
+}
+
+
 /*
  * monitor_new()
  * -----------
- * allocate and initialize a monitor from a monitor definition,
- * and associate it with a libevent watcher
+ * allocate and initialize a monitor from a monitor definition, taking
+ * its strings, and attach it to a capture handle if asked to
  */
 static struct monitor *
-monitor_new(struct monitor_definition *mondef, struct event_base *ev_base) {
+monitor_new(struct monitor_definition *mondef, int attach) {
     struct monitor  *mon;
-    char    errbuf[PCAP_ERRBUF_SIZE];
-    int     fd;
+    const char      *device;
 
-    /* allocate memory for the monitor */
-    mon = calloc(1, sizeof(struct monitor));
-    if (mon == NULL) {
-        syslog(_LOGERR_"couldn't allocate monitor: %s", strerror(errno));
+    /* allocate memory for the monitor, with the fields read for every
+       packet on the first cache line */
+    if (posix_memalign((void **)&mon, CACHE_LINE_SIZE,
+        sizeof(struct monitor)) != 0) {
+        syslog(_LOGERR_"couldn't allocate monitor");
         return(NULL);
     }
 
-    /* insert it into the monitors list */
+    memset(mon, 0, sizeof(struct monitor));
+
+    /* append it to the monitors list, which monitor_sort() puts back
+       in order once the whole config is applied */
     mon->index = mondef->index;
-    INSERT_OBJECT_INT(mon, &monitors);
+    TAILQ_INSERT_TAIL(&monitors, mon, link);
     monitor_count++;
 
-    /* populate the monitor fields */
-    if (mondef->description != NULL)
-        mon->description = mondef->description;
-
-    if ((mondef->device != NULL) && (strlen(mondef->device) > 0))
-        mon->device = mondef->device;
-    else {
-        mon->device = pcap_lookupdev(errbuf);
-        if (mon->device == NULL) {
-            syslog(_LOGWARN_"pcap_lookupdev: %s", errbuf);
-            syslog(_LOGWARN_"trying with interface \"any\"");
-            mon->device = "any";
-        }
+    /* allocate the counters of each worker */
+    if (posix_memalign((void **)&mon->counters, CACHE_LINE_SIZE,
+        worker_count * sizeof(struct monitor_counters)) != 0) {
+        syslog(_LOGERR_"couldn't allocate monitor counters");
+        monitor_free(mon);
+        return(NULL);
     }
 
-    if (mondef->filter != NULL)
-        mon->filter = mondef->filter;
+    memset(mon->counters, 0, worker_count * sizeof(struct monitor_counters));
 
-    /* create the pcap handle */
-    assert(mon->device);
-    mon->pcap = pcap_open_live(mon->device, SNAP_LENGTH, 1, 100, errbuf);
-    if (mon->pcap == NULL) {
-        syslog(_LOGERR_"couldn't open monitor on %s: %s", mon->device, errbuf);
+    /* and their rings of per-second rates */
+    if (rate_init(mon, options.interval) < 0) {
         monitor_free(mon);
         return(NULL);
     }
 
-    /* if there's a filter.. */
-    if ((mon->filter != NULL) && (strlen(mon->filter) > 0)) {
-        /* compile it */
-        if (pcap_compile(mon->pcap, &mon->filter_bpf, mon->filter, 1, 0) < 0) {
-            syslog(_LOGERR_"couldn't compile monitor filter: %s",
-                pcap_geterr(mon->pcap));
-            monitor_free(mon);
-            return(NULL);
-        }
+    /* populate the monitor fields */
+    mon->config = *mondef;
+    mon->config.description = mon->config.device = NULL;
+    mon->config.filter = NULL;
 
-        mon->filter_valid = 1;
+    mon->description = mondef->description;
+    mondef->description = NULL;
 
-        /* associate it to the pcap handle */
-        if (pcap_setfilter(mon->pcap, &mon->filter_bpf) < 0) {
-            syslog(_LOGERR_"couldn't setup monitor filter: %s",
-                pcap_geterr(mon->pcap));
+    if ((device = monitor_device(mondef)) == mondef->device) {
+        mon->device = mondef->device;
+        mondef->device = NULL;
+    }
+    else
+        mon->device = strdup(device);
+
+    mon->filter = mondef->filter;
+    mondef->filter = NULL;
+
+    mon->ring = mondef->ring;
+
+    /* allocate the flow tables */
+    if (mondef->flows > 0) {
+        if (mondef->flow_top > MAX_FLOW_TOP) {
+            syslog(_LOGWARN_"only reporting the top %d flows of monitor %u",
+                MAX_FLOW_TOP, mon->index);
+            mondef->flow_top = MAX_FLOW_TOP;
+        }
+
+        if (flow_init(mon, mondef->flows, (mondef->flow_timeout
+            ? mondef->flow_timeout : DEFAULT_FLOW_TIMEOUT), (mondef->flow_top
+            ? mondef->flow_top : DEFAULT_FLOW_TOP)) < 0) {
             monitor_free(mon);
             return(NULL);
         }
     }
 
-    /* set the pcap handle in non-block mode */
-    if (pcap_setnonblock(mon->pcap, 1, errbuf) < 0) {
-        syslog(_LOGERR_"couldn't set monitor in non-block mode: %s", errbuf);
-        monitor_free(mon);
-        return(NULL);
+    /* allocate the heavy hitter summaries */
+    if (mondef->hitters > 0 && mondef->hitter_top > MAX_HITTER_TOP) {
+        syslog(_LOGWARN_"only reporting the top %d heavy hitters of "
+            "monitor %u", MAX_HITTER_TOP, mon->index);
+        mondef->hitter_top = MAX_HITTER_TOP;
     }
 
-    /* get a selectable file descriptor */
-    fd = pcap_get_selectable_fd(mon->pcap);
-    if (fd < 0) {
-        syslog(_LOGERR_"couldn't get a selectable file descriptor: %s",
-            pcap_geterr(mon->pcap));
+    if (mondef->hitters > 0 && sketch_init(mon, mondef->hitters,
+        (mondef->hitter_top ? mondef->hitter_top : DEFAULT_HITTER_TOP)) < 0) {
         monitor_free(mon);
         return(NULL);
     }
 
-    /* create and activate the libevent watcher associated with
-       the pcap handle */
-    mon->watcher = event_new(ev_base, fd, EV_READ|EV_PERSIST,
-        monitor_io, (void *)mon);
-    if (mon->watcher == NULL) {
-        syslog(_LOGERR_"couldn't create a watcher for a pcap handle");
+    /* select the buckets of the size histogram */
+    mon->sizes = mondef->sizes;
+    if (mon->sizes == SIZES_RMON) {
+        mon->size_bounds = rmon_bounds;
+        mon->size_bucket_count = sizeof(rmon_bounds) / sizeof(uint32_t);
+    }
+    else if (mon->sizes == SIZES_POW2) {
+        mon->size_bounds = pow2_bounds;
+        mon->size_bucket_count = sizeof(pow2_bounds) / sizeof(uint32_t);
+    }
+
+    /* allocate the registers of the distinct counts */
+    if (mondef->distinct > 0 && hll_init(mon, mondef->distinct) < 0) {
         monitor_free(mon);
         return(NULL);
     }
 
-    if (event_add(mon->watcher, NULL) < 0) {
-        syslog(_LOGERR_"couldn't activate a watcher for a pcap handle");
+    /* open or share the pcap handle; with --ebpf, the monitors are
+       attached by device once they're all created */
+    if (mon->device == NULL || (attach && capture_attach(mon) < 0)) {
         monitor_free(mon);
         return(NULL);
     }
@@ -254,27 +440,208 @@ monitor_new(struct monitor_definition *mondef, struct event_base *ev_base) {
 
 
 /*
- * monitor_parse_config()
- * --------------------
+ * monitor_attach_ebpf()
+ * -------------------
+ * count the monitors of each device with a single eBPF program, and fall
+ * back to capture handles on the devices where eBPF can't be used
  */
-void
-monitor_parse_config(const char *path, struct event_base *ev_base) {
-    struct monitor_definition **defs;
+static void
+monitor_attach_ebpf(void) {
+    struct monitor  *mon, *other, **group, **fallback;
+    int     count, fallback_count = 0, i;
+
+    group = calloc(monitor_count, sizeof(struct monitor *));
+    fallback = calloc(monitor_count, sizeof(struct monitor *));
+    if (group == NULL || fallback == NULL) {
+        syslog(_LOGERR_"couldn't allocate monitor list: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    TAILQ_FOREACH(mon, &monitors, link) {
+        /* skip the devices already handled */
+        for (other = TAILQ_FIRST(&monitors); other != mon;
+            other = TAILQ_NEXT(other, link)) {
+            if (strcmp(other->device, mon->device) == 0)
+                break;
+        }
+        if (other != mon)
+            continue;
+
+        /* gather the monitors of this device; those with a flow table,
+           heavy hitters, distinct counts or a size histogram need the
+           packets in userspace */
+        count = 0;
+        for (other = mon; other != NULL; other = TAILQ_NEXT(other, link)) {
+            if (strcmp(other->device, mon->device) != 0)
+                continue;
+            if (other->flows != NULL || other->sketches != NULL
+                || other->hlls != NULL || other->sizes != SIZES_NONE)
+                fallback[fallback_count++] = other;
+            else
+                group[count++] = other;
+        }
+
+        if (count == 0)
+            continue;
+
+        if (ebpf_attach(group, count) == 0) {
+            if (options.debug)
+                fprintf(stderr, "monitor_attach_ebpf: %d monitor(s) counted "
+                    "in the kernel on %s\n", count, mon->device);
+            continue;
+        }
+
+        syslog(_LOGWARN_"falling back to libpcap for the monitors on %s",
+            mon->device);
+        memcpy(&fallback[fallback_count], group,
+            count * sizeof(struct monitor *));
+        fallback_count += count;
+    }
+
+    for (i=0; i<fallback_count; i++) {
+        if (capture_attach(fallback[i]) < 0)
+            monitor_free(fallback[i]);
+    }
+
+    free(group);
+    free(fallback);
+}
+
+
+/*
+ * monitor_definition()
+ * ------------------
+ * find the definition of the given monitor index in a set, or add it;
+ * the hash table is kept at most half full, and the array of definitions
+ * has room for a NULL at the end
+ */
+static struct monitor_definition *
+monitor_definition(struct definition_set *set, uint32_t index) {
+    struct monitor_definition **defs, *def;
+    uint32_t    *slots, size, slot, i;
+
+    slot = (index * 0x9e3779b1U) & (set->size - 1);
+    for (; set->slots[slot] != 0; slot = (slot + 1) & (set->size - 1)) {
+        if (set->defs[set->slots[slot] - 1]->index == index)
+            return(set->defs[set->slots[slot] - 1]);
+    }
+
+    /* grow the set, and hash the definitions again */
+    if (2 * (set->count + 2) > set->size) {
+        size = set->size * 2;
+        defs = realloc(set->defs, size / 2 * sizeof(void*));
+        slots = calloc(size, sizeof(uint32_t));
+        if (defs == NULL || slots == NULL) {
+            syslog(_LOGERR_"couldn't allocate monitor definitions: %s",
+                strerror(errno));
+            if (defs != NULL)
+                set->defs = defs;
+            free(slots);
+            return(NULL);
+        }
+
+        for (i=0; i<set->count; i++) {
+            slot = (defs[i]->index * 0x9e3779b1U) & (size - 1);
+            while (slots[slot] != 0)
+                slot = (slot + 1) & (size - 1);
+            slots[slot] = i + 1;
+        }
+
+        free(set->slots);
+        set->defs = defs;
+        set->slots = slots;
+        set->size = size;
+
+        slot = (index * 0x9e3779b1U) & (size - 1);
+        while (slots[slot] != 0)
+            slot = (slot + 1) & (size - 1);
+    }
+
+    if ((def = calloc(1, sizeof(struct monitor_definition))) == NULL) {
+        syslog(_LOGERR_"couldn't allocate monitor definition: %s",
+            strerror(errno));
+        return(NULL);
+    }
+
+    def->index = index;
+    set->defs[set->count++] = def;
+    set->slots[slot] = set->count;
+
+    return(def);
+}
+
+
+/*
+ * monitor_definition_compare()
+ * --------------------------
+ * qsort() callback, ordering monitor definitions by index
+ */
+static int
+monitor_definition_compare(const void *a, const void *b) {
+    const struct monitor_definition *x = *(struct monitor_definition **)a;
+    const struct monitor_definition *y = *(struct monitor_definition **)b;
+
+    return((x->index > y->index) - (x->index < y->index));
+}
+
+
+/*
+ * monitor_free_definitions()
+ * ------------------------
+ * deallocate monitor definitions, and the fields not taken by a monitor
+ */
+static void
+monitor_free_definitions(struct monitor_definition **defs) {
+    int i;
+
+    for (i=0; defs[i] != NULL; i++) {
+        free(defs[i]->description);
+        free(defs[i]->device);
+        free(defs[i]->filter);
+        free(defs[i]);
+    }
+
+    free(defs);
+}
+
+
+/*
+ * monitor_read_config()
+ * -------------------
+ * parse the config file into monitor definitions, sorted by index and
+ * ended by NULL; return NULL if it can't be read
+ */
+static struct monitor_definition **
+monitor_read_config(const char *path) {
+    struct definition_set   set;
+    struct monitor_definition **defs, *def;
     FILE        *fh;
     char        line[1025];
-    char        *token, *suboid;
+    char        *token, *suboid, *end;
+    unsigned long   value;
     uint32_t    index;
     int         i = 0;
 
     if (options.debug)
-        fprintf(stderr, "monitor_parse_config: path=%s\n", path);
+        fprintf(stderr, "monitor_read_config: path=%s\n", path);
 
     if ((fh = fopen(path, "r")) == NULL) {
         syslog(_LOGERR_"can't read file '%s': %s", path, strerror(errno));
-        return;
+        return(NULL);
     }
 
-    defs = calloc(MAX_DEFINITIONS, sizeof(void*));
+    set.count = 0;
+    set.size = 64;
+    set.defs = malloc(set.size / 2 * sizeof(void*));
+    set.slots = calloc(set.size, sizeof(uint32_t));
+    if (set.defs == NULL || set.slots == NULL) {
+        syslog(_LOGERR_"couldn't allocate monitor definitions: %s",
+            strerror(errno));
+        free(set.defs);
+        free(set.slots);
+        fclose(fh);
+        return(NULL);
+    }
 
     while (fgets(line, 1024, fh)) {
         i++;
@@ -293,12 +660,16 @@ monitor_parse_config(const char *path, struct event_base *ev_base) {
             syslog(_LOGERR_"parse error on line %d", i);
             continue;
         }
-        index = atoi(token);
-        if (index <= 0) {
+        /* check the range before narrowing; strtoul() accepts a sign */
+        errno = 0;
+        value = strtoul(token, &end, 10);
+        if (token[0] == '-' || errno == ERANGE || *end != '\0'
+            || value == 0 || value > MAX_INDEX) {
             syslog(_LOGERR_"parse error on line %d: index must be "
-                "a positive integer", i);
+                "a positive integer up to %d", i, MAX_INDEX);
             continue;
         }
+        index = value;
 
         /* extract the value */
         if ((token = strtok(NULL, "\"")) == NULL) {
@@ -312,50 +683,305 @@ monitor_parse_config(const char *path, struct event_base *ev_base) {
             }
         }
 
-        /* allocate a monitor definition if needed */
-        if (defs[index-1] == NULL)
-            defs[index-1] = calloc(1, sizeof(struct monitor_definition));
+        /* find the monitor definition, or allocate it */
+        if ((def = monitor_definition(&set, index)) == NULL)
+            goto fail;
 
         /* fill up the fields */
-        defs[index-1]->index = index;
-
         if (strstr(suboid+4, "Descr") != NULL)
-            defs[index-1]->description = strdup(token);
+            def->description = strdup(token);
 
         if (strstr(suboid+4, "Device") != NULL)
-            defs[index-1]->device = strdup(token);
+            def->device = strdup(token);
 
         if (strstr(suboid+4, "Filter") != NULL)
-            defs[index-1]->filter = strdup(token);
+            def->filter = strdup(token);
+
+        if (strstr(suboid+4, "RingBlocks") != NULL)
+            def->ring.blocks = strtoul(token, NULL, 10);
+
+        if (strstr(suboid+4, "RingBlockSize") != NULL)
+            def->ring.block_size = strtoul(token, NULL, 10);
+
+        if (strstr(suboid+4, "RingTimeout") != NULL)
+            def->ring.timeout = strtoul(token, NULL, 10);
+
+        if (strstr(suboid+4, "Flows") != NULL)
+            def->flows = strtoul(token, NULL, 10);
+
+        if (strstr(suboid+4, "FlowTimeout") != NULL)
+            def->flow_timeout = strtoul(token, NULL, 10);
+
+        if (strstr(suboid+4, "FlowTop") != NULL)
+            def->flow_top = strtoul(token, NULL, 10);
+
+        if (strstr(suboid+4, "HeavyHitters") != NULL)
+            def->hitters = strtoul(token, NULL, 10);
+
+        if (strstr(suboid+4, "HeavyHitterTop") != NULL)
+            def->hitter_top = strtoul(token, NULL, 10);
+
+        if (strstr(suboid+4, "Distinct") != NULL)
+            def->distinct = strtoul(token, NULL, 10);
+
+        if (strstr(suboid+4, "SizeHistogram") != NULL) {
+            if (strcmp(token, "rmon") == 0)
+                def->sizes = SIZES_RMON;
+            else if (strcmp(token, "pow2") == 0)
+                def->sizes = SIZES_POW2;
+            else if (strcmp(token, "none") != 0)
+                syslog(_LOGERR_"parse error on line %d: size histogram "
+                    "must be \"rmon\", \"pow2\" or \"none\"", i);
+        }
 
     }
 
-    for (i=0; i<MAX_DEFINITIONS; i++) {
-        struct monitor * m;
+    fclose(fh);
+    free(set.slots);
 
-        if (defs[i] == NULL)
-            continue;
+    /* sort them, and end them with NULL */
+    qsort(set.defs, set.count, sizeof(void*), monitor_definition_compare);
+    defs = set.defs;
+    defs[set.count] = NULL;
 
+    for (i=0; defs[i] != NULL; i++) {
         if (options.debug)
             fprintf(stderr,
-                "monitor_parse_config: parsed the following definition:\n"
-                " - index=%d, device=<%s>\n"
+                "monitor_read_config: parsed the following definition:\n"
+                " - index=%u, device=<%s>\n"
                 " - description: <%s>\n"
-                " - filter: <%s>\n\n",
+                " - filter: <%s>\n"
+                " - ring: blocks=%u, block_size=%u, timeout=%u\n"
+                " - flows: %u, timeout=%u, top=%u\n"
+                " - heavy hitters: %u, top=%u\n"
+                " - distinct counts: precision=%u\n"
+                " - size histogram: %d\n\n",
                 defs[i]->index, defs[i]->device,
-                defs[i]->description, defs[i]->filter);
+                defs[i]->description, defs[i]->filter,
+                defs[i]->ring.blocks, defs[i]->ring.block_size,
+                defs[i]->ring.timeout, defs[i]->flows,
+                defs[i]->flow_timeout, defs[i]->flow_top,
+                defs[i]->hitters, defs[i]->hitter_top,
+                defs[i]->distinct, defs[i]->sizes);
+    }
+
+    return(defs);
+
+  fail:
+    fclose(fh);
+    free(set.slots);
+    set.defs[set.count] = NULL;
+    monitor_free_definitions(set.defs);
+    return(NULL);
+}
+
 
+/*
+ * monitor_same()
+ * ------------
+ * tell if a monitor still matches its definition; only its description
+ * can change without reopening it
+ */
+static int
+monitor_same(const struct monitor *mon, const struct monitor_definition *def) {
+    const struct monitor_definition *old = &mon->config;
+
+    if (strcmp(mon->device, monitor_device(def)) != 0)
+        return(0);
+
+    if (strcmp((mon->filter ? mon->filter : ""),
+        (def->filter ? def->filter : "")) != 0)
+        return(0);
+
+    return(old->ring.blocks == def->ring.blocks
+        && old->ring.block_size == def->ring.block_size
+        && old->ring.timeout == def->ring.timeout
+        && old->flows == def->flows
+        && old->flow_timeout == def->flow_timeout
+        && old->flow_top == def->flow_top
+        && old->hitters == def->hitters
+        && old->hitter_top == def->hitter_top
+        && old->distinct == def->distinct
+        && old->sizes == def->sizes);
+}
+
+
+/*
+ * monitor_compare()
+ * ---------------
+ * qsort() callback, ordering monitors by index
+ */
+static int
+monitor_compare(const void *a, const void *b) {
+    const struct monitor *x = *(struct monitor **)a;
+    const struct monitor *y = *(struct monitor **)b;
+
+    return((x->index > y->index) - (x->index < y->index));
+}
+
+
+/*
+ * monitor_sort()
+ * ------------
+ * put the monitors list back in order after monitors were added or
+ * removed, and rebuild the table of the lookups by index
+ */
+static void
+monitor_sort(void) {
+    struct monitor  **table, *mon;
+    int     sorted = 1, i = 0;
+
+    table = realloc(monitor_table, (monitor_count + 1) * sizeof(void*));
+    if (table == NULL) {
+        syslog(_LOGERR_"couldn't allocate monitor table: %s",
+            strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    monitor_table = table;
+
+    TAILQ_FOREACH(mon, &monitors, link) {
+        if (i > 0 && table[i-1]->index > mon->index)
+            sorted = 0;
+        table[i++] = mon;
+    }
+
+    if (sorted)
+        return;
+
+    qsort(table, monitor_count, sizeof(void*), monitor_compare);
+
+    TAILQ_INIT(&monitors);
+    for (i=0; i<monitor_count; i++)
+        TAILQ_INSERT_TAIL(&monitors, table[i], link);
+}
+
+
+/*
+ * monitor_find()
+ * ------------
+ * return the monitor of the given index, or NULL
+ */
+struct monitor *
+monitor_find(uint32_t index) {
+    struct monitor *mon = monitor_next(index - 1);
+
+    return((mon != NULL && mon->index == index) ? mon : NULL);
+}
+
+
+/*
+ * monitor_next()
+ * ------------
+ * return the monitor with the lowest index above the given one, or NULL;
+ * for the walks of the table, starting from 0
+ */
+struct monitor *
+monitor_next(uint32_t index) {
+    int     low = 0, high = monitor_count, middle;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (monitor_table[middle]->index <= index)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return((low < monitor_count) ? monitor_table[low] : NULL);
+}
+
+
+/*
+ * monitor_parse_config()
+ * --------------------
+ * create the monitors defined in the config file, at startup
+ */
+void
+monitor_parse_config(const char *path) {
+    struct monitor_definition **defs;
+    struct monitor *m;
+    int i;
+
+    if ((defs = monitor_read_config(path)) == NULL)
+        return;
+
+    for (i=0; defs[i] != NULL; i++) {
         /* create the monitor from the given definition */
-        m = monitor_new(defs[i], ev_base);
+        m = monitor_new(defs[i], !options.ebpf);
 
         if (options.debug)
             fprintf(stderr, "monitor_parse_config: monitor was "
                 "%s created\n", ((m != NULL) ? "successfully" : "not"));
-
-        /* deallocate the monitor definition */
-        free(defs[i]);
     }
 
-    free(defs);
+    monitor_free_definitions(defs);
+
+    if (options.ebpf)
+        monitor_attach_ebpf();
+
+    capture_classify_all();
+
+    /* the definitions were sorted, this only builds the table */
+    monitor_sort();
 }
 
+
+/*
+ * monitor_reload()
+ * --------------
+ * parse the config file again, and apply the differences with the
+ * current monitors: those which are gone are closed, those whose device,
+ * filter or settings changed are reopened, the new ones are opened, and
+ * the others keep their capture handles and their counters. invoked on
+ * SIGHUP, with the workers paused. with --ebpf, the eBPF programs of the
+ * kept monitors stay as they are, and the opened ones get capture handles
+ */
+void
+monitor_reload(const char *path) {
+    struct monitor_definition **defs, *def;
+    struct monitor  *mon, *next;
+    int     kept = 0, closed = 0, opened = 0, i = 0;
+
+    if ((defs = monitor_read_config(path)) == NULL) {
+        syslog(_LOGERR_"keeping the current monitors");
+        return;
+    }
+
+    /* both are sorted by index, walk them together */
+    for (mon = TAILQ_FIRST(&monitors); mon != NULL; mon = next) {
+        next = TAILQ_NEXT(mon, link);
+
+        while (defs[i] != NULL && defs[i]->index < mon->index)
+            i++;
+
+        def = (defs[i] != NULL && defs[i]->index == mon->index)
+            ? defs[i] : NULL;
+
+        if (def == NULL || !monitor_same(mon, def)) {
+            closed++;
+            monitor_free(mon);
+            continue;
+        }
+
+        /* kept as is, but for its description */
+        free(mon->description);
+        mon->description = def->description;
+        def->description = NULL;
+        def->index = 0;     /* no monitor to open */
+        kept++;
+    }
+
+    /* open the new and the changed monitors */
+    for (i=0; defs[i] != NULL; i++) {
+        if (defs[i]->index != 0 && monitor_new(defs[i], 1) != NULL)
+            opened++;
+    }
+
+    monitor_free_definitions(defs);
+    capture_classify_all();
+    monitor_sort();
+
+    syslog(LOG_INFO, PROGRAM ": reloaded %s: kept %d monitor(s), closed %d, "
+        "opened %d", path, kept, closed, opened);
+}
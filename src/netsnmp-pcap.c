@@ -33,10 +33,13 @@
  * DAMAGE.
  */
 
+#include <arpa/inet.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/syslog.h>
+#include <time.h>
 
 #include "netsnmp-pcap.h"
 #include "bsnmp-snmpmod-listmgmt.h"
@@ -46,6 +49,22 @@
  */
 static void nsp_exporter_start(struct event_base *ev_base);
 static void nsp_exporter_do(evutil_socket_t fd, short what, void *arg);
+static void nsp_exporter_drops(struct monitor *mon,
+    const struct kernel_stats *kernel);
+static void nsp_exporter_flows(FILE *file, struct monitor *mon);
+static void nsp_exporter_hitters(FILE *file, struct monitor *mon);
+static void nsp_exporter_self(FILE *file);
+static void nsp_exporter_sizes(FILE *file, struct monitor *mon);
+static void nsp_reload(evutil_socket_t signum, short what, void *arg);
+static void nsp_reload_start(struct event_base *ev_base);
+
+
+/* costs of the daemon itself */
+struct self_stats self_stats;
+
+/* when the export timer is expected to fire next, and when it last did */
+static uint64_t export_expected = 0;
+static uint64_t export_last = 0;
 
 
 
@@ -61,11 +80,46 @@ netsnmp_pcap_run(void) {
     /* create the libevent event base */
     ev_base = event_base_new();
 
+    /* allocate the capture workers */
+    worker_init(ev_base);
+
+    /* make sure the filter JIT agrees with the interpreter before
+       using it */
+    if (options.jit && jit_selftest() < 0)
+        options.jit = 0;
+
     /* parse the config file and create the monitors */
-    monitor_parse_config(options.config, ev_base);
+    monitor_parse_config(options.config);
+
+    /* create the stats segment, the socket to push the stats to, and the
+       history log */
+    if (options.stats_file != NULL)
+        stats_open();
+    if (options.push != NULL)
+        push_open();
+    if (options.history != NULL)
+        history_open();
+
+    /* replay a capture file through the monitors, write the stats and
+       stop there */
+    if (options.replay != NULL) {
+        replay_run();
+        nsp_exporter_do(-1, 0, NULL);
+        return;
+    }
+
+    /* start the capture workers threads */
+    worker_start();
 
     /* initialize the stats exporter */
     nsp_exporter_start(ev_base);
+    stats_start(ev_base);
+
+    /* serve the metrics over HTTP */
+    http_start(ev_base);
+
+    /* reload the config file on SIGHUP */
+    nsp_reload_start(ev_base);
 
     /* initialize and start the AgentX handlers */
     nsp_agent_init();
@@ -76,6 +130,63 @@ netsnmp_pcap_run(void) {
 }
 
 
+/*
+ * nsp_clock()
+ * ---------
+ * read the monotonic clock, in microseconds
+ */
+uint64_t
+nsp_clock(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return((uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
+
+/*
+ * nsp_reload_start()
+ * ----------------
+ * set up a signal watcher to reload the config file on SIGHUP
+ */
+static void
+nsp_reload_start(struct event_base *ev_base) {
+    struct event    *signal_watcher;
+
+    signal_watcher = evsignal_new(ev_base, SIGHUP, nsp_reload, NULL);
+    if (signal_watcher == NULL || event_add(signal_watcher, NULL) < 0) {
+        syslog(_LOGERR_"couldn't create the signal watcher to reload the "
+            "config file");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * nsp_reload()
+ * ----------
+ * callback function invoked by libevent on SIGHUP; the workers are paused
+ * while the monitors are reopened, so that their event bases are left
+ * alone, and resumed with the kept monitors as they were
+ */
+static void
+nsp_reload(evutil_socket_t signum, short what, void *arg) {
+    syslog(LOG_INFO, PROGRAM ": reloading %s", options.config);
+
+    if (worker_pause() < 0) {
+        syslog(_LOGERR_"keeping the current monitors");
+        return;
+    }
+
+    monitor_reload(options.config);
+    worker_resume();
+
+    nsp_agent_snapshot();
+    stats_publish(0);
+}
+
+
 /*
  * nsp_exporter_start()
  * ------------------
@@ -111,6 +222,9 @@ nsp_exporter_start(struct event_base *ev_base) {
             "statistics");
         exit(EXIT_FAILURE);
     }
+
+    export_last = nsp_clock();
+    export_expected = export_last + (uint64_t)options.interval * 1000000;
 }
 
 
@@ -123,11 +237,31 @@ nsp_exporter_start(struct event_base *ev_base) {
 static void
 nsp_exporter_do(evutil_socket_t fd, short what, void *arg) {
     struct monitor  *mon;
+    struct dispatch_stats   dispatch;
+    struct kernel_stats     kernel;
+    uint64_t    start, period, calls, packets;
     FILE*   file = NULL;
 
     if (options.debug >= 2)
         fprintf(stderr, "nsp_exporter_start\n");
 
+    /* how late the timer fired; libevent schedules the next one from when
+       this one was due, unless that's already past */
+    start = nsp_clock();
+    period = start - export_last;
+    export_last = start;
+
+    if (export_expected != 0) {
+        self_stats.loop_lag = (start > export_expected
+            ? start - export_expected : 0);
+        if (self_stats.loop_lag > self_stats.loop_lag_max)
+            self_stats.loop_lag_max = self_stats.loop_lag;
+
+        export_expected += (uint64_t)options.interval * 1000000;
+        if (export_expected <= start)
+            export_expected = start + (uint64_t)options.interval * 1000000;
+    }
+
     /* if a dump path was provided, open it */
     if (options.dump_file) {
         if ((file = fopen(options.dump_file, "w")) == NULL) {
@@ -139,29 +273,232 @@ nsp_exporter_do(evutil_socket_t fd, short what, void *arg) {
         fprintf(file, "[\n");
     }
 
+    push_start();
+
     TAILQ_FOREACH(mon, &monitors, link) {
+        /* sum the counters of the workers */
+        monitor_collect(mon);
+        monitor_interval(mon);
+        capture_dispatch_stats(mon, &dispatch);
+        capture_kernel_stats(mon, &kernel);
+        push_monitor(mon, &kernel);
+        nsp_exporter_drops(mon, &kernel);
+
+        /* packets per dispatch and dispatches per second since the last
+           export */
+        calls = dispatch.calls - mon->last_calls;
+        packets = dispatch.packets - mon->last_packets;
+        mon->last_calls = dispatch.calls;
+        mon->last_packets = dispatch.packets;
+
         /* write the stats to the file */
         if (file) {
             fprintf(file, 
                 "  { \"pcapIndex\":%d, \"pcapDescr\":\"%s\","
                 " \"pcapDevice\":\"%s\", \"pcapFilter\":\"%s\","
-                " \"pcapOctets\":%lu, \"pcapPackets\":%lu }",
+                " \"pcapOctets\":%lu, \"pcapPackets\":%lu,"
+                " \"pcapBudget\":%u, \"pcapDelay\":%u,"
+                " \"pcapDispatches\":%lu, \"pcapFullBatches\":%lu,"
+                " \"pcapDeferrals\":%lu, \"pcapDispatchTime\":%lu,"
+                " \"pcapPacketsPerDispatch\":%lu, \"pcapDispatchRate\":%lu",
                 mon->index, mon->description, mon->device,
-                mon->filter, mon->seen_octets, mon->seen_packets
+                mon->filter, mon->seen_octets, mon->seen_packets,
+                dispatch.budget, dispatch.delay, dispatch.calls,
+                dispatch.full, dispatch.deferred, dispatch.time / 1000,
+                (calls > 0 ? packets / calls : 0),
+                (period > 0 ? calls * 1000000 / period : 0)
             );
 
-            /* JSON is picky about trailing commas */
-            if (TAILQ_NEXT(mon, link) == NULL)
-                fputs("\n", file);
-            else
-                fputs(",\n", file);
+            /* the monitors counted in the kernel only have totals, and
+               no capture handle */
+            if (mon->ebpf == NULL)
+                fprintf(file, ", \"pcapRecv\":%lu, \"pcapDrops\":%lu,"
+                    " \"pcapIfDrops\":%lu", kernel.recv, kernel.drop,
+                    kernel.ifdrop);
+
+            if (mon->ebpf == NULL)
+                fprintf(file, ", \"pcapPeakOctetRate\":%lu,"
+                    " \"pcapP50OctetRate\":%lu, \"pcapP95OctetRate\":%lu,"
+                    " \"pcapP99OctetRate\":%lu, \"pcapPeakPacketRate\":%lu,"
+                    " \"pcapP50PacketRate\":%lu, \"pcapP95PacketRate\":%lu,"
+                    " \"pcapP99PacketRate\":%lu",
+                    mon->octet_rates.peak, mon->octet_rates.p50,
+                    mon->octet_rates.p95, mon->octet_rates.p99,
+                    mon->packet_rates.peak, mon->packet_rates.p50,
+                    mon->packet_rates.p95, mon->packet_rates.p99);
+
+            if (mon->hlls != NULL)
+                fprintf(file, ", \"pcapDistinctSources\":%lu,"
+                    " \"pcapDistinctDestinations\":%lu,"
+                    " \"pcapDistinctFlows\":%lu",
+                    mon->distinct[DISTINCT_SOURCES],
+                    mon->distinct[DISTINCT_DESTINATIONS],
+                    mon->distinct[DISTINCT_FLOWS]);
+
+            if (mon->sizes != SIZES_NONE)
+                nsp_exporter_sizes(file, mon);
+
+            if (mon->flows != NULL)
+                nsp_exporter_flows(file, mon);
+
+            if (mon->sketches != NULL)
+                nsp_exporter_hitters(file, mon);
+
+            fputs(" },\n", file);
         }
     }
 
+    /* the values served over SNMP until the next export, and to the
+       readers of the stats segment */
+    nsp_agent_snapshot();
+    stats_publish(1);
+    push_flush();
+    history_record();
+
+    /* the costs of the daemon come last, after the time of this export
+       up to there */
+    self_stats.export_time = nsp_clock() - start;
+    if (self_stats.export_time > self_stats.export_time_max)
+        self_stats.export_time_max = self_stats.export_time;
+
     if (file) {
+        nsp_exporter_self(file);
         fprintf(file, "]\n");
         fclose(file);
     }
 }
 
 
+/*
+ * nsp_exporter_self()
+ * -----------------
+ * write the costs of the daemon itself, as the last JSON object of the
+ * dump, distinguished from those of the monitors by its pcapSelf member
+ */
+static void
+nsp_exporter_self(FILE *file) {
+    fprintf(file,
+        "  { \"pcapSelf\":{ \"pcapLoopLag\":%lu, \"pcapLoopLagMax\":%lu,"
+        " \"pcapExportTime\":%lu, \"pcapExportTimeMax\":%lu,"
+        " \"pcapAgentCalls\":%lu, \"pcapAgentTime\":%lu,"
+        " \"pcapAgentTimeMax\":%lu } }\n",
+        self_stats.loop_lag, self_stats.loop_lag_max,
+        self_stats.export_time, self_stats.export_time_max,
+        self_stats.agent_calls, self_stats.agent_time,
+        self_stats.agent_time_max);
+}
+
+
+/*
+ * nsp_exporter_drops()
+ * ------------------
+ * warn when the kernel dropped more than --drop-threshold percent of the
+ * packets of a monitor since the last export
+ */
+static void
+nsp_exporter_drops(struct monitor *mon, const struct kernel_stats *kernel) {
+    uint64_t    recv = kernel->recv - mon->last_recv;
+    uint64_t    drop = kernel->drop - mon->last_drop;
+
+    mon->last_recv = kernel->recv;
+    mon->last_drop = kernel->drop;
+
+    if (recv == 0 || options.drop_threshold <= 0
+        || drop * 100.0 / recv <= options.drop_threshold)
+        return;
+
+    syslog(_LOGWARN_"monitor %u on %s: the kernel dropped %lu of %lu "
+        "packets (%.2f%%) since the last export", mon->index, mon->device,
+        drop, recv, drop * 100.0 / recv);
+}
+
+
+/*
+ * nsp_exporter_flows()
+ * ------------------
+ * write the top flows of a monitor, as the members of its JSON object
+ */
+static void
+nsp_exporter_flows(FILE *file, struct monitor *mon) {
+    struct flow *flow;
+    char        src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+    uint32_t    i;
+
+    fprintf(file, ", \"pcapFlowEvictions\":%lu, \"pcapFlows\":[",
+        mon->flow_evictions);
+
+    for (i=0; i<mon->top_flow_count; i++) {
+        flow = &mon->top_flows[i];
+        fprintf(file, "%s\n    { \"pcapFlowRank\":%u,"
+            " \"pcapFlowProto\":%u, \"pcapFlowSrcAddr\":\"%s\","
+            " \"pcapFlowSrcPort\":%u, \"pcapFlowDstAddr\":\"%s\","
+            " \"pcapFlowDstPort\":%u, \"pcapFlowOctets\":%lu,"
+            " \"pcapFlowPackets\":%lu }",
+            (i > 0 ? "," : ""), i + 1, flow->key.proto,
+            flow_address(flow->key.src, src, sizeof(src)), flow->key.sport,
+            flow_address(flow->key.dst, dst, sizeof(dst)), flow->key.dport,
+            flow->octets, flow->packets);
+    }
+
+    fputs(" ]", file);
+}
+
+
+/*
+ * nsp_exporter_hitters()
+ * --------------------
+ * write the heavy hitters of a monitor, as the members of its JSON object
+ */
+static void
+nsp_exporter_hitters(FILE *file, struct monitor *mon) {
+    static const char *names[HITTER_KINDS] = {
+        "pcapTopSources", "pcapTopDestinations", "pcapTopPorts"
+    };
+    struct heavy_hitter *hitter;
+    char        value[INET6_ADDRSTRLEN];
+    uint32_t    i;
+    int         kind;
+
+    for (kind=0; kind<HITTER_KINDS; kind++) {
+        fprintf(file, ", \"%s\":[", names[kind]);
+
+        for (i=0; i<mon->hitter_count[kind]; i++) {
+            hitter = &mon->hitters[kind][i];
+            fprintf(file, "%s\n    { \"pcapHitterRank\":%u,"
+                " \"pcapHitterValue\":\"%s\", \"pcapHitterOctets\":%lu }",
+                (i > 0 ? "," : ""), i + 1,
+                sketch_format(kind, hitter, value, sizeof(value)),
+                hitter->octets);
+        }
+
+        fputs(" ]", file);
+    }
+}
+
+
+/*
+ * nsp_exporter_sizes()
+ * ------------------
+ * write the size histogram of a monitor, as a member of its JSON object;
+ * the highest size of the last bucket is 0, as it has none
+ */
+static void
+nsp_exporter_sizes(FILE *file, struct monitor *mon) {
+    uint32_t    b, high;
+
+    fputs(", \"pcapSizes\":[", file);
+
+    for (b=0; b<mon->size_bucket_count; b++) {
+        high = (b + 1 < mon->size_bucket_count ? mon->size_bounds[b + 1] - 1
+            : 0);
+        fprintf(file, "%s\n    { \"pcapSizeBucket\":%u,"
+            " \"pcapSizeLow\":%u, \"pcapSizeHigh\":%u,"
+            " \"pcapSizePackets\":%lu }",
+            (b > 0 ? "," : ""), b + 1, mon->size_bounds[b], high,
+            mon->seen_sizes[b]);
+    }
+
+    fputs(" ]", file);
+}
+
+
@@ -41,6 +41,7 @@
 
 #include <event2/event.h>
 #include <pcap.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <sys/queue.h>
 #include <sys/types.h>
@@ -58,6 +59,22 @@
 #define _LOGERR_    LOG_ERR, PROGRAM ": error: "
 #define _LOGWARN_   LOG_WARNING, PROGRAM ": warning: "
 
+#define CACHE_LINE_SIZE     64
+
+/* counters only have one writer, so a relaxed store is enough for the
+   readers in other threads to never see a torn value */
+#define COUNTER_ADD(c, n)   __atomic_store_n(&(c), (c) + (n), __ATOMIC_RELAXED)
+#define COUNTER_GET(c)      __atomic_load_n(&(c), __ATOMIC_RELAXED)
+#define COUNTER_SET(c, v)   __atomic_store_n(&(c), (v), __ATOMIC_RELAXED)
+
+/* PACKET_FANOUT modes of the capture workers */
+#define FANOUT_HASH         0
+#define FANOUT_CPU          1
+
+/* formats of the pushed stats */
+#define PUSH_STATSD         0
+#define PUSH_INFLUX         1
+
 
 /* program options */
 struct options {
@@ -65,27 +82,152 @@ struct options {
     char    *config;
     int     debug;
     int     detach;
+    int     dispatch_slice;
+    double  drop_threshold;
     char    *dump_file;
+    int     ebpf;
+    int     fanout;
     int     help;
+    char    *history;
+    int     history_segments;
+    int     history_size;
+    char    *http;
     int     interval;
+    int     jit;
     char    *pidfile;
+    char    *push;
+    int     push_format;
+    char    *replay;
+    double  replay_speed;
+    int     shared;
     char    *socket;
+    char    *stats_file;
     int     version;
+    int     workers;
 };
 
 extern struct options   options;
 
 
+/* geometry of a TPACKET_V3 capture ring; a ring is used instead of
+   a libpcap handle when blocks is not zero */
+struct ring_geometry {
+    uint32_t    blocks;         /* pcapRingBlocks */
+    uint32_t    block_size;     /* pcapRingBlockSize, in bytes */
+    uint32_t    timeout;        /* pcapRingTimeout, in milliseconds */
+};
+
+/* classic BPF filter translated to native code */
+typedef u_int (*jit_filter)(const u_char *bytes, u_int wirelen, u_int buflen);
+
+struct jit {
+    jit_filter          function;
+    void                *code;
+    size_t              size;
+    struct jit_arena    *arena;     /* holding the code, if any */
+};
+
 /* monitor definition */
 struct monitor_definition {
     uint32_t    index;
     char        *description;
     char        *device;
     char        *filter;
+    struct ring_geometry    ring;
+    uint32_t    flows;          /* pcapFlows, 0 for no flow table */
+    uint32_t    flow_timeout;   /* pcapFlowTimeout, in seconds */
+    uint32_t    flow_top;       /* pcapFlowTop */
+    uint32_t    hitters;        /* pcapHeavyHitters, 0 for none */
+    uint32_t    hitter_top;     /* pcapHeavyHitterTop */
+    uint32_t    distinct;       /* pcapDistinct, 0 for none */
+    int         sizes;          /* pcapSizeHistogram, SIZES_* */
+};
+
+/* 5-tuple of a flow, with IPv4 addresses mapped to IPv6 ones */
+struct flow_key {
+    uint8_t     src[16];
+    uint8_t     dst[16];
+    uint16_t    sport;
+    uint16_t    dport;
+    uint8_t     proto;
+    uint8_t     pad[3];
+};
+
+/* flow, served over SNMP in pcapFlowTable, indexed by monitor and rank */
+struct flow {
+    struct flow_key key;        /* pcap.3.1.1 to pcap.3.1.5 */
+    uint64_t    octets;         /* pcap.3.1.6 */
+    uint64_t    packets;        /* pcap.3.1.7 */
+    uint32_t    last_seen;      /* timestamp of its last packet */
+    uint32_t    seq;            /* odd while the flow is replaced */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* kinds of heavy hitters, served over SNMP in pcapTopSourceTable,
+   pcapTopDestinationTable and pcapTopPortTable */
+#define HITTER_SOURCES      0
+#define HITTER_DESTINATIONS 1
+#define HITTER_PORTS        2
+#define HITTER_KINDS        3
+
+#define HITTER_KEY_LENGTH   16
+
+/* heavy hitter: an address, or a port and its protocol */
+struct heavy_hitter {
+    uint8_t     key[HITTER_KEY_LENGTH];
+    uint64_t    octets;         /* estimated, never under the real count */
+    uint32_t    position;       /* in the heap of its summary */
+    uint32_t    seq;            /* odd while the key is replaced */
+};
+
+/* kinds of distinct counts, served over SNMP in pcapTable */
+#define DISTINCT_SOURCES        0
+#define DISTINCT_DESTINATIONS   1
+#define DISTINCT_FLOWS          2
+#define DISTINCT_KINDS          3
+
+/* peak and percentiles of the per-second rates of a monitor */
+struct rate_stats {
+    uint64_t    peak;
+    uint64_t    p50;
+    uint64_t    p95;
+    uint64_t    p99;
 };
 
-/* monitor */
+/* buckets of the packet size histograms, served over SNMP in
+   pcapSizeTable, indexed by monitor and bucket */
+#define SIZES_NONE          0
+#define SIZES_RMON          1       /* etherStatsPkts64Octets and others */
+#define SIZES_POW2          2       /* powers of two from 64 to 16384 */
+
+#define SIZE_BUCKETS        10      /* the most of any kind */
+
+/* per-worker counters of a monitor, each on its own cache line */
+struct monitor_counters {
+    uint64_t    octets;
+    uint64_t    packets;
+    uint64_t    sizes[SIZE_BUCKETS];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* monitor, allocated on a cache line boundary; the fields read by the
+   workers for every packet fill its first cache line (monitor.c checks
+   it), the classic BPF program starts the second one, and the strings
+   and the fields only used by the main thread come after */
 struct monitor {
+    /* read for every packet */
+    struct monitor_counters *counters;      /* one per worker */
+    struct rate_ring        **rates;        /* one per worker */
+    struct flow_table       **flows;        /* one per worker, if any */
+    struct sketch           **sketches;     /* one per worker, if any */
+    struct hll              **hlls;         /* one per worker, if any */
+    struct jit              *filter_jit;    /* when run in userspace */
+    int                     filter_valid;
+    int                     sizes;          /* kind of size histogram */
+    uint32_t                hll_epoch;      /* selects the registers */
+
+    /* read for every packet of a shared handle which runs the filters
+       one by one, without the JIT */
+    struct bpf_program      filter_bpf;
+
     /* the fields that will be served over SNMP */
     uint32_t                index;          /* pcap.2.1.0 */
     char                    *description;   /* pcap.2.1.1 */
@@ -93,24 +235,265 @@ struct monitor {
     char                    *filter;        /* pcap.2.1.3 */
     uint64_t                seen_octets;    /* pcap.2.1.4 */
     uint64_t                seen_packets;   /* pcap.2.1.5 */
+    uint64_t                seen_sizes[SIZE_BUCKETS];   /* pcap.7.1.3 */
 
     /* private fields */
     TAILQ_ENTRY(monitor)    link;
-    struct event            *watcher;
-    pcap_t                  *pcap;
-    struct bpf_program      filter_bpf;
-    int                     filter_valid;
+    struct capture          **captures;     /* one per worker */
+    struct ebpf             *ebpf;          /* counted in the kernel */
+    uint32_t                ebpf_slot;      /* at this key of its map */
+    struct monitor_definition   config;     /* compared on reload */
+    struct ring_geometry    ring;
+    const uint32_t          *size_bounds;   /* lowest size of the buckets */
+    uint32_t                size_bucket_count;
+    uint64_t                last_recv;      /* kernel counters at the */
+    uint64_t                last_drop;      /* last export */
+    uint64_t                last_calls;     /* dispatch counters at the */
+    uint64_t                last_packets;   /* last export */
+    uint64_t                push_octets;    /* counters at the last */
+    uint64_t                push_packets;   /* push */
+    uint64_t                history_octets; /* counters at the last */
+    uint64_t                history_packets;    /* history record */
+
+    /* flows, in tables filled by the workers */
+    struct flow             *top_flows;     /* largest, by octets */
+    struct flow             *flow_scratch;  /* to merge the workers */
+    uint32_t                top_flow_count;
+    uint32_t                flow_top;
+    uint64_t                flow_evictions;
+
+    /* heavy hitters, in summaries filled by the workers */
+    struct heavy_hitter     *hitters[HITTER_KINDS];     /* by octets */
+    struct heavy_hitter     *hitter_scratch;            /* to merge them */
+    uint32_t                hitter_count[HITTER_KINDS];
+    uint32_t                hitter_top;
+
+    /* distinct counts over the last interval, from the registers filled
+       by the workers */
+    uint8_t                 *hll_scratch;   /* to merge them */
+    uint64_t                distinct[DISTINCT_KINDS];   /* pcap.2.1.12-14 */
+
+    /* per-second rates over the last interval, from the rings filled by
+       the workers */
+    uint64_t                *rate_scratch;  /* to merge them */
+    uint32_t                rate_until;     /* first second not reported */
+    struct rate_stats       octet_rates;    /* pcap.2.1.15-18 */
+    struct rate_stats       packet_rates;   /* pcap.2.1.19-22 */
 };
 
 TAILQ_HEAD(monitor_list, monitor);
 extern struct monitor_list monitors;
+extern int monitor_count;
+
+/* capture handle, owned by one monitor or shared by all the monitors
+   of a device */
+struct capture {
+    char                    *device;
+    pcap_t                  *pcap;      /* for a ring, only used to compile
+                                           the filters */
+    struct ring             *ring;
+    struct event            *watcher;
+    struct monitor          **monitors;
+    int                     monitor_count;
+    int                     shared;
+    int                     worker;
+    int                     fanout_id;
+
+    /* filters of the monitors of a shared handle, merged */
+    struct classifier       *classifier;
+    int                     classify;       /* to be rebuilt */
+
+    /* dispatch scheduler */
+    struct event            *resume;
+    uint32_t                budget;         /* packets per wakeup */
+    uint32_t                delay;          /* deferral, in microseconds */
+    uint64_t                packet_cost;    /* average, in nanoseconds */
+    uint64_t                dispatch_calls;
+    uint64_t                dispatch_full;
+    uint64_t                dispatch_deferred;
+    uint64_t                dispatch_packets;
+    uint64_t                dispatch_time;  /* in nanoseconds */
+
+    /* kernel counters, from pcap_stats() or the ring, polled by the
+       worker */
+    struct event            *stats_timer;
+    struct pcap_stat        last_stats;     /* which wrap around */
+    uint64_t                kernel_recv;
+    uint64_t                kernel_drop;
+    uint64_t                kernel_ifdrop;
+
+    TAILQ_ENTRY(capture)    link;
+};
+
+/* dispatch scheduler metrics of the capture handles of a monitor */
+struct dispatch_stats {
+    uint32_t    budget;         /* summed over the workers */
+    uint32_t    delay;          /* highest among the workers */
+    uint64_t    calls;
+    uint64_t    full;
+    uint64_t    deferred;
+    uint64_t    packets;
+    uint64_t    time;           /* in nanoseconds */
+};
+
+/* kernel counters of the capture handles of a monitor */
+struct kernel_stats {
+    uint64_t    recv;           /* summed over the workers */
+    uint64_t    drop;
+    uint64_t    ifdrop;         /* of the device, highest among the
+                                   workers */
+};
+
+TAILQ_HEAD(capture_list, capture);
+extern struct capture_list captures;
+
+/* capture worker, running its own event loop */
+struct worker {
+    int                     id;
+    pthread_t               thread;
+    struct event_base       *ev_base;
+    int                     pause_pipe[2];
+    struct event            *pause_watcher;
+};
+
+extern struct worker    *workers;
+extern int              worker_count;
+
+/* types of the AgentX variables */
+#define AGENTX_INTEGER          2
+#define AGENTX_OCTET_STRING     4
+#define AGENTX_NULL             5
+#define AGENTX_COUNTER64        70
+#define AGENTX_NO_SUCH_OBJECT   128
+#define AGENTX_NO_SUCH_INSTANCE 129
+#define AGENTX_END_OF_MIB_VIEW  130
+
+#define AGENTX_MAX_SUBIDS       128
+
+/* object identifier, as carried by AgentX */
+struct agentx_oid {
+    uint32_t    len;
+    uint32_t    subids[AGENTX_MAX_SUBIDS];
+};
+
+/* subtree registered with the master agent; with a range_subid, counted
+   from 1, that sub-identifier ranges up to upper_bound */
+struct agentx_region {
+    struct agentx_oid   subtree;
+    uint8_t             range_subid;
+    uint32_t            upper_bound;
+};
+
+/* value of an AgentX variable; a string points into the SNMP snapshot */
+struct agentx_value {
+    int         type;           /* AGENTX_* */
+    uint64_t    number;
+    const char  *string;
+    uint32_t    length;
+};
+
+/* costs of the daemon itself, served over SNMP in pcapSelf, in
+   microseconds */
+struct self_stats {
+    uint64_t    loop_lag;       /* of the last export timer */
+    uint64_t    loop_lag_max;
+    uint64_t    export_time;    /* of the last export */
+    uint64_t    export_time_max;
+    uint64_t    agent_calls;    /* AgentX PDUs handled */
+    uint64_t    agent_time;
+    uint64_t    agent_time_max;
+};
+
+extern struct self_stats    self_stats;
 
 /* prototypes */
-void monitor_parse_config(const char *path, struct event_base *ev_base);
+int  agentx_start(struct event_base *ev_base, const char *address,
+    const struct agentx_region *regions, int count);
+void agentx_stop(void);
+int  capture_attach(struct monitor *mon);
+void capture_classify(struct capture *cap);
+void capture_classify_all(void);
+void capture_detach(struct monitor *mon);
+void capture_packet(u_char *arg, const struct pcap_pkthdr *header,
+    const u_char *bytes);
+void capture_dispatch_stats(struct monitor *mon, struct dispatch_stats *stats);
+void capture_kernel_stats(struct monitor *mon, struct kernel_stats *stats);
+struct classifier *classifier_build(struct monitor **mons, int count);
+void classifier_free(struct classifier *cl);
+const uint64_t *classifier_run(struct classifier *cl, const u_char *bytes,
+    u_int wirelen, u_int buflen);
+int  ebpf_attach(struct monitor **mons, int count);
+void ebpf_detach(struct monitor *mon);
+int  ebpf_read(struct monitor *mon, uint64_t *octets, uint64_t *packets);
+const char *flow_address(const uint8_t *address, char *buffer, size_t size);
+void flow_collect(struct monitor *mon);
+void flow_free(struct monitor *mon);
+int  flow_init(struct monitor *mon, uint32_t size, uint32_t timeout,
+    uint32_t top);
+int  flow_parse(const struct pcap_pkthdr *header, const u_char *bytes,
+    struct flow_key *key, uint64_t *hash);
+void flow_update(struct flow_table *table, const struct flow_key *key,
+    uint64_t hash, uint64_t octets, uint32_t now);
+void history_open(void);
+void history_record(void);
+void hll_collect(struct monitor *mon);
+void hll_free(struct monitor *mon);
+int  hll_init(struct monitor *mon, uint32_t precision);
+void hll_update(struct hll *hll, const struct flow_key *key, uint64_t hash);
+void http_start(struct event_base *ev_base);
+struct jit *jit_compile(const struct bpf_program *program);
+void jit_free(struct jit *jit);
+int  jit_selftest(void);
+void monitor_collect(struct monitor *mon);
+struct monitor *monitor_find(uint32_t index);
+void monitor_interval(struct monitor *mon);
+struct monitor *monitor_next(uint32_t index);
+void monitor_packet(struct monitor *mon, int worker,
+    const struct pcap_pkthdr *header, const u_char *bytes);
+void monitor_parse_config(const char *path);
+void monitor_reload(const char *path);
+void monitor_totals(struct monitor *mon);
+void push_flush(void);
+void push_monitor(struct monitor *mon, const struct kernel_stats *kernel);
+void push_open(void);
+void push_start(void);
+void rate_collect(struct monitor *mon);
+void rate_free(struct monitor *mon);
+int  rate_init(struct monitor *mon, uint32_t interval);
+void rate_update(struct rate_ring *ring, uint32_t second, uint64_t octets);
+struct ring *ring_open(const char *device, int snaplen,
+    const struct ring_geometry *geometry);
+void ring_close(struct ring *ring);
+int  ring_dispatch(struct ring *ring, int count, pcap_handler callback,
+    u_char *arg);
+int  ring_fd(struct ring *ring);
+int  ring_setfilter(struct ring *ring, struct bpf_program *program);
+int  ring_stats(struct ring *ring, uint64_t *packets, uint64_t *drops,
+    uint64_t *ifdrops);
+void sketch_collect(struct monitor *mon);
+const char *sketch_format(int kind, const struct heavy_hitter *hitter,
+    char *buffer, size_t size);
+void sketch_free(struct monitor *mon);
+int  sketch_init(struct monitor *mon, uint32_t width, uint32_t top);
+void sketch_update(struct sketch *sketch, const struct flow_key *key,
+    uint64_t octets);
+void stats_open(void);
+void stats_publish(int export);
+void stats_start(struct event_base *ev_base);
+void worker_init(struct event_base *ev_base);
+int  worker_pause(void);
+void worker_resume(void);
+void worker_start(void);
 void netsnmp_pcap_run(void);
+uint64_t nsp_clock(void);
+void replay_run(void);
 void nsp_agent_init(void);
+void nsp_agent_snapshot(void);
 void nsp_agent_start(struct event_base *ev_base);
 void nsp_agent_stop(void);
+int  nsp_tree_get(const struct agentx_oid *name, struct agentx_value *value);
+int  nsp_tree_next(const struct agentx_oid *start, int include,
+    struct agentx_oid *name, struct agentx_value *value);
 
 
 #endif
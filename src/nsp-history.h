@@ -0,0 +1,86 @@
+/*
+ * netsnmp-pcap :: nsp-history.h
+ * -----------------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+/*
+ * layout of the history log: a directory of segments, each a data file
+ * of records and an index file with one entry per record. a record holds
+ * the octets and packets counted by every monitor since the previous
+ * one, column after column, as LEB128 varints:
+ *
+ *   length     uint32_t, little endian: bytes of the record after it
+ *   time       microseconds since the start of the segment
+ *   flags      NSP_HISTORY_SAME_INDEXES if the index column is left out
+ *   count      number of monitors
+ *   indexes    count of them, each as the gap from the previous one, the
+ *              first from 0; left out when the monitors didn't change
+ *              since the record at the base offset of the index entry
+ *   octets     count deltas, in the order of the indexes
+ *   packets    count deltas, likewise
+ */
+
+#ifndef NSP_HISTORY_H
+#define NSP_HISTORY_H
+
+#include <stdint.h>
+
+
+#define NSP_HISTORY_MAGIC       0x4850534e  /* "NSPH" */
+#define NSP_HISTORY_VERSION     1
+
+#define NSP_HISTORY_DATA        "history-%08u.nsph"
+#define NSP_HISTORY_INDEX       "history-%08u.idx"
+
+/* flags of a record */
+#define NSP_HISTORY_SAME_INDEXES    0x01
+
+/* header of a data file, followed by the records */
+struct nsp_history_header {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    number;         /* of the segment */
+    uint32_t    reserved;
+    uint64_t    start;          /* microseconds since the epoch */
+    uint64_t    reserved2;
+};
+
+/* entry of an index file, in the byte order of the host */
+struct nsp_history_entry {
+    uint64_t    time;           /* microseconds since the epoch */
+    uint64_t    offset;         /* of the record in the data file */
+    uint64_t    base;           /* of the record with its index column */
+};
+
+
+#endif
@@ -0,0 +1,213 @@
+/*
+ * netsnmp-pcap :: nsp-stats.c
+ * ---------------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+/*
+ * library reading the stats segment published by the daemon, without
+ * any system call unless the segment grew
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nsp-stats.h"
+
+
+/* attempts at a consistent copy before giving up; the daemon keeps the
+   segment odd for a few microseconds per second */
+#define NSP_STATS_ATTEMPTS  100000
+
+
+/*
+ * nsp_stats_map()
+ * -------------
+ * map the whole segment, as large as it is now
+ */
+static int
+nsp_stats_map(struct nsp_stats *stats) {
+    const struct nsp_stats_header *header;
+    struct stat st;
+    void    *map;
+
+    if (fstat(stats->fd, &st) < 0)
+        return(-1);
+
+    if ((size_t)st.st_size < sizeof(struct nsp_stats_header)) {
+        errno = EINVAL;
+        return(-1);
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, stats->fd, 0);
+    if (map == MAP_FAILED)
+        return(-1);
+
+    header = map;
+    if (header->magic != NSP_STATS_MAGIC
+        || header->version != NSP_STATS_VERSION
+        || header->header_size != sizeof(struct nsp_stats_header)
+        || header->row_size != sizeof(struct nsp_stats_row)) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return(-1);
+    }
+
+    if (stats->map != NULL)
+        munmap((void *)stats->map, stats->size);
+
+    stats->map = map;
+    stats->size = st.st_size;
+
+    return(0);
+}
+
+
+/*
+ * nsp_stats_open()
+ * --------------
+ * map the stats segment at the given path; return -1 and set errno if
+ * it can't be opened, or isn't a segment of this version
+ */
+int
+nsp_stats_open(struct nsp_stats *stats, const char *path) {
+    int     error;
+
+    stats->map = NULL;
+    stats->size = 0;
+
+    if ((stats->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return(-1);
+
+    if (nsp_stats_map(stats) < 0) {
+        error = errno;
+        close(stats->fd);
+        stats->fd = -1;
+        errno = error;
+        return(-1);
+    }
+
+    return(0);
+}
+
+
+/*
+ * nsp_stats_read()
+ * --------------
+ * copy the segment into a snapshot, whose rows are reallocated when
+ * needed; the copy is retried until the daemon didn't write the segment
+ * during it. return -1 and set errno to EAGAIN if that never happened
+ */
+int
+nsp_stats_read(struct nsp_stats *stats,
+    struct nsp_stats_snapshot *snapshot) {
+    const struct nsp_stats_header *header;
+    const struct nsp_stats_row *rows;
+    struct nsp_stats_row *copy;
+    uint32_t    seq, count;
+    int         attempt;
+
+    for (attempt = 0; attempt < NSP_STATS_ATTEMPTS; attempt++) {
+        header = stats->map;
+        rows = (const struct nsp_stats_row *)(header + 1);
+
+        seq = __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        snapshot->header = *header;
+        count = snapshot->header.count;
+
+        /* the segment grew since it was mapped */
+        if (sizeof(struct nsp_stats_header)
+            + (size_t)count * sizeof(struct nsp_stats_row) > stats->size) {
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&header->seq, __ATOMIC_RELAXED) == seq
+                && nsp_stats_map(stats) < 0)
+                return(-1);
+            continue;
+        }
+
+        if (count > snapshot->size) {
+            copy = realloc(snapshot->rows,
+                count * sizeof(struct nsp_stats_row));
+            if (copy == NULL)
+                return(-1);
+            snapshot->rows = copy;
+            snapshot->size = count;
+        }
+
+        memcpy(snapshot->rows, rows, count * sizeof(struct nsp_stats_row));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&header->seq, __ATOMIC_RELAXED) == seq)
+            return(0);
+    }
+
+    errno = EAGAIN;
+    return(-1);
+}
+
+
+/*
+ * nsp_stats_free()
+ * --------------
+ * deallocate the rows of a snapshot
+ */
+void
+nsp_stats_free(struct nsp_stats_snapshot *snapshot) {
+    free(snapshot->rows);
+    snapshot->rows = NULL;
+    snapshot->size = 0;
+}
+
+
+/*
+ * nsp_stats_close()
+ * ---------------
+ * unmap the stats segment
+ */
+void
+nsp_stats_close(struct nsp_stats *stats) {
+    if (stats->map != NULL)
+        munmap((void *)stats->map, stats->size);
+    if (stats->fd >= 0)
+        close(stats->fd);
+
+    stats->map = NULL;
+    stats->fd = -1;
+}
@@ -0,0 +1,129 @@
+/*
+ * netsnmp-pcap :: nsp-stats.h
+ * ---------------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+/*
+ * layout of the stats segment, and the functions of the library reading
+ * it; this header doesn't depend on the headers of the daemon
+ */
+
+#ifndef NSP_STATS_H
+#define NSP_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define NSP_STATS_MAGIC         0x5350534e  /* "NSPS" */
+#define NSP_STATS_VERSION       1
+
+#define NSP_STATS_DESCR_LENGTH  64          /* strings are truncated, */
+#define NSP_STATS_DEVICE_LENGTH 32          /* and always end with a */
+#define NSP_STATS_FILTER_LENGTH 160         /* NUL */
+
+/* flags of a row */
+#define NSP_STATS_KERNEL        0x01        /* counted by an eBPF program */
+
+/* rates of a row, by kind */
+#define NSP_STATS_PEAK          0
+#define NSP_STATS_P50           1
+#define NSP_STATS_P95           2
+#define NSP_STATS_P99           3
+#define NSP_STATS_RATES         4
+
+/* distinct counts of a row, by kind */
+#define NSP_STATS_SOURCES       0
+#define NSP_STATS_DESTINATIONS  1
+#define NSP_STATS_FLOWS         2
+#define NSP_STATS_DISTINCT      3
+
+/* header of the segment; the rows follow it. the segment only grows,
+   and every field but magic and the sizes is written while seq is odd */
+struct nsp_stats_header {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    header_size;
+    uint32_t    row_size;
+    uint32_t    seq;            /* odd while the segment is written */
+    uint32_t    pid;            /* of the daemon */
+    uint32_t    capacity;       /* rows the segment has room for */
+    uint32_t    count;          /* rows in use, sorted by index */
+    uint64_t    updated;        /* microseconds since the epoch */
+    uint64_t    exported;       /* of the last export, likewise */
+    uint32_t    interval;       /* between two exports, in seconds */
+    uint32_t    reserved[3];
+};
+
+/* a monitor; octets and packets are updated every second, the other
+   counters at each export */
+struct nsp_stats_row {
+    uint32_t    index;
+    uint32_t    flags;
+    char        descr[NSP_STATS_DESCR_LENGTH];
+    char        device[NSP_STATS_DEVICE_LENGTH];
+    char        filter[NSP_STATS_FILTER_LENGTH];
+    uint64_t    octets;
+    uint64_t    packets;
+    uint64_t    recv;           /* by the kernel */
+    uint64_t    drops;          /* by the kernel */
+    uint64_t    octet_rates[NSP_STATS_RATES];   /* per second */
+    uint64_t    packet_rates[NSP_STATS_RATES];  /* per second */
+    uint64_t    distinct[NSP_STATS_DISTINCT];
+    uint64_t    reserved;
+};
+
+/* a mapping of the segment, in a reader */
+struct nsp_stats {
+    int         fd;
+    const void  *map;
+    size_t      size;
+};
+
+/* a consistent copy of the segment; zeroed before the first read, and
+   reused by the next ones */
+struct nsp_stats_snapshot {
+    struct nsp_stats_header header;
+    struct nsp_stats_row    *rows;      /* header.count of them */
+    uint32_t                size;       /* rows allocated */
+};
+
+/* prototypes */
+int  nsp_stats_open(struct nsp_stats *stats, const char *path);
+int  nsp_stats_read(struct nsp_stats *stats,
+    struct nsp_stats_snapshot *snapshot);
+void nsp_stats_free(struct nsp_stats_snapshot *snapshot);
+void nsp_stats_close(struct nsp_stats *stats);
+
+
+#endif
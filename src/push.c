@@ -0,0 +1,358 @@
+/*
+ * netsnmp-pcap :: push.c
+ * ----------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syslog.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "netsnmp-pcap.h"
+
+
+#define PUSH_UDP_SIZE       1432    /* fits an Ethernet frame, in IPv6 */
+#define PUSH_UNIX_SIZE      8192
+#define PUSH_BATCH          64      /* datagrams per sendmmsg() */
+#define PUSH_LINE_SIZE      1024
+
+
+/* the datagrams being filled, sent PUSH_BATCH at a time */
+static struct {
+    int             fd;
+    struct sockaddr_storage peer;       /* connected to */
+    socklen_t       peer_length;
+    size_t          size;               /* of a datagram */
+    char            *data;              /* PUSH_BATCH datagrams */
+    struct mmsghdr  messages[PUSH_BATCH];
+    struct iovec    iovecs[PUSH_BATCH];
+    int             count;              /* datagrams in use */
+    uint64_t        timestamp;          /* of the export, nanoseconds */
+    int             error;              /* of the last send, if any */
+} push = { .fd = -1 };
+
+
+
+/*
+ * push_socket()
+ * -----------
+ * create a non-blocking datagram socket, connected to the given address:
+ * udp:host:port, or unix:path
+ */
+static int
+push_socket(const char *address) {
+    struct sockaddr_un  sun;
+    struct addrinfo     hints, *list, *ai;
+    char    host[256], *port;
+    int     fd = -1, res;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        if (strlen(address + 5) >= sizeof(sun.sun_path)) {
+            errno = ENAMETOOLONG;
+            return(-1);
+        }
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, address + 5);
+
+        if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0)
+            return(-1);
+
+        /* the reader may not be there yet */
+        memcpy(&push.peer, &sun, sizeof(sun));
+        push.peer_length = sizeof(sun);
+        connect(fd, (struct sockaddr *)&sun, sizeof(sun));
+        push.size = PUSH_UNIX_SIZE;
+        return(fd);
+    }
+
+    if (strncmp(address, "udp:", 4) != 0
+        || (port = strrchr(address + 4, ':')) == NULL) {
+        errno = EINVAL;
+        return(-1);
+    }
+
+    /* an IPv6 address is given within brackets */
+    snprintf(host, sizeof(host), "%.*s", (int)(port - address - 4),
+        address + 4);
+    if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+        memmove(host, host + 1, strlen(host));
+        host[strlen(host) - 1] = '\0';
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if ((res = getaddrinfo(host, port + 1, &hints, &list)) != 0) {
+        syslog(_LOGERR_"couldn't resolve '%s': %s", address,
+            gai_strerror(res));
+        errno = EINVAL;
+        return(-1);
+    }
+
+    for (ai = list; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            memcpy(&push.peer, ai->ai_addr, ai->ai_addrlen);
+            push.peer_length = ai->ai_addrlen;
+            break;
+        }
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(list);
+    push.size = PUSH_UDP_SIZE;
+
+    return(fd);
+}
+
+
+/*
+ * push_open()
+ * ---------
+ * create the socket to push the deltas of each export to, given by
+ * --push
+ */
+void
+push_open(void) {
+    int     i;
+
+    if (options.debug >= 1)
+        fprintf(stderr, "push_open: %s, in %s format\n", options.push,
+            (options.push_format == PUSH_INFLUX ? "influx" : "statsd"));
+
+    if ((push.fd = push_socket(options.push)) < 0) {
+        syslog(_LOGERR_"couldn't create the socket to push the stats to "
+            "'%s': %s", options.push, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if ((push.data = malloc(PUSH_BATCH * push.size)) == NULL) {
+        syslog(_LOGERR_"couldn't allocate the datagrams: %s",
+            strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    memset(push.messages, 0, sizeof(push.messages));
+    for (i=0; i<PUSH_BATCH; i++) {
+        push.iovecs[i].iov_base = push.data + i * push.size;
+        push.iovecs[i].iov_len = 0;
+        push.messages[i].msg_hdr.msg_iov = &push.iovecs[i];
+        push.messages[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+
+/*
+ * push_flush()
+ * ----------
+ * send the datagrams filled so far, in as few calls as possible; what the
+ * socket doesn't take right away is dropped, as the next export carries
+ * on from there
+ */
+void
+push_flush(void) {
+    int     sent = 0, res, error = 0;
+
+    if (push.fd < 0)
+        return;
+
+    /* a reader which wasn't there, or came back */
+    if (push.error == ENOTCONN || push.error == ECONNREFUSED)
+        connect(push.fd, (struct sockaddr *)&push.peer, push.peer_length);
+
+    while (sent < push.count) {
+        res = sendmmsg(push.fd, push.messages + sent, push.count - sent, 0);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0) {
+            error = errno;
+            break;
+        }
+        sent += res;
+    }
+
+    /* only log the changes, not every export */
+    if (error != 0 && error != push.error)
+        syslog(_LOGWARN_"couldn't push %d datagram(s) to '%s': %s",
+            push.count - sent, options.push, strerror(error));
+    else if (error == 0 && push.error != 0)
+        syslog(LOG_INFO, PROGRAM ": pushing to '%s' again", options.push);
+
+    if (options.debug >= 2)
+        fprintf(stderr, "push_flush: sent %d of %d datagram(s)\n", sent,
+            push.count);
+
+    push.error = error;
+    push.count = 0;
+}
+
+
+/*
+ * push_line()
+ * ---------
+ * append a line to the current datagram, or to the next one
+ */
+static void
+push_line(const char *line, size_t length) {
+    struct iovec    *iov;
+
+    if (length > push.size)
+        return;
+
+    iov = &push.iovecs[push.count > 0 ? push.count - 1 : 0];
+    if (push.count == 0 || iov->iov_len + length > push.size) {
+        if (push.count == PUSH_BATCH)
+            push_flush();
+
+        iov = &push.iovecs[push.count++];
+        iov->iov_len = 0;
+    }
+
+    memcpy((char *)iov->iov_base + iov->iov_len, line, length);
+    iov->iov_len += length;
+}
+
+
+/*
+ * push_tag()
+ * --------
+ * write an Influx tag, escaping its value; empty values are left out.
+ * return the bytes written, or size if the tag doesn't fit
+ */
+static size_t
+push_tag(char *buffer, size_t size, const char *name, const char *value) {
+    size_t  length;
+    int     n;
+
+    if (value == NULL || *value == '\0')
+        return(0);
+
+    n = snprintf(buffer, size, ",%s=", name);
+    if (n < 0 || (size_t)n >= size)
+        return(size);
+
+    for (length = n; *value; value++) {
+        if (*value == ',' || *value == '=' || *value == ' '
+            || *value == '\\') {
+            if (length + 1 >= size)
+                return(size);
+            buffer[length++] = '\\';
+        }
+
+        if (length + 1 >= size)
+            return(size);
+        buffer[length++] = (*value == '\n') ? ' ' : *value;
+    }
+
+    buffer[length] = '\0';
+
+    return(length);
+}
+
+
+/*
+ * push_start()
+ * ----------
+ * note the time of the export the next lines belong to
+ */
+void
+push_start(void) {
+    struct timeval  now;
+
+    gettimeofday(&now, NULL);
+    push.timestamp = (uint64_t)now.tv_sec * 1000000000
+        + (uint64_t)now.tv_usec * 1000;
+}
+
+
+/*
+ * push_monitor()
+ * ------------
+ * append the deltas of a monitor since the previous export; invoked by
+ * the exporter before it updates the last kernel counters
+ */
+void
+push_monitor(struct monitor *mon, const struct kernel_stats *kernel) {
+    char        line[PUSH_LINE_SIZE];
+    uint64_t    octets, packets, drops;
+    size_t      length;
+    int         n;
+
+    if (push.fd < 0)
+        return;
+
+    octets = mon->seen_octets - mon->push_octets;
+    packets = mon->seen_packets - mon->push_packets;
+    drops = (mon->ebpf == NULL) ? kernel->drop - mon->last_drop : 0;
+    mon->push_octets = mon->seen_octets;
+    mon->push_packets = mon->seen_packets;
+
+    if (options.push_format == PUSH_INFLUX) {
+        length = snprintf(line, sizeof(line), "netsnmp_pcap,index=%u",
+            mon->index);
+        length += push_tag(line + length, sizeof(line) - length, "descr",
+            mon->description);
+        if (length >= sizeof(line))
+            return;
+        length += push_tag(line + length, sizeof(line) - length, "device",
+            mon->device);
+        if (length >= sizeof(line))
+            return;
+        n = snprintf(line + length, sizeof(line) - length, " octets=%lui,"
+            "packets=%lui,drops=%lui %lu\n", octets, packets, drops,
+            push.timestamp);
+        if (n < 0 || (size_t)n >= sizeof(line) - length)
+            return;
+        push_line(line, length + n);
+        return;
+    }
+
+    /* statsd: one counter per line, grouped in the datagram */
+    n = snprintf(line, sizeof(line), "netsnmp_pcap.%u.octets:%lu|c\n"
+        "netsnmp_pcap.%u.packets:%lu|c\nnetsnmp_pcap.%u.drops:%lu|c\n",
+        mon->index, octets, mon->index, packets, mon->index, drops);
+    push_line(line, n);
+}
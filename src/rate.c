@@ -0,0 +1,271 @@
+/*
+ * netsnmp-pcap :: rate.c
+ * ----------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#include <errno.h>
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslog.h>
+#include <sys/types.h>
+
+#include "netsnmp-pcap.h"
+
+
+/* octets and packets of a monitor in one second, in one worker; the
+   second is written first when the slot is reused, so that a reader
+   which sees it unchanged around its copy has a consistent one */
+struct rate_slot {
+    uint32_t    second;
+    uint32_t    pad;
+    uint64_t    octets;
+    uint64_t    packets;
+};
+
+/* ring of the last seconds of a monitor in one worker, bucketed by the
+   timestamps of the packets */
+struct rate_ring {
+    struct rate_slot    *slots;
+    uint32_t    mask;
+    uint32_t    first;          /* second of the first packet */
+    uint32_t    latest;         /* second of the last packet */
+};
+
+
+/*
+ * rate_update()
+ * -----------
+ * account a packet to the second of its timestamp, invoked by
+ * monitor_packet()
+ */
+void
+rate_update(struct rate_ring *ring, uint32_t second, uint64_t octets) {
+    struct rate_slot *slot = &ring->slots[second & ring->mask];
+
+    if (slot->second != second) {
+        COUNTER_SET(slot->second, second);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        COUNTER_SET(slot->octets, 0);
+        COUNTER_SET(slot->packets, 0);
+
+        if (ring->first == 0)
+            COUNTER_SET(ring->first, second);
+        if ((int32_t)(second - ring->latest) > 0)
+            COUNTER_SET(ring->latest, second);
+    }
+
+    COUNTER_ADD(slot->octets, octets);
+    COUNTER_ADD(slot->packets, 1);
+}
+
+
+/*
+ * rate_read()
+ * ---------
+ * add the octets and packets of a second in a ring, if it still holds
+ * them
+ */
+static void
+rate_read(const struct rate_ring *ring, uint32_t second, uint64_t *octets,
+    uint64_t *packets) {
+    const struct rate_slot *slot = &ring->slots[second & ring->mask];
+    uint64_t    o, p;
+
+    if (__atomic_load_n(&slot->second, __ATOMIC_ACQUIRE) != second)
+        return;
+
+    o = COUNTER_GET(slot->octets);
+    p = COUNTER_GET(slot->packets);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (COUNTER_GET(slot->second) != second)
+        return;
+
+    *octets += o;
+    *packets += p;
+}
+
+
+/*
+ * rate_compare()
+ * ------------
+ */
+static int
+rate_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return((x > y) - (x < y));
+}
+
+
+/*
+ * rate_percentiles()
+ * ----------------
+ * sort the rates of some seconds, and pick the peak and the percentiles
+ * by nearest rank
+ */
+static void
+rate_percentiles(uint64_t *rates, uint32_t count, struct rate_stats *stats) {
+    qsort(rates, count, sizeof(uint64_t), rate_compare);
+
+    stats->peak = rates[count - 1];
+    stats->p50 = rates[(count * 50 + 99) / 100 - 1];
+    stats->p95 = rates[(count * 95 + 99) / 100 - 1];
+    stats->p99 = rates[(count * 99 + 99) / 100 - 1];
+}
+
+
+/*
+ * rate_collect()
+ * ------------
+ * compute the peak and percentile rates of the monitor over the seconds
+ * since the last export; the second of the last packet is left for the
+ * next one, as it's still being counted, and so are seconds older than
+ * the rings. invoked once per export
+ */
+void
+rate_collect(struct monitor *mon) {
+    uint64_t    *octets, *packets;
+    uint32_t    start, end, first, latest, second, count;
+    int         w;
+
+    if (mon->rates == NULL)
+        return;
+
+    /* the seconds are compared as differences, which survive wrapping */
+    end = COUNTER_GET(mon->rates[0]->latest);
+    for (w=1; w<worker_count; w++) {
+        latest = COUNTER_GET(mon->rates[w]->latest);
+        if ((int32_t)(latest - end) > 0)
+            end = latest;
+    }
+
+    /* the first export starts with the first packet */
+    start = mon->rate_until;
+    if (start == 0) {
+        start = end;
+        for (w=0; w<worker_count; w++) {
+            first = COUNTER_GET(mon->rates[w]->first);
+            if (first != 0 && (int32_t)(first - start) < 0)
+                start = first;
+        }
+    }
+
+    if ((int32_t)(end - start) > (int32_t)mon->rates[0]->mask)
+        start = end - mon->rates[0]->mask;
+
+    memset(&mon->octet_rates, 0, sizeof(mon->octet_rates));
+    memset(&mon->packet_rates, 0, sizeof(mon->packet_rates));
+
+    if (end == 0 || (int32_t)(end - start) <= 0)
+        return;
+
+    count = end - start;
+    octets = mon->rate_scratch;
+    packets = mon->rate_scratch + count;
+
+    for (second=start; second != end; second++) {
+        octets[second - start] = packets[second - start] = 0;
+        for (w=0; w<worker_count; w++)
+            rate_read(mon->rates[w], second, &octets[second - start],
+                &packets[second - start]);
+    }
+
+    rate_percentiles(octets, count, &mon->octet_rates);
+    rate_percentiles(packets, count, &mon->packet_rates);
+
+    mon->rate_until = end;
+}
+
+
+/*
+ * rate_free()
+ * ---------
+ */
+void
+rate_free(struct monitor *mon) {
+    int     w;
+
+    if (mon->rates != NULL) {
+        for (w=0; w<worker_count; w++) {
+            if (mon->rates[w] != NULL)
+                free(mon->rates[w]->slots);
+            free(mon->rates[w]);
+        }
+        free(mon->rates);
+        mon->rates = NULL;
+    }
+
+    free(mon->rate_scratch);
+    mon->rate_scratch = NULL;
+}
+
+
+/*
+ * rate_init()
+ * ---------
+ * allocate the rings of a monitor in each worker, of a power of two of
+ * seconds covering at least twice the export interval
+ */
+int
+rate_init(struct monitor *mon, uint32_t interval) {
+    uint32_t    size;
+    int         w;
+
+    for (size=2; size < 2 * interval; size *= 2);
+
+    mon->rates = calloc(worker_count, sizeof(struct rate_ring *));
+    mon->rate_scratch = calloc(2 * size, sizeof(uint64_t));
+    if (mon->rates == NULL || mon->rate_scratch == NULL)
+        goto fail;
+
+    for (w=0; w<worker_count; w++) {
+        if ((mon->rates[w] = calloc(1, sizeof(struct rate_ring))) == NULL)
+            goto fail;
+
+        mon->rates[w]->mask = size - 1;
+        mon->rates[w]->slots = calloc(size, sizeof(struct rate_slot));
+        if (mon->rates[w]->slots == NULL)
+            goto fail;
+    }
+
+    return(0);
+
+  fail:
+    syslog(_LOGERR_"couldn't allocate the rates of monitor %u: %s",
+        mon->index, strerror(errno));
+    rate_free(mon);
+    return(-1);
+}
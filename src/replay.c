@@ -0,0 +1,165 @@
+/*
+ * netsnmp-pcap :: replay.c
+ * ------------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#include <errno.h>
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslog.h>
+#include <time.h>
+
+#include "netsnmp-pcap.h"
+
+
+/* state of the replay loop */
+struct replay {
+    struct capture  *capture;
+    uint64_t        packets;
+    uint64_t        slept;          /* nanoseconds spent pacing */
+    struct timespec start;          /* wall clock of the first packet */
+    struct timeval  first;          /* timestamp of the first packet */
+};
+
+
+/*
+ * timespec_ns()
+ * -----------
+ */
+static uint64_t
+timespec_ns(const struct timespec *ts) {
+    return((uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec);
+}
+
+
+/*
+ * replay_packet()
+ * -------------
+ * callback function invoked by pcap_loop() for each packet of the file;
+ * with --replay-speed, wait until the packet is due, relative to the
+ * first one, then hand it to the monitors
+ */
+static void
+replay_packet(u_char *arg, const struct pcap_pkthdr *header,
+    const u_char *bytes) {
+    struct replay   *replay = (struct replay*)arg;
+    struct timespec now, delay, end;
+    int64_t         due, elapsed;
+
+    if (replay->packets++ == 0)
+        replay->first = header->ts;
+
+    if (options.replay_speed > 0) {
+        due = ((header->ts.tv_sec - replay->first.tv_sec) * 1e9
+            + (header->ts.tv_usec - replay->first.tv_usec) * 1e3)
+            / options.replay_speed;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = timespec_ns(&now) - timespec_ns(&replay->start);
+
+        if (due > elapsed) {
+            delay.tv_sec = (due - elapsed) / 1000000000;
+            delay.tv_nsec = (due - elapsed) % 1000000000;
+            nanosleep(&delay, NULL);
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            replay->slept += timespec_ns(&end) - timespec_ns(&now);
+        }
+    }
+
+    capture_packet((u_char *)replay->capture, header, bytes);
+}
+
+
+/*
+ * replay_run()
+ * ----------
+ * feed the capture file given to --replay through the monitors, then
+ * print the throughput and the final counters of each monitor
+ */
+void
+replay_run(void) {
+    struct replay   replay;
+    struct monitor  *mon;
+    struct timespec end;
+    uint64_t        busy;
+    double          seconds;
+
+    memset(&replay, 0, sizeof(replay));
+
+    replay.capture = TAILQ_FIRST(&captures);
+    if (replay.capture == NULL) {
+        syslog(_LOGERR_"no monitor to replay %s through", options.replay);
+        exit(EXIT_FAILURE);
+    }
+
+    if (options.debug)
+        fprintf(stderr, "replay_run: replaying %s through %d monitor(s)\n",
+            options.replay, replay.capture->monitor_count);
+
+    clock_gettime(CLOCK_MONOTONIC, &replay.start);
+
+    if (pcap_loop(replay.capture->pcap, -1, replay_packet,
+        (u_char *)&replay) == -1) {
+        syslog(_LOGERR_"couldn't read %s: %s", options.replay,
+            pcap_geterr(replay.capture->pcap));
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    /* the time spent pacing isn't processing time */
+    busy = timespec_ns(&end) - timespec_ns(&replay.start) - replay.slept;
+    seconds = busy / 1e9;
+
+    printf("replayed %lu packets from %s\n", replay.packets, options.replay);
+    printf("  time:       %.6f s", seconds);
+    if (replay.slept > 0)
+        printf(" (plus %.6f s pacing at %gx)", replay.slept / 1e9,
+            options.replay_speed);
+    printf("\n");
+    printf("  throughput: %.0f packets/s\n",
+        (seconds > 0 ? replay.packets / seconds : 0));
+    printf("  cost:       %.1f ns/packet\n",
+        (replay.packets > 0 ? (double)busy / replay.packets : 0));
+    printf("\n%8s %14s %18s  %s\n", "index", "packets", "octets",
+        "description");
+
+    TAILQ_FOREACH(mon, &monitors, link) {
+        monitor_collect(mon);
+        printf("%8u %14lu %18lu  %s\n", mon->index, mon->seen_packets,
+            mon->seen_octets, (mon->description ? mon->description : ""));
+    }
+}
@@ -0,0 +1,392 @@
+/*
+ * netsnmp-pcap :: ring.c
+ * ----------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslog.h>
+#include <sys/types.h>
+
+#include "netsnmp-pcap.h"
+
+#ifdef __linux__
+
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+#define DEFAULT_BLOCK_SIZE      (1 << 20)
+#define DEFAULT_BLOCK_TIMEOUT   100
+#define FRAME_SIZE              2048
+
+
+/* TPACKET_V3 capture ring */
+struct ring {
+    int         fd;
+    u_char      *map;
+    size_t      map_length;
+    uint32_t    block_size;
+    uint32_t    block_count;
+    uint32_t    current;
+
+    /* kernel counters, which are reset when read */
+    char        device[IF_NAMESIZE];
+    uint64_t    packets;
+    uint64_t    drops;
+    uint64_t    ifdrops_base;   /* of the device, when it was opened */
+};
+
+
+/*
+ * ring_ifdrops()
+ * ------------
+ * read the packets dropped by a device, as counted by its driver
+ */
+static uint64_t
+ring_ifdrops(const char *device) {
+    char        path[64 + IF_NAMESIZE];
+    uint64_t    drops = 0;
+    FILE        *file;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/rx_dropped",
+        device);
+
+    if ((file = fopen(path, "r")) != NULL) {
+        if (fscanf(file, "%lu", &drops) != 1)
+            drops = 0;
+        fclose(file);
+    }
+
+    return(drops);
+}
+
+
+/*
+ * ring_close()
+ * ----------
+ * unmap and close a capture ring
+ */
+void
+ring_close(struct ring *ring) {
+    if (ring == NULL)
+        return;
+
+    if (ring->map != NULL)
+        munmap(ring->map, ring->map_length);
+
+    if (ring->fd >= 0)
+        close(ring->fd);
+
+    free(ring);
+}
+
+
+/*
+ * ring_open()
+ * ---------
+ * create a packet socket on the given device, and map a TPACKET_V3 ring
+ * with the given geometry; packets are truncated by the kernel to snaplen
+ */
+struct ring *
+ring_open(const char *device, int snaplen,
+    const struct ring_geometry *geometry) {
+    struct ring         *ring;
+    struct tpacket_req3 req;
+    struct packet_mreq  mreq;
+    struct sockaddr_ll  sll;
+    struct bpf_program  snap;
+    struct bpf_insn     ret = { BPF_RET|BPF_K, 0, 0, snaplen };
+    long    page_size = sysconf(_SC_PAGESIZE);
+    int     version = TPACKET_V3;
+    int     ifindex;
+
+    if ((ifindex = if_nametoindex(device)) == 0) {
+        syslog(_LOGERR_"couldn't open ring on %s: %s", device,
+            strerror(errno));
+        return(NULL);
+    }
+
+    /* check the ring geometry */
+    memset(&req, 0, sizeof(req));
+    req.tp_block_nr = geometry->blocks;
+    req.tp_block_size = (geometry->block_size ? geometry->block_size
+        : DEFAULT_BLOCK_SIZE);
+    req.tp_retire_blk_tov = (geometry->timeout ? geometry->timeout
+        : DEFAULT_BLOCK_TIMEOUT);
+
+    if ((req.tp_block_size % page_size) != 0
+        || (req.tp_block_size & (req.tp_block_size - 1)) != 0) {
+        syslog(_LOGERR_"couldn't open ring on %s: the block size (%u) must "
+            "be a power of two multiple of the page size", device,
+            req.tp_block_size);
+        return(NULL);
+    }
+
+    req.tp_frame_size = FRAME_SIZE;
+    req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size)
+        * req.tp_block_nr;
+
+    if (options.debug)
+        fprintf(stderr, "ring_open: %u blocks of %u bytes on %s, "
+            "timeout %u ms\n", req.tp_block_nr, req.tp_block_size, device,
+            req.tp_retire_blk_tov);
+
+    /* allocate memory for the ring */
+    ring = calloc(1, sizeof(struct ring));
+    if (ring == NULL) {
+        syslog(_LOGERR_"couldn't allocate ring: %s", strerror(errno));
+        return(NULL);
+    }
+
+    ring->block_size = req.tp_block_size;
+    ring->block_count = req.tp_block_nr;
+    ring->map_length = (size_t)req.tp_block_size * req.tp_block_nr;
+
+    snprintf(ring->device, sizeof(ring->device), "%s", device);
+    ring->ifdrops_base = ring_ifdrops(device);
+
+    /* create the packet socket; it doesn't receive anything until it's
+       bound to the device, below */
+    ring->fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (ring->fd < 0) {
+        syslog(_LOGERR_"couldn't create packet socket: %s", strerror(errno));
+        goto fail;
+    }
+
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version,
+        sizeof(version)) < 0) {
+        syslog(_LOGERR_"couldn't select TPACKET_V3: %s", strerror(errno));
+        goto fail;
+    }
+
+    /* only copy the first snaplen bytes of each packet in the ring */
+    snap.bf_len = 1;
+    snap.bf_insns = &ret;
+    if (ring_setfilter(ring, &snap) < 0)
+        goto fail;
+
+    /* create and map the ring */
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req,
+        sizeof(req)) < 0) {
+        syslog(_LOGERR_"couldn't create the capture ring on %s: %s", device,
+            strerror(errno));
+        goto fail;
+    }
+
+    ring->map = mmap(NULL, ring->map_length, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring->fd, 0);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        syslog(_LOGERR_"couldn't map the capture ring on %s: %s", device,
+            strerror(errno));
+        goto fail;
+    }
+
+    /* bind the socket to the device */
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+
+    if (bind(ring->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        syslog(_LOGERR_"couldn't bind packet socket to %s: %s", device,
+            strerror(errno));
+        goto fail;
+    }
+
+    /* set the device in promiscuous mode, like pcap_open_live() does */
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+        sizeof(mreq)) < 0)
+        syslog(_LOGWARN_"couldn't set %s in promiscuous mode: %s", device,
+            strerror(errno));
+
+    return(ring);
+
+  fail:
+    ring_close(ring);
+    return(NULL);
+}
+
+
+/*
+ * ring_setfilter()
+ * --------------
+ * attach a compiled filter to the packet socket of the ring; classic
+ * BPF instructions have the same layout in libpcap and in the kernel
+ */
+int
+ring_setfilter(struct ring *ring, struct bpf_program *program) {
+    struct sock_fprog prog;
+
+    prog.len = program->bf_len;
+    prog.filter = (struct sock_filter *)program->bf_insns;
+
+    if (setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+        sizeof(prog)) < 0) {
+        syslog(_LOGERR_"couldn't attach filter to the capture ring: %s",
+            strerror(errno));
+        return(-1);
+    }
+
+    return(0);
+}
+
+
+/*
+ * ring_fd()
+ * -------
+ */
+int
+ring_fd(struct ring *ring) {
+    return(ring->fd);
+}
+
+
+/*
+ * ring_stats()
+ * ----------
+ * read the packets received and dropped by the kernel on the ring since
+ * it was opened, and the packets dropped by its device
+ */
+int
+ring_stats(struct ring *ring, uint64_t *packets, uint64_t *drops,
+    uint64_t *ifdrops) {
+    struct tpacket_stats_v3 stats;
+    socklen_t   length = sizeof(stats);
+
+    if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &stats,
+        &length) < 0) {
+        syslog(_LOGERR_"couldn't read the statistics of the capture ring on "
+            "%s: %s", ring->device, strerror(errno));
+        return(-1);
+    }
+
+    ring->packets += stats.tp_packets;
+    ring->drops += stats.tp_drops;
+
+    *packets = ring->packets;
+    *drops = ring->drops;
+    *ifdrops = ring_ifdrops(ring->device) - ring->ifdrops_base;
+
+    return(0);
+}
+
+
+/*
+ * ring_dispatch()
+ * -------------
+ * walk the blocks retired by the kernel, and invoke the callback on each
+ * packet in place, then hand the blocks back to the kernel; stop after
+ * the block where count packets are reached, unless count is -1. return
+ * the number of packets processed
+ */
+int
+ring_dispatch(struct ring *ring, int count, pcap_handler callback,
+    u_char *arg) {
+    struct tpacket_block_desc   *block;
+    struct tpacket3_hdr         *packet;
+    struct pcap_pkthdr          header;
+    uint32_t    i, packets;
+    int         n = 0;
+
+    while (count < 0 || n < count) {
+        block = (struct tpacket_block_desc *)
+            (ring->map + (size_t)ring->current * ring->block_size);
+
+        if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+            & TP_STATUS_USER) == 0)
+            break;
+
+        packets = block->hdr.bh1.num_pkts;
+        packet = (struct tpacket3_hdr *)
+            ((u_char *)block + block->hdr.bh1.offset_to_first_pkt);
+
+        for (i=0; i<packets; i++) {
+            header.ts.tv_sec  = packet->tp_sec;
+            header.ts.tv_usec = packet->tp_nsec / 1000;
+            header.caplen = packet->tp_snaplen;
+            header.len = packet->tp_len;
+
+            callback(arg, &header, (u_char *)packet + packet->tp_mac);
+
+            packet = (struct tpacket3_hdr *)
+                ((u_char *)packet + packet->tp_next_offset);
+        }
+
+        n += packets;
+
+        /* give the block back to the kernel */
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+            __ATOMIC_RELEASE);
+        ring->current = (ring->current + 1) % ring->block_count;
+    }
+
+    return(n);
+}
+
+
+#else /* __linux__ */
+
+
+struct ring *
+ring_open(const char *device, int snaplen,
+    const struct ring_geometry *geometry) {
+    syslog(_LOGERR_"couldn't open ring on %s: TPACKET_V3 rings are only "
+        "available on Linux", device);
+    return(NULL);
+}
+
+void ring_close(struct ring *ring) { }
+int  ring_dispatch(struct ring *ring, int count, pcap_handler callback,
+    u_char *arg) { return(-1); }
+int  ring_fd(struct ring *ring) { return(-1); }
+int  ring_setfilter(struct ring *ring, struct bpf_program *program)
+    { return(-1); }
+int  ring_stats(struct ring *ring, uint64_t *packets, uint64_t *drops,
+    uint64_t *ifdrops) { return(-1); }
+
+
+#endif /* __linux__ */
@@ -0,0 +1,524 @@
+/*
+ * netsnmp-pcap :: sketch.c
+ * ------------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslog.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "netsnmp-pcap.h"
+
+
+/* rows of the Count-Min sketches */
+#define SKETCH_DEPTH        4
+
+
+/* Count-Min sketch of one kind of heavy hitters, with the keys whose
+   estimate is among the largest; the candidates stay in place, so that
+   they can be read while the worker updates them, and a min-heap of
+   their numbers gives the smallest one, replaced by a larger key. an
+   index from the hashes of the keys finds their candidates */
+struct summary {
+    uint64_t    *rows;          /* SKETCH_DEPTH rows of width counters */
+    uint32_t    width;
+    struct heavy_hitter *candidates;
+    uint32_t    *heap;          /* candidate numbers, smallest first */
+    uint32_t    *index;         /* candidate numbers + 1, or 0 */
+    uint32_t    size;           /* of candidates */
+    uint32_t    used;
+    uint32_t    mask;           /* of the index */
+};
+
+/* heavy hitters of a monitor in one worker */
+struct sketch {
+    struct summary  summaries[HITTER_KINDS];
+};
+
+
+/* seed of the hashes of the keys */
+static uint64_t sketch_seed = 0;
+
+
+/*
+ * sketch_hash()
+ * -----------
+ */
+static inline uint64_t
+sketch_hash(const uint8_t *key) {
+    uint64_t    words[2], hash;
+
+    memcpy(words, key, sizeof(words));
+
+    hash = (sketch_seed ^ words[0]) * 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ (hash >> 29) ^ words[1]) * 0x9e3779b97f4a7c15ULL;
+
+    /* fold the high bits, where IPv4 addresses end, into the low ones */
+    hash = (hash ^ (hash >> 32)) * 0xbf58476d1ce4e5b9ULL;
+
+    return(hash ^ (hash >> 29));
+}
+
+
+/*
+ * sketch_lookup()
+ * -------------
+ * return the slot of the index holding the candidate of a key, or else
+ * the empty slot where it would go
+ */
+static uint32_t
+sketch_lookup(const struct summary *sum, const uint8_t *key, uint64_t hash) {
+    uint32_t slot, n;
+
+    for (slot = (hash >> 40) & sum->mask; ; slot = (slot + 1) & sum->mask) {
+        n = sum->index[slot];
+        if (n == 0 || memcmp(sum->candidates[n - 1].key, key,
+            HITTER_KEY_LENGTH) == 0)
+            return(slot);
+    }
+}
+
+
+/*
+ * sketch_unindex()
+ * --------------
+ * remove a key from the index, and move back the keys after it that
+ * can't be found anymore across the hole
+ */
+static void
+sketch_unindex(struct summary *sum, const uint8_t *key) {
+    uint32_t hole, slot, home;
+
+    hole = sketch_lookup(sum, key, sketch_hash(key));
+
+    for (slot = (hole + 1) & sum->mask; sum->index[slot] != 0;
+        slot = (slot + 1) & sum->mask) {
+        home = (sketch_hash(sum->candidates[sum->index[slot] - 1].key) >> 40)
+            & sum->mask;
+
+        /* move the key if its home isn't between the hole and it */
+        if (((slot - home) & sum->mask) >= ((slot - hole) & sum->mask)) {
+            sum->index[hole] = sum->index[slot];
+            hole = slot;
+        }
+    }
+
+    sum->index[hole] = 0;
+}
+
+
+/*
+ * sketch_swap()
+ * -----------
+ */
+static inline void
+sketch_swap(struct summary *sum, uint32_t i, uint32_t j) {
+    uint32_t n = sum->heap[i];
+
+    sum->heap[i] = sum->heap[j];
+    sum->heap[j] = n;
+    sum->candidates[sum->heap[i]].position = i;
+    sum->candidates[sum->heap[j]].position = j;
+}
+
+
+/*
+ * sketch_sift()
+ * -----------
+ * restore the heap after the candidate at the given position grew, or
+ * was added at its end
+ */
+static void
+sketch_sift(struct summary *sum, uint32_t i) {
+    struct heavy_hitter *candidates = sum->candidates;
+    uint32_t child;
+
+    /* up, for a new candidate */
+    while (i > 0 && candidates[sum->heap[i]].octets
+        < candidates[sum->heap[(i - 1) / 2]].octets) {
+        sketch_swap(sum, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    /* down, for a candidate which grew */
+    while ((child = 2 * i + 1) < sum->used) {
+        if (child + 1 < sum->used && candidates[sum->heap[child + 1]].octets
+            < candidates[sum->heap[child]].octets)
+            child++;
+        if (candidates[sum->heap[i]].octets
+            <= candidates[sum->heap[child]].octets)
+            break;
+        sketch_swap(sum, i, child);
+        i = child;
+    }
+}
+
+
+/*
+ * sketch_count()
+ * ------------
+ * add octets to a key in the sketch; only when its estimate is larger
+ * than the smallest candidate is it looked up among the candidates,
+ * which keeps the cost of a flood of small keys to the sketch itself
+ */
+static void
+sketch_count(struct summary *sum, const uint8_t *key, uint64_t octets) {
+    struct heavy_hitter *candidate;
+    uint64_t    hash, estimate = UINT64_MAX, *counter;
+    uint32_t    slot, n, i;
+
+    hash = sketch_hash(key);
+
+    /* the rows are indexed by combinations of two halves of the hash */
+    for (i=0; i<SKETCH_DEPTH; i++) {
+        counter = &sum->rows[i * sum->width
+            + (((uint32_t)hash + i * ((hash >> 32) | 1)) & (sum->width - 1))];
+        *counter += octets;
+        if (*counter < estimate)
+            estimate = *counter;
+    }
+
+    if (sum->used == sum->size
+        && estimate <= sum->candidates[sum->heap[0]].octets)
+        return;
+
+    slot = sketch_lookup(sum, key, hash);
+
+    if (sum->index[slot] != 0) {
+        candidate = &sum->candidates[sum->index[slot] - 1];
+        COUNTER_SET(candidate->octets, estimate);
+        sketch_sift(sum, candidate->position);
+        return;
+    }
+
+    if (sum->used < sum->size) {
+        n = sum->used++;
+        candidate = &sum->candidates[n];
+        candidate->position = n;
+        sum->heap[n] = n;
+    }
+    else {
+        n = sum->heap[0];
+        candidate = &sum->candidates[n];
+        sketch_unindex(sum, candidate->key);
+        slot = sketch_lookup(sum, key, hash);
+    }
+
+    sum->index[slot] = n + 1;
+
+    /* replace the key, under the sequence number for the readers */
+    COUNTER_SET(candidate->seq, candidate->seq + 1);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(candidate->key, key, HITTER_KEY_LENGTH);
+    COUNTER_SET(candidate->octets, estimate);
+
+    __atomic_store_n(&candidate->seq, candidate->seq + 1, __ATOMIC_RELEASE);
+
+    sketch_sift(sum, candidate->position);
+}
+
+
+/*
+ * sketch_update()
+ * -------------
+ * account a packet to its source and destination addresses, and to each
+ * of its ports, invoked by monitor_packet()
+ */
+void
+sketch_update(struct sketch *sketch, const struct flow_key *key,
+    uint64_t octets) {
+    uint8_t port[HITTER_KEY_LENGTH];
+
+    sketch_count(&sketch->summaries[HITTER_SOURCES], key->src, octets);
+    sketch_count(&sketch->summaries[HITTER_DESTINATIONS], key->dst, octets);
+
+    if (key->sport == 0 && key->dport == 0)
+        return;
+
+    /* a port is stored with its protocol */
+    memset(port, 0, sizeof(port));
+    port[0] = key->sport >> 8;
+    port[1] = key->sport;
+    port[2] = key->proto;
+    sketch_count(&sketch->summaries[HITTER_PORTS], port, octets);
+
+    if (key->dport != key->sport) {
+        port[0] = key->dport >> 8;
+        port[1] = key->dport;
+        sketch_count(&sketch->summaries[HITTER_PORTS], port, octets);
+    }
+}
+
+
+/*
+ * sketch_read()
+ * -----------
+ * copy a candidate of a summary; return -1 if it's unused, or being
+ * replaced by its worker
+ */
+static int
+sketch_read(const struct heavy_hitter *candidate, struct heavy_hitter *copy) {
+    uint32_t seq;
+
+    seq = __atomic_load_n(&candidate->seq, __ATOMIC_ACQUIRE);
+    if (seq == 0 || (seq & 1))
+        return(-1);
+
+    memcpy(copy->key, candidate->key, HITTER_KEY_LENGTH);
+    copy->octets = COUNTER_GET(candidate->octets);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (COUNTER_GET(candidate->seq) != seq)
+        return(-1);
+
+    return(0);
+}
+
+
+/*
+ * sketch_compare_keys()
+ * -------------------
+ */
+static int
+sketch_compare_keys(const void *a, const void *b) {
+    return(memcmp(((const struct heavy_hitter *)a)->key,
+        ((const struct heavy_hitter *)b)->key, HITTER_KEY_LENGTH));
+}
+
+
+/*
+ * sketch_compare_octets()
+ * ---------------------
+ * sort by decreasing octets
+ */
+static int
+sketch_compare_octets(const void *a, const void *b) {
+    uint64_t x = ((const struct heavy_hitter *)a)->octets;
+    uint64_t y = ((const struct heavy_hitter *)b)->octets;
+
+    return((x < y) - (x > y));
+}
+
+
+/*
+ * sketch_collect()
+ * --------------
+ * gather the candidates of the workers into the top heavy hitters of the
+ * monitor; the estimates of a key in several workers are summed
+ */
+void
+sketch_collect(struct monitor *mon) {
+    struct heavy_hitter *merged = mon->hitter_scratch;
+    struct summary      *sum;
+    uint32_t    count, i, j;
+    int         kind, w;
+
+    if (mon->sketches == NULL)
+        return;
+
+    for (kind=0; kind<HITTER_KINDS; kind++) {
+        count = 0;
+
+        for (w=0; w<worker_count; w++) {
+            sum = &mon->sketches[w]->summaries[kind];
+            for (i=0; i<sum->size; i++) {
+                if (sketch_read(&sum->candidates[i], &merged[count]) == 0)
+                    count++;
+            }
+        }
+
+        /* sum the estimates of the same key */
+        qsort(merged, count, sizeof(struct heavy_hitter),
+            sketch_compare_keys);
+
+        for (i=0, j=0; i<count; i++) {
+            if (j > 0 && memcmp(merged[j - 1].key, merged[i].key,
+                HITTER_KEY_LENGTH) == 0) {
+                merged[j - 1].octets += merged[i].octets;
+            }
+            else
+                merged[j++] = merged[i];
+        }
+
+        qsort(merged, j, sizeof(struct heavy_hitter), sketch_compare_octets);
+
+        mon->hitter_count[kind] = (j < mon->hitter_top ? j : mon->hitter_top);
+        memcpy(mon->hitters[kind], merged,
+            mon->hitter_count[kind] * sizeof(struct heavy_hitter));
+    }
+}
+
+
+/*
+ * sketch_free()
+ * -----------
+ */
+void
+sketch_free(struct monitor *mon) {
+    struct summary  *sum;
+    int     kind, w;
+
+    if (mon->sketches != NULL) {
+        for (w=0; w<worker_count; w++) {
+            if (mon->sketches[w] == NULL)
+                continue;
+            for (kind=0; kind<HITTER_KINDS; kind++) {
+                sum = &mon->sketches[w]->summaries[kind];
+                free(sum->rows);
+                free(sum->candidates);
+                free(sum->heap);
+                free(sum->index);
+            }
+            free(mon->sketches[w]);
+        }
+        free(mon->sketches);
+        mon->sketches = NULL;
+    }
+
+    for (kind=0; kind<HITTER_KINDS; kind++) {
+        free(mon->hitters[kind]);
+        mon->hitters[kind] = NULL;
+    }
+
+    free(mon->hitter_scratch);
+    mon->hitter_scratch = NULL;
+}
+
+
+/*
+ * sketch_init()
+ * -----------
+ * allocate the summaries of a monitor in each worker, with sketches of
+ * the given width, and the given number of candidates; the memory they
+ * take is fixed from there
+ */
+int
+sketch_init(struct monitor *mon, uint32_t width, uint32_t top) {
+    struct summary  *sum;
+    uint32_t    columns, slots;
+    int         kind, w;
+
+    if (sketch_seed == 0)
+        sketch_seed = ((uint64_t)random() << 32) ^ random() ^ time(NULL);
+
+    /* the largest power of two within the width, and an index at most
+       half full */
+    for (columns=1; columns * 2 <= width; columns *= 2);
+    for (slots=1; slots < 2 * top; slots *= 2);
+
+    mon->hitter_top = top;
+    mon->sketches = calloc(worker_count, sizeof(struct sketch *));
+    mon->hitter_scratch = calloc((size_t)top * worker_count,
+        sizeof(struct heavy_hitter));
+    if (mon->sketches == NULL || mon->hitter_scratch == NULL)
+        goto fail;
+
+    for (kind=0; kind<HITTER_KINDS; kind++) {
+        mon->hitters[kind] = calloc(mon->hitter_top,
+            sizeof(struct heavy_hitter));
+        if (mon->hitters[kind] == NULL)
+            goto fail;
+    }
+
+    for (w=0; w<worker_count; w++) {
+        if ((mon->sketches[w] = calloc(1, sizeof(struct sketch))) == NULL)
+            goto fail;
+
+        for (kind=0; kind<HITTER_KINDS; kind++) {
+            sum = &mon->sketches[w]->summaries[kind];
+            sum->width = columns;
+            sum->size = top;
+            sum->mask = slots - 1;
+            sum->rows = calloc((size_t)SKETCH_DEPTH * columns,
+                sizeof(uint64_t));
+            sum->candidates = calloc(top, sizeof(struct heavy_hitter));
+            sum->heap = calloc(top, sizeof(uint32_t));
+            sum->index = calloc(slots, sizeof(uint32_t));
+            if (sum->rows == NULL || sum->candidates == NULL
+                || sum->heap == NULL || sum->index == NULL)
+                goto fail;
+        }
+    }
+
+    if (options.debug)
+        fprintf(stderr, "sketch_init: %u x %u counters and %u candidates "
+            "of each kind in %d worker(s) for monitor %u\n", SKETCH_DEPTH,
+            columns, top, worker_count, mon->index);
+
+    return(0);
+
+  fail:
+    syslog(_LOGERR_"couldn't allocate the heavy hitters of monitor %u: %s",
+        mon->index, strerror(errno));
+    sketch_free(mon);
+    return(-1);
+}
+
+
+/*
+ * sketch_format()
+ * -------------
+ * format the key of a heavy hitter: an address, or a port followed by
+ * its protocol
+ */
+const char *
+sketch_format(int kind, const struct heavy_hitter *hitter, char *buffer,
+    size_t size) {
+    const uint8_t *key = hitter->key;
+
+    if (kind != HITTER_PORTS)
+        return(flow_address(key, buffer, size));
+
+    switch (key[2]) {
+        case IPPROTO_TCP:
+            snprintf(buffer, size, "%u/tcp", (key[0] << 8) | key[1]);
+            break;
+        case IPPROTO_UDP:
+            snprintf(buffer, size, "%u/udp", (key[0] << 8) | key[1]);
+            break;
+        case IPPROTO_SCTP:
+            snprintf(buffer, size, "%u/sctp", (key[0] << 8) | key[1]);
+            break;
+        default:
+            snprintf(buffer, size, "%u/%u", (key[0] << 8) | key[1], key[2]);
+    }
+
+    return(buffer);
+}
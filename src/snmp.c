@@ -33,24 +33,87 @@
  * DAMAGE.
  */
 
-#include <net-snmp/net-snmp-config.h>
-#include <net-snmp/net-snmp-includes.h>
-#include <net-snmp/agent/net-snmp-agent-includes.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/syslog.h>
 
 #include "netsnmp-pcap.h"
 
 
+/* objects of the tree, under the base OID */
+#define PCAP_COUNT      1           /* pcapCount.0 */
+#define PCAP_TABLE      2           /* pcapTable.pcapEntry.column.index */
+#define PCAP_ENTRY      1
+
+/* columns of pcapTable */
+#define COLUMN_INDEX    0
+#define COLUMN_DESCR    1
+#define COLUMN_DEVICE   2
+#define COLUMN_FILTER   3
+#define COLUMN_OCTETS   4
+#define COLUMN_PACKETS  5
+#define LAST_COLUMN     COLUMN_PACKETS
+
+/* what an OID of the tree designates */
+#define OBJECT_NONE     -1
+#define OBJECT_COUNT    0
+#define OBJECT_CELL     1
+
+/* strings of a row */
+#define STRING_DESCR    0
+#define STRING_DEVICE   1
+#define STRING_FILTER   2
+#define STRING_COUNT    3
+
+/* sub-identifiers of the longest OID of the tree, after the base one */
+#define SUFFIX_LENGTH   4
+
+
+/* row of pcapTable, with its values ready to be copied into the
+   variables */
+struct snapshot_row {
+    uint32_t    index;
+    uint32_t    lengths[STRING_COUNT];
+    const char  *strings[STRING_COUNT];
+    uint64_t    octets;
+    uint64_t    packets;
+};
+
+/* pcapTable as of the last export, sorted by index; it's never changed
+   once built, but replaced by the next one, so that all the variables of
+   a request, and of the repetitions of a GETBULK, come from the same
+   point in time. the rows and their strings are in a single block */
+struct snapshot {
+    struct snapshot_row *rows;
+    int                 count;
+};
+
+static struct snapshot *snapshot = NULL;
+
+/* the base OID */
+static struct agentx_oid root;
+
+/* what's registered with the master agent: pcapCount, and the columns
+   of pcapTable served here; the other ones are left to the stats reader */
+#define REGION_COUNT    2
+static struct agentx_region regions[REGION_COUNT];
+
+
 /*
  * prototypes
  */
-static void init_pcap(void);
-static void nsp_agent_check(evutil_socket_t fd, short what, void *arg);
-static int  nsp_tree_handler(netsnmp_mib_handler*,
-    netsnmp_handler_registration*, netsnmp_agent_request_info*,
-    netsnmp_request_info*);
+static int  nsp_parse_oid(const char *string, struct agentx_oid *oid);
+static int  nsp_snapshot_next(uint32_t index);
+static int  nsp_tree_after(const uint32_t *suffix, uint32_t len,
+    int *column, int *row);
+static int  nsp_tree_find(const uint32_t *suffix, uint32_t len,
+    int *column, int *row);
+static int  nsp_tree_suffix(const struct agentx_oid *name,
+    const uint32_t **suffix, uint32_t *len);
+static void nsp_tree_value(struct agentx_value *value, int object,
+    int column, int row);
 
 
 
@@ -61,195 +124,393 @@ static int  nsp_tree_handler(netsnmp_mib_handler*,
  */
 void
 nsp_agent_init(void) {
-    /* configure netsnmp logging */
-    if (options.debug) {
-        fprintf(stderr, "nsp_agent_init: initialize the AgentX sub-agent\n");
-        snmp_enable_stderrlog();
+    if (options.debug)
+        fprintf(stderr, "nsp_agent_init: serve the tree under %s\n",
+            options.base_oid);
+
+    if (nsp_parse_oid(options.base_oid, &root) < 0) {
+        syslog(_LOGERR_"couldn't parse '%s' as a numeric OID",
+            options.base_oid);
+        exit(EXIT_FAILURE);
     }
-    else {
-        snmp_enable_syslog_ident(PROGRAM, SYSLOG_FACILITY);
+}
+
+
+/*
+ * nsp_parse_oid()
+ * -------------
+ * parse an OID in numeric form, with or without a leading dot, leaving
+ * room for the sub-identifiers of the tree
+ */
+static int
+nsp_parse_oid(const char *string, struct agentx_oid *oid) {
+    unsigned long   subid;
+    const char      *s = string;
+    char            *end;
+
+    oid->len = 0;
+
+    if (*s == '.')
+        s++;
+
+    while (*s != '\0') {
+        if (*s < '0' || *s > '9'
+            || oid->len == AGENTX_MAX_SUBIDS - SUFFIX_LENGTH)
+            return(-1);
+
+        errno = 0;
+        subid = strtoul(s, &end, 10);
+        if (errno != 0 || subid > UINT32_MAX
+            || (*end != '.' && *end != '\0'))
+            return(-1);
+
+        oid->subids[oid->len++] = subid;
+        s = (*end == '.') ? end + 1 : end;
+        if (*end == '.' && *s == '\0')
+            return(-1);
     }
 
-    /* declare ourself as an AgentX sub-agent */
-    netsnmp_enable_subagent();
+    return(oid->len > 0 ? 0 : -1);
+}
+
 
-    /* set the AgentX socket, if specified */
-    if (options.socket != NULL)
-        netsnmp_ds_set_string(NETSNMP_DS_APPLICATION_ID,
-            NETSNMP_DS_AGENT_X_SOCKET, options.socket);
+/*
+ * nsp_agent_start()
+ * ---------------
+ * start the AgentX session with the master agent
+ */
+void
+nsp_agent_start(struct event_base *ev_base) {
+    if (options.debug)
+        fprintf(stderr, "nsp_agent_start: open the AgentX session\n");
 
-    /* initialize the agent library */
-    init_agent(AGENT_NAME);
-    init_pcap();
-    init_snmp(AGENT_NAME);
+    regions[0].subtree = root;
+    regions[0].subtree.subids[regions[0].subtree.len++] = PCAP_COUNT;
 
-    if (options.debug < 2)
-        snmp_disable_log();
+    regions[1].subtree = root;
+    regions[1].subtree.subids[regions[1].subtree.len++] = PCAP_TABLE;
+    regions[1].subtree.subids[regions[1].subtree.len++] = PCAP_ENTRY;
+    regions[1].subtree.subids[regions[1].subtree.len++] = COLUMN_INDEX;
+    regions[1].range_subid = regions[1].subtree.len;
+    regions[1].upper_bound = LAST_COLUMN;
 
-    /* restore our syslog options */
-    openlog(PROGRAM, SYSLOG_OPTIONS, SYSLOG_FACILITY);
+    if (agentx_start(ev_base, options.socket, regions, REGION_COUNT) < 0)
+        exit(EXIT_FAILURE);
 }
 
 
 /*
- * init_pcap()
- * ---------
- * register our handler for serving the OID tree
+ * nsp_agent_stop()
+ * --------------
  */
-static void
-init_pcap(void) {
-    netsnmp_mib_handler             *handler;
-    netsnmp_handler_registration    *reg;
-    oid     root[MAX_OID_LEN];
-    size_t  rootlen = MAX_OID_LEN;
-    int     res;
+void
+nsp_agent_stop(void) {
+    if (options.debug >= 1)
+        fprintf(stderr, "nsp_agent_stop\n");
 
-    if (options.debug)
-        fprintf(stderr, "init_pcap: register on %s\n", options.base_oid);
+    agentx_stop();
+}
 
-    /* parse the given base OID */
-    if (!snmp_parse_oid(options.base_oid, root, &rootlen)) {
-        if (!read_objid(options.base_oid, root, &rootlen)) {
-            syslog(_LOGERR_"couldn't parse '%s' as an OID", options.base_oid);
-            exit(EXIT_FAILURE);
-        }
+
+/*
+ * nsp_agent_snapshot()
+ * ------------------
+ * build the snapshot of pcapTable served to the requests, from the
+ * monitors as of their last collect; invoked at each export, and after
+ * the config is reloaded
+ */
+void
+nsp_agent_snapshot(void) {
+    struct snapshot *next;
+    struct snapshot_row *row;
+    struct monitor  *mon;
+    const char  *string;
+    size_t      size;
+    char        *strings;
+    int         i;
+
+    /* size the block */
+    size = sizeof(struct snapshot)
+        + monitor_count * sizeof(struct snapshot_row);
+
+    TAILQ_FOREACH(mon, &monitors, link) {
+        size += (mon->description ? strlen(mon->description) : 0)
+            + strlen(mon->device) + (mon->filter ? strlen(mon->filter) : 0);
     }
 
-    /* create the OID tree handler callback */
-    handler = netsnmp_create_handler(AGENT_NAME, nsp_tree_handler);
-    if (handler == NULL) {
-        syslog(_LOGERR_"couldn't create the handler callback");
-        exit(EXIT_FAILURE);
+    if ((next = malloc(size)) == NULL) {
+        syslog(_LOGERR_"couldn't allocate the SNMP snapshot: %s",
+            strerror(errno));
+        return;
     }
 
-    /* create a handler registration thingy (yay Net-SNMP) */
-    reg = netsnmp_handler_registration_create(AGENT_NAME, handler,
-        root, rootlen, HANDLER_CAN_RONLY);
-    if (reg == NULL) {
-        syslog(_LOGERR_"couldn't create the handler registration");
-        exit(EXIT_FAILURE);
+    next->rows = (struct snapshot_row *)(next + 1);
+    next->count = monitor_count;
+    strings = (char *)(next->rows + monitor_count);
+
+    /* fill the rows, in the order of the indexes */
+    row = next->rows;
+    TAILQ_FOREACH(mon, &monitors, link) {
+        row->index = mon->index;
+
+        for (i=0; i<STRING_COUNT; i++) {
+            string = (i == STRING_DESCR) ? mon->description
+                : (i == STRING_DEVICE) ? mon->device : mon->filter;
+            row->lengths[i] = (string != NULL) ? strlen(string) : 0;
+            row->strings[i] = strings;
+            if (row->lengths[i] > 0)
+                memcpy(strings, string, row->lengths[i]);
+            strings += row->lengths[i];
+        }
+
+        row->octets  = mon->seen_octets;
+        row->packets = mon->seen_packets;
+        row++;
     }
 
-    /* actually register the OID tree handler */
-    res = netsnmp_register_handler(reg);
-    if (res != MIB_REGISTERED_OK) {
-        syslog(_LOGERR_"couldn't register the handler (code %d)", res);
-        exit(EXIT_FAILURE);
+    free(snapshot);
+    snapshot = next;
+}
+
+
+/*
+ * nsp_snapshot_next()
+ * -----------------
+ * return the row of the snapshot with the lowest index above the given
+ * one, or its count of rows if there's none
+ */
+static int
+nsp_snapshot_next(uint32_t index) {
+    int     low = 0, high = snapshot->count, middle;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (snapshot->rows[middle].index <= index)
+            low = middle + 1;
+        else
+            high = middle;
     }
+
+    return(low);
 }
 
 
 /*
- * nsp_agent_start()
+ * nsp_tree_suffix()
  * ---------------
- * create the I/O watchers over netsnmpagent's file descriptors
- *
- * XXX: the watchers are currently not stored. this may need to
- *      be changed in the future.
+ * find the sub-identifiers of an OID after the base one; return 0 if the
+ * OID is within the tree, -1 if it's before it, 1 if it's after it
  */
-void
-nsp_agent_start(struct event_base *ev_base) {
-    struct event    *socket_watcher /*, *timer_watcher */;
-    struct timeval  tv, ping_delay = { 30, 0 };
-    fd_set  fdset;
-    int     i, numfds = 0, block = 0;
-
-    if (options.debug)
-        fprintf(stderr, "nsp_agent_start: create the I/O and timer watchers\n");
-
-    /* get the file descriptor of the AgentX socket */
-    FD_ZERO(&fdset);
-    snmp_select_info(&numfds, &fdset, &tv, &block);
-    if (numfds) {
-        for (i=0; i<numfds; i++) {
-            if (FD_ISSET(i, &fdset)) {
-                /* create and activate a libevent watcher associated with
-                   the AgentX socket */
-                socket_watcher = event_new(ev_base, i, EV_READ|EV_PERSIST,
-                    nsp_agent_check, NULL);
-                if (socket_watcher == NULL) {
-                    syslog(_LOGERR_"couldn't create a watcher for the AgentX "
-                        "socket");
-                    exit(EXIT_FAILURE);
-                }
-
-                if (event_add(socket_watcher, &ping_delay) < 0) {
-                    syslog(_LOGERR_"couldn't activate a watcher for the AgentX "
-                        "socket");
-                    exit(EXIT_FAILURE);
-                }
-            }
-        }
+static int
+nsp_tree_suffix(const struct agentx_oid *name, const uint32_t **suffix,
+    uint32_t *len) {
+    uint32_t    i;
+
+    for (i=0; i<root.len; i++) {
+        if (i == name->len)
+            return(-1);
+        if (name->subids[i] != root.subids[i])
+            return((name->subids[i] < root.subids[i]) ? -1 : 1);
     }
 
-    /* create and activate a timer watcher, to regularly check that we are
-       still connected to the AgentX master */
-    /* replaced by adding timeout in the I/O watchers; however the handler
-       now gets called three times in a row, which is a bit stupid */
-    /*
-    timer_watcher = event_new(ev_base, -1, EV_PERSIST, nsp_agent_check, NULL);
-    if (timer_watcher == NULL) {
-        syslog(_LOGERR_"couldn't create the timer watcher to monitor the "
-            "AgentX socket");
-        exit(EXIT_FAILURE);
-    }
+    *suffix = name->subids + root.len;
+    *len = name->len - root.len;
 
-    if (event_add(timer_watcher, &ping_delay) < 0) {
-        syslog(_LOGERR_"couldn't activate the timer watcher to monitor the "
-            "AgentX socket");
-        exit(EXIT_FAILURE);
+    return(0);
+}
+
+
+/*
+ * nsp_tree_get()
+ * ------------
+ * set the value of the object of the given OID, or the exception telling
+ * why there's none
+ */
+int
+nsp_tree_get(const struct agentx_oid *name, struct agentx_value *value) {
+    const uint32_t  *suffix;
+    uint32_t    len = 0;
+    int     object = OBJECT_NONE, column = 0, row = 0;
+
+    /* before the first export */
+    if (snapshot == NULL)
+        nsp_agent_snapshot();
+
+    if (snapshot != NULL && nsp_tree_suffix(name, &suffix, &len) == 0)
+        object = nsp_tree_find(suffix, len, &column, &row);
+
+    if (object == OBJECT_NONE) {
+        value->type = (len > 0 && (suffix[0] == PCAP_COUNT
+            || suffix[0] == PCAP_TABLE)) ? AGENTX_NO_SUCH_INSTANCE
+            : AGENTX_NO_SUCH_OBJECT;
+        return(-1);
     }
-    */
 
+    nsp_tree_value(value, object, column, row);
+
+    return(0);
 }
 
 
 /*
- * nsp_agent_stop()
- * --------------
+ * nsp_tree_next()
+ * -------------
+ * find the object following the given OID in the order of a walk, or
+ * the OID itself if include is set; set its OID and its value, or
+ * return -1 if there's none
  */
-void
-nsp_agent_stop(void) {
-    if (options.debug >= 1)
-        fprintf(stderr, "nsp_agent_stop\n");
+int
+nsp_tree_next(const struct agentx_oid *start, int include,
+    struct agentx_oid *name, struct agentx_value *value) {
+    const uint32_t  *suffix = NULL;
+    uint32_t    len = 0;
+    int     object = OBJECT_NONE, column = 0, row = 0, cmp;
+
+    if (snapshot == NULL)
+        nsp_agent_snapshot();
+    if (snapshot == NULL)
+        return(-1);
+
+    /* a GETNEXT may start before the tree, or after it */
+    cmp = nsp_tree_suffix(start, &suffix, &len);
+
+    if (cmp == 0 && include)
+        object = nsp_tree_find(suffix, len, &column, &row);
+
+    if (object == OBJECT_NONE) {
+        object = (cmp < 0) ? nsp_tree_after(NULL, 0, &column, &row)
+            : (cmp > 0) ? OBJECT_NONE
+            : nsp_tree_after(suffix, len, &column, &row);
+    }
 
-    snmp_shutdown(AGENT_NAME);
+    if (object == OBJECT_NONE)
+        return(-1);
+
+    /* build the OID of the object found */
+    *name = root;
+
+    if (object == OBJECT_COUNT) {
+        name->subids[name->len++] = PCAP_COUNT;
+        name->subids[name->len++] = 0;
+    }
+    else {
+        name->subids[name->len++] = PCAP_TABLE;
+        name->subids[name->len++] = PCAP_ENTRY;
+        name->subids[name->len++] = column;
+        name->subids[name->len++] = snapshot->rows[row].index;
+    }
+
+    nsp_tree_value(value, object, column, row);
+
+    return(0);
 }
 
 
 /*
- * nsp_agent_check()
- * ---------------
- * callback function invoked by libevent when there are incoming data in
- * the watched AgentX socket
+ * nsp_tree_find()
+ * -------------
+ * find the object of the given OID, relative to the base one: pcapCount,
+ * or a cell of pcapTable in *column and *row; return OBJECT_NONE if
+ * there's no such object
  */
-static void
-nsp_agent_check(evutil_socket_t fd, short what, void *arg) {
-    if (options.debug >= 3)
-        fprintf(stderr, "nsp_agent_check\n");
+static int
+nsp_tree_find(const uint32_t *suffix, uint32_t len, int *column, int *row) {
+    if (len == 2 && suffix[0] == PCAP_COUNT && suffix[1] == 0)
+        return(OBJECT_COUNT);
+
+    if (len != 4 || suffix[0] != PCAP_TABLE || suffix[1] != PCAP_ENTRY
+        || suffix[2] > LAST_COLUMN || suffix[3] == 0)
+        return(OBJECT_NONE);
+
+    *row = nsp_snapshot_next(suffix[3] - 1);
+    if (*row == snapshot->count || snapshot->rows[*row].index != suffix[3])
+        return(OBJECT_NONE);
 
-    snmp_timeout();
-    agent_check_and_process(0);
+    *column = suffix[2];
+
+    return(OBJECT_CELL);
 }
 
 
 /*
- * nsp_tree_handler()
- * ----------------
- * callback invoked by netsnmpagent during agent_check_and_process()
+ * nsp_tree_after()
+ * --------------
+ * find the object following the given OID, relative to the base one,
+ * in the order of a walk: pcapCount, then pcapTable column by column,
+ * each in the order of the monitors indexes
  */
 static int
-nsp_tree_handler(
-    netsnmp_mib_handler          *handler,
-    netsnmp_handler_registration *reginfo,
-    netsnmp_agent_request_info   *reqinfo,
-    netsnmp_request_info         *requests)
-{
-    if (options.debug >= 3)
-        fprintf(stderr, "nsp_tree_handler\n");
+nsp_tree_after(const uint32_t *suffix, uint32_t len, int *column, int *row) {
+    uint32_t    index = 0;
+    int         col = COLUMN_INDEX;
+
+    if (len == 0 || suffix[0] < PCAP_COUNT
+        || (suffix[0] == PCAP_COUNT && len == 1))
+        return(OBJECT_COUNT);
+
+    if (suffix[0] > PCAP_TABLE
+        || (suffix[0] == PCAP_TABLE && len > 1 && suffix[1] > PCAP_ENTRY))
+        return(OBJECT_NONE);
+
+    /* within a column, after the given index */
+    if (suffix[0] == PCAP_TABLE && len > 2 && suffix[1] == PCAP_ENTRY) {
+        if (suffix[2] > LAST_COLUMN)
+            return(OBJECT_NONE);
+
+        col = suffix[2];
+        if (len > 3)
+            index = suffix[3];
+    }
 
-    /* TODO */
+    for (; col <= LAST_COLUMN; col++, index = 0) {
+        if ((*row = nsp_snapshot_next(index)) < snapshot->count) {
+            *column = col;
+            return(OBJECT_CELL);
+        }
+    }
 
-    return(0);
+    return(OBJECT_NONE);
 }
 
+
+/*
+ * nsp_tree_value()
+ * --------------
+ * set the value of a variable from the object it designates
+ */
+static void
+nsp_tree_value(struct agentx_value *value, int object, int column,
+    int row) {
+    const struct snapshot_row *cell = &snapshot->rows[row];
+
+    if (object == OBJECT_COUNT) {
+        value->type = AGENTX_INTEGER;
+        value->number = snapshot->count;
+        return;
+    }
+
+    switch (column) {
+    case COLUMN_INDEX:
+        value->type = AGENTX_INTEGER;
+        value->number = cell->index;
+        return;
+
+    case COLUMN_DESCR:
+    case COLUMN_DEVICE:
+    case COLUMN_FILTER:
+        value->type = AGENTX_OCTET_STRING;
+        value->string = cell->strings[column - COLUMN_DESCR];
+        value->length = cell->lengths[column - COLUMN_DESCR];
+        return;
+
+    case COLUMN_OCTETS:
+        value->type = AGENTX_COUNTER64;
+        value->number = cell->octets;
+        return;
+
+    case COLUMN_PACKETS:
+        value->type = AGENTX_COUNTER64;
+        value->number = cell->packets;
+        return;
+    }
+}
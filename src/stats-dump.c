@@ -0,0 +1,170 @@
+/*
+ * netsnmp-pcap :: stats-dump.c
+ * ----------------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+/*
+ * netsnmp-pcap-stats-dump: print the monitors published in the stats
+ * segment of the daemon, once or every given number of seconds
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nsp-stats.h"
+
+
+/*
+ * dump_table()
+ * ----------
+ * print the rows of a snapshot, with their throughput since the previous
+ * one if any
+ */
+static void
+dump_table(const struct nsp_stats_snapshot *snapshot,
+    const struct nsp_stats_snapshot *previous) {
+    const struct nsp_stats_row *row, *last;
+    uint64_t    elapsed = 0, octet_rate = 0, packet_rate = 0;
+    time_t      updated = snapshot->header.updated / 1000000;
+    uint32_t    i, p = 0;
+    char        when[32];
+
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&updated));
+    printf("# pid %u, %u monitor(s), updated %s\n", snapshot->header.pid,
+        snapshot->header.count, when);
+
+    if (previous != NULL
+        && snapshot->header.updated > previous->header.updated)
+        elapsed = snapshot->header.updated - previous->header.updated;
+
+    printf("%10s  %-10s %-20s %16s %14s %12s %14s %12s\n", "index",
+        "device", "descr", "octets", "packets", "drops",
+        (elapsed ? "octets/s" : "p95 octets/s"),
+        (elapsed ? "packets/s" : "p95 pkts/s"));
+
+    for (i=0; i<snapshot->header.count; i++) {
+        row = &snapshot->rows[i];
+
+        if (elapsed) {
+            /* both are sorted by index */
+            while (p < previous->header.count
+                && previous->rows[p].index < row->index)
+                p++;
+
+            last = (p < previous->header.count
+                && previous->rows[p].index == row->index)
+                ? &previous->rows[p] : NULL;
+
+            octet_rate = (last && row->octets >= last->octets)
+                ? (row->octets - last->octets) * 1000000 / elapsed : 0;
+            packet_rate = (last && row->packets >= last->packets)
+                ? (row->packets - last->packets) * 1000000 / elapsed : 0;
+        }
+        else {
+            octet_rate = row->octet_rates[NSP_STATS_P95];
+            packet_rate = row->packet_rates[NSP_STATS_P95];
+        }
+
+        printf("%10u  %-10s %-20s %16" PRIu64 " %14" PRIu64 " %12" PRIu64
+            " %14" PRIu64 " %12" PRIu64 "\n", row->index, row->device,
+            row->descr, row->octets, row->packets, row->drops, octet_rate,
+            packet_rate);
+    }
+}
+
+
+/*
+ * main()
+ * ----
+ */
+int
+main(int argc, char **argv) {
+    struct nsp_stats    stats;
+    struct nsp_stats_snapshot   snapshots[2];
+    int     opt, current = 0, count = 0, interval = 0;
+
+    while ((opt = getopt(argc, argv, "hw:")) != -1) {
+        switch (opt) {
+            case 'w':
+                interval = atoi(optarg);
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-w seconds] path\n", argv[0]);
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-w seconds] path\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (nsp_stats_open(&stats, argv[optind]) < 0) {
+        fprintf(stderr, "couldn't open the stats file '%s': %s\n",
+            argv[optind], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    memset(snapshots, 0, sizeof(snapshots));
+
+    while (1) {
+        if (nsp_stats_read(&stats, &snapshots[current]) < 0) {
+            fprintf(stderr, "couldn't read the stats file '%s': %s\n",
+                argv[optind], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        dump_table(&snapshots[current],
+            (count++ > 0) ? &snapshots[!current] : NULL);
+
+        if (interval <= 0)
+            break;
+
+        fflush(stdout);
+        sleep(interval);
+        current = !current;
+    }
+
+    nsp_stats_free(&snapshots[0]);
+    nsp_stats_free(&snapshots[1]);
+    nsp_stats_close(&stats);
+
+    return(EXIT_SUCCESS);
+}
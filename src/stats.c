@@ -0,0 +1,296 @@
+/*
+ * netsnmp-pcap :: stats.c
+ * -----------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syslog.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "netsnmp-pcap.h"
+#include "nsp-stats.h"
+
+
+#define STATS_MIN_ROWS      64
+#define STATS_INTERVAL      1           /* between two updates, seconds */
+
+
+/* the segment, mapped in the daemon */
+static struct {
+    int                     fd;
+    struct nsp_stats_header *header;
+    size_t                  size;
+    uint64_t                exported;
+} segment = { .fd = -1 };
+
+
+/*
+ * prototypes
+ */
+static int  stats_map(size_t size);
+static void stats_tick(evutil_socket_t fd, short what, void *arg);
+
+
+
+/*
+ * stats_now()
+ * ---------
+ * return the current time, in microseconds since the epoch
+ */
+static uint64_t
+stats_now(void) {
+    struct timeval  now;
+
+    gettimeofday(&now, NULL);
+
+    return((uint64_t)now.tv_sec * 1000000 + now.tv_usec);
+}
+
+
+/*
+ * stats_map()
+ * ---------
+ * make the file of the segment at least as large as the given size, and
+ * map all of it; the file never shrinks, as readers may have mapped it
+ */
+static int
+stats_map(size_t size) {
+    struct stat st;
+    void    *map;
+
+    if (fstat(segment.fd, &st) < 0)
+        return(-1);
+
+    if ((size_t)st.st_size < size) {
+        if (ftruncate(segment.fd, size) < 0)
+            return(-1);
+    }
+    else
+        size = st.st_size;
+
+    map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, segment.fd, 0);
+    if (map == MAP_FAILED)
+        return(-1);
+
+    if (segment.header != NULL)
+        munmap(segment.header, segment.size);
+
+    segment.header = map;
+    segment.size = size;
+
+    return(0);
+}
+
+
+/*
+ * stats_open()
+ * ----------
+ * create or reuse the file of the stats segment given by --stats-file;
+ * readers that mapped it before a restart keep reading the new values
+ */
+void
+stats_open(void) {
+    struct nsp_stats_header *header;
+    uint32_t    seq = 0;
+
+    if (options.debug >= 1)
+        fprintf(stderr, "stats_open: %s\n", options.stats_file);
+
+    segment.fd = open(options.stats_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (segment.fd < 0 || stats_map(sizeof(struct nsp_stats_header)
+        + STATS_MIN_ROWS * sizeof(struct nsp_stats_row)) < 0) {
+        syslog(_LOGERR_"couldn't map the stats file '%s': %s",
+            options.stats_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* carry on the sequence of a previous run */
+    header = segment.header;
+    if (header->magic == NSP_STATS_MAGIC)
+        seq = (header->seq + 1) & ~1;
+
+    __atomic_store_n(&header->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    header->magic = NSP_STATS_MAGIC;
+    header->version = NSP_STATS_VERSION;
+    header->header_size = sizeof(struct nsp_stats_header);
+    header->row_size = sizeof(struct nsp_stats_row);
+    header->pid = getpid();
+    header->capacity = (segment.size - sizeof(struct nsp_stats_header))
+        / sizeof(struct nsp_stats_row);
+    header->count = 0;
+    header->updated = stats_now();
+    header->exported = 0;
+    header->interval = options.interval;
+
+    __atomic_store_n(&header->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * stats_start()
+ * -----------
+ * update the counters of the segment every second, between the exports
+ */
+void
+stats_start(struct event_base *ev_base) {
+    struct event    *timer_watcher;
+    struct timeval  interval = { STATS_INTERVAL, 0 };
+
+    if (segment.fd < 0)
+        return;
+
+    timer_watcher = event_new(ev_base, -1, EV_PERSIST, stats_tick, NULL);
+    if (timer_watcher == NULL || event_add(timer_watcher, &interval) < 0) {
+        syslog(_LOGERR_"couldn't create the timer watcher to update the "
+            "stats file");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * stats_tick()
+ * ----------
+ * callback function invoked by libevent every second, to sum the
+ * counters of the workers and publish them
+ */
+static void
+stats_tick(evutil_socket_t fd, short what, void *arg) {
+    struct monitor  *mon;
+
+    TAILQ_FOREACH(mon, &monitors, link)
+        monitor_totals(mon);
+
+    stats_publish(0);
+}
+
+
+/*
+ * stats_copy()
+ * ----------
+ * copy a string into a field of a row, truncated if needed
+ */
+static void
+stats_copy(char *field, const char *string, size_t size) {
+    size_t  length = (string != NULL) ? strnlen(string, size - 1) : 0;
+
+    if (length > 0)
+        memcpy(field, string, length);
+    memset(field + length, 0, size - length);
+}
+
+
+/*
+ * stats_publish()
+ * -------------
+ * write the monitors into the segment, under its sequence number so that
+ * the readers never copy a half-written table; export tells if the
+ * monitors were just collected by an export
+ */
+void
+stats_publish(int export) {
+    struct nsp_stats_header *header = segment.header;
+    struct nsp_stats_row    *row;
+    struct monitor  *mon;
+    uint32_t    seq, capacity;
+    int         i;
+
+    if (header == NULL)
+        return;
+
+    seq = header->seq;
+    __atomic_store_n(&header->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    /* grow the segment to the next power of two rows */
+    if ((uint32_t)monitor_count > header->capacity) {
+        for (capacity = STATS_MIN_ROWS; capacity < (uint32_t)monitor_count;
+            capacity *= 2)
+            ;
+
+        if (stats_map(sizeof(struct nsp_stats_header)
+            + (size_t)capacity * sizeof(struct nsp_stats_row)) < 0) {
+            syslog(_LOGERR_"couldn't grow the stats file '%s': %s",
+                options.stats_file, strerror(errno));
+            header->count = 0;
+            __atomic_store_n(&header->seq, seq + 2, __ATOMIC_RELEASE);
+            return;
+        }
+
+        header = segment.header;
+        header->capacity = (segment.size - sizeof(struct nsp_stats_header))
+            / sizeof(struct nsp_stats_row);
+    }
+
+    row = (struct nsp_stats_row *)(header + 1);
+    TAILQ_FOREACH(mon, &monitors, link) {
+        row->index = mon->index;
+        row->flags = (mon->ebpf != NULL) ? NSP_STATS_KERNEL : 0;
+        stats_copy(row->descr, mon->description, NSP_STATS_DESCR_LENGTH);
+        stats_copy(row->device, mon->device, NSP_STATS_DEVICE_LENGTH);
+        stats_copy(row->filter, mon->filter, NSP_STATS_FILTER_LENGTH);
+        row->octets = mon->seen_octets;
+        row->packets = mon->seen_packets;
+        row->recv = mon->last_recv;
+        row->drops = mon->last_drop;
+        row->octet_rates[NSP_STATS_PEAK] = mon->octet_rates.peak;
+        row->octet_rates[NSP_STATS_P50] = mon->octet_rates.p50;
+        row->octet_rates[NSP_STATS_P95] = mon->octet_rates.p95;
+        row->octet_rates[NSP_STATS_P99] = mon->octet_rates.p99;
+        row->packet_rates[NSP_STATS_PEAK] = mon->packet_rates.peak;
+        row->packet_rates[NSP_STATS_P50] = mon->packet_rates.p50;
+        row->packet_rates[NSP_STATS_P95] = mon->packet_rates.p95;
+        row->packet_rates[NSP_STATS_P99] = mon->packet_rates.p99;
+        for (i=0; i<NSP_STATS_DISTINCT; i++)
+            row->distinct[i] = mon->distinct[i];
+        row->reserved = 0;
+        row++;
+    }
+
+    header->count = monitor_count;
+    header->updated = stats_now();
+    if (export)
+        segment.exported = header->updated;
+    header->exported = segment.exported;
+
+    __atomic_store_n(&header->seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,256 @@
+/*
+ * netsnmp-pcap :: worker.c
+ * ------------------------
+ * Copyright (c) 2012, Sebastien Aperghis-Tramoni <sebastien@aperghis.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above 
+ *       copyright notice, this list of conditions and the 
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the 
+ *       above copyright notice, this list of conditions and 
+ *       the following disclaimer in the documentation and/or 
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be 
+ *       used to endorse or promote products derived from this 
+ *       software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS 
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF 
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+ * DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslog.h>
+#include <unistd.h>
+
+#include "netsnmp-pcap.h"
+
+
+/* capture workers */
+struct worker   *workers = NULL;
+int             worker_count = 0;
+
+/* pause of the workers, while the main thread changes their captures */
+static pthread_mutex_t  worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   worker_cond = PTHREAD_COND_INITIALIZER;
+static int              worker_paused = 0;
+static int              worker_parked = 0;
+
+
+/*
+ * worker_park()
+ * -----------
+ * callback function invoked by libevent in a worker when the main thread
+ * asks it to pause; the worker waits there, out of its captures, until
+ * it's resumed
+ */
+static void
+worker_park(evutil_socket_t fd, short what, void *arg) {
+    char    byte;
+
+    if (read(fd, &byte, 1) < 0)
+        return;
+
+    pthread_mutex_lock(&worker_lock);
+    worker_parked++;
+    pthread_cond_broadcast(&worker_cond);
+
+    while (worker_paused)
+        pthread_cond_wait(&worker_cond, &worker_lock);
+
+    worker_parked--;
+    pthread_cond_broadcast(&worker_cond);
+    pthread_mutex_unlock(&worker_lock);
+}
+
+
+/*
+ * worker_init()
+ * -----------
+ * allocate the capture workers; without --workers, a single worker
+ * runs the captures in the main event loop
+ */
+void
+worker_init(struct event_base *ev_base) {
+    int i;
+
+    worker_count = (options.workers > 0 ? options.workers : 1);
+
+    if (options.debug)
+        fprintf(stderr, "worker_init: %d worker(s)\n", worker_count);
+
+    workers = calloc(worker_count, sizeof(struct worker));
+    if (workers == NULL) {
+        syslog(_LOGERR_"couldn't allocate workers: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i=0; i<worker_count; i++) {
+        workers[i].id = i;
+
+        if (options.workers == 0) {
+            workers[i].ev_base = ev_base;
+            continue;
+        }
+
+        workers[i].ev_base = event_base_new();
+        if (workers[i].ev_base == NULL) {
+            syslog(_LOGERR_"couldn't create the event base of worker %d", i);
+            exit(EXIT_FAILURE);
+        }
+
+        /* and the pipe through which it's asked to pause */
+        if (pipe(workers[i].pause_pipe) < 0) {
+            syslog(_LOGERR_"couldn't create the pause pipe of worker %d: %s",
+                i, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        workers[i].pause_watcher = event_new(workers[i].ev_base,
+            workers[i].pause_pipe[0], EV_READ|EV_PERSIST, worker_park,
+            &workers[i]);
+        if (workers[i].pause_watcher == NULL
+            || event_add(workers[i].pause_watcher, NULL) < 0) {
+            syslog(_LOGERR_"couldn't create the pause watcher of worker %d",
+                i);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+/*
+ * worker_pause()
+ * ------------
+ * stop the workers between two callbacks, so that the main thread can
+ * open, close and change their captures; libevent isn't used with
+ * threads, so their event bases mustn't be touched otherwise. return -1
+ * if a worker couldn't be asked to pause, in which case the others are
+ * resumed, as it would never park
+ */
+int
+worker_pause(void) {
+    ssize_t n;
+    int     i;
+
+    if (options.workers == 0)
+        return(0);
+
+    pthread_mutex_lock(&worker_lock);
+    worker_paused = 1;
+    pthread_mutex_unlock(&worker_lock);
+
+    for (i=0; i<worker_count; i++) {
+        do
+            n = write(workers[i].pause_pipe[1], "p", 1);
+        while (n < 0 && errno == EINTR);
+
+        if (n < 0) {
+            syslog(_LOGERR_"couldn't pause worker %d: %s", i,
+                strerror(errno));
+            worker_resume();
+            return(-1);
+        }
+    }
+
+    pthread_mutex_lock(&worker_lock);
+    while (worker_parked < worker_count)
+        pthread_cond_wait(&worker_cond, &worker_lock);
+    pthread_mutex_unlock(&worker_lock);
+
+    return(0);
+}
+
+
+/*
+ * worker_resume()
+ * -------------
+ * let the workers run their captures again, after worker_pause()
+ */
+void
+worker_resume(void) {
+    if (options.workers == 0)
+        return;
+
+    pthread_mutex_lock(&worker_lock);
+    worker_paused = 0;
+    pthread_cond_broadcast(&worker_cond);
+
+    while (worker_parked > 0)
+        pthread_cond_wait(&worker_cond, &worker_lock);
+    pthread_mutex_unlock(&worker_lock);
+}
+
+
+/*
+ * worker_run()
+ * ----------
+ * thread function of a capture worker
+ */
+static void *
+worker_run(void *arg) {
+    struct worker *worker = (struct worker*)arg;
+
+    if (options.debug)
+        fprintf(stderr, "worker_run: worker %d started\n", worker->id);
+
+    event_base_loop(worker->ev_base, EVLOOP_NO_EXIT_ON_EMPTY);
+
+    return(NULL);
+}
+
+
+/*
+ * worker_start()
+ * ------------
+ * start the threads of the capture workers, if any; in the cpu fanout
+ * mode, each worker is pinned on the CPU whose packets it receives
+ */
+void
+worker_start(void) {
+    long    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int     i, res;
+
+    if (options.workers == 0)
+        return;
+
+    for (i=0; i<worker_count; i++) {
+        res = pthread_create(&workers[i].thread, NULL, worker_run,
+            &workers[i]);
+        if (res != 0) {
+            syslog(_LOGERR_"couldn't start worker %d: %s", i, strerror(res));
+            exit(EXIT_FAILURE);
+        }
+
+        if (options.fanout == FANOUT_CPU && cpus > 0) {
+            cpu_set_t set;
+
+            CPU_ZERO(&set);
+            CPU_SET(i % cpus, &set);
+            res = pthread_setaffinity_np(workers[i].thread, sizeof(set), &set);
+            if (res != 0)
+                syslog(_LOGWARN_"couldn't pin worker %d on CPU %ld: %s", i,
+                    i % cpus, strerror(res));
+        }
+    }
+}